@@ -0,0 +1,337 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Benchmark of the block stream decoder on recorded data files
+	or generated blocks: block counts and decoding speed of each kernel level
+	without and with the check of block bodies and with the samples converted.
+	The samples converted by each level are compared with the scalar ones first.
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "blkdecode.h"
+#include "recformat.h"
+#include "wfcodec.h"
+
+#define MAXREC		0x100000	// maximum payload of a record
+#define MAXSERIAL	256		// decoders per module serial number
+
+//	Module data payloads of all files in the order of the files
+struct blkbench_data {
+	char *buf;
+	long long len;
+	long long size;
+	long long *off;		// payload offsets in buf
+	int *plen;		// payload lengths
+	int *serial;		// module of the payload
+	int n;
+	int nsize;
+};
+
+void Help(void)
+{
+	printf("\t\tBlock stream decoder benchmark\n");
+	printf("Usage blkbench [options] file.data [...]\n");
+	printf("Options:\n");
+	printf("-b bytes - buffer size for generated data, default 65536;\n");
+	printf("-g MBytes - use generated blocks instead of files;\n");
+	printf("-h - print this message and exit;\n");
+	printf("-l level - test only this kernel level: 0 - scalar, 1 - SSE2, 2 - AVX2, 3 - AVX-512;\n");
+	printf("-n num - repeat num times, default 3.\n");
+}
+
+double Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+//	Add a payload. Return 0 on success, negative if no memory
+int AddPayload(struct blkbench_data *d, const void *data, int len, int serial)
+{
+	if (d->len + len > d->size) {
+		d->size = 2 * (d->size + len);
+		d->buf = (char *) realloc(d->buf, d->size);
+		if (!d->buf) return -1;
+	}
+	if (d->n >= d->nsize) {
+		d->nsize = 2 * d->nsize + 1024;
+		d->off = (long long *) realloc(d->off, d->nsize * sizeof(long long));
+		d->plen = (int *) realloc(d->plen, d->nsize * sizeof(int));
+		d->serial = (int *) realloc(d->serial, d->nsize * sizeof(int));
+		if (!d->off || !d->plen || !d->serial) return -1;
+	}
+	memcpy(d->buf + d->len, data, len);
+	d->off[d->n] = d->len;
+	d->plen[d->n] = len;
+	d->serial[d->n] = serial & (MAXSERIAL - 1);
+	d->n++;
+	d->len += (len + 7) & ~7;	// keep payloads aligned
+	return 0;
+}
+
+//	Take module data records of the file, compressed ones are expanded
+int ReadFile(struct blkbench_data *d, const char *fname)
+{
+	struct stat st;
+	struct rec_info_struct info;
+	char *map, *rec;
+	long long pos;
+	int fd, irc, cnt;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		printf("Can not open %s: %m\n", fname);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("Can not map %s: %m\n", fname);
+		return -1;
+	}
+	rec = (char *) malloc(MAXREC + REC_MAXHEADER);
+	cnt = 0;
+	for (pos = 0; pos < st.st_size; pos += info.len) {
+		irc = rec_parse(map + pos, (st.st_size - pos > 0x7FFFFFFF) ? 0x7FFFFFFF : st.st_size - pos, &info);
+		if (irc < 0) break;
+		if (info.type < REC_WFDDATA) continue;
+		if (info.flags & REC_FLAG_WFC) {
+			irc = wfc_rec_decode(map + pos, info.len, rec, MAXREC + REC_MAXHEADER);
+			if (irc < 0) continue;
+			irc = AddPayload(d, rec + info.hlen, irc - info.hlen, info.serial);
+		} else {
+			irc = AddPayload(d, map + pos + info.hlen, info.len - info.hlen, info.serial);
+		}
+		if (irc) break;
+		cnt++;
+	}
+	if (pos < st.st_size) printf("%s: stopped at offset %Ld of %Ld\n", fname, pos, (long long) st.st_size);
+	printf("%s: %d data records\n", fname, cnt);
+	free(rec);
+	munmap(map, st.st_size);
+	return 0;
+}
+
+//	Generate a stream of blocks of all types and cut it into buffers of bsize bytes
+int Generate(struct blkbench_data *d, int mbytes, int bsize)
+{
+	const int types[] = {BLK_SELF, BLK_SELF, BLK_SELF, BLK_MASTER, BLK_HISTORY, BLK_TRIGINFO, BLK_TOKENSYNC, BLK_SELF};
+	unsigned short *w;
+	long long total;
+	int i, j, n, L, type;
+
+	w = (unsigned short *) malloc(bsize + 4 * BLK_MAXLEN);
+	if (!w) return -1;
+	srand48(1);
+	n = 0;
+	for (total = 0; total < (long long) mbytes << 20; ) {
+		type = types[lrand48() & 7];
+		L = (type == BLK_TRIGINFO) ? 7 : (type == BLK_TOKENSYNC) ? 2 : 2 + 16 * (1 + (lrand48() & 7));
+		if (!(lrand48() & 15)) w[n++] = BLK_CW;		// alignment
+		w[n] = BLK_CW | ((lrand48() & 0x3F) << 9) | L;
+		w[n+1] = (type << 12) | (lrand48() & 0x3FF);
+		for (j = 2; j <= L; j++) w[n+j] = lrand48() & 0x7FFF;
+		n += L + 1;
+		while (2 * n >= bsize) {
+			if (AddPayload(d, w, bsize, 0)) {
+				free(w);
+				return -1;
+			}
+			total += bsize;
+			i = n - bsize / 2;
+			memmove(w, w + bsize / 2, 2 * i);
+			n = i;
+		}
+	}
+	free(w);
+	return 0;
+}
+
+//	Decode all payloads, each module is a separate stream.
+//	unpack: 1 - convert samples of complete blocks to short, 2 - to float, the pedestal of 100 is subtracted.
+//	Return the number of complete blocks.
+long long Decode(struct blkbench_data *d, blkdecoder **dec, int flags, int unpack, struct blk_stat *total)
+{
+	struct blk_view v;
+	const struct blk_stat *st;
+	short sbuf[BLK_MAXLEN];
+	float fbuf[BLK_MAXLEN];
+	long long blocks;
+	int i, k, irc;
+
+	for (i = 0; i < MAXSERIAL; i++) if (dec[i]) delete dec[i];
+	memset(dec, 0, MAXSERIAL * sizeof(blkdecoder *));
+	blocks = 0;
+	for (i = 0; i < d->n; i++) {
+		if (!dec[d->serial[i]]) dec[d->serial[i]] = new blkdecoder(flags);
+		dec[d->serial[i]]->Feed(d->buf + d->off[i], d->plen[i]);
+		while ((irc = dec[d->serial[i]]->Next(&v)) != BLK_END) {
+			if (irc != BLK_OK) continue;
+			blocks++;
+			if (unpack == 1) blk_samples(v.data, v.ndata, sbuf, 100, v.chan & 1);
+			else if (unpack == 2) blk_samples_float(v.data, v.ndata, fbuf, 100, v.chan & 1);
+		}
+	}
+	if (total) {
+		memset(total, 0, sizeof(struct blk_stat));
+		for (i = 0; i < MAXSERIAL; i++) if (dec[i]) {
+			st = dec[i]->GetStat();
+			total->words += st->words;
+			total->blocks += st->blocks;
+			for (k = 0; k < 8; k++) total->types[k] += st->types[k];
+			total->align += st->align;
+			total->stray += st->stray;
+			total->shortblk += st->shortblk;
+			total->split += st->split;
+		}
+	}
+	return blocks;
+}
+
+//	Convert the samples of all complete blocks by levels lfrom - lto and compare them with the scalar
+//	conversion, for pedestals at and beyond the limits of short and both polarities.
+//	Return the number of mismatches
+long long Verify(struct blkbench_data *d, int lfrom, int lto)
+{
+	const int ped[] = {0, 100, -100, 16383, -16384, 32767, -32768, 32768, -32769, 40000, -40000, 49151, -49152, 100000, -100000};
+	const char *lname[] = {"scalar", "SSE2", "AVX2", "AVX512"};
+	struct blk_view v;
+	blkdecoder dec;
+	short sref[BLK_MAXLEN], sbuf[BLK_MAXLEN];
+	float fref[BLK_MAXLEN], fbuf[BLK_MAXLEN];
+	long long bad[BLK_AVX512 + 1], total;
+	int i, j, inv, level, irc;
+
+	memset(bad, 0, sizeof(bad));
+	for (i = 0; i < d->n; i++) {
+		dec.Feed(d->buf + d->off[i], d->plen[i]);
+		while ((irc = dec.Next(&v)) != BLK_END) {
+			if (irc != BLK_OK || v.ndata <= 0) continue;
+			for (j = 0; j < (int) (sizeof(ped) / sizeof(ped[0])); j++) for (inv = 0; inv < 2; inv++) {
+				blk_set_level(BLK_SCALAR);
+				blk_samples(v.data, v.ndata, sref, ped[j], inv);
+				blk_samples_float(v.data, v.ndata, fref, ped[j], inv);
+				for (level = lfrom; level <= lto; level++) {
+					if (blk_set_level(level) != level) continue;
+					blk_samples(v.data, v.ndata, sbuf, ped[j], inv);
+					blk_samples_float(v.data, v.ndata, fbuf, ped[j], inv);
+					if (memcmp(sbuf, sref, v.ndata * sizeof(short)) || memcmp(fbuf, fref, v.ndata * sizeof(float))) {
+						if (!bad[level]) printf("%s: samples differ from scalar, pedestal %d%s\n",
+							lname[level], ped[j], (inv) ? ", inverted" : "");
+						bad[level]++;
+					}
+				}
+			}
+		}
+	}
+	for (level = lfrom, total = 0; level <= lto; level++) {
+		if (blk_set_level(level) != level) continue;
+		printf("%-6s: samples %s\n", lname[level], (bad[level]) ? "DIFFER from scalar" : "as scalar");
+		total += bad[level];
+	}
+	return total;
+}
+
+int main(int argc, char **argv)
+{
+	struct blkbench_data d;
+	struct blk_stat st;
+	blkdecoder *dec[MAXSERIAL];
+	const char *lname[] = {"scalar", "SSE2", "AVX2", "AVX512"};
+	double t0, tplain, tcheck, tshort, tfloat;
+	long long total;
+	int level, lfrom, lto, nrep, gen, bsize;
+	int c, i, k, irc;
+
+	memset(&d, 0, sizeof(d));
+	memset(dec, 0, sizeof(dec));
+	lfrom = BLK_SCALAR;
+	lto = BLK_AVX512;
+	nrep = 3;
+	gen = 0;
+	bsize = 0x10000;
+	for (;;) {
+		c = getopt(argc, argv, "b:g:hl:n:");
+		if (c == -1) break;
+		switch (c) {
+		case 'b':
+			bsize = strtol(optarg, NULL, 0) & ~1;
+			if (bsize < 2) bsize = 2;
+			break;
+		case 'g':
+			gen = strtol(optarg, NULL, 0);
+			break;
+		case 'l':
+			lfrom = lto = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			nrep = strtol(optarg, NULL, 0);
+			if (nrep < 1) nrep = 1;
+			break;
+		case 'h':
+		default:
+			Help();
+			return 0;
+		}
+	}
+	if (gen > 0) {
+		Generate(&d, gen, bsize);
+	} else if (optind < argc) {
+		for (; optind < argc; optind++) ReadFile(&d, argv[optind]);
+	} else {
+		Help();
+		return 0;
+	}
+	if (!d.n) {
+		printf("No data records.\n");
+		return 10;
+	}
+
+	for (i = 0, total = 0; i < d.n; i++) total += d.plen[i];
+	printf("%d buffers, %Ld bytes\n", d.n, total);
+	Decode(&d, dec, BLK_CHECK, 0, &st);
+	printf("Blocks %Ld: self %Ld, master %Ld, trigger %Ld, history %Ld, token %Ld, other %Ld\n", st.blocks,
+		st.types[BLK_SELF], st.types[BLK_MASTER], st.types[BLK_TRIGINFO], st.types[BLK_HISTORY], st.types[BLK_TOKENSYNC],
+		st.blocks - st.types[BLK_SELF] - st.types[BLK_MASTER] - st.types[BLK_TRIGINFO] - st.types[BLK_HISTORY] - st.types[BLK_TOKENSYNC]);
+	printf("Alignment %Ld, split %Ld, short %Ld, stray words %Ld\n", st.align, st.split, st.shortblk, st.stray);
+	irc = (Verify(&d, lfrom, lto)) ? 20 : 0;
+	for (level = lfrom; level <= lto; level++) {
+		if (blk_set_level(level) != level) continue;
+		tplain = tcheck = tshort = tfloat = 1E10;
+		for (k = 0; k < nrep; k++) {
+			t0 = Now();
+			Decode(&d, dec, 0, 0, NULL);
+			t0 = Now() - t0;
+			if (t0 < tplain) tplain = t0;
+			t0 = Now();
+			Decode(&d, dec, BLK_CHECK, 0, NULL);
+			t0 = Now() - t0;
+			if (t0 < tcheck) tcheck = t0;
+			t0 = Now();
+			Decode(&d, dec, 0, 1, NULL);
+			t0 = Now() - t0;
+			if (t0 < tshort) tshort = t0;
+			t0 = Now();
+			Decode(&d, dec, 0, 2, NULL);
+			t0 = Now() - t0;
+			if (t0 < tfloat) tfloat = t0;
+		}
+		printf("%-6s: decode %.2f GB/s, with check %.2f GB/s, to short %.2f GB/s, to float %.2f GB/s\n", lname[level],
+			total / tplain * 1E-9, total / tcheck * 1E-9, total / tshort * 1E-9, total / tfloat * 1E-9);
+	}
+	for (i = 0; i < MAXSERIAL; i++) if (dec[i]) delete dec[i];
+	free(d.buf);
+	free(d.off);
+	free(d.plen);
+	free(d.serial);
+	return irc;
+}
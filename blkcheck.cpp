@@ -0,0 +1,167 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Streaming integrity check of the module data in the readout.
+	Every buffer read from the module FIFO goes through the block decoder with BLK_CHECK:
+	stray words and blocks cut by a control word are framing errors. Blocks of triggers
+	(master, trigger information, history, token synchronization) are checked for the length,
+	the token parity, the error bit and the order of the tokens: blocks of a trigger come
+	together and the token only goes up by one, or more if the module had nothing for some
+	triggers. The trigger information has no error bit, its token is 11 bits wide.
+	The buffer is not changed. The first error of each kind is logged, the first
+	MaxBad offending blocks are kept with their FIFO addresses.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blkcheck.h"
+#include "log.h"
+
+static const char *bc_names[BC_NERR] = {"stray data", "cut blocks", "wrong length", "wrong type", "parity", "error bit", "token back"};
+
+blkcheck::blkcheck(struct blkcheck_config *conf) : dec(BLK_CHECK)
+{
+	memcpy(&Conf, conf, sizeof(Conf));
+	if (Conf.MaxBad < 0) Conf.MaxBad = 0;
+	bad = (struct blkcheck_bad *) calloc((Conf.MaxBad) ? Conf.MaxBad : 1, sizeof(struct blkcheck_bad));
+	if (!bad) Conf.MaxBad = 0;
+	memset(&stat, 0, sizeof(stat));
+	words = 0;
+	logged = 0;
+	Reset();
+}
+
+blkcheck::~blkcheck(void)
+{
+	free(bad);
+}
+
+//	Count the error and remember the block
+void blkcheck::Bad(const struct blk_view *v, int what)
+{
+	struct blkcheck_bad *b;
+
+	stat.errors[what]++;
+	if (!(logged & (1 << what))) {
+		Log(WARN, "Data check: %s at word %Ld: %4.4X %4.4X\n", bc_names[what], words + v->pos,
+			v->cw[0], (v->len > 0) ? v->cw[1] : 0);
+		logged |= 1 << what;
+	}
+	if (stat.nbad >= Conf.MaxBad) return;
+	b = &bad[stat.nbad++];
+	b->pos = words + v->pos;
+	if (v->pos >= 0) {
+		b->addr = addr + 2 * v->pos;
+	} else {		// the block began in the previous buffer
+		b->addr = prev_addr + 2 * ((prev_len + v->pos > 0) ? prev_len + v->pos : 0);
+	}
+	b->what = what;
+	b->cw = v->cw[0];
+	b->w1 = (v->len > 0) ? v->cw[1] : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Check len bytes of the module data read from fifo_addr. The words go in order
+//	as they came from the module FIFO, buffer by buffer.
+//	Return the number of errors found
+int blkcheck::Check(const void *data, int len, unsigned int fifo_addr)
+{
+	struct blk_view v;
+	int irc, d, n, L, tok, mask;
+
+	n = 0;
+	addr = fifo_addr;
+	dec.Feed(data, len);
+	while ((irc = dec.Next(&v)) != BLK_END) {
+		if (irc == BLK_PART) continue;		// comes whole with the next buffer
+		if (irc == BLK_STRAY) {
+			Bad(&v, BC_STRAY);
+			n++;
+			continue;
+		}
+		if (irc == BLK_SHORT) {
+			Bad(&v, BC_SHORT);
+			n++;
+			continue;
+		}
+		if (!v.len) continue;		// alignment
+		stat.blocks++;
+		switch (v.type) {
+		case BLK_SELF:
+			continue;		// self trigger blocks have no trigger token
+		case BLK_MASTER:
+		case BLK_HISTORY:
+			L = (Conf.WinLen > 0) ? Conf.WinLen + 2 : v.len;
+			break;
+		case BLK_TRIGINFO:
+			L = 7;
+			break;
+		case BLK_TOKENSYNC:
+			L = v.len;
+			break;
+		default:
+			Bad(&v, BC_TYPE);
+			n++;
+			continue;
+		}
+		if (v.len != L) {
+			Bad(&v, BC_LENGTH);
+			n++;
+		}
+		if (v.parity == __builtin_parity(v.cw[1] & 0x7FF)) {
+			Bad(&v, BC_PARITY);
+			n++;
+		}
+		if (v.err && v.type != BLK_TRIGINFO) {		// bit 10 of the trigger information is the token bit
+			Bad(&v, BC_ERRBIT);
+			n++;
+		}
+		tok = (v.type == BLK_TRIGINFO) ? v.cw[1] & 0x7FF : v.token;
+		if (last >= 0) {		// 11 bits between two trigger information blocks, the common 10 bits otherwise
+			mask = (v.type == BLK_TRIGINFO && last_mask == 0x7FF) ? 0x7FF : 0x3FF;
+			d = (tok - last) & mask;
+			if (d > mask / 2) {
+				Bad(&v, BC_TOKEN);
+				n++;
+			} else if (d > 1) {
+				stat.skips++;
+			}
+		}
+		last = tok;
+		last_mask = (v.type == BLK_TRIGINFO) ? 0x7FF : 0x3FF;
+	}
+	stat.words += len / 2;
+	words += len / 2;
+	prev_addr = fifo_addr;
+	prev_len = len / 2;
+	return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Print error counters and the offending blocks remembered
+void blkcheck::PrintStat(int serial)
+{
+	long long errors;
+	int i;
+
+	for (i = 0, errors = 0; i < BC_NERR; i++) errors += stat.errors[i];
+	printf("Module %d data check: %Ld blocks, %Ld words, %Ld errors", serial, stat.blocks, stat.words, errors);
+	for (i = 0; i < BC_NERR; i++) if (stat.errors[i]) printf(", %s %Ld", bc_names[i], stat.errors[i]);
+	if (stat.skips) printf(", %Ld token skips", stat.skips);
+	printf(".\n");
+	for (i = 0; i < stat.nbad; i++) printf("\tword %Ld FIFO 0x%8.8X: %4.4X %4.4X %s\n",
+		bad[i].pos, bad[i].addr, bad[i].cw, bad[i].w1, bc_names[bad[i].what]);
+	if (errors > stat.nbad && stat.nbad) printf("\t... %Ld more\n", errors - stat.nbad);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Forget a block split between buffers and the last token, when the module FIFO is reset.
+//	The counters are kept.
+void blkcheck::Reset(void)
+{
+	dec.Reset();
+	last = -1;
+	last_mask = 0x3FF;
+	prev_addr = addr = 0;
+	prev_len = 0;
+}
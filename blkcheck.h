@@ -0,0 +1,74 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Streaming integrity check of the module data in the readout.
+*/
+#ifndef BLKCHECK_H
+#define BLKCHECK_H
+
+#include "blkdecode.h"
+
+#define BC_MAXBAD	16		// default number of offending blocks remembered
+
+//	Kinds of errors
+enum BC_ERROR {
+	BC_STRAY = 0,		// words outside any block, counted once per run of them
+	BC_SHORT = 1,		// a block cut by the next control word
+	BC_LENGTH = 2,		// length is not WinLen + 2 for waveform blocks, 7 for the trigger information
+	BC_TYPE = 3,		// unknown block type
+	BC_PARITY = 4,		// token parity is not NOT (xor) of word 1 bits 10:0
+	BC_ERRBIT = 5,		// error bit set by the module, the trigger information has none
+	BC_TOKEN = 6,		// token went back
+	BC_NERR = 7
+};
+
+//	Parameters of one module, normally DataCheck* of the module configuration
+struct blkcheck_config {
+	int WinLen;		// waveform window length, 0 - lengths are not checked
+	int MaxBad;		// offending blocks remembered
+};
+
+//	An offending block or stray words
+struct blkcheck_bad {
+	long long pos;		// words from the beginning of the stream
+	unsigned int addr;	// FIFO address, bytes
+	int what;		// BC_ERROR
+	unsigned short cw;	// the control word, or the first stray word
+	unsigned short w1;	// word 1, 0 if none
+};
+
+//	Counters since the start
+struct blkcheck_stat {
+	long long words;
+	long long blocks;
+	long long errors[BC_NERR];
+	long long skips;	// tokens jumped forward by more than one: triggers without blocks of the module
+	int nbad;		// offending blocks remembered
+};
+
+//	Check of one module stream. Framing goes through the block decoder with BLK_CHECK,
+//	so control words inside blocks are looked for with its SIMD scan.
+class blkcheck {
+private:
+	struct blkcheck_config Conf;
+	blkdecoder dec;
+	int last;		// the last token, -1 if none
+	int last_mask;		// its bits: 0x7FF of the trigger information, 0x3FF of other blocks
+	long long words;	// words before the current buffer
+	unsigned int addr;	// FIFO address of the current buffer
+	unsigned int prev_addr;	// and of the previous one
+	int prev_len;		// words in the previous buffer
+	int logged;		// BC_ERROR bits already reported to the log
+	struct blkcheck_stat stat;
+	struct blkcheck_bad *bad;
+	void Bad(const struct blk_view *v, int what);
+public:
+	blkcheck(struct blkcheck_config *conf);
+	~blkcheck(void);
+	int Check(const void *data, int len, unsigned int fifo_addr);
+	inline const struct blkcheck_bad *GetBad(void) { return bad; };
+	inline const struct blkcheck_stat *GetStat(void) { return &stat; };
+	void PrintStat(int serial);
+	void Reset(void);
+};
+
+#endif /* BLKCHECK_H */
@@ -0,0 +1,416 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Streaming decoder of the module block stream.
+	Blocks are returned as views into the buffers given, a block split between
+	two buffers is copied once. Control words are skipped to by their length,
+	stray words and block bodies (BLK_CHECK) are scanned with SSE2/AVX2 when available.
+	15-bit samples are converted to short or float with the pedestal subtracted and
+	the polarity inverted if required, with SSE2/AVX2/AVX-512 when available.
+*/
+
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "blkdecode.h"
+
+//	Index of the first word with bit 15 set, n if none
+typedef int (*blk_scan_fn)(const unsigned short *w, int n);
+//	Samples: sign extended from 15 bits, minus the pedestal, negated if sgn is -1. Both steps saturate to short.
+typedef void (*blk_short_fn)(const unsigned short *src, int n, short *dst, int ped, int sgn);
+//	The same to float, sgn is 1 or -1
+typedef void (*blk_float_fn)(const unsigned short *src, int n, float *dst, float ped, float sgn);
+
+static int blk_scan_scalar(const unsigned short *w, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) if (w[i] & BLK_CW) break;
+	return i;
+}
+
+static void blk_short_scalar(const unsigned short *src, int n, short *dst, int ped, int sgn)
+{
+	int i, y;
+
+	for (i = 0; i < n; i++) {
+		y = (((short) (src[i] << 1)) >> 1) - ped;
+		y = (y > 32767) ? 32767 : (y < -32768) ? -32768 : y;
+		y = (y ^ sgn) - sgn;
+		dst[i] = (y > 32767) ? 32767 : y;
+	}
+}
+
+static void blk_float_scalar(const unsigned short *src, int n, float *dst, float ped, float sgn)
+{
+	int i;
+
+	for (i = 0; i < n; i++) dst[i] = ((((short) (src[i] << 1)) >> 1) - ped) * sgn;
+}
+
+#if defined(__x86_64__)
+//	Bit 15 of a word is the sign of its high byte: odd bits of the byte mask
+static int blk_scan_sse2(const unsigned short *w, int n)
+{
+	__m128i a, b;
+	int i, m;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		a = _mm_loadu_si128((const __m128i *) (w + i));
+		b = _mm_loadu_si128((const __m128i *) (w + i + 8));
+		if (!(_mm_movemask_epi8(_mm_or_si128(a, b)) & 0xAAAA)) continue;
+		m = _mm_movemask_epi8(a) & 0xAAAA;
+		if (m) return i + (__builtin_ctz(m) >> 1);
+		m = _mm_movemask_epi8(b) & 0xAAAA;
+		return i + 8 + (__builtin_ctz(m) >> 1);
+	}
+	for (; i + 8 <= n; i += 8) {
+		m = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (w + i))) & 0xAAAA;
+		if (m) return i + (__builtin_ctz(m) >> 1);
+	}
+	return i + blk_scan_scalar(w + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int blk_scan_avx2(const unsigned short *w, int n)
+{
+	__m256i a, b;
+	unsigned int m;
+	int i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		a = _mm256_loadu_si256((const __m256i *) (w + i));
+		b = _mm256_loadu_si256((const __m256i *) (w + i + 16));
+		if (!(_mm256_movemask_epi8(_mm256_or_si256(a, b)) & 0xAAAAAAAA)) continue;
+		m = _mm256_movemask_epi8(a) & 0xAAAAAAAA;
+		if (!m) {
+			m = _mm256_movemask_epi8(b) & 0xAAAAAAAA;
+			i += 16;
+		}
+		_mm256_zeroupper();
+		return i + (__builtin_ctz(m) >> 1);
+	}
+	_mm256_zeroupper();
+	for (; i + 8 <= n; i += 8) {
+		m = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (w + i))) & 0xAAAA;
+		if (m) return i + (__builtin_ctz(m) >> 1);
+	}
+	return i + blk_scan_scalar(w + i, n - i);
+}
+
+//	Negation as (y ^ -1) - (-1) saturates -32768 to 32767
+static void blk_short_sse2(const unsigned short *src, int n, short *dst, int ped, int sgn)
+{
+	__m128i v;
+	const __m128i p = _mm_set1_epi16(ped);
+	const __m128i s = _mm_set1_epi16(sgn);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm_loadu_si128((const __m128i *) (src + i));
+		v = _mm_subs_epi16(_mm_srai_epi16(_mm_slli_epi16(v, 1), 1), p);
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_subs_epi16(_mm_xor_si128(v, s), s));
+	}
+	blk_short_scalar(src + i, n - i, dst + i, ped, sgn);
+}
+
+static void blk_float_sse2(const unsigned short *src, int n, float *dst, float ped, float sgn)
+{
+	__m128i v;
+	const __m128 p = _mm_set1_ps(ped);
+	const __m128 s = _mm_set1_ps(sgn);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm_slli_epi16(_mm_loadu_si128((const __m128i *) (src + i)), 1);
+		// the sample to the upper half of a 32-bit word, then shift back with the sign
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 17)), p), s));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 17)), p), s));
+	}
+	blk_float_scalar(src + i, n - i, dst + i, ped, sgn);
+}
+
+__attribute__((target("avx2")))
+static void blk_short_avx2(const unsigned short *src, int n, short *dst, int ped, int sgn)
+{
+	__m256i v;
+	const __m256i p = _mm256_set1_epi16(ped);
+	const __m256i s = _mm256_set1_epi16(sgn);
+	int i, y;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm256_loadu_si256((const __m256i *) (src + i));
+		v = _mm256_subs_epi16(_mm256_srai_epi16(_mm256_slli_epi16(v, 1), 1), p);
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_subs_epi16(_mm256_xor_si256(v, s), s));
+	}
+	for (; i < n; i++) {
+		y = (((short) (src[i] << 1)) >> 1) - ped;
+		y = (y > 32767) ? 32767 : (y < -32768) ? -32768 : y;
+		y = (y ^ sgn) - sgn;
+		dst[i] = (y > 32767) ? 32767 : y;
+	}
+}
+
+__attribute__((target("avx2")))
+static void blk_float_avx2(const unsigned short *src, int n, float *dst, float ped, float sgn)
+{
+	__m256i v;
+	const __m256 p = _mm256_set1_ps(ped);
+	const __m256 s = _mm256_set1_ps(sgn);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm256_cvtepi16_epi32(_mm_slli_epi16(_mm_loadu_si128((const __m128i *) (src + i)), 1));
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_srai_epi32(v, 1)), p), s));
+	}
+	for (; i < n; i++) dst[i] = ((((short) (src[i] << 1)) >> 1) - ped) * sgn;
+}
+
+//	Tails are done with masked loads and stores
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+static void blk_short_avx512(const unsigned short *src, int n, short *dst, int ped, int sgn)
+{
+	__m512i v;
+	const __m512i p = _mm512_set1_epi16(ped);
+	const __m512i s = _mm512_set1_epi16(sgn);
+	__mmask32 m;
+	int i;
+
+	for (i = 0; i < n; i += 32) {
+		m = (n - i >= 32) ? 0xFFFFFFFF : (1U << (n - i)) - 1;
+		v = _mm512_maskz_loadu_epi16(m, src + i);
+		v = _mm512_subs_epi16(_mm512_srai_epi16(_mm512_slli_epi16(v, 1), 1), p);
+		_mm512_mask_storeu_epi16(dst + i, m, _mm512_subs_epi16(_mm512_xor_si512(v, s), s));
+	}
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+static void blk_float_avx512(const unsigned short *src, int n, float *dst, float ped, float sgn)
+{
+	__m512i v;
+	const __m512 p = _mm512_set1_ps(ped);
+	const __m512 s = _mm512_set1_ps(sgn);
+	__mmask16 m;
+	int i;
+
+	for (i = 0; i < n; i += 16) {
+		m = (n - i >= 16) ? 0xFFFF : (1U << (n - i)) - 1;
+		v = _mm512_cvtepi16_epi32(_mm256_slli_epi16(_mm256_maskz_loadu_epi16(m, src + i), 1));
+		_mm512_mask_storeu_ps(dst + i, m, _mm512_mul_ps(_mm512_sub_ps(_mm512_cvtepi32_ps(_mm512_srai_epi32(v, 1)), p), s));
+	}
+}
+#endif
+
+static int blk_level = -1;
+static int blk_maxlevel = BLK_SCALAR;
+static blk_scan_fn blk_scan_ptr = blk_scan_scalar;
+static blk_short_fn blk_short = blk_short_scalar;
+static blk_float_fn blk_float = blk_float_scalar;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Select the kernels. The level is limited to what the CPU supports.
+//	Return the level set
+int blk_set_level(int level)
+{
+#if defined(__x86_64__)
+	blk_maxlevel = (__builtin_cpu_supports("avx2")) ? BLK_AVX2 : BLK_SSE2;
+	if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) blk_maxlevel = BLK_AVX512;
+#endif
+	if (level > blk_maxlevel) level = blk_maxlevel;
+	if (level < BLK_SCALAR) level = BLK_SCALAR;
+	blk_scan_ptr = blk_scan_scalar;
+	blk_short = blk_short_scalar;
+	blk_float = blk_float_scalar;
+#if defined(__x86_64__)
+	if (level >= BLK_SSE2) {
+		blk_scan_ptr = blk_scan_sse2;
+		blk_short = blk_short_sse2;
+		blk_float = blk_float_sse2;
+	}
+	if (level >= BLK_AVX2) {
+		blk_scan_ptr = blk_scan_avx2;
+		blk_short = blk_short_avx2;
+		blk_float = blk_float_avx2;
+	}
+	if (level >= BLK_AVX512) {
+		blk_short = blk_short_avx512;
+		blk_float = blk_float_avx512;
+	}
+#endif
+	blk_level = level;
+	return level;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	The level in use, the best available by default
+int blk_get_level(void)
+{
+	if (blk_level < 0) blk_set_level(BLK_AVX512);
+	return blk_level;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Find the next control word.
+//	Return its index in w, n if there is none
+int blk_scan(const unsigned short *w, int n)
+{
+	if (blk_level < 0) blk_get_level();
+	return blk_scan_ptr(w, n);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Convert n 15-bit samples from src to dst: sign extended, minus the pedestal,
+//	negated if invert is set (see BLK_INVERTED()). The source is not changed.
+//	The vector kernels take the pedestal as short, others are done by the scalar one.
+void blk_samples(const unsigned short *src, int n, short *dst, int pedestal, int invert)
+{
+	if (blk_level < 0) blk_get_level();
+	if (pedestal < -32768 || pedestal > 32767) blk_short_scalar(src, n, dst, pedestal, (invert) ? -1 : 0);
+	else blk_short(src, n, dst, pedestal, (invert) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	The same as blk_samples() to float
+void blk_samples_float(const unsigned short *src, int n, float *dst, float pedestal, int invert)
+{
+	if (blk_level < 0) blk_get_level();
+	blk_float(src, n, dst, pedestal, (invert) ? -1 : 1);
+}
+
+//*************************************************************************************************************************************//
+
+blkdecoder::blkdecoder(int flg)
+{
+	flags = flg;
+	Reset();
+}
+
+//	Fill the view of the block at cw with len words present
+void blkdecoder::Block(struct blk_view *v, const unsigned short *cw, int cpos, int len, int missing)
+{
+	v->cw = cw;
+	v->pos = cpos;
+	v->len = len;
+	v->missing = missing;
+	v->chan = (cw[0] >> 9) & 0x3F;
+	if (len > 0) {
+		v->type = (cw[1] >> 12) & 7;
+		v->token = cw[1] & 0x3FF;
+		v->err = (cw[1] >> 10) & 1;
+		v->parity = (cw[1] >> 11) & 1;
+	} else {
+		v->type = v->token = -1;
+		v->err = v->parity = 0;
+	}
+	v->data = cw + 3;
+	v->ndata = (len > 2) ? len - 2 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Give the next buffer of the stream, len in bytes. The buffer must stay until Next() returns BLK_END.
+//	A block left incomplete by the previous buffer is completed first.
+void blkdecoder::Feed(const void *data, int len)
+{
+	int k, m;
+
+	buf = (const unsigned short *) data;
+	n = len / sizeof(short);
+	pos = 0;
+	stat.words += n;
+	if (!need) return;
+	carry_pos = -ncarry;
+	k = (need < n) ? need : n;
+	if (flags & BLK_CHECK) {
+		m = blk_scan(buf, k);
+		if (m < k) {
+			carry_short = need - m;
+			need = m;
+			k = m;
+		}
+	}
+	memcpy(&carry[ncarry], buf, k * sizeof(short));
+	ncarry += k;
+	need -= k;
+	pos = k;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Get the next block of the current buffer.
+//	Return BLK_OK, BLK_PART, BLK_STRAY, BLK_SHORT with v filled or BLK_END
+int blkdecoder::Next(struct blk_view *v)
+{
+	int L, k, avail;
+
+	if (ncarry && !need) {
+		Block(v, carry, carry_pos, ncarry - 1, carry_short);
+		ncarry = 0;
+		if (carry_short) {
+			carry_short = 0;
+			stat.shortblk++;
+			return BLK_SHORT;
+		}
+		stat.blocks++;
+		if (v->type >= 0) stat.types[v->type]++;
+		return BLK_OK;
+	}
+	if (need) return BLK_END;
+	while (pos < n) {
+		if (!(buf[pos] & BLK_CW)) {
+			k = pos + 1 + blk_scan(buf + pos + 1, n - pos - 1);
+			memset(v, 0, sizeof(*v));
+			v->cw = buf + pos;
+			v->pos = pos;
+			v->len = k - pos;
+			v->chan = v->type = v->token = -1;
+			v->data = v->cw;
+			v->ndata = k - pos;
+			stat.stray += k - pos;
+			pos = k;
+			return BLK_STRAY;
+		}
+		L = buf[pos] & 0x1FF;
+		if (!L) {
+			stat.align++;
+			pos++;
+			if (!(flags & BLK_ALIGN)) continue;
+			Block(v, buf + pos - 1, pos - 1, 0, 0);
+			return BLK_OK;
+		}
+		avail = n - pos - 1;
+		if (flags & BLK_CHECK) {
+			k = blk_scan(buf + pos + 1, (L < avail) ? L : avail);
+			if (k < L && k < avail) {
+				Block(v, buf + pos, pos, k, L - k);
+				pos += k + 1;
+				stat.shortblk++;
+				return BLK_SHORT;
+			}
+		}
+		if (L > avail) {
+			memcpy(carry, buf + pos, (avail + 1) * sizeof(short));
+			ncarry = avail + 1;
+			need = L - avail;
+			Block(v, buf + pos, pos, avail, need);
+			pos = n;
+			stat.split++;
+			return BLK_PART;
+		}
+		Block(v, buf + pos, pos, L, 0);
+		pos += L + 1;
+		stat.blocks++;
+		stat.types[v->type]++;
+		return BLK_OK;
+	}
+	return BLK_END;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Start a new stream: forget the carried block and the counters
+void blkdecoder::Reset(void)
+{
+	buf = NULL;
+	n = pos = 0;
+	ncarry = need = 0;
+	carry_pos = carry_short = 0;
+	memset(&stat, 0, sizeof(stat));
+}
@@ -0,0 +1,100 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Streaming decoder of the module block stream.
+*/
+#ifndef BLKDECODE_H
+#define BLKDECODE_H
+
+//	Block: control word, then len words. Control word: bit 15 set, channel in bits 14:9,
+//	len in bits 8:0, len = 0 is an alignment word. Word 1: type in bits 14:12, parity in bit 11,
+//	error in bit 10, token in bits 9:0. Word 2 is the time, samples follow, 15 bits signed.
+#define BLK_CW		0x8000
+#define BLK_MAXLEN	0x200		// words in the longest block including the control word
+
+//	Block types
+enum BLK_TYPE {
+	BLK_SELF = 0,		// self trigger
+	BLK_MASTER = 1,		// master trigger
+	BLK_TRIGINFO = 2,	// trigger information
+	BLK_HISTORY = 4,	// trigger history
+	BLK_TOKENSYNC = 5	// token synchronization
+};
+
+//	Next() return codes
+#define BLK_END		0	// the buffer is done, a partial block at its end is kept for the next one
+#define BLK_OK		1	// a block
+#define BLK_PART	2	// the beginning of the block not complete in this buffer
+#define BLK_STRAY	(-1)	// len words outside any block
+#define BLK_SHORT	(-2)	// a block cut by the next control word, BLK_CHECK only
+
+//	Decoder flags
+#define BLK_ALIGN	1	// return alignment words as blocks of zero length
+#define BLK_CHECK	2	// look for control words inside blocks
+
+//	SIMD level of the kernels
+enum BLK_LEVEL {
+	BLK_SCALAR = 0,
+	BLK_SSE2 = 1,
+	BLK_AVX2 = 2,
+	BLK_AVX512 = 3
+};
+
+//	Channel chan is inverted by InvertMask[4], a bit per channel of each 16
+#define BLK_INVERTED(mask, chan)	(((mask)[((chan) >> 4) & 3] >> ((chan) & 0xF)) & 1)
+
+//	A block as found. Points to the buffer given or to the decoder copy for blocks
+//	split between buffers, valid until the next call.
+struct blk_view {
+	const unsigned short *cw;	// control word, the block words follow
+	int pos;		// word offset of cw in the current buffer, negative if the block began in a previous one
+	int len;		// words after the control word, the number of words for BLK_STRAY
+	int missing;		// words not here for BLK_PART and BLK_SHORT
+	int chan;
+	int type;		// BLK_TYPE, -1 if no word 1
+	int token;		// -1 if no word 1
+	int err;
+	int parity;
+	const unsigned short *data;	// samples
+	int ndata;
+};
+
+//	Counters since Reset()
+struct blk_stat {
+	long long words;
+	long long blocks;	// complete blocks
+	long long types[8];	// complete blocks by type
+	long long align;
+	long long stray;	// words
+	long long shortblk;
+	long long split;
+};
+
+class blkdecoder {
+private:
+	const unsigned short *buf;
+	int n;
+	int pos;
+	int flags;
+	unsigned short carry[BLK_MAXLEN];	// the block split between buffers
+	int ncarry;
+	int need;		// words of the carried block still to come
+	int carry_pos;		// its control word offset in the current buffer
+	int carry_short;	// cut by a control word
+	struct blk_stat stat;
+	void Block(struct blk_view *v, const unsigned short *cw, int cpos, int len, int missing);
+public:
+	blkdecoder(int flg = 0);
+	void Feed(const void *data, int len);
+	inline int GetNeed(void) { return need; };
+	inline const struct blk_stat *GetStat(void) { return &stat; };
+	int Next(struct blk_view *v);
+	void Reset(void);
+};
+
+int blk_get_level(void);
+void blk_samples(const unsigned short *src, int n, short *dst, int pedestal = 0, int invert = 0);
+void blk_samples_float(const unsigned short *src, int n, float *dst, float pedestal = 0, int invert = 0);
+int blk_scan(const unsigned short *w, int n);
+int blk_set_level(int level);
+
+#endif /* BLKDECODE_H */
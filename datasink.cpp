@@ -0,0 +1,513 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Data sinks: queue with overflow policy and the file sink.
+
+	Each sink has its own record queue and thread, so a slow sink does not delay
+	the readout and the other sinks. When the queue is full the record is either
+	dropped or appended to an unlinked temporary spill file. While there are spilled
+	records all new records go to the spill file too, the sink thread moves them back
+	to the queue in order when it has space.
+*/
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "datasink.h"
+#include "log.h"
+#include "recformat.h"
+#include "wfcodec.h"
+
+datasink::datasink(const char *sname, struct datasink_config *conf)
+{
+	if (conf) {
+		memcpy(&Conf, conf, sizeof(Conf));
+	} else {
+		memset(&Conf, 0, sizeof(Conf));
+	}
+	if (Conf.Queue <= 0) Conf.Queue = 64;
+	if (!Conf.SpillDir[0]) strcpy(Conf.SpillDir, "/tmp");
+	strncpy(name, sname, sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+	queue = new recqueue(DATASINK_SLOTS, (long long) Conf.Queue * 0x100000);
+	thread_running = 0;
+	stop = 0;
+	deadline = 0;
+	pthread_mutex_init(&spill_mutex, NULL);
+	spill_fd = -1;
+	spill_rpos = 0;
+	spill_wpos = 0;
+	spill_cnt = 0;
+	dropped_recs = 0;
+	dropped_bytes = 0;
+	spilled_recs = 0;
+	spilled_bytes = 0;
+	lost_recs = 0;
+	cbuf = NULL;
+	cbufsize = 0;
+	comp_in = 0;
+	comp_out = 0;
+	feat = (Conf.Features.Mode) ? new wffextractor(&Conf.Features) : NULL;
+}
+
+datasink::~datasink(void)
+{
+	datasink::Close();
+	delete queue;
+	pthread_mutex_destroy(&spill_mutex);
+	free(cbuf);
+	if (feat) delete feat;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Stop the sink thread. Wait up to CloseTimeout s for the queued and spilled records
+//	to be delivered, drop the rest.
+void datasink::Close(void)
+{
+	int cnt;
+
+	if (thread_running) {
+		deadline = (Conf.CloseTimeout > 0) ? time(NULL) + Conf.CloseTimeout : 0;
+		stop = 1;
+		pthread_join(thread, NULL);
+		thread_running = 0;
+	}
+	cnt = queue->GetCount() + spill_cnt;
+	if (cnt) Log(ERROR, "%s: %d records were not delivered\n", name, cnt);
+	lost_recs += cnt;
+	queue->Release(queue->GetCount());
+	if (spill_fd >= 0) close(spill_fd);
+	spill_fd = -1;
+	spill_rpos = 0;
+	spill_wpos = 0;
+	spill_cnt = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Compress the record into cbuf if the sink is configured so. Called from the sink thread.
+//	Return the compressed length, 0 if the record is to be written as it is
+int datasink::Compress(const void *rec, int len)
+{
+	int irc;
+
+	if (!Conf.Compress) return 0;
+	if (cbufsize < WFC_MAXSIZE(len)) {
+		free(cbuf);
+		cbufsize = WFC_MAXSIZE(len);
+		cbuf = (char *) malloc(cbufsize);
+		if (!cbuf) {
+			Log(ERROR, "%s: no memory for compression buffer: %m. Records are not compressed.\n", name);
+			cbufsize = 0;
+			Conf.Compress = 0;
+			return 0;
+		}
+	}
+	irc = wfc_rec_encode(rec, len, cbuf, cbufsize);
+	if (irc <= 0) return 0;
+	comp_in += len;
+	comp_out += irc;
+	return irc;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Replace num records got with Peek(from, ...) by their compressed copies and/or feature records,
+//	in the queue and in recs. For sinks which keep records in the queue after writing them.
+//	Converted records are not touched again: compressed ones are flagged, feature records have their own type
+//	and a data record followed by its feature record is longer than its header says.
+void datasink::ConvertQueued(struct recbuf **recs, int from, int num)
+{
+	struct rec_info_struct info;
+	struct recbuf *rec;
+	int i, len, flen, keep;
+
+	for (i = 0; i < num; i++) {
+		if (rec_parse(recs[i]->data, recs[i]->len, &info) < 0 || info.len != recs[i]->len) continue;
+		flen = Extract(recs[i]->data, recs[i]->len);
+		len = (flen && Conf.Features.Mode == WFF_ONLY) ? 0 : Compress(recs[i]->data, recs[i]->len);
+		if (!len && !flen) continue;
+		keep = (flen && Conf.Features.Mode == WFF_ONLY) ? 0 : (len) ? len : recs[i]->len;
+		rec = recbuf_alloc(keep + flen);
+		if (!rec) continue;
+		if (keep) memcpy(rec->data, (len) ? cbuf : recs[i]->data, keep);
+		if (flen) memcpy(rec->data + keep, feat->GetRecord(), flen);
+		rec->len = keep + flen;
+		queue->Replace(from + i, rec);
+		recs[i] = rec;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Make the feature record of a module data record if the sink is configured so. Called from the sink thread.
+//	Return the feature record length, the record is in feat->GetRecord(); 0 if there is none
+int datasink::Extract(const void *rec, int len)
+{
+	int irc;
+
+	if (!Conf.Features.Mode) return 0;
+	irc = feat->Convert(rec, len);
+	if (irc < 0) {
+		Log(ERROR, "%s: no memory for feature records: %m. Module data are kept as they are.\n", name);
+		Conf.Features.Mode = WFF_OFF;
+		return 0;
+	}
+	return irc;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Check if the sink thread should exit: the sink is closed and everything is delivered
+//	or the close timeout expired.
+int datasink::IsDone(void)
+{
+	if (!stop) return 0;
+	if (!queue->GetCount() && !spill_cnt) return 1;
+	return deadline && time(NULL) >= deadline;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Print queue statistics
+void datasink::PrintStat(void)
+{
+	printf("%s: queue max %d records (%Ld of %Ld MBytes)", name, queue->GetMaxCount(),
+		queue->GetMaxBytes() / 0x100000, queue->GetLimit() / 0x100000);
+	if (dropped_recs) printf(", %Ld records (%Ld bytes) dropped", dropped_recs, dropped_bytes);
+	if (spilled_recs) printf(", %Ld records (%Ld bytes) spilled to disk", spilled_recs, spilled_bytes);
+	if (lost_recs) printf(", %Ld records lost at close", lost_recs);
+	if (comp_in) printf(", %Ld bytes compressed to %Ld (%.2f)", comp_in, comp_out, (double) comp_in / comp_out);
+	if (feat && feat->GetStat()->records) printf(", %Ld bytes of module data made %Ld features in %Ld bytes (%.1f)",
+		feat->GetStat()->in, feat->GetStat()->features, feat->GetStat()->out, (double) feat->GetStat()->in / feat->GetStat()->out);
+	printf(".\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Give the record to the sink. The sink takes over the reference of the caller.
+//	Never waits for the sink, the record is dropped or spilled if the queue is full.
+//	Return 0 if the record is queued or spilled, 1 if it was dropped, negative on error
+int datasink::Put(struct recbuf *rec)
+{
+	int irc;
+
+	pthread_mutex_lock(&spill_mutex);
+	irc = 1;
+	if (!spill_cnt) irc = queue->Put(rec, 0);	// keep order: nothing goes to the queue before the spilled records
+	if (irc > 0 && Conf.Policy == DATASINK_SPILL) irc = Spill(rec);
+	pthread_mutex_unlock(&spill_mutex);
+	if (irc) {
+		if (irc > 0) {
+			dropped_recs++;
+			dropped_bytes += rec->len;
+		}
+		recbuf_release(rec);
+	}
+	return irc;
+}
+
+void *datasink::SinkThread(void *arg)
+{
+	((datasink *) arg)->Run();
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Write what the sink has collected so far to a file, for sinks which collect something (histsink)
+//	Return 0 on success, 1 if the sink has nothing of the kind, negative on error
+int datasink::Snapshot(const char *)
+{
+	return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Append the record to the spill file. Called with spill_mutex locked.
+//	The reference stays with the caller.
+//	Return 0 if spilled, 1 if not
+int datasink::Spill(struct recbuf *rec)
+{
+	char fname[MAX_PATH_LEN + 32];
+	struct iovec iov[2];
+
+	if (spill_fd < 0) {
+		snprintf(fname, sizeof(fname), "%s/uwfdspill.XXXXXX", Conf.SpillDir);
+		spill_fd = mkstemp(fname);
+		if (spill_fd < 0) {
+			Log(ERROR, "%s: can not create spill file %s: %m. Records will be dropped.\n", name, fname);
+			Conf.Policy = DATASINK_DROP;
+			return 1;
+		}
+		unlink(fname);		// nobody else needs it, the space is freed at close
+	}
+	if (Conf.SpillSize > 0 && spill_wpos + rec->len + (int) sizeof(int) > (long long) Conf.SpillSize * 0x100000) return 1;
+	iov[0].iov_base = &rec->len;
+	iov[0].iov_len = sizeof(int);
+	iov[1].iov_base = rec->data;
+	iov[1].iov_len = rec->len;
+	if (pwritev(spill_fd, iov, 2, spill_wpos) != (ssize_t)(sizeof(int) + rec->len)) {
+		Log(ERROR, "%s: spill file write error: %m. Records will be dropped.\n", name);
+		Conf.Policy = DATASINK_DROP;
+		return 1;
+	}
+	spill_wpos += sizeof(int) + rec->len;
+	spill_cnt++;
+	spilled_recs++;
+	spilled_bytes += rec->len;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Start the sink thread
+//	Return 0 on success, negative on error
+int datasink::Start(void)
+{
+	stop = 0;
+	if (pthread_create(&thread, NULL, SinkThread, this)) {
+		Log(ERROR, "%s: can not start sink thread: %m\n", name);
+		return -1;
+	}
+	thread_running = 1;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Move spilled records back to the queue while it has space. Called from the sink thread.
+void datasink::Unspill(void)
+{
+	struct recbuf *rec;
+	int len, irc;
+
+	while (spill_cnt) {
+		// only this thread moves spill_rpos, the producer only appends
+		if (pread(spill_fd, &len, sizeof(len), spill_rpos) != sizeof(len) || len <= 0) goto err;
+		if (queue->IsFull(len)) return;
+		rec = recbuf_alloc(len);
+		if (!rec) return;
+		if (pread(spill_fd, rec->data, len, spill_rpos + sizeof(len)) != len) {
+			recbuf_release(rec);
+			goto err;
+		}
+		rec->len = len;
+		pthread_mutex_lock(&spill_mutex);
+		irc = queue->Put(rec, 0);
+		if (!irc) {
+			spill_rpos += sizeof(len) + len;
+			spill_cnt--;
+			if (!spill_cnt) {	// start the file from the beginning
+				spill_rpos = 0;
+				spill_wpos = 0;
+				if (ftruncate(spill_fd, 0)) Log(WARN, "%s: spill file truncate error: %m\n", name);
+			}
+		}
+		pthread_mutex_unlock(&spill_mutex);
+		if (irc) {
+			recbuf_release(rec);
+			return;
+		}
+	}
+	return;
+err:
+	Log(ERROR, "%s: spill file read error: %m. %d spilled records lost.\n", name, spill_cnt);
+	pthread_mutex_lock(&spill_mutex);
+	lost_recs += spill_cnt;
+	spill_cnt = 0;
+	spill_rpos = 0;
+	spill_wpos = 0;
+	if (ftruncate(spill_fd, 0)) Log(WARN, "%s: spill file truncate error: %m\n", name);
+	pthread_mutex_unlock(&spill_mutex);
+}
+
+//*************************************************************************************************************************************//
+
+filesink::filesink(const char *fname, struct datasink_config *conf, struct recfile_config *fconf) : datasink(fname, conf)
+{
+	file = new recfile(fconf);
+	idx = (fconf && fconf->Index) ? new recindex_writer() : NULL;
+	lastcnt = 0;
+	lastversion = 1;
+	errcnt = 0;
+}
+
+filesink::~filesink(void)
+{
+	Close();
+	delete file;
+	if (idx) delete idx;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Write all queued records and close the file
+void filesink::Close(void)
+{
+	datasink::Close();
+	file->Close();
+	if (idx) idx->Close();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Open the file and start the sink thread. The name can be * or a pattern for automatic names with rotation.
+//	Return 0 on success, negative on error
+int filesink::Open(void)
+{
+	if (file->Open(name)) return -1;
+	if (idx) idx->Open(file->GetName());
+	return Start();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Print file and queue statistics
+void filesink::PrintStat(void)
+{
+	if (file->GetNFiles() > 1) {
+		printf("%Ld bytes written to %d files, the last is %s\n", file->GetTotal(), file->GetNFiles(), file->GetName());
+	} else {
+		printf("%Ld bytes written to file %s\n", file->GetTotal(), file->GetName());
+	}
+	if (errcnt) printf("%d write errors.\n", errcnt);
+	datasink::PrintStat();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	The sink thread body
+void filesink::Run(void)
+{
+	struct recbuf *recs[DATASINK_BATCH];
+	struct rec_info_struct info;
+	int i, n;
+
+	for (;;) {
+		if (IsDone()) break;
+		Unspill();
+		n = queue->Peek(0, recs, DATASINK_BATCH);
+		if (!n) {
+			file->Flush();
+			if (idx) idx->Flush();
+			queue->Wait(0, 100);
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			// switch to the next file only when it is already prepared, otherwise keep writing this one
+			if (file->IsRotateDue() && file->IsNextReady()) {
+				WriteHeader(REC_END, lastcnt + 1);
+				file->Rotate();
+				if (idx) idx->Open(file->GetName());
+				WriteHeader(REC_BEGIN, 0);
+			}
+			if (WriteRecord(recs[i]->data, recs[i]->len)) {
+				if (!errcnt) Log(ERROR, "File %s write error: %m.\n", file->GetName());
+				errcnt++;
+			}
+			if (rec_parse(recs[i]->data, recs[i]->len, &info) > 0) {
+				lastcnt = info.cnt;
+				lastversion = info.version;
+			}
+		}
+		queue->Release(n);
+	}
+	file->Flush();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Write record consisting of the header only
+//	Return 0 on success, negative on error
+int filesink::WriteHeader(int type, long long cnt)
+{
+	long long header[REC_MAXHEADER / sizeof(long long)];
+	int hlen;
+
+	hlen = rec_header_size(lastversion);
+	rec_fill(header, lastversion, hlen, cnt, type);
+	return WriteRecord(header, hlen);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Write the record to the file, compressed if configured, and add it to the index.
+//	Module data records are followed or replaced by their feature records if configured.
+//	Return 0 on success, negative on error
+int filesink::WriteRecord(const void *buf, int len)
+{
+	long long offset;
+	int clen, flen;
+
+	flen = Extract(buf, len);
+	if (!flen || Conf.Features.Mode == WFF_BOTH) {
+		offset = file->GetSize();
+		clen = Compress(buf, len);
+		if (file->Write((clen) ? cbuf : buf, (clen) ? clen : len)) return -1;
+		if (idx) idx->Add(buf, len, offset, clen);
+	}
+	if (flen) {
+		offset = file->GetSize();
+		if (file->Write(feat->GetRecord(), flen)) return -1;
+		if (idx) idx->Add(feat->GetRecord(), flen, offset, 0);
+	}
+	return 0;
+}
+
+//*************************************************************************************************************************************//
+
+shmsink::shmsink(const char *sname, struct datasink_config *conf, int size) : datasink(sname, conf)
+{
+	ring = new shmring();
+	mbytes = size;
+	written = 0;
+	toobig = 0;
+}
+
+shmsink::~shmsink(void)
+{
+	Close();
+	delete ring;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Copy what is queued to the ring and mark it idle
+void shmsink::Close(void)
+{
+	datasink::Close();
+	ring->Detach();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Create the ring and start the sink thread
+//	Return 0 on success, negative on error
+int shmsink::Open(void)
+{
+	if (ring->Create(name, mbytes)) return -1;
+	mbytes = ring->GetSize() / 0x100000;
+	return Start();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Print ring and queue statistics
+void shmsink::PrintStat(void)
+{
+	printf("%Ld bytes published to shared memory %s of %d MBytes", written, name, mbytes);
+	if (toobig) printf(", %d records were too big for the ring", toobig);
+	printf(".\n");
+	datasink::PrintStat();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	The sink thread body. The ring never blocks, slow consumers are overrun.
+void shmsink::Run(void)
+{
+	struct recbuf *recs[DATASINK_BATCH];
+	int i, n;
+
+	for (;;) {
+		if (IsDone()) break;
+		Unspill();
+		n = queue->Peek(0, recs, DATASINK_BATCH);
+		if (!n) {
+			queue->Wait(0, 100);
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			if (ring->Write(recs[i]->data, recs[i]->len)) {
+				toobig++;
+			} else {
+				written += recs[i]->len;
+			}
+		}
+		queue->Release(n);
+	}
+}
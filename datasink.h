@@ -0,0 +1,125 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Data sinks: queue with overflow policy and the file sink.
+*/
+#ifndef DATASINK_H
+#define DATASINK_H
+
+#include <pthread.h>
+#include <time.h>
+#include "recfile.h"
+#include "recindex.h"
+#include "recqueue.h"
+#include "shmring.h"
+#include "wffeat.h"
+
+#ifndef MAX_PATH_LEN
+#define MAX_PATH_LEN	1024
+#endif
+
+#define DATASINK_SLOTS	16384	// maximum number of records in a sink queue
+#define DATASINK_BATCH	64	// records taken from the queue at once
+
+//	What to do with a record when the sink queue is full. The readout never waits.
+enum DATASINK_POLICY {
+	DATASINK_DROP = 0,	// drop the record
+	DATASINK_SPILL = 1	// keep it in a temporary file until the queue has space
+};
+
+//	Queue parameters of one sink type, normally from Sink section of the configuration
+struct datasink_config {
+	int Queue;			// MBytes of records in memory
+	int Policy;			// DATASINK_POLICY
+	char SpillDir[MAX_PATH_LEN];	// directory for the spill file
+	int SpillSize;			// MBytes, maximum spill file size, records are dropped above it
+	int CloseTimeout;		// s, wait for the queue to drain at the end, 0 - no limit
+	int Compress;			// compress module data records with the waveform codec (v2 records only)
+	struct wff_config Features;	// feature records of module data (file and TCP sinks)
+};
+
+//	Base sink: own queue, own thread, overflow policy.
+//	The derived class implements Run(), which takes records from the queue.
+class datasink {
+protected:
+	struct datasink_config Conf;
+	char name[MAX_PATH_LEN];
+	recqueue *queue;
+	pthread_t thread;
+	int thread_running;
+	volatile int stop;
+	time_t deadline;
+	//	spill file: records which did not fit into the queue, in order
+	pthread_mutex_t spill_mutex;
+	int spill_fd;
+	long long spill_rpos;	// the oldest spilled record
+	long long spill_wpos;	// end of the spilled data
+	volatile int spill_cnt;	// records in the spill file
+	//	statistics
+	long long dropped_recs;
+	long long dropped_bytes;
+	long long spilled_recs;
+	long long spilled_bytes;
+	long long lost_recs;
+	//	compression
+	char *cbuf;		// the last compressed record
+	int cbufsize;
+	long long comp_in;	// bytes of the records compressed
+	long long comp_out;	// their compressed size
+	//	feature extraction
+	wffextractor *feat;	// NULL if off
+
+	static void *SinkThread(void *arg);
+	virtual void Run(void) = 0;
+	int Compress(const void *rec, int len);
+	void ConvertQueued(struct recbuf **recs, int from, int num);
+	int Extract(const void *rec, int len);
+	int IsDone(void);
+	int Spill(struct recbuf *rec);
+	int Start(void);
+	void Unspill(void);
+public:
+	datasink(const char *sname, struct datasink_config *conf);
+	virtual ~datasink(void);
+	virtual void Close(void);
+	inline const char *GetName(void) { return name; };
+	virtual void PrintStat(void);
+	int Put(struct recbuf *rec);
+	virtual int Snapshot(const char *fname);
+};
+
+//	Local file with rotation
+class filesink : public datasink {
+private:
+	recfile *file;
+	recindex_writer *idx;	// NULL if no index is written
+	long long lastcnt;	// cnt of the last written record
+	int lastversion;	// its header version, rotation records are written the same way
+	int errcnt;
+	void Run(void);
+	int WriteHeader(int type, long long cnt);
+	int WriteRecord(const void *buf, int len);
+public:
+	filesink(const char *fname, struct datasink_config *conf, struct recfile_config *fconf);
+	~filesink(void);
+	void Close(void);
+	int Open(void);
+	void PrintStat(void);
+};
+
+//	Shared memory ring for local online consumers
+class shmsink : public datasink {
+private:
+	shmring *ring;
+	int mbytes;		// ring size, MBytes
+	long long written;
+	int toobig;		// records which do not fit into the ring
+	void Run(void);
+public:
+	shmsink(const char *sname, struct datasink_config *conf, int size);
+	~shmsink(void);
+	void Close(void);
+	int Open(void);
+	void PrintStat(void);
+};
+
+#endif /* DATASINK_H */
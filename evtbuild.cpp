@@ -0,0 +1,426 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Event builder: blocks of all modules put together by trigger token.
+	Module data records are decoded block by block, every block with a token goes to the event
+	of its trigger number: the token extended by the last trigger number of the module,
+	the trigger information block gives the full 30-bit TRIGCNT. Waveform blocks have 10 token
+	bits, bit 10 is their error bit, the trigger information has 11 (uwfd64.h). The first
+	TRIGCNT renumbers the events made from the tokens before it, the counter needs not start
+	near 0. Events wait in a ring indexed by the trigger number until every module which
+	brings triggered data has passed them, or for the timeout, and are given out in order
+	as REC_EVENT records. The modules are learned from the data during a short warm up
+	at the beginning.
+	Token synchronization blocks are not put into the events, they go to the clock
+	tracking of the modules (trigtime.cpp) with GTIME of their event when it is given out.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "evtbuild.h"
+#include "recformat.h"
+
+static long long evtbuild_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+//	The trigger number with token tok of period bits nearest to base, the token itself if base < 0
+static long long evtbuild_extend(long long base, int tok, int period)
+{
+	long long trig;
+	int d;
+
+	if (base < 0) return tok;
+	d = (tok - base) & (period - 1);
+	if (d >= period / 2) d -= period;
+	trig = base + d;
+	return (trig < 0) ? trig + period : trig;
+}
+
+evtbuilder::evtbuilder(struct evtbuild_config *conf)
+{
+	int i;
+
+	memcpy(&Conf, conf, sizeof(Conf));
+	if (Conf.MaxEvent <= 0) Conf.MaxEvent = EVT_MAXEVENT;
+	for (mask = 1; mask < Conf.MaxEvent; mask <<= 1);
+	Conf.MaxEvent = mask;
+	mask--;
+	if (Conf.Timeout <= 0) Conf.Timeout = 1000;
+	ev = (struct evtbuild_event *) calloc(Conf.MaxEvent, sizeof(struct evtbuild_event));
+	if (!ev) Conf.MaxEvent = 0;
+	for (i = 0; i < EVT_MAXSERIAL; i++) mod[i].dec = NULL;
+	out = NULL;
+	outsize = 0;
+	clock = new trigtime(&Conf.Clock);
+	Reset();
+}
+
+evtbuilder::~evtbuilder(void)
+{
+	int i;
+
+	for (i = 0; i < Conf.MaxEvent; i++) {
+		free(ev[i].buf);
+		free(ev[i].sync);
+	}
+	free(ev);
+	for (i = 0; i < EVT_MAXSERIAL; i++) if (mod[i].dec) delete mod[i].dec;
+	free(out);
+	delete clock;
+}
+
+//	Put the block into its event, real - readout time of the record.
+//	Return 0 on success, 1 if the block was dropped, negative if no memory
+int evtbuilder::AddBlock(int serial, const struct blk_view *v, long long now, long long real)
+{
+	struct evtbuild_module *m;
+	struct evtbuild_event *e;
+	long long base, trig, tc;
+	int i, need, tok;
+
+	m = &mod[serial];
+	base = (m->last >= 0) ? m->last : top - 1;	// a new module is taken to be near the newest event
+	trig = evtbuild_extend(base, v->token, 0x400);
+	if (v->type == BLK_TRIGINFO && v->len >= 7) {
+		// bit 10 of word 1 is the error bit of the waveform blocks, the 11th token bit of the trigger information
+		tok = v->cw[1] & 0x7FF;
+		tc = tt_trigcnt(v->cw);
+		if ((tc & 0x7FF) == tok) {
+			// the counter needs not start near 0: the first TRIGCNT moves the events numbered by the 10-bit tokens
+			if (!seeded && base >= 0 && !Rebase(tc - trig)) base += tc - trig;
+			seeded = 1;
+			trig = (base >= 0) ? tt_unwrap(base, tc, TT_TRIGCNT_BITS) : tc;
+		} else {
+			trig = evtbuild_extend(base, tok, 0x800);
+			stat.badtoken++;
+		}
+	}
+	// token synchronization does not tell that the module brings triggered data
+	if (v->type != BLK_TOKENSYNC && trig > m->last) m->last = trig;
+	if (head < 0) {
+		head = top = trig;
+		start = now;
+	}
+	if (trig < head) {
+		stat.late++;
+		return 1;
+	}
+
+	e = &ev[trig & mask];
+	if (e->trigcnt > trig) {		// a far newer event is there already
+		stat.late++;
+		return 1;
+	}
+	if (e->trigcnt >= 0 && e->trigcnt < trig) {
+		// the ring is full: give out everything up to the old event
+		for (; head <= e->trigcnt; head++) if (ev[head & mask].trigcnt == head) Build(&ev[head & mask], EVT_OVERFLOW);
+	}
+	if (e->trigcnt < 0) {
+		e->trigcnt = trig;
+		e->first = now;
+		e->gtime = -1;
+		e->real = 0;
+		e->flags = EVT_NOTRIG;
+		e->nblocks = 0;
+		e->len = 0;
+		e->nsync = 0;
+		memset(e->mods, 0, sizeof(e->mods));
+		npending++;
+		if (trig >= top) top = trig + 1;
+	}
+
+	if (v->type == BLK_TOKENSYNC) {
+		stat.syncs++;
+		if (v->len < 2) return 1;
+		for (i = 0; i < e->nsync; i++) if ((int) (e->sync[i] >> 16) == serial) return 0;
+		if (e->nsync >= e->syncsize) {
+			e->syncsize = 2 * e->syncsize + 8;
+			e->sync = (unsigned int *) realloc(e->sync, e->syncsize * sizeof(int));
+			if (!e->sync) {
+				e->syncsize = e->nsync = 0;
+				return -1;
+			}
+		}
+		e->sync[e->nsync++] = (serial << 16) | (v->cw[2] & 0x7FFF);
+		return 0;
+	}
+
+	need = e->len + v->len + 3;
+	if (need > e->size) {
+		e->size = 2 * need + BLK_MAXLEN;
+		e->buf = (unsigned short *) realloc(e->buf, e->size * sizeof(short));
+		if (!e->buf) {
+			e->size = e->len = 0;
+			return -1;
+		}
+	}
+	e->buf[e->len] = serial;
+	e->buf[e->len + 1] = v->len + 1;
+	memcpy(&e->buf[e->len + 2], v->cw, (v->len + 1) * sizeof(short));
+	e->len += v->len + 3;
+	e->nblocks++;
+	e->mods[serial / 32] |= 1U << (serial % 32);
+	if (v->type == BLK_TRIGINFO && v->len >= 7 && e->gtime < 0) {
+		e->gtime = tt_gtime(v->cw);
+		e->real = real;
+		e->flags &= ~EVT_NOTRIG;
+	}
+	stat.blocks++;
+	return 0;
+}
+
+//	Add off, a multiple of 0x400, to the trigger numbers of the events in the ring and of the modules.
+//	Return 0 on success, 1 if the numbers would go below 0, negative if no memory
+int evtbuilder::Rebase(long long off)
+{
+	struct evtbuild_event *tmp;
+	int i;
+
+	if (!off) return 0;
+	if (head < 0 || head + off < 0) return 1;
+	tmp = (struct evtbuild_event *) malloc(Conf.MaxEvent * sizeof(struct evtbuild_event));
+	if (!tmp) return -1;
+	// slot is trigcnt & mask: the ring turns by off, the free slots with it
+	for (i = 0; i < Conf.MaxEvent; i++) {
+		if (ev[i].trigcnt >= 0) ev[i].trigcnt += off;
+		memcpy(&tmp[(i + off) & mask], &ev[i], sizeof(struct evtbuild_event));
+	}
+	memcpy(ev, tmp, Conf.MaxEvent * sizeof(struct evtbuild_event));
+	free(tmp);
+	head += off;
+	top += off;
+	for (i = 0; i < EVT_MAXSERIAL; i++) if (mod[i].last >= 0) mod[i].last += off;
+	return 0;
+}
+
+//	Make the event record in the output buffer and free the slot. Events are built in the order
+//	of the triggers, the clocks are followed here. An event of token synchronization blocks only
+//	gives no record.
+//	Return 0 on success, negative if no memory
+int evtbuilder::Build(struct evtbuild_event *e, int flags)
+{
+	int words[EVT_MAXSERIAL];
+	int pos[EVT_MAXSERIAL];
+	struct evt_header *h;
+	struct evt_module *s;
+	unsigned short *w;
+	int *missing;
+	char *p;
+	long long gtime;
+	int i, j, hlen, len, nmods, nmissing, tflags;
+
+	gtime = -1;
+	if (e->gtime >= 0) {
+		gtime = clock->Extend(e->gtime, &tflags);
+		if (tflags & TT_RESET) flags |= EVT_GTRESET;
+		clock->Anchor(gtime, e->real);
+		for (i = 0; i < e->nsync; i++) if (clock->Sync(e->sync[i] >> 16, gtime, e->sync[i] & 0x7FFF)) flags |= EVT_CLOCK;
+	}
+	if (!e->nblocks) {
+		e->trigcnt = -1;
+		npending--;
+		return 0;
+	}
+
+	memset(words, 0, sizeof(words));
+	for (j = 0; j < e->len; j += e->buf[j + 1] + 2) words[e->buf[j]] += e->buf[j + 1];
+	nmods = nmissing = 0;
+	for (i = 0; i < EVT_MAXSERIAL; i++) {
+		if (e->mods[i / 32] & (1U << (i % 32))) {
+			nmods++;
+		} else if (mod[i].last >= 0) {
+			nmissing++;
+		}
+	}
+	hlen = rec_header_size(Conf.RecVersion);
+	len = hlen + sizeof(struct evt_header) + nmissing * sizeof(int) + nmods * sizeof(struct evt_module) + (e->len - 2 * e->nblocks) * sizeof(short);
+	if (outlen + len + 8 > outsize) {
+		outsize = 2 * (outlen + len + 8);
+		out = (char *) realloc(out, outsize);
+		if (!out) {
+			outsize = outlen = outpos = 0;
+			return -1;
+		}
+	}
+
+	p = out + outlen;
+	h = (struct evt_header *) (p + hlen);
+	h->trigcnt = e->trigcnt;
+	h->gtime = gtime;
+	h->abstime = clock->Time(gtime);
+	h->nmodules = nmods;
+	h->nmissing = nmissing;
+	h->flags = flags | e->flags;
+	h->nblocks = e->nblocks;
+	missing = (int *) (h + 1);
+	for (i = 0; i < EVT_MAXSERIAL; i++) if (!(e->mods[i / 32] & (1U << (i % 32))) && mod[i].last >= 0) {
+		*missing++ = i;
+		stat.missing[i]++;
+	}
+	// sections in the order of serial numbers, then the blocks are scattered to them in one pass
+	w = (unsigned short *) missing;
+	for (i = 0; i < EVT_MAXSERIAL; i++) if (e->mods[i / 32] & (1U << (i % 32))) {
+		s = (struct evt_module *) w;
+		s->serial = i;
+		s->len = words[i];
+		w += sizeof(struct evt_module) / sizeof(short);
+		pos[i] = w - (unsigned short *) p;
+		w += words[i];
+	}
+	w = (unsigned short *) p;
+	for (j = 0; j < e->len; j += e->buf[j + 1] + 2) {
+		memcpy(&w[pos[e->buf[j]]], &e->buf[j + 2], e->buf[j + 1] * sizeof(short));
+		pos[e->buf[j]] += e->buf[j + 1];
+	}
+	rec_fill(p, Conf.RecVersion, len, ++cnt, REC_EVENT);
+	outlen += (len + 7) & ~7;
+
+	stat.events++;
+	if (!nmissing) stat.complete++;
+	if (h->flags & EVT_TIMEOUT) stat.timeout++;
+	if (h->flags & EVT_OVERFLOW) stat.overflow++;
+	if (h->flags & EVT_NOTRIG) stat.notrig++;
+	if (h->flags & EVT_CLOCK) stat.clock++;
+	e->trigcnt = -1;
+	npending--;
+	return 0;
+}
+
+//	The lowest of the last trigger numbers of the modules, events below it are complete. -1 if none.
+long long evtbuilder::Watermark(void)
+{
+	long long wm;
+	int i;
+
+	wm = -1;
+	for (i = 0; i < EVT_MAXSERIAL; i++) if (mod[i].last >= 0 && (wm < 0 || mod[i].last < wm)) wm = mod[i].last;
+	return wm;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Take a module data record, blocks split between records of a module are put together.
+//	Events pushed out of a full ring become available from Next().
+//	Return 0 on success, the rec_parse() error if the record is not understood
+int evtbuilder::Add(const void *rec, int len)
+{
+	struct rec_info_struct info;
+	struct blk_view v;
+	struct evtbuild_module *m;
+	long long now;
+	int irc, serial;
+
+	irc = rec_parse(rec, len, &info);
+	if (irc < 0) return irc;
+	if (info.type < REC_WFDDATA || !Conf.MaxEvent) return 0;
+	if (info.flags & REC_FLAG_WFC) {	// the readout never gives compressed records
+		stat.errors++;
+		return 0;
+	}
+	serial = (info.serial >= 0) ? info.serial : info.type - REC_WFDDATA;
+	if (serial < 0 || serial >= EVT_MAXSERIAL) return 0;
+	m = &mod[serial];
+	if (!m->dec) m->dec = new blkdecoder();
+	now = evtbuild_now();
+	m->dec->Feed((const char *) rec + info.hlen, info.len - info.hlen);
+	while ((irc = m->dec->Next(&v)) != BLK_END) {
+		if (irc == BLK_STRAY || irc == BLK_SHORT) {
+			stat.errors++;
+			continue;
+		}
+		if (irc != BLK_OK || v.type < 0 || v.type == BLK_SELF) continue;
+		AddBlock(serial, &v, now, info.real);
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Give out all events in flight, at the end of data.
+//	Return the number of events made available from Next()
+int evtbuilder::Flush(void)
+{
+	int n;
+
+	for (n = 0; npending && head < top; head++) if (ev[head & mask].trigcnt == head) {
+		if (ev[head & mask].nblocks) n++;
+		Build(&ev[head & mask], EVT_FLUSH);
+	}
+	return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Get the next event record. The oldest event is given out when all modules have passed it
+//	or it is older than the timeout. The record is valid until the next call of any method.
+//	Return 1 if there is a record, 0 if none is ready
+int evtbuilder::Next(const void **rec, int *len)
+{
+	long long k, wm, now;
+	int flags;
+
+	while (outpos >= outlen) {		// an event of token synchronization only gives no record
+		outpos = outlen = 0;
+		if (!npending) return 0;
+		for (k = head; k < top && ev[k & mask].trigcnt != k; k++);
+		if (k >= top) return 0;
+		// modules which have not sent anything yet are not known during the warm up
+		now = evtbuild_now();
+		wm = Watermark();
+		if (k < wm && now - start >= EVT_WARMUP) {
+			flags = 0;
+		} else if (now - ev[k & mask].first >= Conf.Timeout) {
+			flags = (k < wm) ? 0 : EVT_TIMEOUT;
+		} else {
+			return 0;
+		}
+		head = k + 1;
+		if (Build(&ev[k & mask], flags)) return 0;
+	}
+	*rec = out + outpos;
+	*len = *((int *) *rec);
+	outpos += (*len + 7) & ~7;
+	return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Print the counters
+void evtbuilder::PrintStat(void)
+{
+	int i;
+
+	printf("Events: %Ld built, %Ld complete, %Ld timed out, %Ld pushed out of the ring of %d, %Ld without trigger block.\n",
+		stat.events, stat.complete, stat.timeout, stat.overflow, Conf.MaxEvent, stat.notrig);
+	printf("Blocks: %Ld in events, %Ld late, %Ld trigger blocks with wrong token, %Ld data errors.\n",
+		stat.blocks, stat.late, stat.badtoken, stat.errors);
+	if (stat.syncs) printf("Token synchronization: %Ld blocks, %Ld events with clock anomalies.\n", stat.syncs, stat.clock);
+	clock->PrintStat();
+	if (stat.complete == stat.events) return;
+	printf("Events without module:");
+	for (i = 0; i < EVT_MAXSERIAL; i++) if (stat.missing[i]) printf(" %d:%Ld", i, stat.missing[i]);
+	printf("\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Start a new run: drop events in flight and module states, clear the counters
+void evtbuilder::Reset(void)
+{
+	int i;
+
+	for (i = 0; i < Conf.MaxEvent; i++) ev[i].trigcnt = -1;
+	head = top = -1;
+	start = 0;
+	seeded = 0;
+	npending = 0;
+	for (i = 0; i < EVT_MAXSERIAL; i++) {
+		if (mod[i].dec) mod[i].dec->Reset();
+		mod[i].last = -1;
+	}
+	outlen = outpos = 0;
+	cnt = 0;
+	memset(&stat, 0, sizeof(stat));
+	clock->Reset();
+}
@@ -0,0 +1,122 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Event builder: blocks of all modules put together by trigger token.
+*/
+#ifndef EVTBUILD_H
+#define EVTBUILD_H
+
+#include "blkdecode.h"
+#include "trigtime.h"
+
+#define EVT_MAXSERIAL	256		// module serial numbers
+#define EVT_MAXEVENT	4096		// default events in flight
+#define EVT_WARMUP	200		// ms after the first block to learn which modules send triggered data
+
+//	Event record (REC_EVENT) payload: struct evt_header, int serial[nmissing] of the expected
+//	modules with no data, then nmodules sections: struct evt_module followed by the blocks
+//	of the module as they came, self trigger and token sync blocks are not included.
+struct evt_header {
+	long long trigcnt;	// trigger number, TRIGCNT of the trigger information block with the token in 11 LSB, over its wraps
+	long long gtime;	// GTIME of the first trigger information block over its wraps and resets, -1 if none
+	long long abstime;	// ns since the Epoch from GTIME, -1 if not known (see trigtime.cpp)
+	int nmodules;		// module sections
+	int nmissing;		// expected modules missing
+	int flags;		// EVT_*
+	int nblocks;		// blocks in all sections
+};
+
+struct evt_module {
+	int serial;
+	int len;		// words of blocks following
+};
+
+//	Event flags
+#define EVT_TIMEOUT	1	// given out by the timeout before all modules have passed it
+#define EVT_OVERFLOW	2	// pushed out of the ring by a newer event
+#define EVT_FLUSH	4	// given out at the end of data
+#define EVT_NOTRIG	8	// no trigger information block
+#define EVT_CLOCK	16	// a module clock jumped or drifts against GTIME at this token synchronization
+#define EVT_GTRESET	32	// GTIME went back at this event, the trigger counters were reset
+
+//	Builder parameters, normally from Sink section of the configuration
+struct evtbuild_config {
+	int MaxEvent;		// events in flight, rounded up to a power of 2
+	int Timeout;		// ms, an incomplete event is given out after this time
+	int RecVersion;		// record header version of the events
+	struct trigtime_config Clock;	// clock tracking of the modules
+};
+
+//	Counters
+struct evtbuild_stat {
+	long long events;	// given out
+	long long complete;	// with all expected modules
+	long long timeout;
+	long long overflow;
+	long long notrig;
+	long long blocks;	// blocks put into events
+	long long late;		// blocks of the events already given out, dropped
+	long long badtoken;	// trigger blocks with TRIGCNT not matching the token
+	long long errors;	// stray words and cut blocks in module data
+	long long syncs;	// token synchronization blocks
+	long long clock;	// events with EVT_CLOCK
+	long long missing[EVT_MAXSERIAL];	// events without the module
+};
+
+//	An event in flight. Entries in buf: serial, length in words, the block.
+struct evtbuild_event {
+	long long trigcnt;	// -1 if the slot is free
+	long long first;	// ms, arrival of the first block
+	long long gtime;
+	long long real;		// ns, readout time of the trigger information block
+	int flags;
+	int nblocks;
+	unsigned short *buf;
+	int len;		// words
+	int size;
+	unsigned int *sync;	// token synchronization: serial << 16 | time word, the first block of a module
+	int nsync;
+	int syncsize;
+	unsigned int mods[EVT_MAXSERIAL / 32];	// modules present
+};
+
+//	Per module state
+struct evtbuild_module {
+	blkdecoder *dec;	// module data are split between records
+	long long last;		// the highest trigger number seen, -1 - the module brings no triggered data
+};
+
+class evtbuilder {
+private:
+	struct evtbuild_config Conf;
+	struct evtbuild_event *ev;	// the ring, slot is trigcnt & mask
+	long long mask;
+	long long head;		// the oldest trigger number which can be in the ring
+	long long top;		// the highest trigger number in the ring + 1
+	long long start;	// ms, arrival of the first block
+	int seeded;		// trigger numbers are taken from TRIGCNT of a trigger information block
+	int npending;
+	struct evtbuild_module mod[EVT_MAXSERIAL];
+	char *out;		// built event records
+	int outlen;
+	int outpos;
+	int outsize;
+	long long cnt;		// event record number
+	struct evtbuild_stat stat;
+	trigtime *clock;
+	int AddBlock(int serial, const struct blk_view *v, long long now, long long real);
+	int Build(struct evtbuild_event *e, int flags);
+	int Rebase(long long off);
+	long long Watermark(void);
+public:
+	evtbuilder(struct evtbuild_config *conf);
+	~evtbuilder(void);
+	int Add(const void *rec, int len);
+	int Flush(void);
+	inline trigtime *GetClock(void) { return clock; };
+	inline const struct evtbuild_stat *GetStat(void) { return &stat; };
+	int Next(const void **rec, int *len);
+	void PrintStat(void);
+	void Reset(void);
+};
+
+#endif /* EVTBUILD_H */
@@ -0,0 +1,106 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Event building sink: events are published to a shared memory ring.
+
+	The sink thread takes module data records from its queue, puts the blocks together
+	by trigger number (see evtbuild.cpp) and writes the events given out by the builder
+	to the ring. Incomplete events are given out by the builder timeout while the queue
+	is idle and all the rest at REC_END or when the sink is closed.
+*/
+
+#include <stdio.h>
+#include "evtsink.h"
+#include "log.h"
+#include "recformat.h"
+
+evtsink::evtsink(const char *sname, struct datasink_config *conf, struct evtbuild_config *econf, int size) : datasink(sname, conf)
+{
+	builder = new evtbuilder(econf);
+	ring = new shmring();
+	mbytes = size;
+	written = 0;
+	toobig = 0;
+}
+
+evtsink::~evtsink(void)
+{
+	Close();
+	delete ring;
+	delete builder;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Build what is queued, give out the events in flight and mark the ring idle
+void evtsink::Close(void)
+{
+	datasink::Close();
+	ring->Detach();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Create the ring and start the sink thread
+//	Return 0 on success, negative on error
+int evtsink::Open(void)
+{
+	if (ring->Create(name, mbytes)) return -1;
+	mbytes = ring->GetSize() / 0x100000;
+	return Start();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Print builder, ring and queue statistics
+void evtsink::PrintStat(void)
+{
+	printf("%Ld bytes of events published to shared memory %s of %d MBytes", written, name, mbytes);
+	if (toobig) printf(", %d events were too big for the ring", toobig);
+	printf(".\n");
+	builder->PrintStat();
+	datasink::PrintStat();
+}
+
+//	Write the events ready to the ring
+void evtsink::Publish(void)
+{
+	const void *rec;
+	int len;
+
+	while (builder->Next(&rec, &len) == 1) {
+		if (ring->Write(rec, len)) {
+			toobig++;
+		} else {
+			written += len;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	The sink thread body. The ring never blocks, slow consumers are overrun.
+void evtsink::Run(void)
+{
+	struct recbuf *recs[DATASINK_BATCH];
+	struct rec_info_struct info;
+	int i, n;
+
+	for (;;) {
+		if (IsDone()) break;
+		Unspill();
+		n = queue->Peek(0, recs, DATASINK_BATCH);
+		if (!n) {
+			Publish();		// events which timed out
+			queue->Wait(0, 100);
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			if (rec_parse(recs[i]->data, recs[i]->len, &info) < 0) continue;
+			if (info.type == REC_END) {
+				builder->Flush();
+			} else if (builder->Add(recs[i]->data, recs[i]->len)) {
+				Log(WARN, "%s: record %Ld not understood\n", name, info.cnt);
+			}
+			Publish();
+		}
+		queue->Release(n);
+	}
+	builder->Flush();
+	Publish();
+}
@@ -0,0 +1,30 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Event building sink: events are published to a shared memory ring.
+*/
+#ifndef EVTSINK_H
+#define EVTSINK_H
+
+#include "datasink.h"
+#include "evtbuild.h"
+#include "shmring.h"
+
+//	Builds events from the module data and publishes REC_EVENT records for online consumers
+class evtsink : public datasink {
+private:
+	evtbuilder *builder;
+	shmring *ring;
+	int mbytes;		// ring size, MBytes
+	long long written;
+	int toobig;		// events which do not fit into the ring
+	void Publish(void);
+	void Run(void);
+public:
+	evtsink(const char *sname, struct datasink_config *conf, struct evtbuild_config *econf, int size);
+	~evtsink(void);
+	void Close(void);
+	int Open(void);
+	void PrintStat(void);
+};
+
+#endif /* EVTSINK_H */
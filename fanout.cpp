@@ -0,0 +1,172 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Fan-out of the record stream to several data sinks.
+
+	The readout takes each record once and gives it to all sinks by reference.
+	Every sink has its own queue and thread, a slow one can only drop or spill
+	its own records and never throttles the readout or the other sinks.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "evtsink.h"
+#include "fanout.h"
+#include "histsink.h"
+#include "log.h"
+
+fanout::fanout(void)
+{
+	N = 0;
+}
+
+fanout::~fanout(void)
+{
+	Clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Close and delete all sinks
+void fanout::Clear(void)
+{
+	int i;
+
+	Close();
+	for (i = 0; i < N; i++) delete sinks[i];
+	N = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Deliver what is queued (within the sink timeouts) and close all sinks.
+//	Sink statistics are kept until the next Open().
+void fanout::Close(void)
+{
+	int i;
+
+	for (i = 0; i < N; i++) sinks[i]->Close();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Open sinks from the comma separated list of names:
+//	shm:/name - shared memory ring, evt:/name - events built and published to shared memory ring,
+//	hist:fname - online histograms written to fname,
+//	host:port - TCP sink,
+//	anything else - file sink (* or a pattern with %d for automatic names).
+//	A TCP sink which can not connect at start is fatal only when it is the only sink,
+//	otherwise it keeps trying in the background.
+//	Return 0 on success, negative on error
+int fanout::Open(const char *names, struct fanout_config *conf)
+{
+	char list[MAX_PATH_LEN];
+	char *tok, *save;
+	int nnames, irc;
+	filesink *fs;
+	tcpsender *ts;
+	shmsink *ss;
+	evtsink *es;
+	histsink *hs;
+	struct evtbuild_config econf;
+
+	Clear();
+	strncpy(list, names, sizeof(list) - 1);
+	list[sizeof(list) - 1] = '\0';
+	nnames = 1;
+	for (tok = list; *tok; tok++) if (*tok == ',') nnames++;
+
+	for (tok = strtok_r(list, ", \t", &save); tok; tok = strtok_r(NULL, ", \t", &save)) {
+		if (N >= FANOUT_MAX) {
+			Log(ERROR, "Too many sinks, only %d allowed\n", FANOUT_MAX);
+			goto err;
+		}
+		if (!strncmp(tok, "evt:", 4)) {
+			memcpy(&econf, &conf->EvtBuild, sizeof(econf));
+			econf.RecVersion = conf->RecVersion;
+			es = new evtsink(tok + 4, &conf->Evt, &econf, conf->ShmSize);
+			sinks[N++] = es;
+			irc = es->Open();
+		} else if (!strncmp(tok, "hist:", 5)) {
+			hs = new histsink(tok + 5, &conf->Hist, &conf->Histograms);
+			sinks[N++] = hs;
+			irc = hs->Open();
+		} else if (!strncmp(tok, "shm:", 4)) {
+			ss = new shmsink(tok + 4, &conf->Shm, conf->ShmSize);
+			sinks[N++] = ss;
+			irc = ss->Open();
+		} else if (strchr(tok, ':')) {
+			ts = new tcpsender(tok, &conf->Tcp, &conf->TcpSock);
+			sinks[N++] = ts;
+			irc = ts->Open(nnames == 1);
+		} else {
+			fs = new filesink(tok, &conf->File, &conf->FileRot);
+			sinks[N++] = fs;
+			irc = fs->Open();
+		}
+		if (irc) {
+			printf("Can not open sink %s.\n", tok);
+			goto err;
+		}
+	}
+	if (!N) {
+		printf("No data sink given.\n");
+		return -1;
+	}
+	return 0;
+err:
+	Clear();
+	return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Print statistics of all sinks
+void fanout::PrintStat(void)
+{
+	int i;
+
+	for (i = 0; i < N; i++) sinks[i]->PrintStat();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Give the record to all sinks. The reference of the caller is consumed.
+//	Return 0 on success, negative if there are no sinks
+int fanout::Put(struct recbuf *rec)
+{
+	int i;
+
+	if (!N) {
+		recbuf_release(rec);
+		return -1;
+	}
+	recbuf_addref(rec, N - 1);
+	for (i = 0; i < N; i++) sinks[i]->Put(rec);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Write snapshots of the sinks which collect something (histograms) now,
+//	to fname or to their own files if fname is NULL
+//	Return the number of snapshots written, negative on error
+int fanout::Snapshot(const char *fname)
+{
+	int i, irc, cnt;
+
+	cnt = 0;
+	for (i = 0; i < N; i++) {
+		irc = sinks[i]->Snapshot(fname);
+		if (irc < 0) return irc;
+		if (!irc) cnt++;
+	}
+	return cnt;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Give a short record (usually header only) to all sinks
+//	Return 0 on success, negative on error
+int fanout::PutHeader(const void *header, int len)
+{
+	struct recbuf *rec;
+
+	rec = recbuf_alloc(len);
+	if (!rec) return -1;
+	memcpy(rec->data, header, len);
+	rec->len = len;
+	return Put(rec);
+}
@@ -0,0 +1,50 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Fan-out of the record stream to several data sinks.
+*/
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include "datasink.h"
+#include "evtbuild.h"
+#include "recfile.h"
+#include "recqueue.h"
+#include "tcpsender.h"
+#include "wfhist.h"
+
+#define FANOUT_MAX	8	// maximum number of sinks
+
+//	Configuration of all sink types
+struct fanout_config {
+	struct datasink_config File;		// file sink queue
+	struct recfile_config FileRot;		// file rotation
+	struct datasink_config Tcp;		// TCP sink queue
+	struct tcpsender_config TcpSock;	// TCP socket
+	struct datasink_config Shm;		// shared memory sink queue
+	int ShmSize;				// MBytes, shared memory ring size
+	struct datasink_config Evt;		// event builder sink queue
+	struct evtbuild_config EvtBuild;	// event builder
+	struct datasink_config Hist;		// histogram sink queue
+	struct wfh_config Histograms;		// histogram binning and threads
+	int RecVersion;				// record header version written
+};
+
+//	The output stage: every record is delivered to all sinks without copying
+class fanout {
+private:
+	datasink *sinks[FANOUT_MAX];
+	int N;
+	void Clear(void);
+public:
+	fanout(void);
+	~fanout(void);
+	void Close(void);
+	inline int GetN(void) { return N; };
+	int Open(const char *names, struct fanout_config *conf);
+	void PrintStat(void);
+	int Put(struct recbuf *rec);
+	int PutHeader(const void *header, int len);
+	int Snapshot(const char *fname);
+};
+
+#endif /* FANOUT_H */
@@ -0,0 +1,182 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Histogram sink: online per channel histograms written as snapshots.
+
+	The sink thread only hands the records out to the filling threads, each record
+	to the thread with the shortest queue. A filling thread has its own histograms
+	(see wfhist.cpp), they are summed when a snapshot is written, so the threads
+	never wait for each other. The filling queues are short, when all of them are full
+	the records wait in the sink queue with its overflow policy.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "histsink.h"
+#include "log.h"
+
+histsink::histsink(const char *fname, struct datasink_config *conf, struct wfh_config *hconf) : datasink(fname, conf)
+{
+	int i;
+
+	hist = new wfhist(hconf);
+	period = hconf->Period;
+	last = 0;
+	pthread_mutex_init(&snap_mutex, NULL);
+	snapshots = 0;
+	errcnt = 0;
+	for (i = 0; i < hist->GetThreads(); i++) {
+		workers[i].sink = this;
+		workers[i].num = i;
+		workers[i].queue = new recqueue(HISTSINK_SLOTS, (long long) HISTSINK_SLOTS * RECBUF_POOLSIZE);
+		workers[i].records = 0;
+	}
+	nworkers = 0;
+	workers_stop = 0;
+}
+
+histsink::~histsink(void)
+{
+	int i;
+
+	Close();
+	for (i = 0; i < hist->GetThreads(); i++) delete workers[i].queue;
+	delete hist;
+	pthread_mutex_destroy(&snap_mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Histogram what is queued and write the final snapshot
+void histsink::Close(void)
+{
+	int running;
+
+	running = nworkers;
+	datasink::Close();
+	StopWorkers();
+	if (running) Snapshot(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Start the filling threads and the sink thread
+//	Return 0 on success, negative on error
+int histsink::Open(void)
+{
+	int i;
+
+	workers_stop = 0;
+	for (i = 0; i < hist->GetThreads(); i++) {
+		if (pthread_create(&workers[i].thread, NULL, WorkerThread, &workers[i])) {
+			Log(ERROR, "%s: can not start histogram thread: %m\n", name);
+			StopWorkers();
+			return -1;
+		}
+		nworkers++;
+	}
+	last = time(NULL);
+	if (Start()) {
+		StopWorkers();
+		return -1;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Print snapshot, thread and queue statistics
+void histsink::PrintStat(void)
+{
+	int i;
+
+	printf("%Ld histogram snapshots written to %s", snapshots, name);
+	if (errcnt) printf(", %d failed", errcnt);
+	printf(", records by thread:");
+	for (i = 0; i < hist->GetThreads(); i++) printf(" %Ld", workers[i].records);
+	printf(".\n");
+	datasink::PrintStat();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	The sink thread body: give the records to the filling threads, write periodic snapshots
+void histsink::Run(void)
+{
+	struct recbuf *recs[DATASINK_BATCH];
+	int i, j, k, n;
+
+	for (;;) {
+		if (IsDone()) break;
+		Unspill();
+		if (period > 0 && time(NULL) >= last + period) {
+			last = time(NULL);
+			Snapshot(NULL);
+		}
+		n = queue->Peek(0, recs, DATASINK_BATCH);
+		if (!n) {
+			queue->Wait(0, 100);
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			for (j = 1, k = 0; j < hist->GetThreads(); j++)
+				if (workers[j].queue->GetCount() < workers[k].queue->GetCount()) k = j;
+			recbuf_addref(recs[i], 1);
+			if (workers[k].queue->Put(recs[i], 1)) recbuf_release(recs[i]);
+		}
+		queue->Release(n);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Write the snapshot of the histograms to fname, to the sink file if fname is NULL.
+//	May be called from any thread.
+//	Return 0 on success, negative on error
+int histsink::Snapshot(const char *fname)
+{
+	int irc;
+
+	pthread_mutex_lock(&snap_mutex);
+	irc = hist->Write((fname) ? fname : name);
+	if (irc) {
+		errcnt++;
+	} else {
+		snapshots++;
+	}
+	pthread_mutex_unlock(&snap_mutex);
+	return irc;
+}
+
+//	Let the filling threads take what is in their queues and stop them
+void histsink::StopWorkers(void)
+{
+	int i;
+
+	workers_stop = 1;
+	for (i = 0; i < nworkers; i++) pthread_join(workers[i].thread, NULL);
+	nworkers = 0;
+}
+
+//	The filling thread body
+void histsink::Work(struct histsink_worker *w)
+{
+	struct recbuf *recs[HISTSINK_SLOTS];
+	wfhfiller *f;
+	int i, n;
+
+	f = hist->GetFiller(w->num);
+	for (;;) {
+		n = w->queue->Peek(0, recs, HISTSINK_SLOTS);
+		if (!n) {
+			if (workers_stop) break;
+			w->queue->Wait(0, 100);
+			continue;
+		}
+		for (i = 0; i < n; i++) if (f->Fill(recs[i]->data, recs[i]->len) > 0) w->records++;
+		w->queue->Release(n);
+	}
+}
+
+void *histsink::WorkerThread(void *arg)
+{
+	struct histsink_worker *w;
+
+	w = (struct histsink_worker *) arg;
+	w->sink->Work(w);
+	return NULL;
+}
@@ -0,0 +1,49 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Histogram sink: online per channel histograms written as snapshots.
+*/
+#ifndef HISTSINK_H
+#define HISTSINK_H
+
+#include <pthread.h>
+#include <time.h>
+#include "datasink.h"
+#include "recqueue.h"
+#include "wfhist.h"
+
+#define HISTSINK_SLOTS	16		// records queued for a filling thread
+
+//	Fills the histograms of the module data with several threads and writes
+//	their snapshot to the file every Period s, at the end and on request
+class histsink : public datasink {
+private:
+	wfhist *hist;
+	int period;		// s, 0 - no periodic snapshots
+	time_t last;		// the last periodic snapshot
+	pthread_mutex_t snap_mutex;	// one snapshot at a time
+	long long snapshots;
+	int errcnt;
+	//	filling threads, each with its own queue
+	struct histsink_worker {
+		histsink *sink;
+		int num;
+		recqueue *queue;
+		pthread_t thread;
+		long long records;
+	} workers[WFH_MAXTHREADS];
+	int nworkers;		// running
+	volatile int workers_stop;
+	static void *WorkerThread(void *arg);
+	void Run(void);
+	void StopWorkers(void);
+	void Work(struct histsink_worker *w);
+public:
+	histsink(const char *fname, struct datasink_config *conf, struct wfh_config *hconf);
+	~histsink(void);
+	void Close(void);
+	int Open(void);
+	void PrintStat(void);
+	int Snapshot(const char *fname);
+};
+
+#endif /* HISTSINK_H */
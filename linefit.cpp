@@ -0,0 +1,210 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Straight line fit of the waveforms of all channels at once.
+	One pass over the samples accumulates sum(y), sum(i*y) and sum(y^2) of several channels
+	in SIMD lanes with SSE2/AVX2/AVX-512 at the level of blk_get_level(). The sums are kept
+	in doubles: for 15-bit samples and up to 511 samples they are exact integers,
+	so the results do not depend on the level, and the residuals are got in closed form
+	without the second pass.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "blkdecode.h"
+#include "linefit.h"
+#include "log.h"
+
+//	Sums of the first ncol channels of n samples y[i * LFIT_STRIDE + chan], the kernels
+//	may go on over the rest of the stride
+typedef void (*lfit_sums_fn)(const short *y, int n, int ncol, double *sy, double *sxy, double *syy);
+
+static void lfit_sums_scalar(const short *y, int n, int ncol, double *sy, double *sxy, double *syy)
+{
+	double v;
+	int i, c;
+
+	for (c = 0; c < ncol; c++) {
+		sy[c] = sxy[c] = syy[c] = 0;
+		for (i = 0; i < n; i++) {
+			v = y[i * LFIT_STRIDE + c];
+			sy[c] += v;
+			sxy[c] += i * v;
+			syy[c] += v * v;
+		}
+	}
+}
+
+#if defined(__x86_64__)
+//	4 channels per step
+static void lfit_sums_sse2(const short *y, int n, int ncol, double *sy, double *sxy, double *syy)
+{
+	__m128i w;
+	__m128d x, lo, hi, ylo, yhi, xylo, xyhi, yylo, yyhi;
+	int i, c;
+
+	for (c = 0; c < ncol; c += 4) {
+		ylo = yhi = xylo = xyhi = yylo = yyhi = _mm_setzero_pd();
+		for (i = 0; i < n; i++) {
+			w = _mm_loadl_epi64((const __m128i *) (y + i * LFIT_STRIDE + c));
+			w = _mm_srai_epi32(_mm_unpacklo_epi16(w, w), 16);
+			lo = _mm_cvtepi32_pd(w);
+			hi = _mm_cvtepi32_pd(_mm_shuffle_epi32(w, 0x4E));
+			x = _mm_set1_pd(i);
+			ylo = _mm_add_pd(ylo, lo);
+			yhi = _mm_add_pd(yhi, hi);
+			xylo = _mm_add_pd(xylo, _mm_mul_pd(x, lo));
+			xyhi = _mm_add_pd(xyhi, _mm_mul_pd(x, hi));
+			yylo = _mm_add_pd(yylo, _mm_mul_pd(lo, lo));
+			yyhi = _mm_add_pd(yyhi, _mm_mul_pd(hi, hi));
+		}
+		_mm_storeu_pd(sy + c, ylo);
+		_mm_storeu_pd(sy + c + 2, yhi);
+		_mm_storeu_pd(sxy + c, xylo);
+		_mm_storeu_pd(sxy + c + 2, xyhi);
+		_mm_storeu_pd(syy + c, yylo);
+		_mm_storeu_pd(syy + c + 2, yyhi);
+	}
+}
+
+//	8 channels per step
+__attribute__((target("avx2")))
+static void lfit_sums_avx2(const short *y, int n, int ncol, double *sy, double *sxy, double *syy)
+{
+	__m256i w;
+	__m256d x, lo, hi, ylo, yhi, xylo, xyhi, yylo, yyhi;
+	int i, c;
+
+	for (c = 0; c < ncol; c += 8) {
+		ylo = yhi = xylo = xyhi = yylo = yyhi = _mm256_setzero_pd();
+		for (i = 0; i < n; i++) {
+			w = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (y + i * LFIT_STRIDE + c)));
+			lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(w));
+			hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(w, 1));
+			x = _mm256_set1_pd(i);
+			ylo = _mm256_add_pd(ylo, lo);
+			yhi = _mm256_add_pd(yhi, hi);
+			xylo = _mm256_add_pd(xylo, _mm256_mul_pd(x, lo));
+			xyhi = _mm256_add_pd(xyhi, _mm256_mul_pd(x, hi));
+			yylo = _mm256_add_pd(yylo, _mm256_mul_pd(lo, lo));
+			yyhi = _mm256_add_pd(yyhi, _mm256_mul_pd(hi, hi));
+		}
+		_mm256_storeu_pd(sy + c, ylo);
+		_mm256_storeu_pd(sy + c + 4, yhi);
+		_mm256_storeu_pd(sxy + c, xylo);
+		_mm256_storeu_pd(sxy + c + 4, xyhi);
+		_mm256_storeu_pd(syy + c, yylo);
+		_mm256_storeu_pd(syy + c + 4, yyhi);
+	}
+}
+
+//	16 channels per step
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+static void lfit_sums_avx512(const short *y, int n, int ncol, double *sy, double *sxy, double *syy)
+{
+	__m512i w;
+	__m512d x, lo, hi, ylo, yhi, xylo, xyhi, yylo, yyhi;
+	int i, c;
+
+	for (c = 0; c < ncol; c += 16) {
+		ylo = yhi = xylo = xyhi = yylo = yyhi = _mm512_setzero_pd();
+		for (i = 0; i < n; i++) {
+			w = _mm512_cvtepi16_epi32(_mm256_loadu_si256((const __m256i *) (y + i * LFIT_STRIDE + c)));
+			lo = _mm512_cvtepi32_pd(_mm512_castsi512_si256(w));
+			hi = _mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(w, 1));
+			x = _mm512_set1_pd(i);
+			ylo = _mm512_add_pd(ylo, lo);
+			yhi = _mm512_add_pd(yhi, hi);
+			xylo = _mm512_add_pd(xylo, _mm512_mul_pd(x, lo));
+			xyhi = _mm512_add_pd(xyhi, _mm512_mul_pd(x, hi));
+			yylo = _mm512_add_pd(yylo, _mm512_mul_pd(lo, lo));
+			yyhi = _mm512_add_pd(yyhi, _mm512_mul_pd(hi, hi));
+		}
+		_mm512_storeu_pd(sy + c, ylo);
+		_mm512_storeu_pd(sy + c + 8, yhi);
+		_mm512_storeu_pd(sxy + c, xylo);
+		_mm512_storeu_pd(sxy + c + 8, xyhi);
+		_mm512_storeu_pd(syy + c, yylo);
+		_mm512_storeu_pd(syy + c + 8, yyhi);
+	}
+}
+#endif
+
+static int lfit_level = -1;
+static lfit_sums_fn lfit_sums = lfit_sums_scalar;
+
+//	Follow the kernel level of the block decoder
+static void lfit_set_kernels(void)
+{
+	lfit_level = blk_get_level();
+	lfit_sums = lfit_sums_scalar;
+#if defined(__x86_64__)
+	if (lfit_level >= BLK_SSE2) lfit_sums = lfit_sums_sse2;
+	if (lfit_level >= BLK_AVX2) lfit_sums = lfit_sums_avx2;
+	if (lfit_level >= BLK_AVX512) lfit_sums = lfit_sums_avx512;
+#endif
+}
+
+//*************************************************************************************************************************************//
+
+linefit::linefit(int len)
+{
+	n = (len > 0) ? len : 0;
+	sx = (double) n * (n - 1) / 2;
+	det = (double) n * ((double) (n - 1) * n * (2 * n - 1) / 6) - sx * sx;
+	y = (short *) calloc((n) ? n : 1, LFIT_STRIDE * sizeof(short));
+	if (!y) {
+		Log(FATAL, "No memory for line fit of %d samples: %m\n", n);
+		n = 0;
+	}
+	Clear();
+}
+
+linefit::~linefit(void)
+{
+	free(y);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Put the waveform of len 15-bit samples as they come from the module in place of the channel chan.
+//	Return 0 on success, negative if chan is out of range or the length is not that of the fit
+int linefit::Add(int chan, const unsigned short *data, int len)
+{
+	int i;
+
+	if (chan < 0 || chan >= LFIT_MAXCHAN || len != n) return -1;
+	for (i = 0; i < n; i++) y[i * LFIT_STRIDE + chan] = ((short) (data[i] << 1)) >> 1;
+	present[chan] = 1;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Forget all waveforms
+void linefit::Clear(void)
+{
+	memset(present, 0, sizeof(present));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Fit all channels. res[LFIT_MAXCHAN] is zero for channels which were not added.
+void linefit::Fit(struct lfit_result *res)
+{
+	double sy[LFIT_STRIDE], sxy[LFIT_STRIDE], syy[LFIT_STRIDE];
+	double cy, cxy;
+	int c;
+
+	memset(res, 0, LFIT_MAXCHAN * sizeof(struct lfit_result));
+	if (!n) return;
+	if (lfit_level != blk_get_level()) lfit_set_kernels();
+	lfit_sums(y, n, LFIT_MAXCHAN, sy, sxy, syy);
+	for (c = 0; c < LFIT_MAXCHAN; c++) if (present[c]) {
+		cy = n * syy[c] - sy[c] * sy[c];	// n^2 times the variance of y, exact
+		cxy = n * sxy[c] - sx * sy[c];		// the same for the covariance
+		res[c].slope = (det > 0) ? cxy / det : 0;
+		res[c].intercept = (sy[c] - res[c].slope * sx) / n;
+		res[c].chi2 = (cy - res[c].slope * cxy) / ((double) n * n);
+		if (res[c].chi2 < 0) res[c].chi2 = 0;
+	}
+}
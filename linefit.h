@@ -0,0 +1,38 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Straight line fit of the waveforms of all channels at once.
+*/
+#ifndef LINEFIT_H
+#define LINEFIT_H
+
+#define LFIT_MAXCHAN	68		// 64 channels and 4 history blocks
+#define LFIT_STRIDE	80		// samples of all channels at one time, a multiple of the widest SIMD step
+
+//	Fit y = intercept + slope * i, i - sample number from 0
+struct lfit_result {
+	double slope;
+	double intercept;
+	double chi2;		// mean square of the residuals
+};
+
+//	Waveforms of the same length n are put in as they come, one per channel,
+//	and fitted together. Samples are kept by time: y[i * LFIT_STRIDE + chan], so the sums
+//	of several channels are accumulated at once. Sums of i and i^2 are the same for all.
+class linefit {
+private:
+	int n;			// samples in a waveform
+	double sx;		// sum of i
+	double det;		// n * sum(i^2) - sx^2
+	short *y;
+	int present[LFIT_MAXCHAN];
+public:
+	linefit(int len);
+	~linefit(void);
+	int Add(int chan, const unsigned short *data, int len);
+	void Clear(void);
+	void Fit(struct lfit_result *res);
+	inline int GetLen(void) { return n; };
+	inline int IsPresent(int chan) { return present[chan]; };
+};
+
+#endif /* LINEFIT_H */
@@ -0,0 +1,294 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Data file writer with automatic rotation.
+
+	The data file is switched to the next one when the size or time limit is reached.
+	The switch is done by the caller between records (after REC_END and before REC_BEGIN),
+	the next file is created, preallocated and checked by CheckDiskScript in the helper thread
+	in advance, so the readout loop never waits for the file system. Old files are closed by
+	the same helper thread.
+*/
+
+#define _FILE_OFFSET_BITS 64
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "recfile.h"
+
+#define RECFILE_RETRY	10	// s, retry period after failed preparation of the next file
+
+recfile::recfile(struct recfile_config *conf)
+{
+	if (conf) {
+		memcpy(&Conf, conf, sizeof(Conf));
+	} else {
+		memset(&Conf, 0, sizeof(Conf));
+	}
+	f = NULL;
+	name[0] = '\0';
+	pattern[0] = '\0';
+	fnum = 1;
+	fsize = 0;
+	ftime = 0;
+	total = 0;
+	nfiles = 0;
+	rotate = 0;
+	thread_running = 0;
+	stop = 0;
+	next_state = RECFILE_NEXT_NONE;
+	next_f = NULL;
+	next_name[0] = '\0';
+	old_f = NULL;
+	errtime = 0;
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+recfile::~recfile(void)
+{
+	Close();
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Close everything. Unused prepared file is removed.
+void recfile::Close(void)
+{
+	if (thread_running) {
+		pthread_mutex_lock(&mutex);
+		stop = 1;
+		pthread_cond_signal(&cond);
+		pthread_mutex_unlock(&mutex);
+		pthread_join(thread, NULL);
+		thread_running = 0;
+	}
+	if (old_f) {
+		fclose(old_f);
+		old_f = NULL;
+	}
+	if (next_f) {
+		fclose(next_f);
+		unlink(next_name);
+		next_f = NULL;
+	}
+	next_state = RECFILE_NEXT_NONE;
+	if (f) {
+		fclose(f);
+		f = NULL;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	The helper thread body
+void recfile::Helper(void)
+{
+	FILE *fc;
+	FILE *fn;
+	char fname[MAX_PATH_LEN];
+
+	pthread_mutex_lock(&mutex);
+	for (;;) {
+		while (!stop && !old_f && next_state != RECFILE_NEXT_REQUESTED) pthread_cond_wait(&cond, &mutex);
+		if (old_f) {		// close the old file first, it frees the slot for the next rotation
+			fc = old_f;
+			pthread_mutex_unlock(&mutex);
+			if (fclose(fc)) Log(ERROR, "Data file close error: %m\n");
+			pthread_mutex_lock(&mutex);
+			old_f = NULL;
+			continue;
+		}
+		if (stop) break;
+		pthread_mutex_unlock(&mutex);
+		fn = OpenNext(fname);
+		pthread_mutex_lock(&mutex);
+		if (fn) {
+			next_f = fn;
+			strcpy(next_name, fname);
+			next_state = RECFILE_NEXT_READY;
+		} else {
+			next_state = RECFILE_NEXT_ERROR;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void *recfile::HelperThread(void *arg)
+{
+	((recfile *) arg)->Helper();
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Check if rotation is needed. Start preparation of the next file in advance,
+//	when 7/8 of either limit is used.
+//	Return 1 if the current file reached its limits.
+int recfile::IsRotateDue(void)
+{
+	long long lim;
+	time_t dt;
+	int due, soon;
+
+	if (!rotate) return 0;
+	lim = (long long) Conf.AutoSize * 0x100000;
+	dt = time(NULL) - ftime;
+	due = (lim > 0 && fsize >= lim) || (Conf.AutoTime > 0 && dt >= Conf.AutoTime);
+	soon = (lim > 0 && 8 * fsize >= 7 * lim) || (Conf.AutoTime > 0 && 8 * dt >= 7 * Conf.AutoTime);
+	if (due || soon) RequestNext();
+	return due;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Return 1 if the next file is ready
+int recfile::IsNextReady(void)
+{
+	int irc;
+	pthread_mutex_lock(&mutex);
+	irc = (next_state == RECFILE_NEXT_READY && !old_f);
+	pthread_mutex_unlock(&mutex);
+	return irc;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Open data file. fname can be:
+//	"*" - use AutoName from the configuration as the name pattern,
+//	a pattern with % - printf-like format with the file number,
+//	anything else - a plain file name, no rotation.
+//	Return 0 on success, negative on error
+int recfile::Open(const char *fname)
+{
+	FILE *fn;
+
+	Close();
+	stop = 0;
+	total = 0;
+	nfiles = 0;
+	if (!strcmp(fname, "*")) {
+		if (!Conf.AutoName[0]) {
+			Log(ERROR, "Automatic file name requested, but Sink.AutoName is not configured\n");
+			return -1;
+		}
+		strcpy(pattern, Conf.AutoName);
+	} else if (strchr(fname, '%')) {
+		strncpy(pattern, fname, sizeof(pattern) - 1);
+		pattern[sizeof(pattern) - 1] = '\0';
+	} else {
+		pattern[0] = '\0';
+	}
+	rotate = (pattern[0] && (Conf.AutoSize > 0 || Conf.AutoTime > 0));
+
+	if (pattern[0]) {
+		fnum = 1;
+		fn = OpenNext(name);	// the first script call is done here, before data taking
+	} else {
+		strncpy(name, fname, sizeof(name) - 1);
+		name[sizeof(name) - 1] = '\0';
+		fn = fopen(name, "wb");
+		if (!fn) Log(ERROR, "Can not open file %s: %m.\n", name);
+	}
+	if (!fn) return -1;
+	f = fn;
+	fsize = 0;
+	ftime = time(NULL);
+	nfiles = 1;
+
+	if (rotate) {
+		if (pthread_create(&thread, NULL, HelperThread, this)) {
+			Log(ERROR, "Can not start file rotation thread: %m\n");
+			fclose(f);
+			f = NULL;
+			return -2;
+		}
+		thread_running = 1;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Run the check disk script, create the next file by the pattern and preallocate it.
+//	Called from the helper thread except for the very first file.
+//	fname - buffer of MAX_PATH_LEN for the file name
+//	Return the stream or NULL on error
+FILE *recfile::OpenNext(char *fname)
+{
+	FILE *fn;
+	int irc;
+
+	if (Conf.CheckDiskScript[0]) {
+		irc = system(Conf.CheckDiskScript);
+		if (irc) Log(WARN, "%s returned %d\n", Conf.CheckDiskScript, irc);
+	}
+	// skip existing files, we never overwrite data
+	for (;; fnum++) {
+		snprintf(fname, MAX_PATH_LEN, pattern, fnum);
+		if (access(fname, F_OK)) break;
+	}
+	fnum++;
+	fn = fopen(fname, "wb");
+	if (!fn) {
+		Log(ERROR, "Can not open file %s: %m.\n", fname);
+		return NULL;
+	}
+	// reserve the space, so that the writes do not wait for block allocation
+	if (Conf.AutoSize > 0 && fallocate(fileno(fn), FALLOC_FL_KEEP_SIZE, 0, (off_t) Conf.AutoSize * 0x100000)
+		&& errno != EOPNOTSUPP) Log(WARN, "Can not preallocate %d MBytes for %s: %m\n", Conf.AutoSize, fname);
+	return fn;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Ask the helper thread to prepare the next file, if not yet requested.
+void recfile::RequestNext(void)
+{
+	pthread_mutex_lock(&mutex);
+	if (next_state == RECFILE_NEXT_ERROR) {
+		errtime = time(NULL);
+		next_state = RECFILE_NEXT_NONE;
+	}
+	if (next_state == RECFILE_NEXT_NONE && time(NULL) - errtime >= RECFILE_RETRY) {
+		next_state = RECFILE_NEXT_REQUESTED;
+		pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Switch to the prepared file. The caller must finish the current file with REC_END
+//	before and start the new one with REC_BEGIN after the call.
+//	Return 1 if switched, 0 if the next file is not ready yet.
+int recfile::Rotate(void)
+{
+	pthread_mutex_lock(&mutex);
+	if (next_state != RECFILE_NEXT_READY || old_f) {
+		pthread_mutex_unlock(&mutex);
+		return 0;
+	}
+	old_f = f;
+	f = next_f;
+	next_f = NULL;
+	strcpy(name, next_name);
+	next_state = RECFILE_NEXT_NONE;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+	fsize = 0;
+	ftime = time(NULL);
+	nfiles++;
+	Log(INFO, "Data file switched to %s\n", name);
+	return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Write len bytes from buf to the current file
+//	Return 0 on success, negative on error
+int recfile::Write(const void *buf, int len)
+{
+	if (!f) return -1;
+	if (fwrite(buf, len, 1, f) != 1) return -2;
+	fsize += len;
+	total += len;
+	return 0;
+}
@@ -0,0 +1,77 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Data file writer with automatic rotation.
+*/
+#ifndef RECFILE_H
+#define RECFILE_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifndef MAX_PATH_LEN
+#define MAX_PATH_LEN	1024
+#endif
+
+//	Rotation parameters, normally from Sink section of the configuration
+struct recfile_config {
+	char AutoName[MAX_PATH_LEN];		// auto file name format, must contain exactly one %d-like field
+	char CheckDiskScript[MAX_PATH_LEN];	// the script is called before new file in auto mode is written
+	int AutoTime;				// s, 0 - no time limit
+	int AutoSize;				// MBytes, 0 - no size limit
+	int Index;				// write the record index next to each data file (recindex.h)
+};
+
+//	States of the next file preparation
+enum RECFILE_NEXT_STATE {
+	RECFILE_NEXT_NONE = 0,		// nothing requested
+	RECFILE_NEXT_REQUESTED = 1,	// helper thread is preparing the file
+	RECFILE_NEXT_READY = 2,		// the file is open and can be switched to
+	RECFILE_NEXT_ERROR = -1		// preparation failed
+};
+
+class recfile {
+private:
+	struct recfile_config Conf;
+	FILE *f;			// current file
+	char name[MAX_PATH_LEN];	// current file name
+	char pattern[MAX_PATH_LEN];	// name pattern, empty if no rotation
+	int fnum;			// number of the next file to be created with pattern
+	long long fsize;		// bytes written to the current file
+	time_t ftime;			// time the current file was opened
+	long long total;		// bytes written to all files
+	int nfiles;			// number of files written
+	int rotate;			// rotation enabled
+	//	helper thread: prepares the next file and closes the old ones
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int thread_running;
+	int stop;
+	enum RECFILE_NEXT_STATE next_state;
+	FILE *next_f;
+	char next_name[MAX_PATH_LEN];
+	FILE *old_f;			// file to be closed by the helper thread
+	time_t errtime;			// time of the last failed preparation
+
+	static void *HelperThread(void *arg);
+	void Helper(void);
+	FILE *OpenNext(char *fname);
+	void RequestNext(void);
+public:
+	recfile(struct recfile_config *conf = NULL);
+	~recfile(void);
+	int Open(const char *fname);
+	void Close(void);
+	inline int Flush(void) { return (f) ? fflush(f) : -1; };
+	inline long long GetSize(void) { return fsize; };
+	inline long long GetTotal(void) { return total; };
+	inline const char *GetName(void) { return name; };
+	inline int GetNFiles(void) { return nfiles; };
+	int IsRotateDue(void);
+	int IsNextReady(void);
+	int Rotate(void);
+	int Write(const void *buf, int len);
+};
+
+#endif /* RECFILE_H */
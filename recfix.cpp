@@ -0,0 +1,382 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Check of data files and repair of files left by a killed run.
+	Record headers are walked through the mapped file, then payloads are checked in parallel
+	threads: block framing, v2 CRC, compressed records are expanded. Blocks continued from one
+	record of a module to its next record are checked after that. With -f the file is cut after
+	the last complete record and REC_END is appended.
+*/
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "blkdecode.h"
+#include "log.h"
+#include "recformat.h"
+#include "recindex.h"
+#include "wfcodec.h"
+
+#define MAXTHREADS	64
+#define MAXSERIAL	0x10000		// REC_WFDDATA + serial
+
+//	Record problems
+#define ERR_TYPE	1		// unknown type or type and serial do not match
+#define ERR_LEN		2		// header only record with payload
+#define ERR_CRC		4		// v2 CRC or compressed payload damaged
+#define ERR_FRAME	8		// a control word was expected
+#define ERR_CONT	16		// the block continued from the previous record does not fit
+
+struct recfix_rec {
+	long long offset;
+	long long cnt;
+	int len;
+	int hlen;
+	int type;
+	int serial;
+	int version;
+	int flags;
+	int head;		// words before the first control word - the end of a block from the previous record
+	int tail;		// words of the last block which are in the next record
+	int err;		// ERR_*
+};
+
+struct recfix_thread {
+	pthread_t thread;
+	struct recfix_rec *recs;
+	const char *map;
+	int first;
+	int num;
+	int check_crc;
+};
+
+void Help(void)
+{
+	printf("\t\tCheck and repair of UWFD64 data files\n");
+	printf("Usage recfix [options] file.data [...]\n");
+	printf("Options:\n");
+	printf("-c - do not check CRC of v2 records;\n");
+	printf("-f - fix: cut the file after the last complete record and append REC_END if it is missing;\n");
+	printf("-h - print this message and exit;\n");
+	printf("-j num - number of threads, default - number of CPUs;\n");
+	printf("-v - list every damaged record.\n");
+	printf("The index file.idx, if present, is rebuilt after the fix.\n");
+}
+
+//	Check block framing of module data. Blocks may start in the previous record and end in the next one.
+void CheckFraming(struct recfix_rec *r, const unsigned short *w, int n)
+{
+	blkdecoder dec;
+	struct blk_view v;
+	int irc;
+
+	r->head = 0;
+	r->tail = 0;
+	dec.Feed(w, n * sizeof(short));
+	while ((irc = dec.Next(&v)) != BLK_END) {
+		if (irc == BLK_STRAY) {
+			if (v.pos) r->err |= ERR_FRAME;
+			else r->head = v.len;		// the end of a block from the previous record
+		} else if (irc == BLK_PART) {
+			r->tail = v.missing;
+		}
+	}
+}
+
+//	Check payloads of a range of records
+void *CheckThread(void *arg)
+{
+	struct recfix_thread *t;
+	struct recfix_rec *r;
+	struct rec_info_struct info;
+	char *buf;
+	int bufsize;
+	int i, len;
+
+	t = (struct recfix_thread *) arg;
+	buf = NULL;
+	bufsize = 0;
+	for (i = t->first; i < t->first + t->num; i++) {
+		r = &t->recs[i];
+		if (r->version >= 2 && t->check_crc && rec_parse(t->map + r->offset, r->len, &info, 1) == REC_ERR_CRC) {
+			r->err |= ERR_CRC;
+			continue;
+		}
+		if (r->type < REC_WFDDATA) continue;
+		if (r->flags & REC_FLAG_WFC) {
+			len = wfc_rec_size(t->map + r->offset, r->len);
+			if (len > bufsize) {
+				free(buf);
+				bufsize = len;
+				buf = (char *) malloc(bufsize);
+				if (!buf) {
+					bufsize = 0;
+					continue;
+				}
+			}
+			if (wfc_rec_decode(t->map + r->offset, r->len, buf, bufsize) != len) {
+				r->err |= ERR_CRC;
+				continue;
+			}
+			CheckFraming(r, (const unsigned short *) (buf + r->hlen), (len - r->hlen) / sizeof(short));
+		} else {
+			CheckFraming(r, (const unsigned short *) (t->map + r->offset + r->hlen), (r->len - r->hlen) / sizeof(short));
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+//	Append REC_END to the file cut at size
+int AppendEnd(const char *fname, long long size, int version, long long cnt)
+{
+	long long header[REC_MAXHEADER / sizeof(long long)];
+	int fd, hlen, irc;
+
+	fd = open(fname, O_WRONLY);
+	if (fd < 0) {
+		printf("Can not open %s for writing: %m\n", fname);
+		return -1;
+	}
+	irc = 0;
+	if (ftruncate(fd, size)) {
+		printf("Can not truncate %s: %m\n", fname);
+		irc = -2;
+	}
+	if (!irc && version > 0) {
+		hlen = rec_header_size(version);
+		rec_fill(header, version, hlen, cnt, REC_END);
+		if (pwrite(fd, header, hlen, size) != hlen) {
+			printf("Can not write REC_END to %s: %m\n", fname);
+			irc = -3;
+		}
+	}
+	if (!irc && fsync(fd)) irc = -4;
+	close(fd);
+	return irc;
+}
+
+//	Check one file and fix it if asked.
+//	Return 0 if the file is good or fixed, 1 if it has problems, negative on error
+int CheckFile(const char *fname, int nthreads, int check_crc, int fix, int verbose)
+{
+	struct stat st;
+	struct rec_info_struct info;
+	struct recfix_rec *recs, *tmp;
+	struct recfix_thread th[MAXTHREADS];
+	int *prev;		// the last record of each module
+	const char *map;
+	long long pos, bytes, per, acc, gaps, lastcnt;
+	int n, size, i, k, irc, fd;
+	int nbegin, nend, npseoc, ndata, nmod;
+	int errs[5];
+	int result, endok, damaged;
+	char iname[MAX_PATH_LEN + 8];
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		printf("Can not open %s: %m\n", fname);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	if (!st.st_size) {
+		printf("%s: empty file\n", fname);
+		close(fd);
+		return 1;
+	}
+	map = (const char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("Can not map %s: %m\n", fname);
+		return -1;
+	}
+
+	// walk the headers, only the first page of each record is touched
+	recs = NULL;
+	n = size = 0;
+	irc = 0;
+	for (pos = 0; pos < st.st_size; pos += info.len) {
+		irc = rec_parse(map + pos, (st.st_size - pos > 0x7FFFFFFF) ? 0x7FFFFFFF : st.st_size - pos, &info);
+		if (irc < 0) break;
+		if (n >= size) {
+			size = 2 * size + 4096;
+			tmp = (struct recfix_rec *) realloc(recs, size * sizeof(struct recfix_rec));
+			if (!tmp) {
+				printf("No memory for %d records\n", size);
+				free(recs);
+				munmap((void *) map, st.st_size);
+				return -2;
+			}
+			recs = tmp;
+		}
+		memset(&recs[n], 0, sizeof(struct recfix_rec));
+		recs[n].offset = pos;
+		recs[n].cnt = info.cnt;
+		recs[n].len = info.len;
+		recs[n].hlen = info.hlen;
+		recs[n].type = info.type;
+		recs[n].serial = info.serial;
+		recs[n].version = info.version;
+		recs[n].flags = info.flags;
+		if (info.type >= REC_WFDDATA) {
+			if (info.type >= REC_WFDDATA + MAXSERIAL || info.serial != info.type - REC_WFDDATA) recs[n].err |= ERR_TYPE;
+		} else if (info.type == REC_BEGIN || info.type == REC_PSEOC || info.type == REC_END) {
+			if (info.len != info.hlen) recs[n].err |= ERR_LEN;
+		} else if (info.type < REC_FEATURE || info.type >= REC_FEATURE + MAXSERIAL) {	// feature records (wffeat.h) are fine
+			recs[n].err |= ERR_TYPE;
+		}
+		n++;
+	}
+
+	// payloads in parallel, the ranges have about the same number of bytes
+	if (nthreads > n) nthreads = n;
+	if (nthreads < 1) nthreads = 1;
+	per = pos / nthreads + 1;
+	for (i = 0, k = 0; k < nthreads; k++) {
+		th[k].recs = recs;
+		th[k].map = map;
+		th[k].check_crc = check_crc;
+		th[k].first = i;
+		for (acc = 0; i < n && (acc < per || k == nthreads - 1); i++) acc += recs[i].len;
+		th[k].num = i - th[k].first;
+	}
+	madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+	for (k = 1; k < nthreads; k++) if (pthread_create(&th[k].thread, NULL, CheckThread, &th[k])) {
+		th[k].thread = 0;
+		CheckThread(&th[k]);
+	}
+	CheckThread(&th[0]);
+	for (k = 1; k < nthreads; k++) if (th[k].thread) pthread_join(th[k].thread, NULL);
+
+	// blocks continued across records of the same module, statistics
+	prev = (int *) malloc(MAXSERIAL * sizeof(int));
+	if (prev) for (k = 0; k < MAXSERIAL; k++) prev[k] = -1;
+	nbegin = nend = npseoc = ndata = nmod = 0;
+	memset(errs, 0, sizeof(errs));
+	gaps = 0;
+	lastcnt = -1;
+	bytes = 0;
+	for (i = 0; i < n; i++) {
+		switch (recs[i].type) {
+		case REC_BEGIN:
+			nbegin++;
+			lastcnt = -1;
+			break;
+		case REC_PSEOC:
+			npseoc++;
+			break;
+		case REC_END:
+			nend++;
+			break;
+		default:
+			if (recs[i].type < REC_WFDDATA) break;
+			ndata++;
+			k = recs[i].type - REC_WFDDATA;
+			if (!prev || (recs[i].err & (ERR_TYPE | ERR_CRC))) break;
+			if (prev[k] < 0) {
+				nmod++;
+			} else if (recs[prev[k]].tail != recs[i].head) {
+				recs[i].err |= ERR_CONT;
+			}
+			prev[k] = i;
+			break;
+		}
+		if (recs[i].type != REC_BEGIN) {
+			// a feature record written next to its data record has the same number
+			if (lastcnt >= 0 && recs[i].cnt != lastcnt + 1 && !(recs[i].type >= REC_FEATURE
+				&& recs[i].type < REC_FEATURE + MAXSERIAL && recs[i].cnt == lastcnt)) gaps++;
+			lastcnt = recs[i].cnt;
+		}
+		bytes += recs[i].len;
+		for (k = 0; k < 5; k++) if (recs[i].err & (1 << k)) errs[k]++;
+		if (recs[i].err && verbose) printf("%s: record %d at %Ld type %X cnt %Ld: error %X\n",
+			fname, i, recs[i].offset, recs[i].type, recs[i].cnt, recs[i].err);
+	}
+	free(prev);
+
+	endok = (n && recs[n-1].type == REC_END);
+	printf("%s: %d records, %Ld of %Ld bytes: %d begin, %d data of %d modules, %d pseudo cycle ends, %d end\n",
+		fname, n, bytes, (long long) st.st_size, nbegin, ndata, nmod, npseoc, nend);
+	if (gaps) printf("\t%Ld gaps in record numbers\n", gaps);
+	if (errs[0]) printf("\t%d records of unknown type\n", errs[0]);
+	if (errs[1]) printf("\t%d header only records with payload\n", errs[1]);
+	if (errs[2]) printf("\t%d records with damaged payload (CRC)\n", errs[2]);
+	if (errs[3]) printf("\t%d records with broken block framing\n", errs[3]);
+	if (errs[4]) printf("\t%d records not continuing the previous block of the module\n", errs[4]);
+	if (pos < st.st_size) printf("\t%Ld bytes after the last complete record: %s\n", st.st_size - pos,
+		(irc == REC_ERR_SHORT) ? "partial record" : "not a record");
+	if (!endok) printf("\tREC_END is missing\n");
+	damaged = gaps || errs[0] || errs[1] || errs[2] || errs[3] || errs[4];
+	result = (damaged || pos < st.st_size || !endok) ? 1 : 0;
+	munmap((void *) map, st.st_size);
+
+	if (fix && !n) {
+		printf("\tNot a data file, not fixed\n");
+	} else if (fix && (pos < st.st_size || !endok)) {
+		// damaged payloads are kept, only what can not be read as records is cut
+		irc = AppendEnd(fname, pos, (endok) ? 0 : recs[n-1].version, recs[n-1].cnt + 1);
+		if (irc) {
+			result = irc;
+		} else {
+			printf("\tFixed: %Ld bytes cut%s\n", st.st_size - pos, (endok) ? "" : ", REC_END appended");
+			snprintf(iname, sizeof(iname), "%s%s", fname, RECINDEX_SUFFIX);
+			if (!access(iname, F_OK)) {
+				recindex idx;
+				if (!idx.Open(fname, 1)) printf("\tIndex %s rebuilt\n", iname);
+			}
+			result = damaged;
+		}
+	}
+	free(recs);
+	return result;
+}
+
+int main(int argc, char **argv)
+{
+	int nthreads, check_crc, fix, verbose;
+	int c, irc, result;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	check_crc = 1;
+	fix = 0;
+	verbose = 0;
+	for (;;) {
+		c = getopt(argc, argv, "cfhj:v");
+		if (c == -1) break;
+		switch (c) {
+		case 'c':
+			check_crc = 0;
+			break;
+		case 'f':
+			fix = 1;
+			break;
+		case 'j':
+			nthreads = strtol(optarg, NULL, 0);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+		default:
+			Help();
+			return 0;
+		}
+	}
+	if (optind >= argc) {
+		Help();
+		return 0;
+	}
+	if (nthreads > MAXTHREADS) nthreads = MAXTHREADS;
+	if (nthreads < 1) nthreads = 1;
+
+	result = 0;
+	for (; optind < argc; optind++) {
+		irc = CheckFile(argv[optind], nthreads, check_crc, fix, verbose);
+		if (irc && !result) result = (irc < 0) ? 20 : 10;
+	}
+	return result;
+}
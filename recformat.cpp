@@ -0,0 +1,157 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Record headers of both versions: fill, parse and check.
+*/
+
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "recformat.h"
+
+#define CRC32C_POLY	0x82F63B78	// reflected Castagnoli polynomial
+
+static unsigned int crc32c_table[256];
+
+//	Table driven CRC32C, 1 byte per step
+static unsigned int crc32c_soft(unsigned int crc, const unsigned char *buf, int len)
+{
+	unsigned int c;
+	int i, j;
+
+	if (!crc32c_table[1]) for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++) c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc32c_table[i] = c;
+	}
+	for (i = 0; i < len; i++) crc = crc32c_table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+//	SSE4.2 crc32 instruction, 8 bytes per step
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int crc, const unsigned char *buf, int len)
+{
+	unsigned long long c;
+	unsigned long long w;
+
+	for (; len > 0 && ((unsigned long) buf & 7); len--, buf++) crc = _mm_crc32_u8(crc, *buf);
+	c = crc;
+	for (; len >= 8; len -= 8, buf += 8) {
+		memcpy(&w, buf, 8);
+		c = _mm_crc32_u64(c, w);
+	}
+	crc = c;
+	for (; len > 0; len--, buf++) crc = _mm_crc32_u8(crc, *buf);
+	return crc;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	CRC32C of buf. crc - the result for the previous part, 0 to start.
+unsigned int rec_crc32c(unsigned int crc, const void *buf, int len)
+{
+#if defined(__x86_64__)
+	static int sse42 = -1;
+
+	if (sse42 < 0) sse42 = __builtin_cpu_supports("sse4.2");
+	if (sse42) return ~crc32c_sse42(~crc, (const unsigned char *) buf, len);
+#endif
+	return ~crc32c_soft(~crc, (const unsigned char *) buf, len);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Fill the header at the beginning of rec. The payload must be already in place.
+//	version - 1 or 2
+//	len - whole record length
+//	cnt - record number
+//	serial, fifo_addr - where the data came from, only in v2
+void rec_fill(void *rec, int version, int len, long long cnt, int type, int serial, unsigned int fifo_addr)
+{
+	struct rec_header_struct *h1;
+	struct rec_header_v2_struct *h2;
+	struct timespec ts;
+
+	if (version < 2) {
+		h1 = (struct rec_header_struct *) rec;
+		h1->len = len;
+		h1->cnt = cnt;
+		h1->ip = INADDR_LOOPBACK;		// 127.0.0.1 - loopback
+		h1->type = type;
+		h1->time = time(NULL);
+		return;
+	}
+	h2 = (struct rec_header_v2_struct *) rec;
+	h2->len = len;
+	h2->magic = REC_MAGIC | REC_VERSION;
+	h2->type = type;
+	h2->hlen = sizeof(struct rec_header_v2_struct);
+	h2->cnt = cnt;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	h2->mono = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	h2->real = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	h2->serial = serial;
+	h2->fifo_addr = fifo_addr;
+	h2->flags = 0;
+	h2->crc = rec_crc32c(0, (char *) rec + h2->hlen, len - h2->hlen);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Header length written for the version
+int rec_header_size(int version)
+{
+	return (version < 2) ? sizeof(struct rec_header_struct) : sizeof(struct rec_header_v2_struct);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Parse a record of any version.
+//	rec, len - the buffer where the record starts and its size
+//	info - filled if the header is understood, even if the record is incomplete
+//	check - verify the payload CRC (v2)
+//	Return the version, REC_ERR_SHORT if the buffer has only a part of the record,
+//	REC_ERR_HEADER if this is not a record header, REC_ERR_CRC on payload damage
+int rec_parse(const void *rec, int len, struct rec_info_struct *info, int check)
+{
+	const struct rec_header_struct *h1;
+	const struct rec_header_v2_struct *h2;
+
+	if (len < (int) sizeof(struct rec_header_struct)) return REC_ERR_SHORT;
+	h1 = (const struct rec_header_struct *) rec;
+	if ((h1->cnt & REC_MAGIC_MASK) != REC_MAGIC) {
+		if (h1->len < (int) sizeof(struct rec_header_struct) || h1->cnt < 0) return REC_ERR_HEADER;
+		info->version = 1;
+		info->hlen = sizeof(struct rec_header_struct);
+		info->len = h1->len;
+		info->type = h1->type;
+		info->cnt = h1->cnt;
+		info->time = h1->time;
+		info->real = h1->time * 1000000000LL;
+		info->mono = 0;
+		info->serial = (h1->type >= REC_WFDDATA) ? h1->type - REC_WFDDATA : -1;
+		info->fifo_addr = 0;
+		info->flags = 0;
+		return (info->len > len) ? REC_ERR_SHORT : 1;
+	}
+	if (len < (int) sizeof(struct rec_header_v2_struct)) return REC_ERR_SHORT;
+	h2 = (const struct rec_header_v2_struct *) rec;
+	if ((h2->magic & ~REC_MAGIC_MASK) < 2 || h2->hlen < (int) sizeof(struct rec_header_v2_struct)
+		|| h2->hlen > h2->len || (h2->hlen & 7)) return REC_ERR_HEADER;
+	info->version = h2->magic & ~REC_MAGIC_MASK;
+	info->hlen = h2->hlen;
+	info->len = h2->len;
+	info->type = h2->type;
+	info->cnt = h2->cnt;
+	info->time = h2->real / 1000000000LL;
+	info->real = h2->real;
+	info->mono = h2->mono;
+	info->serial = h2->serial;
+	info->fifo_addr = h2->fifo_addr;
+	info->flags = h2->flags;
+	if (info->len > len) return REC_ERR_SHORT;
+	if (check && rec_crc32c(0, (const char *) rec + h2->hlen, h2->len - h2->hlen) != h2->crc) return REC_ERR_CRC;
+	return info->version;
+}
@@ -1,6 +1,7 @@
 #ifndef RECFORMAT_H
 #define RECFORMAT_H
 
+//	Version 1 record header
 struct rec_header_struct {
 	int len;
 	int cnt;
@@ -9,10 +10,58 @@ struct rec_header_struct {
 	int time;
 };
 
+//	Version 2 record header. magic is where v1 has a non-negative cnt, so the versions can be told apart.
+struct rec_header_v2_struct {
+	int len;		// record length including the header
+	int magic;		// REC_MAGIC | version
+	int type;		// as in v1
+	int hlen;		// header length, for future extensions
+	long long cnt;		// record sequence number
+	long long mono;		// CLOCK_MONOTONIC, ns
+	long long real;		// CLOCK_REALTIME, ns
+	int serial;		// module serial number, -1 for records not from a module
+	unsigned int fifo_addr;	// module FIFO address the data was read from
+	unsigned int crc;	// CRC32C of the payload as stored
+	int flags;		// REC_FLAG_*
+};
+
+#define REC_MAGIC	0xA5570000	// high 16 bits
+#define REC_MAGIC_MASK	0xFFFF0000
+#define REC_VERSION	2		// current version
+#define REC_MAXHEADER	((int) sizeof(struct rec_header_v2_struct))
+
+#define REC_FLAG_WFC	1		// the payload is compressed with the waveform codec (wfcodec.h)
+
+//	Header of any version as seen by readers
+struct rec_info_struct {
+	int version;
+	int hlen;		// header length, the payload follows
+	int len;		// record length
+	int type;
+	long long cnt;
+	int time;		// seconds, CLOCK_REALTIME
+	long long real;		// ns, CLOCK_REALTIME (v1: seconds only)
+	long long mono;		// ns, CLOCK_MONOTONIC (v1: 0)
+	int serial;		// -1 if not known
+	unsigned int fifo_addr;	// v1: 0
+	int flags;		// REC_FLAG_*, v1: 0
+};
+
+#define REC_ERR_SHORT	-1	// the record does not fit in the buffer
+#define REC_ERR_HEADER	-2	// the header does not make sense
+#define REC_ERR_CRC	-3	// the payload is damaged
+
 #define REC_BEGIN	1		// Begin of file / data from the crate
 #define REC_PSEOC	10		// Marker for the end of pseudo cycle
 #define REC_END		999		// End of file / data from the crate
+#define REC_EVENT	0x1000		// Event put together from all modules (evtbuild.h)
+#define REC_FEATURE	0x2000		// Features of module data blocks (wffeat.h), + module serial number
 #define REC_WFDDATA	0x10000		// Regular wave form data
 
+unsigned int rec_crc32c(unsigned int crc, const void *buf, int len);
+void rec_fill(void *rec, int version, int len, long long cnt, int type, int serial = -1, unsigned int fifo_addr = 0);
+int rec_header_size(int version);
+int rec_parse(const void *rec, int len, struct rec_info_struct *info, int check = 0);
+
 #endif /* RECFORMAT_H */
 
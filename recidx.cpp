@@ -0,0 +1,151 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Build the index of data files and find records with it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "recformat.h"
+#include "recindex.h"
+
+void Help(void)
+{
+	printf("\t\tIndex of UWFD64 data files\n");
+	printf("Usage recidx [options] file.data [...]\n");
+	printf("Without a search option the index is created or updated and a summary is printed.\n");
+	printf("Options:\n");
+	printf("-c cnt - find the first record with number cnt or above;\n");
+	printf("-h - print this message and exit;\n");
+	printf("-k serial:token - find the first record of module serial (-1 - any) with the trigger token;\n");
+	printf("-n num - print num entries starting from the found one, default 1;\n");
+	printf("-o file - write the found records to file;\n");
+	printf("-r - rebuild the index from the whole data file;\n");
+	printf("-t time - find the first record written at time (s since the epoch) or later.\n");
+}
+
+void PrintEntry(int i, const struct recindex_entry *e)
+{
+	char str[64];
+	time_t t;
+
+	t = e->real / 1000000000LL;
+	strftime(str, sizeof(str), "%Y-%m-%d %H:%M:%S", localtime(&t));
+	printf("%8d: offset %12Ld len %7d cnt %10Ld type %6X %s.%9.9Ld", i, e->offset, e->len, e->cnt, e->type, str, e->real % 1000000000LL);
+	if (e->serial >= 0) printf(" serial %3d", e->serial);
+	if (e->token_first >= 0) printf(" tokens %3.3X-%3.3X", e->token_first, e->token_last);
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	recindex *idx;
+	FILE *fout;
+	const struct recindex_entry *e;
+	const char *oname;
+	char *ptr;
+	char *buf;
+	long long cnt, real;
+	int serial, token;
+	int mode, rebuild, num;
+	int c, i, j, irc;
+
+	mode = 0;
+	rebuild = 0;
+	num = 1;
+	oname = NULL;
+	cnt = real = 0;
+	serial = -1;
+	token = 0;
+	for (;;) {
+		c = getopt(argc, argv, "c:hk:n:o:rt:");
+		if (c == -1) break;
+		switch (c) {
+		case 'c':
+			mode = 'c';
+			cnt = strtoll(optarg, NULL, 0);
+			break;
+		case 'k':
+			mode = 'k';
+			serial = strtol(optarg, &ptr, 0);
+			token = (*ptr == ':') ? strtol(ptr + 1, NULL, 0) : 0;
+			break;
+		case 'n':
+			num = strtol(optarg, NULL, 0);
+			break;
+		case 'o':
+			oname = optarg;
+			break;
+		case 'r':
+			rebuild = 1;
+			break;
+		case 't':
+			mode = 't';
+			real = strtoll(optarg, NULL, 0) * 1000000000LL;
+			break;
+		case 'h':
+		default:
+			Help();
+			return 0;
+		}
+	}
+	if (optind >= argc) {
+		Help();
+		return 0;
+	}
+
+	fout = NULL;
+	if (oname) {
+		fout = fopen(oname, "wb");
+		if (!fout) {
+			printf("Can not open %s: %m\n", oname);
+			return 10;
+		}
+	}
+	buf = NULL;
+	idx = new recindex();
+	for (; optind < argc; optind++) {
+		if (idx->Open(argv[optind], rebuild)) continue;
+		if (!mode) {
+			printf("%s: %d records\n", argv[optind], idx->GetCount());
+			if (idx->GetCount()) {
+				PrintEntry(0, idx->Get(0));
+				PrintEntry(idx->GetCount() - 1, idx->Get(idx->GetCount() - 1));
+			}
+			continue;
+		}
+		switch (mode) {
+		case 'c':
+			i = idx->FindCnt(cnt);
+			break;
+		case 't':
+			i = idx->FindTime(real);
+			break;
+		default:
+			i = idx->FindToken(serial, token);
+			break;
+		}
+		if (i < 0 || i >= idx->GetCount()) continue;
+		printf("%s:\n", argv[optind]);
+		for (j = i; j < i + num && j < idx->GetCount(); j++) {
+			e = idx->Get(j);
+			PrintEntry(j, e);
+			if (!fout) continue;
+			buf = (char *) realloc(buf, e->len);
+			if (!buf) {
+				printf("No memory for %d bytes\n", e->len);
+				break;
+			}
+			irc = idx->Read(j, buf, e->len);
+			if (irc < 0 || fwrite(buf, irc, 1, fout) != 1) printf("Record %d copy error %d\n", j, irc);
+		}
+		break;
+	}
+	free(buf);
+	delete idx;
+	if (fout) fclose(fout);
+	return 0;
+}
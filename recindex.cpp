@@ -0,0 +1,360 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Sidecar index of data files.
+	The writer adds an entry per record as the file is written. The reader loads the index
+	and finds records by number, time or module and token, then reads them with pread.
+	Missing or incomplete indexes are built by scanning the data file from the last indexed record.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "blkdecode.h"
+#include "log.h"
+#include "recformat.h"
+#include "recindex.h"
+#include "wfcodec.h"
+
+#define RECINDEX_ALLOC	4096		// entries to add to the reader array at once
+
+//	Find the first and the last trigger token in the module data.
+//	Blocks may be split between records, words before the first control word are skipped.
+static void recindex_tokens(const unsigned short *buf, int n, short *first, short *last)
+{
+	blkdecoder dec;
+	struct blk_view v;
+	int irc;
+
+	*first = *last = -1;
+	dec.Feed(buf, n * sizeof(short));
+	while ((irc = dec.Next(&v)) != BLK_END) {
+		if ((irc != BLK_OK && irc != BLK_PART) || v.type <= BLK_SELF) continue;	// self trigger blocks carry no token
+		*last = v.token;
+		if (*first < 0) *first = *last;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Fill the index entry for the record at offset in the data file.
+//	Tokens are not looked for in compressed records.
+//	Return 0 on success, the rec_parse() error if the record is not understood
+int recindex_fill(struct recindex_entry *e, const void *rec, int len, long long offset)
+{
+	struct rec_info_struct info;
+	int irc;
+
+	irc = rec_parse(rec, len, &info);
+	if (irc < 0) return irc;
+	e->offset = offset;
+	e->cnt = info.cnt;
+	e->real = info.real;
+	e->len = info.len;
+	e->type = info.type;
+	e->serial = info.serial;
+	e->token_first = e->token_last = -1;
+	if (info.type >= REC_WFDDATA && !(info.flags & REC_FLAG_WFC))
+		recindex_tokens((const unsigned short *) ((const char *) rec + info.hlen), (info.len - info.hlen) / sizeof(short),
+			&e->token_first, &e->token_last);
+	return 0;
+}
+
+//*************************************************************************************************************************************//
+
+recindex_writer::recindex_writer(void)
+{
+	f = NULL;
+	name[0] = '\0';
+	nent = 0;
+}
+
+recindex_writer::~recindex_writer(void)
+{
+	Close();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Add the entry for a record just written to the data file at offset.
+//	wlen - the length written if the record was compressed, rec is the original
+//	Return 0 on success, negative on error
+int recindex_writer::Add(const void *rec, int len, long long offset, int wlen)
+{
+	struct recindex_entry e;
+
+	if (!f) return -1;
+	if (recindex_fill(&e, rec, len, offset)) return -2;
+	if (wlen) e.len = wlen;
+	if (fwrite(&e, sizeof(e), 1, f) != 1) {
+		Log(ERROR, "Index %s write error: %m.\n", name);
+		Close();
+		return -3;
+	}
+	nent++;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Close the index file
+void recindex_writer::Close(void)
+{
+	if (f) fclose(f);
+	f = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Create the index for data file dataname. The previous index is closed.
+//	Return 0 on success, negative on error
+int recindex_writer::Open(const char *dataname)
+{
+	struct recindex_header h;
+
+	Close();
+	nent = 0;
+	snprintf(name, sizeof(name), "%s%s", dataname, RECINDEX_SUFFIX);
+	f = fopen(name, "wb");
+	if (!f) {
+		Log(WARN, "Can not create index %s: %m\n", name);
+		return -1;
+	}
+	memset(&h, 0, sizeof(h));
+	h.magic = RECINDEX_MAGIC;
+	h.version = RECINDEX_VERSION;
+	h.entsize = sizeof(struct recindex_entry);
+	if (fwrite(&h, sizeof(h), 1, f) != 1) {
+		Log(WARN, "Index %s write error: %m\n", name);
+		Close();
+		return -2;
+	}
+	return 0;
+}
+
+//*************************************************************************************************************************************//
+
+recindex::recindex(void)
+{
+	ent = NULL;
+	n = 0;
+	size = 0;
+	fd = -1;
+	buf = NULL;
+	bufsize = 0;
+}
+
+recindex::~recindex(void)
+{
+	Close();
+	free(buf);
+}
+
+//	Add an entry to the array. Return 0 on success, negative if no memory
+int recindex::Append(struct recindex_entry *e)
+{
+	struct recindex_entry *tmp;
+
+	if (n >= size) {
+		tmp = (struct recindex_entry *) realloc(ent, (size + RECINDEX_ALLOC) * sizeof(struct recindex_entry));
+		if (!tmp) return -1;
+		ent = tmp;
+		size += RECINDEX_ALLOC;
+	}
+	ent[n++] = *e;
+	return 0;
+}
+
+//	Load the index file. A torn last entry is ignored.
+//	Return 0 on success, negative if there is no usable index
+int recindex::Load(const char *iname)
+{
+	struct recindex_header h;
+	struct recindex_entry e;
+	FILE *f;
+
+	f = fopen(iname, "rb");
+	if (!f) return -1;
+	if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != RECINDEX_MAGIC || h.version != RECINDEX_VERSION
+		|| h.entsize != sizeof(struct recindex_entry)) {
+		fclose(f);
+		return -2;
+	}
+	while (fread(&e, sizeof(e), 1, f) == 1) if (Append(&e)) break;
+	fclose(f);
+	return 0;
+}
+
+//	Index the data file from offset from till the end or the first record which is not understood.
+//	Return the number of entries added, negative on error
+int recindex::Scan(long long from)
+{
+	struct stat st;
+	struct recindex_entry e;
+	char *map;
+	long long pos;
+	int cnt, len, avail;
+
+	if (fstat(fd, &st)) return -1;
+	if (st.st_size <= from) return 0;
+	map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) return -2;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	cnt = 0;
+	for (pos = from; pos < st.st_size; pos += e.len) {
+		avail = (st.st_size - pos > 0x7FFFFFFF) ? 0x7FFFFFFF : st.st_size - pos;
+		if (recindex_fill(&e, map + pos, avail, pos)) break;
+		len = wfc_rec_size(map + pos, avail);
+		if (len != e.len) {		// compressed: tokens are taken from the expanded record
+			if (len > bufsize) {
+				free(buf);
+				bufsize = len;
+				buf = (char *) malloc(bufsize);
+				if (!buf) {
+					bufsize = 0;
+					break;
+				}
+			}
+			len = e.len;
+			if (wfc_rec_decode(map + pos, avail, buf, bufsize) < 0 || recindex_fill(&e, buf, bufsize, pos)) break;
+			e.len = len;
+		}
+		if (Append(&e)) break;
+		cnt++;
+	}
+	if (pos < st.st_size) Log(WARN, "Data file is not indexed after offset %Ld of %Ld\n", pos, (long long) st.st_size);
+	munmap(map, st.st_size);
+	return cnt;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Close the data file and forget the index
+void recindex::Close(void)
+{
+	if (fd >= 0) close(fd);
+	fd = -1;
+	free(ent);
+	ent = NULL;
+	n = 0;
+	size = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Find the first data record with number cnt or above.
+//	Return the entry number, GetCount() if there is no such record
+int recindex::FindCnt(long long cnt)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		// REC_BEGIN has cnt 0 at the beginning of each file
+		if (ent[mid].type == REC_BEGIN || ent[mid].cnt < cnt) lo = mid + 1; else hi = mid;
+	}
+	return lo;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Find the first record written at real (ns since the epoch) or later.
+//	Return the entry number, GetCount() if there is no such record
+int recindex::FindTime(long long real)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ent[mid].real < real) lo = mid + 1; else hi = mid;
+	}
+	return lo;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Find the first record starting with entry from with data of module serial containing token.
+//	Tokens are 10 bits and wrap, so the search is linear. serial < 0 - any module.
+//	Return the entry number, -1 if not found
+int recindex::FindToken(int serial, int token, int from)
+{
+	int i, f, l;
+
+	token &= 0x3FF;
+	for (i = (from > 0) ? from : 0; i < n; i++) {
+		if (ent[i].token_first < 0 || (serial >= 0 && ent[i].serial != serial)) continue;
+		f = ent[i].token_first;
+		l = ent[i].token_last;
+		if ((f <= l) ? (token >= f && token <= l) : (token >= f || token <= l)) return i;
+	}
+	return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Open the data file and its index. Records written after the last indexed one are scanned.
+//	rebuild - ignore the existing index and write a new one from the whole data file
+//	Return 0 on success, negative on error
+int recindex::Open(const char *dataname, int rebuild)
+{
+	char iname[MAX_PATH_LEN + 8];
+	struct recindex_header h;
+	long long from;
+	int nold, irc;
+	FILE *f;
+
+	Close();
+	fd = open(dataname, O_RDONLY);
+	if (fd < 0) {
+		Log(ERROR, "Can not open data file %s: %m\n", dataname);
+		return -1;
+	}
+	snprintf(iname, sizeof(iname), "%s%s", dataname, RECINDEX_SUFFIX);
+	if (rebuild || Load(iname)) {
+		free(ent);
+		ent = NULL;
+		n = size = 0;
+		rebuild = 1;
+	}
+	nold = n;
+	from = (n) ? ent[n-1].offset + ent[n-1].len : 0;
+	irc = Scan(from);
+	if (irc < 0) {
+		Log(ERROR, "Can not scan data file %s: %m\n", dataname);
+		return -2;
+	}
+	if (!irc && !rebuild) return 0;
+
+	// save what was added, so the next time it is not scanned again
+	f = fopen(iname, (rebuild) ? "wb" : "ab");
+	if (!f) {
+		Log(WARN, "Can not write index %s: %m\n", iname);
+		return 0;
+	}
+	if (rebuild) {
+		memset(&h, 0, sizeof(h));
+		h.magic = RECINDEX_MAGIC;
+		h.version = RECINDEX_VERSION;
+		h.entsize = sizeof(struct recindex_entry);
+		fwrite(&h, sizeof(h), 1, f);
+	} else {
+		// drop a torn last entry
+		if (ftruncate(fileno(f), sizeof(h) + (long long) nold * sizeof(struct recindex_entry)))
+			Log(WARN, "Can not truncate index %s: %m\n", iname);
+		fseek(f, 0, SEEK_END);
+	}
+	if (fwrite(&ent[nold], sizeof(struct recindex_entry), n - nold, f) != (size_t) (n - nold))
+		Log(WARN, "Index %s write error: %m\n", iname);
+	fclose(f);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Read record number i of the index as it is stored into rbuf of len bytes.
+//	Compressed records can be expanded with wfc_rec_decode().
+//	Return the record length, negative on error
+int recindex::Read(int i, void *rbuf, int len)
+{
+	if (i < 0 || i >= n || fd < 0) return -1;
+	if (ent[i].len > len) return -2;
+	if (pread(fd, rbuf, ent[i].len, ent[i].offset) != ent[i].len) return -3;
+	return ent[i].len;
+}
@@ -0,0 +1,82 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Sidecar index of data files: record number, time,
+	module and trigger tokens to file offset.
+*/
+#ifndef RECINDEX_H
+#define RECINDEX_H
+
+#include <stdio.h>
+
+#ifndef MAX_PATH_LEN
+#define MAX_PATH_LEN	1024
+#endif
+
+#define RECINDEX_MAGIC		0x49465755	// "UWFI"
+#define RECINDEX_VERSION	1
+#define RECINDEX_SUFFIX		".idx"		// index file name is data file name + suffix
+
+//	At the beginning of the index file
+struct recindex_header {
+	int magic;
+	int version;
+	int entsize;		// sizeof(struct recindex_entry)
+	int reserved;
+};
+
+//	One per record
+struct recindex_entry {
+	long long offset;	// record position in the data file
+	long long cnt;		// record number
+	long long real;		// wall clock, ns
+	int len;		// record length
+	int type;		// REC_*
+	int serial;		// module serial number, -1 if not from a module
+	short token_first;	// first and last trigger token in the data, -1 if none
+	short token_last;
+};
+
+int recindex_fill(struct recindex_entry *e, const void *rec, int len, long long offset);
+
+//	Index writer, used by the file sink together with the data file
+class recindex_writer {
+private:
+	FILE *f;
+	char name[MAX_PATH_LEN + 8];
+	long long nent;
+public:
+	recindex_writer(void);
+	~recindex_writer(void);
+	int Add(const void *rec, int len, long long offset, int wlen = 0);
+	void Close(void);
+	inline int Flush(void) { return (f) ? fflush(f) : -1; };
+	inline long long GetCount(void) { return nent; };
+	int Open(const char *dataname);
+};
+
+//	Index reader. A missing or incomplete index is (re)built from the data file.
+class recindex {
+private:
+	struct recindex_entry *ent;
+	int n;
+	int size;		// allocated entries
+	int fd;			// the data file
+	char *buf;		// compressed records are expanded here
+	int bufsize;
+	int Append(struct recindex_entry *e);
+	int Load(const char *iname);
+	int Scan(long long from);
+public:
+	recindex(void);
+	~recindex(void);
+	void Close(void);
+	int FindCnt(long long cnt);
+	int FindTime(long long real);
+	int FindToken(int serial, int token, int from = 0);
+	inline const struct recindex_entry *Get(int i) { return (i >= 0 && i < n) ? &ent[i] : NULL; };
+	inline int GetCount(void) { return n; };
+	int Open(const char *dataname, int rebuild = 0);
+	int Read(int i, void *rbuf, int len);
+};
+
+#endif /* RECINDEX_H */
@@ -0,0 +1,267 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Record buffers and bounded record queues.
+
+	The readout loop reads module FIFO directly into a pooled record buffer, so the
+	data is copied only once. The buffer is handed to the output queues by pointer
+	and returns to the pool when the last queue releases it.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include "log.h"
+#include "recqueue.h"
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct recbuf *pool = NULL;
+static int pool_cnt = 0;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Get buffer for a record of size bytes. Big buffers come from the pool.
+//	The new buffer has one reference.
+//	Return NULL if no memory.
+struct recbuf *recbuf_alloc(int size)
+{
+	struct recbuf *rec;
+
+	rec = NULL;
+	if (size >= RECBUF_POOLMIN && size <= RECBUF_POOLSIZE) {
+		pthread_mutex_lock(&pool_mutex);
+		if (pool) {
+			rec = pool;
+			pool = rec->next;
+			pool_cnt--;
+		}
+		pthread_mutex_unlock(&pool_mutex);
+		if (!rec) size = RECBUF_POOLSIZE;
+	}
+	if (!rec) {
+		rec = (struct recbuf *) malloc(sizeof(struct recbuf) + size);
+		if (!rec) {
+			Log(ERROR, "No memory for record buffer of %d bytes: %m\n", size);
+			return NULL;
+		}
+		rec->size = size;
+		rec->data = (char *)(rec + 1);
+	}
+	rec->refcnt = 1;
+	rec->len = 0;
+	rec->next = NULL;
+	return rec;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Move short record from a big pooled buffer to an exactly sized one.
+//	Only unshared buffers can be shrinked.
+//	Return the buffer to be used further
+struct recbuf *recbuf_shrink(struct recbuf *rec)
+{
+	struct recbuf *nrec;
+
+	if (rec->refcnt != 1 || rec->len >= RECBUF_POOLMIN || rec->size < RECBUF_POOLMIN) return rec;
+	nrec = recbuf_alloc(rec->len);
+	if (!nrec) return rec;
+	memcpy(nrec->data, rec->data, rec->len);
+	nrec->len = rec->len;
+	recbuf_release(rec);
+	return nrec;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Add cnt references to the buffer
+void recbuf_addref(struct recbuf *rec, int cnt)
+{
+	__sync_fetch_and_add(&rec->refcnt, cnt);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Drop one reference. The last one returns the buffer to the pool or frees it.
+void recbuf_release(struct recbuf *rec)
+{
+	if (!rec || __sync_sub_and_fetch(&rec->refcnt, 1) > 0) return;
+	if (rec->size == RECBUF_POOLSIZE) {
+		pthread_mutex_lock(&pool_mutex);
+		if (pool_cnt < RECBUF_POOLMAX) {
+			rec->next = pool;
+			pool = rec;
+			pool_cnt++;
+			rec = NULL;
+		}
+		pthread_mutex_unlock(&pool_mutex);
+	}
+	if (rec) free(rec);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Queue for up to nslots records and maxbytes of memory
+recqueue::recqueue(int nslots, long long maxbytes)
+{
+	slots = nslots;
+	ring = (struct recbuf **) malloc(slots * sizeof(struct recbuf *));
+	if (!ring) {
+		Log(FATAL, "No memory for record queue of %d slots: %m\n", nslots);
+		slots = 0;
+	}
+	head = 0;
+	count = 0;
+	bytes = 0;
+	limit = maxbytes;
+	closed = 0;
+	max_count = 0;
+	max_bytes = 0;
+	blocked_us = 0;
+	nput = 0;
+	nbytes = 0;
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond_put, NULL);
+	pthread_cond_init(&cond_get, NULL);
+}
+
+recqueue::~recqueue(void)
+{
+	Close();
+	Release(count);
+	if (ring) free(ring);
+	pthread_cond_destroy(&cond_get);
+	pthread_cond_destroy(&cond_put);
+	pthread_mutex_destroy(&mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Wake up all waiting threads. Put() does not block any more.
+void recqueue::Close(void)
+{
+	pthread_mutex_lock(&mutex);
+	closed = 1;
+	pthread_cond_broadcast(&cond_put);
+	pthread_cond_broadcast(&cond_get);
+	pthread_mutex_unlock(&mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Check if a record of size bytes would not fit into the queue.
+//	An empty queue accepts any record.
+int recqueue::IsFull(int size)
+{
+	return count > 0 && (count >= slots || bytes + size > limit);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Get up to num records starting from position from (counted from the head). Records stay in the queue.
+//	Return number of records got
+int recqueue::Peek(int from, struct recbuf **recs, int num)
+{
+	int i;
+
+	pthread_mutex_lock(&mutex);
+	for (i = 0; i < num && from + i < count; i++) recs[i] = ring[(head + from + i) % slots];
+	pthread_mutex_unlock(&mutex);
+	return i;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Add record to the tail. The queue takes over the reference of the caller.
+//	wait - block while the queue is full, otherwise return immediately
+//	Return 0 if the record is queued, 1 if the queue is full (the reference stays with the caller),
+//	negative if the queue is closed.
+int recqueue::Put(struct recbuf *rec, int wait)
+{
+	struct timeval t0, t1;
+
+	pthread_mutex_lock(&mutex);
+	if (IsFull(rec->size)) {
+		if (!wait) {
+			pthread_mutex_unlock(&mutex);
+			return 1;
+		}
+		gettimeofday(&t0, NULL);
+		while (!closed && IsFull(rec->size)) pthread_cond_wait(&cond_put, &mutex);
+		gettimeofday(&t1, NULL);
+		blocked_us += (t1.tv_sec - t0.tv_sec) * 1000000LL + t1.tv_usec - t0.tv_usec;
+	}
+	if (closed || !slots) {
+		pthread_mutex_unlock(&mutex);
+		return -1;
+	}
+	ring[(head + count) % slots] = rec;
+	count++;
+	bytes += rec->size;
+	nput++;
+	nbytes += rec->len;
+	if (count > max_count) max_count = count;
+	if (bytes > max_bytes) max_bytes = bytes;
+	pthread_cond_signal(&cond_get);
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Remove num records from the head and drop their references
+void recqueue::Release(int num)
+{
+	struct recbuf *rec;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		pthread_mutex_lock(&mutex);
+		if (!count) {
+			pthread_mutex_unlock(&mutex);
+			break;
+		}
+		rec = ring[head];
+		head = (head + 1) % slots;
+		count--;
+		bytes -= rec->size;
+		pthread_cond_signal(&cond_put);
+		pthread_mutex_unlock(&mutex);
+		recbuf_release(rec);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Put rec at position pos (counted from the head) instead of the record there, which is released.
+//	The queue takes over the reference of the caller. Only the consumer may call this.
+void recqueue::Replace(int pos, struct recbuf *rec)
+{
+	struct recbuf *old;
+
+	pthread_mutex_lock(&mutex);
+	if (pos < 0 || pos >= count) {
+		pthread_mutex_unlock(&mutex);
+		recbuf_release(rec);
+		return;
+	}
+	old = ring[(head + pos) % slots];
+	ring[(head + pos) % slots] = rec;
+	bytes += rec->size - old->size;
+	if (rec->size < old->size) pthread_cond_signal(&cond_put);
+	pthread_mutex_unlock(&mutex);
+	recbuf_release(old);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Wait until there are more than num records in the queue, the queue is closed or ms milliseconds passed.
+//	Return the number of records in the queue
+int recqueue::Wait(int num, int ms)
+{
+	struct timespec ts;
+	int irc;
+
+	pthread_mutex_lock(&mutex);
+	if (count <= num && !closed) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += ms / 1000;
+		ts.tv_nsec += (ms % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		for (irc = 0; count <= num && !closed && irc != ETIMEDOUT; ) irc = pthread_cond_timedwait(&cond_get, &mutex, &ts);
+	}
+	irc = count;
+	pthread_mutex_unlock(&mutex);
+	return irc;
+}
@@ -0,0 +1,68 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Record buffers and bounded record queues.
+*/
+#ifndef RECQUEUE_H
+#define RECQUEUE_H
+
+#include <pthread.h>
+
+#define RECBUF_POOLSIZE	0x100000	// size of pooled buffers, enough for BSIZE + header
+#define RECBUF_POOLMIN	0x10000		// smaller buffers are allocated exactly and not pooled
+#define RECBUF_POOLMAX	64		// maximum number of free buffers kept in the pool
+
+//	One record: header + payload. Shared by all queues it is put in.
+struct recbuf {
+	int refcnt;		// number of holders, the buffer goes back to the pool when it drops to zero
+	int size;		// allocated size of data
+	int len;		// used length
+	struct recbuf *next;	// link in the pool
+	char *data;		// the record
+};
+
+struct recbuf *recbuf_alloc(int size);
+struct recbuf *recbuf_shrink(struct recbuf *rec);
+void recbuf_addref(struct recbuf *rec, int cnt);
+void recbuf_release(struct recbuf *rec);
+
+//	Bounded FIFO of record pointers with limits on record count and memory.
+//	One producer puts records at the tail, one consumer peeks and releases them from the head.
+class recqueue {
+private:
+	struct recbuf **ring;
+	int slots;		// ring size
+	int head;		// the oldest record
+	int count;		// records in the queue
+	long long bytes;	// memory held by the queue
+	long long limit;	// memory limit
+	int closed;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond_put;	// space freed
+	pthread_cond_t cond_get;	// record added
+	//	statistics
+	int max_count;
+	long long max_bytes;
+	long long blocked_us;	// time the producer spent waiting for space
+	long long nput;
+	long long nbytes;
+public:
+	recqueue(int nslots, long long maxbytes);
+	~recqueue(void);
+	void Close(void);
+	inline int GetCount(void) { return count; };
+	inline long long GetBytes(void) { return bytes; };
+	inline long long GetLimit(void) { return limit; };
+	inline long long GetBlockedTime(void) { return blocked_us; };
+	inline int GetMaxCount(void) { return max_count; };
+	inline long long GetMaxBytes(void) { return max_bytes; };
+	inline long long GetNPut(void) { return nput; };
+	inline long long GetNBytes(void) { return nbytes; };
+	int IsFull(int size);
+	int Peek(int from, struct recbuf **recs, int num);
+	int Put(struct recbuf *rec, int wait);
+	void Release(int num);
+	void Replace(int pos, struct recbuf *rec);
+	int Wait(int num, int ms);
+};
+
+#endif /* RECQUEUE_H */
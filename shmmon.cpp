@@ -0,0 +1,132 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Simple online monitor of the shared memory record ring.
+	Shows how a local consumer reads the live stream without files and copies.
+*/
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "recformat.h"
+#include "shmring.h"
+
+#define MAXSERIAL	256
+
+volatile sig_atomic_t StopFlag;
+
+void catch_stop(int sig)
+{
+	StopFlag = 1;
+	signal(sig, catch_stop);
+}
+
+void Help(void)
+{
+	printf("\t\tMonitor of UWFD64 data published to shared memory (uwfdtool Y ... shm:/name)\n");
+	printf("Usage shmmon [options]\n");
+	printf("Options:\n");
+	printf("-h - print this message and exit;\n");
+	printf("-n name - shared memory name, default /uwfd;\n");
+	printf("-t period - print statistics every period seconds, default 1.\n");
+}
+
+int main(int argc, char **argv)
+{
+	shmring *ring;
+	const char *name;
+	const void *rec;
+	struct rec_info_struct info;
+	long long bytes, recs;
+	int modrecs[MAXSERIAL];
+	int nbegin, nend, npseoc, nevent;
+	int period;
+	time_t t0;
+	int i, c, len, irc;
+
+	name = "/uwfd";
+	period = 1;
+	for (;;) {
+		c = getopt(argc, argv, "hn:t:");
+		if (c == -1) break;
+		switch (c) {
+		case 'n':
+			name = optarg;
+			break;
+		case 't':
+			period = strtol(optarg, NULL, 0);
+			if (period <= 0) period = 1;
+			break;
+		case 'h':
+		default:
+			Help();
+			return 0;
+		}
+	}
+
+	LogInit(NULL);
+	StopFlag = 0;
+	signal(SIGINT, catch_stop);
+	signal(SIGTERM, catch_stop);
+	ring = new shmring();
+	bytes = recs = 0;
+	nbegin = nend = npseoc = nevent = 0;
+	memset(modrecs, 0, sizeof(modrecs));
+	t0 = time(NULL);
+
+	while (!StopFlag) {
+		irc = ring->Next(&rec, &len);
+		if (irc == SHMRING_DETACHED) {
+			if (ring->Attach(name)) {
+				sleep(1);
+			} else {
+				printf("Attached to %s: %Ld MBytes\n", name, ring->GetSize() / 0x100000);
+			}
+			continue;
+		}
+		if (irc == 1 && rec_parse(rec, len, &info) > 0) {
+			switch (info.type) {
+			case REC_BEGIN:
+				nbegin++;
+				break;
+			case REC_END:
+				nend++;
+				break;
+			case REC_PSEOC:
+				npseoc++;
+				break;
+			case REC_EVENT:
+				nevent++;
+				break;
+			default:
+				i = info.type - REC_WFDDATA;
+				if (i >= 0 && i < MAXSERIAL) modrecs[i]++;
+				break;
+			}
+			if (!ring->Done()) {	// the record was valid while we looked at it
+				bytes += len;
+				recs++;
+			}
+		} else if (irc == 0) {
+			usleep(1000);
+		}
+		if (time(NULL) - t0 >= period) {
+			printf("%s: %Ld records %.3f MBytes/s, begin/end/pseoc/event %d/%d/%d/%d, skipped %Ld records in %d overruns%s\n",
+				name, recs, bytes / (1048576.0 * (time(NULL) - t0)), nbegin, nend, npseoc, nevent,
+				ring->GetSkipped(), ring->GetOverruns(), (ring->IsActive()) ? "" : ", no producer");
+			printf("Records by module:");
+			for (i = 0; i < MAXSERIAL; i++) if (modrecs[i]) printf(" %d:%d", i, modrecs[i]);
+			printf("\n");
+			fflush(stdout);
+			bytes = recs = 0;
+			nbegin = nend = npseoc = nevent = 0;
+			memset(modrecs, 0, sizeof(modrecs));
+			t0 = time(NULL);
+		}
+	}
+	delete ring;
+	return 0;
+}
@@ -0,0 +1,278 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Shared memory record ring for local online consumers.
+
+	One producer, any number of consumers, no locks. The producer never waits:
+	before overwriting old data it moves tail forward, then writes the entry and
+	then moves wpos. A consumer reads the entry in place (no copy) and calls Done()
+	to check that tail has not passed the entry while it was being used. A consumer
+	which fell behind the tail has lost data: it counts the skipped records and
+	continues from the newest position.
+
+	The segment survives the producer. The next run reuses it if the size is the same,
+	so attached monitors just see the next REC_BEGIN.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "log.h"
+#include "shmring.h"
+
+#define LOAD(x)		__atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+shmring::shmring(void)
+{
+	name[0] = '\0';
+	fd = -1;
+	hdr = NULL;
+	data = NULL;
+	mask = 0;
+	writer = 0;
+	rpos = 0;
+	cur = 0;
+	lastseq = -1;
+	skipped = 0;
+	overruns = 0;
+}
+
+shmring::~shmring(void)
+{
+	Detach();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Attach to an existing ring as a consumer. Reading starts from the newest data.
+//	Return 0 on success, negative on error
+int shmring::Attach(const char *sname)
+{
+	Detach();
+	strncpy(name, sname, sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) return -1;
+	if (Map(0, 0)) return -2;
+	if (hdr->magic != SHMRING_MAGIC || hdr->state == SHMRING_GONE) {
+		Detach();
+		return -3;
+	}
+	rpos = LOAD(hdr->wpos);
+	lastseq = LOAD(hdr->seq) - 1;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Create the ring of mbytes (rounded up to a power of 2) as the producer.
+//	An existing ring of the same size is reused, otherwise it is marked gone and replaced.
+//	Return 0 on success, negative on error
+int shmring::Create(const char *sname, int mbytes)
+{
+	struct shmring_header *old;
+	struct stat st;
+	long long size;
+
+	Detach();
+	strncpy(name, sname, sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+	for (size = 0x100000; size < (long long) mbytes * 0x100000; size <<= 1);
+
+	fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		Log(ERROR, "Can not open shared memory %s: %m\n", name);
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		Log(ERROR, "Can not stat shared memory %s: %m\n", name);
+		Detach();
+		return -1;
+	}
+	if (st.st_size == SHMRING_HDRSIZE + size) {
+		if (Map(1, size)) return -2;
+		if (hdr->magic == SHMRING_MAGIC && hdr->size == size && hdr->state != SHMRING_GONE) {
+			STORE(hdr->state, SHMRING_ACTIVE);
+			writer = 1;
+			return 0;
+		}
+		munmap(hdr, SHMRING_HDRSIZE + mask + 1);
+		hdr = NULL;
+	}
+	if (st.st_size >= (off_t) sizeof(struct shmring_header)) {	// tell the consumers of the old ring to go away
+		old = (struct shmring_header *) mmap(NULL, sizeof(struct shmring_header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (old != MAP_FAILED) {
+			STORE(old->state, SHMRING_GONE);
+			munmap(old, sizeof(struct shmring_header));
+		}
+	}
+	close(fd);
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		Log(ERROR, "Can not create shared memory %s: %m\n", name);
+		return -1;
+	}
+	if (ftruncate(fd, SHMRING_HDRSIZE + size)) {
+		Log(ERROR, "Can not set shared memory %s size to %Ld: %m\n", name, size);
+		Detach();
+		return -1;
+	}
+	if (Map(1, size)) return -2;
+	hdr->size = size;
+	hdr->wpos = 0;
+	hdr->tail = -size;
+	hdr->seq = 0;
+	hdr->state = SHMRING_ACTIVE;
+	STORE(hdr->magic, SHMRING_MAGIC);
+	writer = 1;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Unmap the ring. The producer marks it idle, the segment itself stays.
+void shmring::Detach(void)
+{
+	if (hdr) {
+		if (writer) STORE(hdr->state, SHMRING_IDLE);
+		munmap(hdr, SHMRING_HDRSIZE + mask + 1);
+	}
+	if (fd >= 0) close(fd);
+	fd = -1;
+	hdr = NULL;
+	data = NULL;
+	mask = 0;
+	writer = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Check that the record given by the last Next() was not overwritten while it was used.
+//	Return 0 if the record was valid, SHMRING_OVERRUN if it must be discarded
+int shmring::Done(void)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);	// all reads of the record are done before tail is checked
+	if (LOAD(hdr->tail) <= cur) return 0;
+	overruns++;
+	skipped++;
+	return SHMRING_OVERRUN;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Return 1 if the producer is writing to the ring
+int shmring::IsActive(void)
+{
+	return hdr && LOAD(hdr->state) == SHMRING_ACTIVE;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Map the segment opened as fd.
+//	wr - map for writing, size - data area size, 0 - take it from the header
+//	Return 0 on success, negative on error
+int shmring::Map(int wr, long long size)
+{
+	struct shmring_header *h;
+
+	if (size <= 0) {
+		h = (struct shmring_header *) mmap(NULL, SHMRING_HDRSIZE, PROT_READ, MAP_SHARED, fd, 0);
+		if (h == MAP_FAILED) {
+			Log(ERROR, "Can not map shared memory %s: %m\n", name);
+			Detach();
+			return -1;
+		}
+		size = h->size;
+		munmap(h, SHMRING_HDRSIZE);
+	}
+	if (size <= 0 || (size & (size - 1))) {
+		Log(ERROR, "Shared memory %s has wrong size %Ld\n", name, size);
+		Detach();
+		return -2;
+	}
+	h = (struct shmring_header *) mmap(NULL, SHMRING_HDRSIZE + size, (wr) ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (h == MAP_FAILED) {
+		Log(ERROR, "Can not map shared memory %s: %m\n", name);
+		Detach();
+		return -1;
+	}
+	hdr = h;
+	data = (char *) h + SHMRING_HDRSIZE;
+	mask = size - 1;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Get the next record in place. The pointer is valid until Done() confirms it.
+//	Return 1 if a record is got, 0 if there is nothing new,
+//	SHMRING_OVERRUN if the consumer was overrun (data is skipped, just call again),
+//	SHMRING_DETACHED if the ring is gone (attach again).
+int shmring::Next(const void **rec, int *len)
+{
+	struct shmring_entry *e;
+	long long w, seq;
+	int elen;
+
+	if (!hdr || LOAD(hdr->state) == SHMRING_GONE) return SHMRING_DETACHED;
+	for (;;) {
+		w = LOAD(hdr->wpos);
+		if (rpos >= w) return 0;
+		if (rpos < LOAD(hdr->tail)) goto overrun;
+		e = (struct shmring_entry *)(data + (rpos & mask));
+		elen = e->len;
+		if (elen == SHMRING_WRAP) {
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (rpos < LOAD(hdr->tail)) goto overrun;
+			rpos += mask + 1 - (rpos & mask);
+			continue;
+		}
+		cur = rpos;
+		*rec = e + 1;
+		*len = e->reclen;
+		seq = e->seq;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (rpos < LOAD(hdr->tail) || elen < (int) sizeof(struct shmring_entry) || (elen & 7)) goto overrun;
+		if (seq > lastseq + 1) skipped += seq - lastseq - 1;
+		lastseq = seq;
+		rpos += elen;
+		return 1;
+	}
+overrun:
+	overruns++;
+	w = LOAD(hdr->seq);
+	skipped += w - lastseq - 1;	// approximately, the producer may be writing
+	lastseq = w - 1;
+	rpos = LOAD(hdr->wpos);
+	return SHMRING_OVERRUN;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Append the record. Never waits, the oldest data is overwritten.
+//	Return 0 on success, negative if the record is too big for the ring
+int shmring::Write(const void *rec, int len)
+{
+	struct shmring_entry *e;
+	long long pos, off, need, npos;
+
+	if (!hdr || !writer) return -1;
+	need = (sizeof(struct shmring_entry) + len + 7) & ~7LL;
+	if (need > (mask + 1) / 4) return -2;
+	pos = hdr->wpos;
+	off = pos & mask;
+	npos = pos + need;
+	if (off + need > mask + 1) npos += mask + 1 - off;	// does not fit at the end - skip to the beginning
+
+	STORE(hdr->tail, npos - (mask + 1));
+	__atomic_thread_fence(__ATOMIC_RELEASE);	// consumers see the new tail before any overwritten data
+	if (npos - pos > need) {
+		((struct shmring_entry *)(data + off))->len = SHMRING_WRAP;
+		off = 0;
+	}
+	e = (struct shmring_entry *)(data + off);
+	e->len = need;
+	e->reclen = len;
+	e->seq = hdr->seq;
+	memcpy(e + 1, rec, len);
+	STORE(hdr->seq, hdr->seq + 1);
+	STORE(hdr->wpos, npos);
+	return 0;
+}
@@ -0,0 +1,74 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Shared memory record ring for local online consumers.
+*/
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#ifndef MAX_PATH_LEN
+#define MAX_PATH_LEN	1024
+#endif
+
+#define SHMRING_MAGIC	0x55574653	// "UWFS"
+#define SHMRING_HDRSIZE	4096		// the data area starts at this offset
+#define SHMRING_WRAP	-1		// entry len: continue from the ring beginning
+
+//	Ring states
+enum SHMRING_STATE {
+	SHMRING_IDLE = 0,	// no producer
+	SHMRING_ACTIVE = 1,	// producer is writing
+	SHMRING_GONE = 2	// the segment is replaced, consumers must attach again
+};
+
+//	Consumer return codes
+#define SHMRING_OVERRUN	-1	// the consumer was too slow, records were skipped
+#define SHMRING_DETACHED -2	// the ring is gone
+
+//	At the beginning of the segment. Positions are monotonic byte counters, offset in the data area is pos & (size - 1).
+struct shmring_header {
+	int magic;
+	int state;		// SHMRING_STATE
+	long long size;		// data area size, power of 2
+	long long wpos;		// end of the written entries
+	long long tail;		// data before this position can be overwritten at any moment
+	long long seq;		// number of records written
+};
+
+//	Precedes every record in the data area. Entries are 8 byte aligned and never wrap.
+struct shmring_entry {
+	int len;		// bytes including this header, or SHMRING_WRAP
+	int reclen;		// record length
+	long long seq;		// record number
+};
+
+class shmring {
+private:
+	char name[MAX_PATH_LEN];
+	int fd;
+	struct shmring_header *hdr;
+	char *data;
+	long long mask;
+	int writer;
+	//	consumer state
+	long long rpos;		// next entry to read
+	long long cur;		// entry given by the last Next()
+	long long lastseq;	// its record number
+	long long skipped;	// records lost by overruns
+	int overruns;
+	int Map(int wr, long long size);
+public:
+	shmring(void);
+	~shmring(void);
+	int Attach(const char *sname);
+	int Create(const char *sname, int mbytes);
+	void Detach(void);
+	int Done(void);
+	inline long long GetSkipped(void) { return skipped; };
+	inline int GetOverruns(void) { return overruns; };
+	inline long long GetSize(void) { return (hdr) ? hdr->size : 0; };
+	int IsActive(void);
+	int Next(const void **rec, int *len);
+	int Write(const void *rec, int len);
+};
+
+#endif /* SHMRING_H */
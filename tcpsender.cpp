@@ -0,0 +1,376 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Asynchronous TCP data sender.
+
+	The readout loop puts records into the sink queue and continues, the sink thread
+	writes them to the socket in batches with sendmsg(). What happens when the queue
+	is full is decided by the sink policy (see datasink.cpp).
+
+	There are no application level acknowledgements in the data stream, so a record
+	is considered delivered when the peer TCP has acknowledged all its bytes: the number
+	of unacknowledged bytes is taken with SIOCOUTQ. Until then the record stays in the
+	queue and is sent again from its beginning after reconnection.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+#include "log.h"
+#include "tcpsender.h"
+
+//	zero copy appeared in Linux 4.14, older headers may not have it
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY	60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY	0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY	5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED	1
+#endif
+
+#define TCPSENDER_CONNECT_TIMEOUT	5000	// ms
+
+tcpsender::tcpsender(const char *hname, struct datasink_config *conf, struct tcpsender_config *sconf) : datasink(hname, conf)
+{
+	if (sconf) {
+		memcpy(&SConf, sconf, sizeof(SConf));
+	} else {
+		memset(&SConf, 0, sizeof(SConf));
+	}
+	if (SConf.ReconnectTime <= 0) SConf.ReconnectTime = 2;
+	host[0] = '\0';
+	port = 0;
+	memset(&addr, 0, sizeof(addr));
+	fd = -1;
+	zc_mark = (unsigned int *) malloc(DATASINK_SLOTS * sizeof(unsigned int));
+	if (!zc_mark && SConf.ZeroCopy) {
+		Log(WARN, "%s: no memory for zero copy tracking, normal send is used\n", hname);
+		SConf.ZeroCopy = 0;
+	}
+	nsent = 0;
+	offset = 0;
+	written = 0;
+	acked = 0;
+	zerocopy = 0;
+	zc_calls = 0;
+	zc_done = 0;
+	nreleased = 0;
+	sent_bytes = 0;
+	sent_recs = 0;
+	resent_recs = 0;
+	reconnects = 0;
+	zc_copied = 0;
+}
+
+tcpsender::~tcpsender(void)
+{
+	Close();
+	if (zc_mark) free(zc_mark);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Release records at the head of the queue, which are completely acknowledged by the peer
+//	and not used by zero copy sends any more.
+void tcpsender::Acknowledge(void)
+{
+	struct recbuf *recs[TCPSENDER_IOV];
+	long long done;
+	int outq;
+	int i, n;
+
+	if (!nsent) return;
+	if (ioctl(fd, SIOCOUTQ, &outq)) return;
+	done = written - outq;
+	n = queue->Peek(0, recs, (nsent < TCPSENDER_IOV) ? nsent : TCPSENDER_IOV);
+	for (i = 0; i < n; i++) {
+		if (acked + recs[i]->len > done) break;
+		if (zerocopy && (int)(zc_done - zc_mark[(nreleased + i) % DATASINK_SLOTS]) < 0) break;
+		acked += recs[i]->len;
+	}
+	queue->Release(i);
+	nsent -= i;
+	nreleased += i;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Stop the sender thread and close the connection
+void tcpsender::Close(void)
+{
+	datasink::Close();
+	nsent = 0;
+	offset = 0;
+	Disconnect();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Create the socket and connect it to addr. Wait no more than TCPSENDER_CONNECT_TIMEOUT.
+//	Return 0 on success, negative on error
+int tcpsender::Connect(void)
+{
+	struct pollfd pfd;
+	socklen_t len;
+	int irc, err;
+	int val;
+
+	fd = socket(PF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		Log(ERROR, "Can not create socket %m\n");
+		return -1;
+	}
+	if (SConf.SendBuffer > 0) {
+		val = SConf.SendBuffer * 1024;
+		if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val)))
+			Log(WARN, "Can not set send buffer of %d kBytes: %m\n", SConf.SendBuffer);
+	}
+	zerocopy = 0;
+	if (SConf.ZeroCopy) {
+		val = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val))) {
+			Log(WARN, "Zero copy is not supported (%m), normal send is used\n");
+			SConf.ZeroCopy = 0;
+		} else {
+			zerocopy = 1;
+		}
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	irc = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	err = (irc) ? errno : 0;
+	if (err == EINPROGRESS) {
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		irc = poll(&pfd, 1, TCPSENDER_CONNECT_TIMEOUT);
+		if (irc == 0) {
+			err = ETIMEDOUT;
+		} else if (irc < 0) {
+			err = errno;
+		} else {
+			len = sizeof(err);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len)) err = errno;
+		}
+	}
+	if (err) {
+		errno = err;
+		Log(ERROR, "Connection to %s:%d failed %m\n", host, port);
+		close(fd);
+		fd = -1;
+		return -2;
+	}
+
+	nsent = 0;
+	offset = 0;
+	written = 0;
+	acked = 0;
+	zc_calls = 0;
+	zc_done = 0;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Close the connection. All records in the queue will be sent again after reconnection.
+void tcpsender::Disconnect(void)
+{
+	if (fd < 0) return;
+	close(fd);
+	fd = -1;
+	resent_recs += nsent + ((offset) ? 1 : 0);
+	nsent = 0;
+	offset = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Resolve host:port given as the sink name, connect and start the sender thread.
+//	must_connect - fail if the first connection attempt fails, otherwise keep trying in the sender thread
+//	Return 0 on success, negative on error
+int tcpsender::Open(int must_connect)
+{
+	struct hostent *hst;
+	const char *ptr;
+	int len;
+
+	Close();
+	ptr = strchr(name, ':');
+	if (!ptr) {
+		Log(ERROR, "%s is not host:port\n", name);
+		return -1;
+	}
+	len = ptr - name;
+	if (len >= (int) sizeof(host)) len = sizeof(host) - 1;
+	memcpy(host, name, len);
+	host[len] = '\0';
+	port = strtol(ptr + 1, NULL, 0);
+
+	hst = gethostbyname(host);
+	if (!hst) {
+		Log(ERROR, "host %s not found.\n", host);
+		return -1;
+	}
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr = *(struct in_addr *) hst->h_addr;
+
+	if (Connect() && must_connect) return -2;
+
+	if (Start()) {
+		Disconnect();
+		return -3;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Print sender and queue statistics
+void tcpsender::PrintStat(void)
+{
+	printf("TCP %s:%d: %Ld bytes in %Ld records sent, %d reconnects, %Ld records resent.\n",
+		host, port, sent_bytes, sent_recs, reconnects, resent_recs);
+	if (zerocopy || zc_copied) printf("Zero copy: %Ld sends fell back to copying.\n", zc_copied);
+	datasink::PrintStat();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Collect zero copy completion notifications from the socket error queue
+void tcpsender::ReadCompletions(void)
+{
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *ee;
+	char control[128];
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+				(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+			ee = (struct sock_extended_err *) CMSG_DATA(cm);
+			if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+			// TCP completes sends in order, [ee_info, ee_data] is the range of send numbers
+			if ((int)(ee->ee_data + 1 - zc_done) > 0) zc_done = ee->ee_data + 1;
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) zc_copied += ee->ee_data - ee->ee_info + 1;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Write as many queued records as the socket accepts with one sendmsg()
+//	Return 0 on success (including nothing sent), negative on connection error
+int tcpsender::Send(void)
+{
+	struct recbuf *recs[TCPSENDER_IOV];
+	struct iovec iov[TCPSENDER_IOV];
+	struct msghdr msg;
+	long long total;
+	int flags;
+	int i, n;
+	ssize_t irc;
+
+	n = queue->Peek(nsent, recs, TCPSENDER_IOV);
+	if (!n) return 0;
+	// a partially sent record must stay as it is
+	if (Conf.Compress || Conf.Features.Mode) ConvertQueued(recs + (offset > 0), nsent + (offset > 0), n - (offset > 0));
+	total = 0;
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = recs[i]->data;
+		iov[i].iov_len = recs[i]->len;
+		if (!i) {
+			iov[i].iov_base = recs[i]->data + offset;
+			iov[i].iov_len -= offset;
+		}
+		total += iov[i].iov_len;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+	flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+	if (zerocopy && total >= TCPSENDER_ZCMIN) flags |= MSG_ZEROCOPY;
+
+	irc = sendmsg(fd, &msg, flags);
+	if (irc < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {	// out of pinned memory - just copy
+		flags &= ~MSG_ZEROCOPY;
+		irc = sendmsg(fd, &msg, flags);
+	}
+	if (irc < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+		Log(ERROR, "TCP %s:%d send error %m\n", host, port);
+		return -1;
+	}
+	if (flags & MSG_ZEROCOPY) zc_calls++;
+	written += irc;
+	sent_bytes += irc;
+
+	for (i = 0; i < n && irc > 0; i++) {
+		if (irc < (ssize_t) iov[i].iov_len) {
+			offset += irc;
+			break;
+		}
+		irc -= iov[i].iov_len;
+		if (zc_mark) zc_mark[(nreleased + nsent) % DATASINK_SLOTS] = zc_calls;
+		offset = 0;
+		nsent++;
+		sent_recs++;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	The sender thread body
+void tcpsender::Run(void)
+{
+	struct pollfd pfd;
+	int i, cnt;
+
+	for (;;) {
+		if (IsDone()) break;
+		if (fd < 0) {
+			if (Connect()) {
+				for (i = 0; i < SConf.ReconnectTime * 10 && !IsDone(); i++) {
+					Unspill();
+					usleep(100000);
+				}
+				continue;
+			}
+			reconnects++;
+			Log(INFO, "Reconnected to %s:%d, %d records to be sent again\n", host, port, queue->GetCount());
+		}
+		if (zerocopy) ReadCompletions();
+		Acknowledge();
+		Unspill();
+		cnt = queue->GetCount();
+		if (nsent >= cnt) {		// everything is sent, wait for new records or acknowledgements
+			if (stop) {
+				usleep(10000);
+			} else {
+				queue->Wait(nsent, 10);
+			}
+			continue;
+		}
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 100) < 0 && errno != EINTR) Log(ERROR, "TCP %s:%d poll error %m\n", host, port);
+		if (pfd.revents & POLLHUP) {
+			Log(ERROR, "TCP %s:%d connection closed by peer\n", host, port);
+			Disconnect();
+			continue;
+		}
+		if (!(pfd.revents & POLLOUT)) continue;
+		if (Send()) Disconnect();
+	}
+}
@@ -0,0 +1,64 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Asynchronous TCP data sender.
+*/
+#ifndef TCPSENDER_H
+#define TCPSENDER_H
+
+#include <netinet/in.h>
+#include "datasink.h"
+
+#define TCPSENDER_IOV		64	// records per one sendmsg()
+#define TCPSENDER_ZCMIN		0x10000	// do not use zero copy for smaller sends
+
+//	Socket parameters, normally from Sink section of the configuration
+struct tcpsender_config {
+	int SendBuffer;		// kBytes, socket send buffer, 0 - system default
+	int ZeroCopy;		// 1 - send big records with MSG_ZEROCOPY
+	int ReconnectTime;	// s, period of reconnection attempts
+};
+
+//	TCP sink. Records stay in the queue until the peer acknowledges them.
+class tcpsender : public datasink {
+private:
+	struct tcpsender_config SConf;
+	char host[MAX_PATH_LEN];
+	int port;
+	struct sockaddr_in addr;
+	int fd;
+	//	current connection state, used by the sender thread only
+	int nsent;		// records at the queue head completely written to the socket
+	int offset;		// bytes of the next record already written
+	long long written;	// bytes written to the connection
+	long long acked;	// bytes of the released records
+	int zerocopy;		// MSG_ZEROCOPY is enabled on the socket
+	unsigned int zc_calls;	// zero copy sends done
+	unsigned int zc_done;	// zero copy sends completed by the kernel
+	unsigned int *zc_mark;	// per record: zc_calls after the record was sent
+	long long nreleased;	// records released from the queue
+	//	statistics
+	long long sent_bytes;
+	long long sent_recs;
+	long long resent_recs;
+	int reconnects;
+	long long zc_copied;
+
+	void Acknowledge(void);
+	int Connect(void);
+	void Disconnect(void);
+	void ReadCompletions(void);
+	void Run(void);
+	int Send(void);
+public:
+	tcpsender(const char *hname, struct datasink_config *conf, struct tcpsender_config *sconf);
+	~tcpsender(void);
+	void Close(void);
+	inline int IsConnected(void) { return fd >= 0; };
+	inline const char *GetHost(void) { return host; };
+	inline int GetPort(void) { return port; };
+	inline long long GetSentBytes(void) { return sent_bytes; };
+	int Open(int must_connect);
+	void PrintStat(void);
+};
+
+#endif /* TCPSENDER_H */
@@ -0,0 +1,525 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Emulation of the master trigger on recorded data for threshold tuning.
+	Master trigger blocks of a module are put together by the token and go through the model
+	of the module trigger sum (trigsum.h) with every set of parameters given as configuration
+	files, the threads share the sets. Each set counts the events over its MasterTrigThreshold
+	and over the thresholds scanned, the history blocks recorded are compared with the sums
+	emulated with the parameters the data was taken with. Only events recorded are seen, so the
+	counts for thresholds below the one used in the run are lower limits.
+*/
+
+#include <fcntl.h>
+#include <libconfig.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "blkdecode.h"
+#include "log.h"
+#include "recformat.h"
+#include "shmring.h"
+#include "trigsum.h"
+#include "wfcodec.h"
+
+#define MAXTHREADS	64
+#define MAXSETS		64
+#define MAXMODULES	64
+#define MAXSERIAL	0x10000		// REC_WFDDATA + serial
+#define CHUNK		256		// events emulated at once
+#define EVTWORDS	((TS_NCHAN + TS_NXIL) * TS_MAXLEN)	// samples and history of an event
+
+//	A set of parameters: a configuration file
+struct emu_set {
+	const char *fname;
+	config_t cnf;
+	trigsum *sum[MAXMODULES];
+	int threshold[MAXMODULES];	// MasterTrigThreshold
+	int offset[MAXMODULES];		// history sample i is sum sample i + offset
+};
+
+//	A module found in the data
+struct emu_module {
+	int serial;
+	int linkdelay;
+	blkdecoder *dec;
+	struct trigsum_event ev;	// being put together, token -1 if none
+	long long first;	// readout time of the first and the last event, ns
+	long long last;
+	long long events;
+	long long badlen;	// blocks of other length than the first one or too long
+};
+
+struct emu_thread {
+	pthread_t thread;
+	int num;
+};
+
+volatile sig_atomic_t StopFlag;
+struct emu_set Sets[MAXSETS];
+int NSets;
+struct emu_module Modules[MAXMODULES];
+int NModules;
+short ModIndex[MAXSERIAL];		// serial -> Modules[] + 1, 0 if not seen
+struct trigsum_event Chunk[CHUNK];
+int ChunkMod[CHUNK];
+int NChunk;
+int Thr[TS_MAXTHR];
+int NThr;
+int NThreads;
+int LinkDelay;				// -1 - SumDelay of the first set
+int Offset;				// INT_MIN - TrigWinBegin - SumWinBegin of the first set
+
+void catch_stop(int sig)
+{
+	StopFlag = 1;
+	signal(sig, catch_stop);
+}
+
+void Help(void)
+{
+	printf("\t\tEmulation of the UWFD64 master trigger sum on recorded data\n");
+	printf("Usage trigemu [options] -c run.conf [-c set.conf ...] [file.data ...]\n");
+	printf("Options:\n");
+	printf("-c conf - module configuration with TrigCoef, TrigSumMask, InvertMask, SumDelay, TrigGenMask,\n");
+	printf("\tMasterTrigThreshold, TrigWinBegin and SumWinBegin (Def and DevNNN sections), a set of parameters\n");
+	printf("\tto emulate; up to %d sets, the first one must be what the data was taken with;\n", MAXSETS);
+	printf("-h - print this message and exit;\n");
+	printf("-j num - number of threads, default - number of CPUs;\n");
+	printf("-l clocks - delay of the sums between the Xilinxes, default - SumDelay of the first set;\n");
+	printf("-n name - read the shared memory ring name (uwfdtool Y ... shm:/name) instead of files;\n");
+	printf("-o samples - history sample i is sum sample i + offset, default - TrigWinBegin - SumWinBegin of the first set;\n");
+	printf("-p period - print the counters every period seconds with -n, default 10;\n");
+	printf("-t from:to:step - thresholds to scan, up to %d.\n", TS_MAXTHR);
+	printf("Rates are events per second of the readout time, thresholds below the one of the run give lower limits.\n");
+}
+
+//	Parse from:to:step
+int ParseThresholds(const char *str)
+{
+	char *ptr;
+	int from, to, step;
+
+	from = strtol(str, &ptr, 0);
+	to = from;
+	step = 1;
+	if (*ptr == ':') to = strtol(ptr + 1, &ptr, 0);
+	if (*ptr == ':') step = strtol(ptr + 1, &ptr, 0);
+	if (*ptr || step <= 0 || to < from) return -1;
+	for (NThr = 0; NThr < TS_MAXTHR && from <= to; from += step) Thr[NThr++] = from;
+	return 0;
+}
+
+//	Parameters of the module serial in the set, as uwfd64::ReadConfig() takes them
+void ReadSet(config_t *cnf, int serial, struct trigsum_config *tc, int *winbeg, int *sumbeg)
+{
+	config_setting_t *ptr;
+	char str[1024];
+	char sect[16];
+	int i, j, tmp;
+
+	memset(tc, 0, sizeof(*tc));
+	*winbeg = *sumbeg = 0;
+	for (i = 0; i < 2; i++) {
+		if (i) {
+			sprintf(sect, "Dev%3.3d", serial);
+		} else {
+			strcpy(sect, "Def");
+		}
+		sprintf(str, "%s.TrigGenMask", sect);
+		if (config_lookup_int(cnf, str, &tmp)) tc->TrigGenMask = tmp;
+		sprintf(str, "%s.MasterTrigThreshold", sect);
+		if (config_lookup_int(cnf, str, &tmp)) tc->MasterTrigThreshold = tmp & 0xFFFF;
+		sprintf(str, "%s.TrigWinBegin", sect);
+		if (config_lookup_int(cnf, str, &tmp)) *winbeg = tmp & 0x3FF;
+		sprintf(str, "%s.SumWinBegin", sect);
+		if (config_lookup_int(cnf, str, &tmp)) *sumbeg = tmp & 0x3FF;
+		sprintf(str, "%s.SumDelay", sect);
+		if (config_lookup_int(cnf, str, &tmp)) tc->SumDelay = tmp & 0x1F;
+		sprintf(str, "%s.TrigCoef", sect);
+		ptr = config_lookup(cnf, str);
+		if (ptr) for (j = 0; j < TS_NCHAN; j++) tc->TrigCoef[j] = config_setting_get_float_elem(ptr, j);
+		sprintf(str, "%s.TrigSumMask", sect);
+		ptr = config_lookup(cnf, str);
+		if (ptr) for (j = 0; j < TS_NXIL; j++) tc->TrigSumMask[j] = config_setting_get_int_elem(ptr, j);
+		sprintf(str, "%s.InvertMask", sect);
+		ptr = config_lookup(cnf, str);
+		if (ptr) for (j = 0; j < TS_NXIL; j++) tc->InvertMask[j] = config_setting_get_int_elem(ptr, j);
+	}
+}
+
+//	The module of the serial, created with its sums when first seen
+struct emu_module *GetModule(int serial)
+{
+	struct emu_module *m;
+	struct trigsum_config tc;
+	int i, winbeg, sumbeg;
+
+	if (ModIndex[serial]) return &Modules[ModIndex[serial] - 1];
+	if (NModules >= MAXMODULES) return NULL;
+	m = &Modules[NModules];
+	memset(m, 0, sizeof(*m));
+	m->ev.x = (short *) malloc(EVTWORDS * sizeof(short));
+	m->dec = new blkdecoder();
+	if (!m->ev.x) {
+		printf("No memory for module %d\n", serial);
+		return NULL;
+	}
+	m->ev.hist = m->ev.x + TS_NCHAN * TS_MAXLEN;
+	m->ev.serial = m->serial = serial;
+	m->ev.token = -1;
+	m->first = -1;
+	m->linkdelay = LinkDelay;
+	for (i = 0; i < NSets; i++) {
+		ReadSet(&Sets[i].cnf, serial, &tc, &winbeg, &sumbeg);
+		if (!i && m->linkdelay < 0) m->linkdelay = tc.SumDelay;
+		if (!i) Sets[0].offset[NModules] = (Offset == INT_MIN) ? winbeg - sumbeg : Offset;
+		else Sets[i].offset[NModules] = -TS_MAXLEN;	// the history is of the first set only
+		tc.LinkDelay = m->linkdelay;
+		Sets[i].threshold[NModules] = tc.MasterTrigThreshold;
+		Sets[i].sum[NModules] = new trigsum(&tc, Thr, NThr);
+	}
+	ModIndex[serial] = ++NModules;
+	return m;
+}
+
+//	Emulate the sets of the threads num, num + NThreads, ... over the events of the chunk
+void *EmulateThread(void *arg)
+{
+	struct emu_thread *t;
+	struct emu_set *s;
+	int i, k;
+
+	t = (struct emu_thread *) arg;
+	for (k = t->num; k < NSets; k += NThreads) {
+		s = &Sets[k];
+		for (i = 0; i < NChunk; i++) s->sum[ChunkMod[i]]->Process(&Chunk[i], s->offset[ChunkMod[i]]);
+	}
+	return NULL;
+}
+
+//	Emulate the events put together
+void Emulate(void)
+{
+	struct emu_thread th[MAXTHREADS];
+	int k, n;
+
+	if (!NChunk) return;
+	n = (NThreads < NSets) ? NThreads : NSets;
+	for (k = 0; k < n; k++) th[k].num = k;
+	for (k = 1; k < n; k++) if (pthread_create(&th[k].thread, NULL, EmulateThread, &th[k])) {
+		th[k].thread = 0;
+		EmulateThread(&th[k]);
+	}
+	EmulateThread(&th[0]);
+	for (k = 1; k < n; k++) if (th[k].thread) pthread_join(th[k].thread, NULL);
+	NChunk = 0;
+}
+
+//	The event of the module is complete: channels not read are zero
+void Finish(struct emu_module *m)
+{
+	struct trigsum_event *ev, *e;
+	int i;
+
+	ev = &m->ev;
+	if (ev->token < 0) return;
+	if (ev->chans || ev->hists) {
+		if (NChunk >= CHUNK) Emulate();
+		e = &Chunk[NChunk];
+		ChunkMod[NChunk] = ModIndex[m->serial] - 1;
+		NChunk++;
+		e->serial = ev->serial;
+		e->token = ev->token;
+		e->len = ev->len;
+		e->stride = ev->stride;
+		e->chans = ev->chans;
+		e->hists = ev->hists;
+		e->real = ev->real;
+		for (i = 0; i < TS_NCHAN; i++) if ((ev->chans >> i) & 1) {
+			memcpy(&e->x[i * ev->stride], &ev->x[i * ev->stride], ev->stride * sizeof(short));
+		} else {
+			memset(&e->x[i * ev->stride], 0, ev->stride * sizeof(short));
+		}
+		for (i = 0; i < TS_NXIL; i++) if ((ev->hists >> i) & 1)
+			memcpy(&e->hist[i * ev->stride], &ev->hist[i * ev->stride], ev->stride * sizeof(short));
+		m->events++;
+		if (m->first < 0) m->first = ev->real;
+		m->last = ev->real;
+	}
+	ev->token = -1;
+	ev->chans = 0;
+	ev->hists = 0;
+}
+
+//	Put the blocks of the module data record together
+void Feed(struct emu_module *m, const void *data, int len, long long real)
+{
+	struct blk_view v;
+	struct trigsum_event *ev;
+	short *row;
+	int irc;
+
+	ev = &m->ev;
+	m->dec->Feed(data, len);
+	while ((irc = m->dec->Next(&v)) != BLK_END) {
+		if (irc != BLK_OK) continue;		// a block split between records comes whole with the next one
+		if (v.type != BLK_MASTER && v.type != BLK_HISTORY && v.type != BLK_TRIGINFO) continue;
+		if (v.token != ev->token) {
+			Finish(m);
+			ev->token = v.token;
+			ev->real = real;
+			ev->len = 0;
+		}
+		if (v.type == BLK_TRIGINFO || v.ndata <= 0) continue;
+		if (!ev->len && v.ndata <= TS_MAXLEN) {
+			ev->len = v.ndata;
+			ev->stride = (v.ndata + TS_ALIGN - 1) & ~(TS_ALIGN - 1);
+		}
+		if (v.ndata != ev->len) {
+			m->badlen++;
+			continue;
+		}
+		if (v.type == BLK_MASTER) {
+			row = &ev->x[v.chan * ev->stride];
+			ev->chans |= 1ULL << v.chan;
+		} else {
+			row = &ev->hist[((v.chan >> 4) & (TS_NXIL - 1)) * ev->stride];
+			ev->hists |= 1 << ((v.chan >> 4) & (TS_NXIL - 1));
+		}
+		blk_samples(v.data, v.ndata, row);
+		memset(row + v.ndata, 0, (ev->stride - v.ndata) * sizeof(short));
+	}
+}
+
+//	A record from a file or the ring
+void Record(const char *rec, int len, struct rec_info_struct *info)
+{
+	static char *buf = NULL;
+	static int bufsize = 0;
+	struct emu_module *m;
+	int i, size;
+
+	if (info->type == REC_BEGIN) {		// a new run
+		for (i = 0; i < NModules; i++) {
+			Finish(&Modules[i]);
+			Modules[i].dec->Reset();
+		}
+		return;
+	}
+	if (info->type < REC_WFDDATA || info->type >= REC_WFDDATA + MAXSERIAL) return;
+	m = GetModule(info->type - REC_WFDDATA);
+	if (!m) return;
+	if (info->flags & REC_FLAG_WFC) {
+		size = wfc_rec_size(rec, len);
+		if (size > bufsize) {
+			free(buf);
+			bufsize = size;
+			buf = (char *) malloc(bufsize);
+			if (!buf) {
+				bufsize = 0;
+				return;
+			}
+		}
+		if (wfc_rec_decode(rec, len, buf, bufsize) != size) return;
+		Feed(m, buf + info->hlen, size - info->hlen, info->real);
+	} else {
+		Feed(m, rec + info->hlen, len - info->hlen, info->real);
+	}
+}
+
+//	Go through the records of a file
+int ReadFile(const char *fname)
+{
+	struct stat st;
+	struct rec_info_struct info;
+	const char *map;
+	long long pos;
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		printf("Can not open %s: %m\n", fname);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	if (!st.st_size) {
+		close(fd);
+		return 0;
+	}
+	map = (const char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("Can not map %s: %m\n", fname);
+		return -1;
+	}
+	madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+	for (pos = 0; pos < st.st_size && !StopFlag; pos += info.len) {
+		if (rec_parse(map + pos, (st.st_size - pos > 0x7FFFFFFF) ? 0x7FFFFFFF : st.st_size - pos, &info) < 0) {
+			printf("%s: no valid record at %Ld, the rest is skipped\n", fname, pos);
+			break;
+		}
+		Record(map + pos, info.len, &info);
+	}
+	munmap((void *) map, st.st_size);
+	return 0;
+}
+
+//	Print the counters of the sets
+void Print(void)
+{
+	const struct trigsum_stat *st;
+	struct emu_module *m;
+	double span;
+	int i, j, k;
+
+	for (k = 0; k < NSets; k++) {
+		printf("Set %d: %s\n", k, Sets[k].fname);
+		for (i = 0; i < NModules; i++) {
+			m = &Modules[i];
+			st = Sets[k].sum[i]->GetStat();
+			span = (m->last - m->first) * 1E-9;
+			printf("Module %d: %Ld events", m->serial, st->events);
+			if (span > 0) printf(" in %.1f s", span);
+			printf(", %Ld over %d", st->fired, Sets[k].threshold[i]);
+			if (st->events) printf(" (%.2f%%", 100.0 * st->fired / st->events);
+			if (st->events && span > 0) printf(", %.1f Hz", st->fired / span);
+			if (st->events) printf(")");
+			if (!k && m->badlen) printf(", %Ld blocks of wrong length", m->badlen);
+			if (st->hist_windows) printf(", history: %Ld windows, %Ld own sums and %Ld sums differ",
+				st->hist_windows, st->hist_local, st->hist_global);
+			printf(".\n");
+			if (!NThr || !st->events) continue;
+			printf("\tthreshold      events   fraction   rate, Hz\n");
+			for (j = 0; j < NThr; j++) printf("\t%9d %11Ld %9.4f%% %10.1f\n", Thr[j], st->pass[j],
+				100.0 * st->pass[j] / st->events, (span > 0) ? st->pass[j] / span : 0.0);
+		}
+	}
+	fflush(stdout);
+}
+
+//	Read the shared memory ring until stopped
+void ReadRing(const char *name, int period)
+{
+	shmring *ring;
+	const void *rec;
+	struct rec_info_struct info;
+	time_t t0;
+	int len, irc;
+
+	ring = new shmring();
+	t0 = time(NULL);
+	while (!StopFlag) {
+		irc = ring->Next(&rec, &len);
+		if (irc == SHMRING_DETACHED) {
+			if (ring->Attach(name)) sleep(1);
+			else printf("Attached to %s\n", name);
+			continue;
+		}
+		if (irc == 1 && rec_parse(rec, len, &info) > 0) {
+			Record((const char *) rec, len, &info);
+			ring->Done();		// a record overwritten while read could only spoil one event
+		} else if (irc == 0) {
+			usleep(1000);
+		}
+		if (time(NULL) - t0 >= period) {
+			Emulate();
+			Print();
+			t0 = time(NULL);
+		}
+	}
+	delete ring;
+}
+
+int main(int argc, char **argv)
+{
+	const char *name;
+	int period;
+	int c, i, result;
+
+	NThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	LinkDelay = -1;
+	Offset = INT_MIN;
+	name = NULL;
+	period = 10;
+	for (;;) {
+		c = getopt(argc, argv, "c:hj:l:n:o:p:t:");
+		if (c == -1) break;
+		switch (c) {
+		case 'c':
+			if (NSets >= MAXSETS) {
+				printf("Too many sets, %s ignored\n", optarg);
+				break;
+			}
+			config_init(&Sets[NSets].cnf);
+			if (config_read_file(&Sets[NSets].cnf, optarg) != CONFIG_TRUE) {
+				printf("Configuration error in %s at line %d: %s\n", optarg,
+					config_error_line(&Sets[NSets].cnf), config_error_text(&Sets[NSets].cnf));
+				return 20;
+			}
+			Sets[NSets++].fname = optarg;
+			break;
+		case 'j':
+			NThreads = strtol(optarg, NULL, 0);
+			break;
+		case 'l':
+			LinkDelay = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			name = optarg;
+			break;
+		case 'o':
+			Offset = strtol(optarg, NULL, 0);
+			break;
+		case 'p':
+			period = strtol(optarg, NULL, 0);
+			if (period <= 0) period = 10;
+			break;
+		case 't':
+			if (ParseThresholds(optarg)) {
+				printf("Wrong thresholds %s\n", optarg);
+				return 20;
+			}
+			break;
+		case 'h':
+		default:
+			Help();
+			return 0;
+		}
+	}
+	if (!NSets || (optind >= argc && !name)) {
+		Help();
+		return 0;
+	}
+	if (NThreads > MAXTHREADS) NThreads = MAXTHREADS;
+	if (NThreads < 1) NThreads = 1;
+	for (i = 0; i < CHUNK; i++) {
+		Chunk[i].x = (short *) malloc(EVTWORDS * sizeof(short));
+		if (!Chunk[i].x) {
+			printf("No memory for %d events\n", CHUNK);
+			return 20;
+		}
+		Chunk[i].hist = Chunk[i].x + TS_NCHAN * TS_MAXLEN;
+	}
+
+	LogInit(NULL);
+	StopFlag = 0;
+	signal(SIGINT, catch_stop);
+	signal(SIGTERM, catch_stop);
+	result = 0;
+	if (name) {
+		ReadRing(name, period);
+	} else {
+		for (; optind < argc && !StopFlag; optind++) if (ReadFile(argv[optind])) result = 10;
+	}
+	for (i = 0; i < NModules; i++) Finish(&Modules[i]);
+	Emulate();
+	Print();
+	return result;
+}
@@ -0,0 +1,243 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Emulation of the master trigger sum of the module.
+
+	The model follows the registers written by ConfigureSlaveXilinx(): every slave Xilinx
+	multiplies the samples of its 16 channels by the 16-bit coefficients 0x8000 * TrigCoef
+	(inverted channels by the negative), adds the channels not masked by TrigSumMask
+	and drops 15 bits of the sum. The sum of a Xilinx goes to the other three over links
+	which take LinkDelay clocks, its own sum is delayed by SumDelay, so every Xilinx sees
+	S_own(t - SumDelay) + S_others(t - LinkDelay) and, if in TrigGenMask, requests the master
+	trigger when it goes over MasterTrigThreshold. The arithmetic is integer and exact: the coefficients are split
+	into 8-bit parts, so the products of pairs of channels fit SSE2/AVX2/AVX-512 multiply-add
+	of 16-bit words at the level of blk_get_level() and the results do not depend on the level.
+*/
+
+#include <limits.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "blkdecode.h"
+#include "trigsum.h"
+
+#define TS_PAIRS	(TS_NCHAN / TS_NXIL / 2)	// channel pairs of a Xilinx
+
+//	Sums of 16 rows of samples x[row * stride + i] with the coefficients of pairs of rows packed
+//	in lo and hi, for n samples. The kernels may go on to the end of the stride.
+typedef void (*ts_sums_fn)(const short *x, int stride, int n, const int *lo, const int *hi, int *slo, int *shi);
+
+static void ts_sums_scalar(const short *x, int stride, int n, const int *lo, const int *hi, int *slo, int *shi)
+{
+	const short *a, *b;
+	int i, p, al, bl, ah, bh;
+
+	for (i = 0; i < n; i++) slo[i] = shi[i] = 0;
+	for (p = 0; p < TS_PAIRS; p++) {
+		a = x + 2 * p * stride;
+		b = a + stride;
+		al = (short) lo[p];
+		bl = lo[p] >> 16;
+		ah = (short) hi[p];
+		bh = hi[p] >> 16;
+		for (i = 0; i < n; i++) {
+			slo[i] += a[i] * al + b[i] * bl;
+			shi[i] += a[i] * ah + b[i] * bh;
+		}
+	}
+}
+
+#if defined(__x86_64__)
+//	8 samples per step
+static void ts_sums_sse2(const short *x, int stride, int n, const int *lo, const int *hi, int *slo, int *shi)
+{
+	__m128i a, b, u0, u1, cl, ch, l0, l1, h0, h1;
+	int i, p;
+
+	for (i = 0; i < n; i += 8) {
+		l0 = l1 = h0 = h1 = _mm_setzero_si128();
+		for (p = 0; p < TS_PAIRS; p++) {
+			a = _mm_loadu_si128((const __m128i *) (x + 2 * p * stride + i));
+			b = _mm_loadu_si128((const __m128i *) (x + (2 * p + 1) * stride + i));
+			u0 = _mm_unpacklo_epi16(a, b);
+			u1 = _mm_unpackhi_epi16(a, b);
+			cl = _mm_set1_epi32(lo[p]);
+			ch = _mm_set1_epi32(hi[p]);
+			l0 = _mm_add_epi32(l0, _mm_madd_epi16(u0, cl));
+			l1 = _mm_add_epi32(l1, _mm_madd_epi16(u1, cl));
+			h0 = _mm_add_epi32(h0, _mm_madd_epi16(u0, ch));
+			h1 = _mm_add_epi32(h1, _mm_madd_epi16(u1, ch));
+		}
+		_mm_storeu_si128((__m128i *) (slo + i), l0);
+		_mm_storeu_si128((__m128i *) (slo + i + 4), l1);
+		_mm_storeu_si128((__m128i *) (shi + i), h0);
+		_mm_storeu_si128((__m128i *) (shi + i + 4), h1);
+	}
+}
+
+//	16 samples per step, unpacking works in 128-bit lanes, the order is restored at the end
+__attribute__((target("avx2")))
+static void ts_sums_avx2(const short *x, int stride, int n, const int *lo, const int *hi, int *slo, int *shi)
+{
+	__m256i a, b, u0, u1, cl, ch, l0, l1, h0, h1;
+	int i, p;
+
+	for (i = 0; i < n; i += 16) {
+		l0 = l1 = h0 = h1 = _mm256_setzero_si256();
+		for (p = 0; p < TS_PAIRS; p++) {
+			a = _mm256_loadu_si256((const __m256i *) (x + 2 * p * stride + i));
+			b = _mm256_loadu_si256((const __m256i *) (x + (2 * p + 1) * stride + i));
+			u0 = _mm256_unpacklo_epi16(a, b);	// samples 0-3, 8-11
+			u1 = _mm256_unpackhi_epi16(a, b);	// samples 4-7, 12-15
+			cl = _mm256_set1_epi32(lo[p]);
+			ch = _mm256_set1_epi32(hi[p]);
+			l0 = _mm256_add_epi32(l0, _mm256_madd_epi16(u0, cl));
+			l1 = _mm256_add_epi32(l1, _mm256_madd_epi16(u1, cl));
+			h0 = _mm256_add_epi32(h0, _mm256_madd_epi16(u0, ch));
+			h1 = _mm256_add_epi32(h1, _mm256_madd_epi16(u1, ch));
+		}
+		_mm256_storeu_si256((__m256i *) (slo + i), _mm256_permute2x128_si256(l0, l1, 0x20));
+		_mm256_storeu_si256((__m256i *) (slo + i + 8), _mm256_permute2x128_si256(l0, l1, 0x31));
+		_mm256_storeu_si256((__m256i *) (shi + i), _mm256_permute2x128_si256(h0, h1, 0x20));
+		_mm256_storeu_si256((__m256i *) (shi + i + 8), _mm256_permute2x128_si256(h0, h1, 0x31));
+	}
+}
+
+//	32 samples per step
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+static void ts_sums_avx512(const short *x, int stride, int n, const int *lo, const int *hi, int *slo, int *shi)
+{
+	__m512i a, b, u0, u1, cl, ch, l0, l1, h0, h1;
+	const __m512i first = _mm512_setr_epi32(0, 1, 2, 3, 16, 17, 18, 19, 4, 5, 6, 7, 20, 21, 22, 23);
+	const __m512i second = _mm512_setr_epi32(8, 9, 10, 11, 24, 25, 26, 27, 12, 13, 14, 15, 28, 29, 30, 31);
+	int i, p;
+
+	for (i = 0; i < n; i += 32) {
+		l0 = l1 = h0 = h1 = _mm512_setzero_si512();
+		for (p = 0; p < TS_PAIRS; p++) {
+			a = _mm512_loadu_si512((const void *) (x + 2 * p * stride + i));
+			b = _mm512_loadu_si512((const void *) (x + (2 * p + 1) * stride + i));
+			u0 = _mm512_unpacklo_epi16(a, b);	// samples 0-3, 8-11, 16-19, 24-27
+			u1 = _mm512_unpackhi_epi16(a, b);	// samples 4-7, 12-15, 20-23, 28-31
+			cl = _mm512_set1_epi32(lo[p]);
+			ch = _mm512_set1_epi32(hi[p]);
+			l0 = _mm512_add_epi32(l0, _mm512_madd_epi16(u0, cl));
+			l1 = _mm512_add_epi32(l1, _mm512_madd_epi16(u1, cl));
+			h0 = _mm512_add_epi32(h0, _mm512_madd_epi16(u0, ch));
+			h1 = _mm512_add_epi32(h1, _mm512_madd_epi16(u1, ch));
+		}
+		_mm512_storeu_si512((void *) (slo + i), _mm512_permutex2var_epi32(l0, first, l1));
+		_mm512_storeu_si512((void *) (slo + i + 16), _mm512_permutex2var_epi32(l0, second, l1));
+		_mm512_storeu_si512((void *) (shi + i), _mm512_permutex2var_epi32(h0, first, h1));
+		_mm512_storeu_si512((void *) (shi + i + 16), _mm512_permutex2var_epi32(h0, second, h1));
+	}
+}
+#endif
+
+static int ts_level = -1;
+static ts_sums_fn ts_sums = ts_sums_scalar;
+
+//	Follow the kernel level of the block decoder
+static void ts_set_kernels(void)
+{
+	ts_level = blk_get_level();
+	ts_sums = ts_sums_scalar;
+#if defined(__x86_64__)
+	if (ts_level >= BLK_SSE2) ts_sums = ts_sums_sse2;
+	if (ts_level >= BLK_AVX2) ts_sums = ts_sums_avx2;
+	if (ts_level >= BLK_AVX512) ts_sums = ts_sums_avx512;
+#endif
+}
+
+//*************************************************************************************************************************************//
+
+trigsum::trigsum(const struct trigsum_config *conf, const int *thresholds, int nthresholds)
+{
+	int c[TS_NCHAN];
+	int i, j, val;
+
+	for (i = 0; i < TS_NCHAN; i++) {
+		val = 0x8000 * conf->TrigCoef[i];	// as ConfigureSlaveXilinx() does
+		val &= 0xFFFF;
+		if ((conf->TrigSumMask[i >> 4] >> (i & 0xF)) & 1) val = 0;
+		if (BLK_INVERTED(conf->InvertMask, i)) val = -val;
+		c[i] = val;
+	}
+	for (i = 0; i < TS_NXIL; i++) for (j = 0; j < TS_PAIRS; j++) {
+		lo[i][j] = (c[16 * i + 2 * j] & 0xFF) | ((c[16 * i + 2 * j + 1] & 0xFF) << 16);
+		hi[i][j] = ((c[16 * i + 2 * j] >> 8) & 0xFFFF) | ((unsigned) (c[16 * i + 2 * j + 1] >> 8) << 16);
+	}
+	shift = conf->LinkDelay - conf->SumDelay;
+	threshold = conf->MasterTrigThreshold;
+	genmask = conf->TrigGenMask & ((1 << TS_NXIL) - 1);
+	thr = thresholds;
+	nthr = (nthresholds < TS_MAXTHR) ? nthresholds : TS_MAXTHR;
+	Reset();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Emulate the sums for the event and count it. If the event has history blocks and offset
+//	is not below -TS_MAXLEN, compare them with the sums: history sample i is sum sample i + offset.
+//	Return the highest sum seen by the Xilinxes of TrigGenMask in the window, LLONG_MIN if none
+long long trigsum::Process(const struct trigsum_event *e, int offset)
+{
+	long long s[TS_NXIL * (TS_MAXLEN + TS_ALIGN)];
+	long long g[TS_NXIL * (TS_MAXLEN + TS_ALIGN)];	// the sums as seen by each Xilinx
+	long long all, max;
+	int x, i, j, from, to, local, global;
+
+	Sums(e, s);
+	// the own sum is compared shift clocks later than the sums of the others
+	from = (shift < 0) ? -shift : 0;
+	to = (shift > 0) ? e->len - shift : e->len;
+	max = LLONG_MIN;
+	for (i = from; i < to; i++) {
+		for (x = 0, all = 0; x < TS_NXIL; x++) all += s[x * e->stride + i];
+		for (x = 0; x < TS_NXIL; x++) {
+			g[x * e->stride + i] = all - s[x * e->stride + i] + s[x * e->stride + i + shift];
+			if (((genmask >> x) & 1) && g[x * e->stride + i] > max) max = g[x * e->stride + i];
+		}
+	}
+	stat.events++;
+	if (from >= to) return max;
+	if (max > threshold) stat.fired++;
+	for (j = 0; j < nthr; j++) if (max > thr[j]) stat.pass[j]++;
+
+	if (offset <= -TS_MAXLEN || !e->hist) return max;
+	for (x = 0; x < TS_NXIL; x++) {
+		// only Xilinxes with all channels read give the whole own sum
+		if (!((e->hists >> x) & 1) || ((e->chans >> (16 * x)) & 0xFFFF) != 0xFFFF) continue;
+		local = global = 0;
+		for (i = 0; i < e->len; i++) {
+			j = i + offset;
+			if (j < from || j >= to) continue;
+			if ((e->hist[x * e->stride + i] ^ s[x * e->stride + j]) & 0x7FFF) local = 1;
+			if ((e->hist[x * e->stride + i] ^ g[x * e->stride + j]) & 0x7FFF) global = 1;
+		}
+		stat.hist_windows++;
+		stat.hist_local += local;
+		stat.hist_global += global;
+	}
+	return max;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Clear the counters
+void trigsum::Reset(void)
+{
+	memset(&stat, 0, sizeof(stat));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Own sums of the Xilinxes: sums[xil * e->stride + i] for the e->len samples
+void trigsum::Sums(const struct trigsum_event *e, long long *sums)
+{
+	int slo[TS_MAXLEN + TS_ALIGN], shi[TS_MAXLEN + TS_ALIGN];
+	int x, i;
+
+	if (ts_level != blk_get_level()) ts_set_kernels();
+	for (x = 0; x < TS_NXIL; x++) {
+		ts_sums(e->x + 16 * x * e->stride, e->stride, e->len, lo[x], hi[x], slo, shi);
+		for (i = 0; i < e->len; i++) sums[x * e->stride + i] = ((long long) shi[i] * 256 + slo[i]) >> 15;
+	}
+}
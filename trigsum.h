@@ -0,0 +1,67 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Emulation of the master trigger sum of the module.
+*/
+#ifndef TRIGSUM_H
+#define TRIGSUM_H
+
+#define TS_NCHAN	64
+#define TS_NXIL		4		// slave Xilinxes, 16 channels each
+#define TS_MAXLEN	512		// samples in a window
+#define TS_ALIGN	32		// rows of samples are padded to a multiple of it with zeros
+#define TS_MAXTHR	256		// thresholds scanned at once
+
+//	Parameters of the sum, the same as in the module configuration (uwfd64.h)
+struct trigsum_config {
+	float TrigCoef[TS_NCHAN];	// written to the module as 16-bit 0x8000 * TrigCoef
+	short int TrigSumMask[TS_NXIL];	// channels not in the sum
+	short int InvertMask[TS_NXIL];	// channels with negative pulses
+	int SumDelay;		// clocks the own sum of a Xilinx is delayed to meet the sums of the others
+	int LinkDelay;		// clocks the sums of the other Xilinxes come late, normally SumDelay of a tuned module
+	int MasterTrigThreshold;
+	int TrigGenMask;	// Xilinxes requesting the master trigger, a bit each
+};
+
+//	Module data of one trigger
+struct trigsum_event {
+	int serial;
+	int token;
+	int len;		// samples in the windows
+	int stride;		// len rounded up to TS_ALIGN
+	unsigned long long chans;	// channel blocks present, a bit per channel
+	int hists;		// history blocks present, a bit per Xilinx
+	long long real;		// ns, readout time of the record
+	short *x;		// samples x[chan * stride + i], zero for channels not present
+	short *hist;		// history hist[xil * stride + i]
+};
+
+//	Counters
+struct trigsum_stat {
+	long long events;
+	long long fired;	// over MasterTrigThreshold
+	long long pass[TS_MAXTHR];	// over each of the thresholds scanned
+	long long hist_windows;	// history blocks compared with the emulation
+	long long hist_local;	// of them not equal to the own sum of the Xilinx
+	long long hist_global;	// not equal to the sum of all Xilinxes as seen by it
+};
+
+//	The sum of one module with one set of parameters
+class trigsum {
+private:
+	int lo[TS_NXIL][TS_NCHAN / TS_NXIL / 2];	// coefficients by channel pairs: low 8 bits
+	int hi[TS_NXIL][TS_NCHAN / TS_NXIL / 2];	// and the rest with the sign
+	int shift;		// LinkDelay - SumDelay
+	int threshold;
+	int genmask;
+	const int *thr;
+	int nthr;
+	struct trigsum_stat stat;
+public:
+	trigsum(const struct trigsum_config *conf, const int *thresholds = 0, int nthresholds = 0);
+	inline const struct trigsum_stat *GetStat(void) { return &stat; };
+	long long Process(const struct trigsum_event *e, int offset = -TS_MAXLEN);
+	void Reset(void);
+	void Sums(const struct trigsum_event *e, long long *sums);
+};
+
+#endif /* TRIGSUM_H */
@@ -0,0 +1,201 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Trigger time: GTIME and TRIGCNT unpacking, clocks of the modules.
+
+	GTIME is the 45-bit 125 MHz counter of the trigger generator, TRIGCNT the 30-bit trigger
+	number, both in the trigger information block. GTIME is extended over wraps and resets,
+	so the time of the triggers taken in order never goes back. It pauses while inhibited:
+	the absolute time is anchored to the readout time of the records, the earliest readout
+	after a trigger gives the best estimate, and the anchor is moved when the readout
+	comes later than Latency after the trigger.
+
+	With TokenSync on every module writes a token synchronization block on the triggers
+	with tokens 0, 256, 512 and 768, word 2 is the 15 LSB of the module clock at the token.
+	Its difference to GTIME is followed over the 15-bit wraps with the drift predicted
+	from the previous synchronizations: a module on the common clock keeps it constant,
+	a jump or a drift means the clock distribution to the module is broken. A step off the
+	prediction by more than MaxJump is a jump, unless the next interval steps at the same rate:
+	then it is a drift, reported if over MaxDrift.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "log.h"
+#include "trigtime.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	GTIME of the trigger information block: words 3, 4, 5 have 15 bits each
+long long tt_gtime(const unsigned short *cw)
+{
+	return (cw[3] & 0x7FFF) | ((long long) (cw[4] & 0x7FFF) << 15) | ((long long) (cw[5] & 0x7FFF) << 30);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	TRIGCNT of the trigger information block: words 6, 7, the token is in its LSB
+long long tt_trigcnt(const unsigned short *cw)
+{
+	return (cw[6] & 0x7FFF) | ((long long) (cw[7] & 0x7FFF) << 15);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	The value with the bits LSB of raw nearest to near, never negative
+long long tt_unwrap(long long near, long long raw, int bits)
+{
+	long long d, v;
+
+	d = (raw - near) & ((1LL << bits) - 1);
+	if (d >= (1LL << (bits - 1))) d -= 1LL << bits;
+	v = near + d;
+	return (v < 0) ? v + (1LL << bits) : v;
+}
+
+//*************************************************************************************************************************************//
+
+trigtime::trigtime(struct trigtime_config *conf)
+{
+	memcpy(&Conf, conf, sizeof(Conf));
+	if (Conf.MaxJump <= 0) Conf.MaxJump = 2;
+	if (Conf.MaxDrift <= 0) Conf.MaxDrift = 10;
+	if (Conf.Latency <= 0) Conf.Latency = 1000;
+	Reset();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Take the readout time real (ns, CLOCK_REALTIME) of the trigger at extended gtime for the absolute time
+void trigtime::Anchor(long long gtime, long long real)
+{
+	long long d;
+
+	if (real <= 0 || gtime < 0) return;
+	d = real - gtime * TT_TICK_NS;
+	if (epoch < 0 || d < epoch) {
+		epoch = d;
+	} else if (d - epoch > Conf.Latency * 1000000LL) {
+		epoch = d;
+		stat.pauses++;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Extend raw GTIME of the next trigger in order. flags gets TT_RESET if GTIME went back
+//	other than by a wrap: the clocks of the modules and the absolute time are learned again.
+//	Return extended GTIME
+long long trigtime::Extend(long long raw, int *flags)
+{
+	int i;
+
+	*flags = 0;
+	raw &= (1LL << TT_GTIME_BITS) - 1;
+	stat.triggers++;
+	if (last >= 0 && raw < last) {
+		if (last - raw >= (1LL << (TT_GTIME_BITS - 1))) {
+			base += 1LL << TT_GTIME_BITS;
+			stat.wraps++;
+		} else {
+			base += last;		// the extended time goes on from the last trigger
+			stat.resets++;
+			epoch = -1;
+			for (i = 0; i < TT_MAXSERIAL; i++) mod[i].syncs = 0;
+			*flags = TT_RESET;
+			Log(WARN, "GTIME went back from 0x%LX to 0x%LX, trigger counters were reset\n", last, raw);
+		}
+	}
+	last = raw;
+	return base + raw;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Print the clocks of the modules
+void trigtime::PrintStat(void)
+{
+	const struct trigtime_module *m;
+	int i;
+
+	printf("Trigger time: %Ld triggers, %Ld GTIME wraps, %Ld resets, %Ld pauses.\n",
+		stat.triggers, stat.wraps, stat.resets, stat.pauses);
+	for (i = 0; i < TT_MAXSERIAL; i++) {
+		m = &mod[i];
+		if (!m->syncs && !m->jumps && !m->drifting) continue;
+		printf("Module %d clock: offset %.0f ticks, drift %.3f ppm, %Ld synchronizations", i, m->offset, m->drift * 1E6, m->syncs);
+		if (m->jumps) printf(", %Ld jumps", m->jumps);
+		if (m->drifting) printf(", drift over %d ppm %Ld times", Conf.MaxDrift, m->drifting);
+		printf(".\n");
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Start a new run
+void trigtime::Reset(void)
+{
+	memset(mod, 0, sizeof(mod));
+	last = -1;
+	base = 0;
+	epoch = -1;
+	memset(&stat, 0, sizeof(stat));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Take the token synchronization block of the module serial with the time word time,
+//	for the trigger at extended gtime. Calls must go in the order of the triggers.
+//	Return TT_JUMP and TT_DRIFT flags of the module clock
+int trigtime::Sync(int serial, long long gtime, int time)
+{
+	struct trigtime_module *m;
+	double dt, pred, d, rate;
+	int flags, settled;
+
+	m = &mod[serial & (TT_MAXSERIAL - 1)];
+	d = (time - gtime) & ((1 << TT_SYNC_BITS) - 1);
+	if (!m->syncs || gtime <= m->gtime) {
+		m->offset = d;
+		m->drift = 0;
+		m->rate = 0;
+		m->gtime = gtime;
+		m->flags = 0;
+		m->syncs = 1;
+		return 0;
+	}
+	dt = gtime - m->gtime;
+	pred = m->offset + m->drift * dt;
+	d -= pred;
+	d -= (1 << TT_SYNC_BITS) * floor((d + (1 << (TT_SYNC_BITS - 1))) / (1 << TT_SYNC_BITS));
+	rate = (pred + d - m->offset) / dt;
+	flags = 0;
+	settled = m->syncs >= TT_DRIFT_AVG || (m->flags & TT_DRIFT);
+	if (fabs(d) <= Conf.MaxJump) {
+		m->drift = (m->syncs == 1) ? rate : m->drift + (rate - m->drift) / TT_DRIFT_AVG;
+	} else if ((m->flags & TT_JUMP) && fabs(rate - m->rate) * 1E6 <= Conf.MaxDrift) {
+		// the same rate off the prediction twice: the clock drifts, the first interval
+		// of it could not be told from a step
+		m->drift = rate;
+		settled = 1;
+	} else {
+		// a step is not a drift: keep the rate, follow the new offset
+		flags |= TT_JUMP;
+		if (!m->jumps) Log(WARN, "Module %d clock jumped by %.0f ticks against GTIME\n", serial, d);
+		m->jumps++;
+	}
+	m->rate = rate;
+	m->offset = pred + d;
+	m->gtime = gtime;
+	m->syncs++;
+	if (settled && fabs(m->drift) * 1E6 > Conf.MaxDrift) {	// not before the average has settled
+		flags |= TT_DRIFT;
+		if (!(m->flags & TT_DRIFT)) {
+			if (!m->drifting) Log(WARN, "Module %d clock drifts %.3f ppm against GTIME\n", serial, m->drift * 1E6);
+			m->drifting++;
+		}
+	}
+	m->flags = flags;
+	return flags;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Absolute time of extended gtime
+//	Return ns since the Epoch, -1 if not known yet
+long long trigtime::Time(long long gtime)
+{
+	if (epoch < 0 || gtime < 0) return -1;
+	return epoch + gtime * TT_TICK_NS;
+}
@@ -0,0 +1,74 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Trigger time: GTIME and TRIGCNT unpacking, clocks of the modules.
+*/
+#ifndef TRIGTIME_H
+#define TRIGTIME_H
+
+#define TT_MAXSERIAL	256		// module serial numbers
+#define TT_TICK_NS	8		// GTIME unit, 125 MHz
+#define TT_GTIME_BITS	45
+#define TT_TRIGCNT_BITS	30
+#define TT_SYNC_BITS	15		// time word of the token synchronization block
+#define TT_DRIFT_AVG	16		// synchronizations over which the drift is averaged
+
+//	Anomalies of a module clock, Sync() return
+#define TT_JUMP		1	// the offset to GTIME moved by more than MaxJump at once
+#define TT_DRIFT	2	// the offset drifts faster than MaxDrift
+//	Anomaly of GTIME, Extend() return
+#define TT_RESET	4	// GTIME went back, the counters were reset
+
+//	Parameters, normally from Sink section of the configuration
+struct trigtime_config {
+	int MaxJump;		// GTIME ticks
+	int MaxDrift;		// ppm
+	int Latency;		// ms, the longest delay from a trigger to its readout, GTIME is taken as paused above it
+};
+
+//	Clock of one module as seen in token synchronization blocks
+struct trigtime_module {
+	long long syncs;	// synchronizations seen
+	long long gtime;	// GTIME of the last one
+	double offset;		// ticks, module time minus GTIME, followed over the 15-bit wraps
+	double drift;		// ticks per tick, averaged
+	double rate;		// ticks per tick over the last interval
+	int flags;		// TT_* of the last synchronization
+	long long jumps;
+	long long drifting;	// times the drift went over the limit
+};
+
+//	Counters
+struct trigtime_stat {
+	long long triggers;	// GTIME values taken
+	long long wraps;	// GTIME wraps
+	long long resets;	// GTIME going back
+	long long pauses;	// GTIME found paused (inhibit), the absolute time is anchored again
+};
+
+//	Unpacking of the trigger information block, words from the control word
+long long tt_gtime(const unsigned short *cw);
+long long tt_trigcnt(const unsigned short *cw);
+long long tt_unwrap(long long near, long long raw, int bits);
+
+//	Follows GTIME of the triggers in order and the clocks of the modules against it
+class trigtime {
+private:
+	struct trigtime_config Conf;
+	struct trigtime_module mod[TT_MAXSERIAL];
+	long long last;		// the last raw GTIME, -1 if none
+	long long base;		// added to raw GTIME for wraps and resets
+	long long epoch;	// ns, CLOCK_REALTIME at GTIME 0, -1 if not known
+	struct trigtime_stat stat;
+public:
+	trigtime(struct trigtime_config *conf);
+	void Anchor(long long gtime, long long real);
+	long long Extend(long long raw, int *flags);
+	inline const struct trigtime_module *GetModule(int serial) { return &mod[serial & (TT_MAXSERIAL - 1)]; };
+	inline const struct trigtime_stat *GetStat(void) { return &stat; };
+	void PrintStat(void);
+	void Reset(void);
+	int Sync(int serial, long long gtime, int time);
+	long long Time(long long gtime);
+};
+
+#endif /* TRIGTIME_H */
@@ -0,0 +1,223 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Emulator of the module SDRAM readout via UDP.
+	Answers read commands like the firmware does: datagrams of 12 byte header
+	(status, SDRAM address, length) and up to 1k of data, all in network order.
+	SDRAM word at byte address A contains A. Loss, reordering, duplication
+	and rate limit can be set to test the receiving side.
+*/
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNK		1024		// maximum payload of one datagram
+#define HDRLEN		12
+#define MEMSIZE		0x20000000	// 512 MBytes of SDRAM
+
+struct udpemu_config {
+	int port;		// command port
+	double loss;		// probability to drop a datagram
+	double reorder;		// probability to delay a datagram after the next one
+	double dup;		// probability to send a datagram twice
+	double rate;		// MBytes/s, 0 - no limit
+	int dport;		// destination port, 0 - reply to the command source port
+};
+
+struct udpemu_stat {
+	long long cmds;
+	long long sent;
+	long long bytes;
+	long long lost;
+	long long reordered;
+	long long duplicated;
+};
+
+volatile sig_atomic_t StopFlag;
+
+void catch_stop(int sig)
+{
+	StopFlag = 1;
+	signal(sig, catch_stop);
+}
+
+void Help(void)
+{
+	printf("\t\tEmulator of UWFD64 SDRAM readout via UDP\n");
+	printf("Usage udpemu [options]\n");
+	printf("Options:\n");
+	printf("-d prob - duplicate datagrams with this probability, default 0;\n");
+	printf("-h - print this message and exit;\n");
+	printf("-l prob - lose datagrams with this probability, default 0;\n");
+	printf("-o port - send data to this port instead of the command source port;\n");
+	printf("-p port - listen for commands on this port, default 9000;\n");
+	printf("-r prob - send a datagram after the next one with this probability, default 0;\n");
+	printf("-s MBytes/s - limit the data rate, default no limit.\n");
+	printf("Set module CmdPort (and IP to 127.0.0.1) in the configuration to read from the emulator.\n");
+}
+
+//	Wait to keep the rate
+void RateLimit(struct udpemu_config *conf, long long bytes, struct timespec *t0)
+{
+	struct timespec t;
+	double dt, need;
+
+	if (conf->rate <= 0) return;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	dt = t.tv_sec - t0->tv_sec + (t.tv_nsec - t0->tv_nsec) * 1E-9;
+	need = bytes / (conf->rate * 1048576.0);
+	if (need > dt) usleep((need - dt) * 1E6);
+}
+
+//	Answer one read command
+void Reply(int sock, struct sockaddr_in *to, unsigned int addr, int len, struct udpemu_config *conf, struct udpemu_stat *stat)
+{
+	unsigned int pkt[2][(HDRLEN + CHUNK) / sizeof(int)];
+	int plen[2];
+	int held;
+	int cur;
+	long long bytes;		// sent for this command
+	int ln, off, i;
+	unsigned int a;
+	struct timespec t0;
+
+	held = 0;
+	cur = 0;
+	bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	stat->cmds++;
+	len &= ~3;
+	for (off = 0; off < len; off += ln) {
+		ln = len - off;
+		if (ln > CHUNK) ln = CHUNK;
+		a = addr + off;
+		pkt[cur][0] = 0;
+		pkt[cur][1] = htonl(a);
+		pkt[cur][2] = htonl(ln);
+		for (i = 0; i < ln / (int) sizeof(int); i++) pkt[cur][3 + i] = htonl((a + i * sizeof(int)) % MEMSIZE);
+		plen[cur] = HDRLEN + ln;
+		if (drand48() < conf->loss) {
+			stat->lost++;
+			continue;
+		}
+		if (!held && drand48() < conf->reorder) {	// keep it to send after the next one
+			held = 1;
+			cur = 1 - cur;
+			stat->reordered++;
+			continue;
+		}
+		RateLimit(conf, bytes, &t0);
+		sendto(sock, pkt[cur], plen[cur], 0, (struct sockaddr *) to, sizeof(*to));
+		stat->sent++;
+		stat->bytes += ln;
+		bytes += ln;
+		if (drand48() < conf->dup) {
+			sendto(sock, pkt[cur], plen[cur], 0, (struct sockaddr *) to, sizeof(*to));
+			stat->duplicated++;
+		}
+		if (held) {
+			sendto(sock, pkt[1 - cur], plen[1 - cur], 0, (struct sockaddr *) to, sizeof(*to));
+			stat->sent++;
+			stat->bytes += plen[1 - cur] - HDRLEN;
+			bytes += plen[1 - cur] - HDRLEN;
+			held = 0;
+			cur = 1 - cur;
+		}
+	}
+	if (held) {
+		sendto(sock, pkt[1 - cur], plen[1 - cur], 0, (struct sockaddr *) to, sizeof(*to));
+		stat->sent++;
+		stat->bytes += plen[1 - cur] - HDRLEN;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct udpemu_config conf;
+	struct udpemu_stat stat;
+	struct sockaddr_in address, from;
+	socklen_t flen;
+	struct timeval tmo;
+	unsigned int cmd[3];
+	int sock;
+	int c, irc;
+
+	memset(&conf, 0, sizeof(conf));
+	memset(&stat, 0, sizeof(stat));
+	conf.port = 9000;
+	for (;;) {
+		c = getopt(argc, argv, "d:hl:o:p:r:s:");
+		if (c == -1) break;
+		switch (c) {
+		case 'd':
+			conf.dup = strtod(optarg, NULL);
+			break;
+		case 'l':
+			conf.loss = strtod(optarg, NULL);
+			break;
+		case 'o':
+			conf.dport = strtol(optarg, NULL, 0);
+			break;
+		case 'p':
+			conf.port = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			conf.reorder = strtod(optarg, NULL);
+			break;
+		case 's':
+			conf.rate = strtod(optarg, NULL);
+			break;
+		case 'h':
+		default:
+			Help();
+			return 0;
+		}
+	}
+
+	sock = socket(PF_INET, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		printf("Can not create socket: %m\n");
+		return 10;
+	}
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(conf.port);
+	if (bind(sock, (struct sockaddr *) &address, sizeof(address)) < 0) {
+		printf("Can not bind port %d: %m\n", conf.port);
+		return 20;
+	}
+	tmo.tv_sec = 1;		// to check StopFlag
+	tmo.tv_usec = 0;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tmo, sizeof(tmo));
+
+	StopFlag = 0;
+	signal(SIGINT, catch_stop);
+	signal(SIGTERM, catch_stop);
+	srand48(time(NULL));
+	printf("Listening on port %d: loss %g, reorder %g, duplicate %g, rate %g MBytes/s\n",
+		conf.port, conf.loss, conf.reorder, conf.dup, conf.rate);
+	fflush(stdout);
+
+	while (!StopFlag) {
+		flen = sizeof(from);
+		irc = recvfrom(sock, cmd, sizeof(cmd), 0, (struct sockaddr *) &from, &flen);
+		if (irc < 0) continue;
+		if (irc != sizeof(cmd) || ntohl(cmd[0]) != 1) {
+			printf("Strange command of %d bytes\n", irc);
+			continue;
+		}
+		if (conf.dport) from.sin_port = htons(conf.dport);
+		Reply(sock, &from, ntohl(cmd[1]), ntohl(cmd[2]), &conf, &stat);
+	}
+
+	printf("%Ld commands, %Ld datagrams %Ld bytes sent, %Ld lost, %Ld reordered, %Ld duplicated\n",
+		stat.cmds, stat.sent, stat.bytes, stat.lost, stat.reordered, stat.duplicated);
+	close(sock);
+	return 0;
+}
@@ -0,0 +1,541 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Persistent UDP receiver for SDRAM readout via ethernet.
+
+	The socket is bound once per host port and kept for the life of the program.
+	Datagrams are taken in batches by recvmmsg into buffers allocated at the start,
+	epoll is used to wait when the socket is empty. The module answers a read command
+	with datagrams of 12 byte header (status, SDRAM address, length) and up to 1k of data.
+
+	Lost datagrams are recovered by asking the module again only for the missing
+	ranges of the chunk bitmap. The wait before asking is derived from the measured
+	reply delay and doubles with every retry.
+
+	Several modules can send to the same port at once: the replies are sorted to
+	the requests by the source IP and the SDRAM address.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "udpengine.h"
+
+udpengine *udpengine::engines[UDPENGINE_MAXPORTS];
+
+//	Monotonic time in us
+static long long GetTime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+//	Real time in us
+static long long GetRealTime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+//	When the kernel took the datagram, us of CLOCK_REALTIME, now if not known
+static long long RxTime(struct msghdr *h)
+{
+	struct cmsghdr *c;
+	struct timespec ts;
+
+	for (c = CMSG_FIRSTHDR(h); c; c = CMSG_NXTHDR(h, c)) if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+		memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+		return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+	}
+	return GetRealTime();
+}
+
+udpmask::udpmask(void)
+{
+	bits = NULL;
+	size = 0;
+	nchunks = 0;
+}
+
+udpmask::~udpmask(void)
+{
+	if (bits) free(bits);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Print the mask to the debug log
+void udpmask::Dump(unsigned int fifo_addr)
+{
+	int i;
+
+	for (i=0; i<nchunks; i++) {
+		if(!(i & 63)) Log(DEBUG, "SDRAM[0x%8.8X]: ", fifo_addr + UDPENGINE_CHUNK*i);
+		Log(DEBUG, "%d", Get(i));
+		if ((i & 7) == 7) Log(DEBUG, " ");
+		if ((i & 63) == 63) Log(DEBUG, "\n");
+	}
+	if (nchunks & 63) Log(DEBUG, "\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Prepare the mask for a read of len bytes. The memory is kept for the next reads.
+//	Return 0 on success, negative on memory error
+int udpmask::Reset(int len)
+{
+	unsigned *ptr;
+	int words;
+
+	nchunks = (len + UDPENGINE_CHUNK - 1) / UDPENGINE_CHUNK;
+	words = (nchunks + 31) / 32;
+	if (words > size) {
+		ptr = (unsigned *) realloc(bits, words * sizeof(unsigned));
+		if (!ptr) {
+			Log(ERROR, "Memory allocation (%d bytes) failed: %m\n", words * sizeof(unsigned));
+			nchunks = 0;
+			return -10;
+		}
+		bits = ptr;
+		size = words;
+	}
+	memset(bits, 0, words * sizeof(unsigned));
+	return 0;
+}
+
+udpengine::udpengine(int hport)
+{
+	int i;
+
+	port = hport;
+	refcnt = 0;
+	sock = -1;
+	epfd = -1;
+	buf = (char *) malloc(UDPENGINE_BATCH * UDPENGINE_DGRAM);
+	memset(msgs, 0, sizeof(msgs));
+	for (i=0; i<UDPENGINE_BATCH; i++) {
+		iov[i].iov_base = (buf) ? buf + i * UDPENGINE_DGRAM : NULL;
+		iov[i].iov_len = UDPENGINE_DGRAM;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &from[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+		msgs[i].msg_hdr.msg_control = ctrl[i];
+		msgs[i].msg_hdr.msg_controllen = UDPENGINE_CTRLLEN;
+	}
+	srtt = 0;
+	tstart = 0;
+	npackets = nbytes = nduplicates = nstray = nreads = 0;
+	nfailed = 0;
+	nretransmits = nlost = nrecovered = 0;
+}
+
+udpengine::~udpengine(void)
+{
+	if (epfd >= 0) close(epfd);
+	if (sock >= 0) close(sock);
+	if (buf) free(buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Send FIFO read command
+//	IP - module IP
+//	cmdport - module command port
+//	fifo_addr - absolute address in the memory
+//	len - data length in bytes
+//	Return number of bytes sent, negative on error
+int udpengine::Command(unsigned IP, int cmdport, unsigned int fifo_addr, int len)
+{
+	struct sockaddr_in address;
+	int msg[3];
+
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(IP);
+	address.sin_port = htons(cmdport);
+
+	msg[0] = htonl(1);	// the command
+	msg[1] = htonl(fifo_addr);
+	msg[2] = htonl(len);
+
+	return sendto(sock, msg, sizeof(msg), 0, (struct sockaddr *) &address, sizeof(address));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Drop datagrams left from previous (failed) reads
+void udpengine::Flush(void)
+{
+	int irc;
+
+	for (;;) {
+		for (irc = 0; irc < UDPENGINE_BATCH; irc++) {
+			msgs[irc].msg_hdr.msg_namelen = sizeof(from[irc]);
+			msgs[irc].msg_hdr.msg_controllen = UDPENGINE_CTRLLEN;
+		}
+		irc = recvmmsg(sock, msgs, UDPENGINE_BATCH, MSG_DONTWAIT, NULL);
+		if (irc <= 0) break;
+		nstray += irc;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Get the engine for the host port, create it on the first request.
+//	Return NULL on error
+udpengine *udpengine::Get(int hport)
+{
+	int i, j;
+
+	j = -1;
+	for (i=0; i<UDPENGINE_MAXPORTS; i++) {
+		if (engines[i] && engines[i]->port == hport) break;
+		if (!engines[i] && j < 0) j = i;
+	}
+	if (i == UDPENGINE_MAXPORTS) {
+		if (j < 0) {
+			Log(ERROR, "Too many UDP ports in use, maximum %d\n", UDPENGINE_MAXPORTS);
+			return NULL;
+		}
+		i = j;
+		engines[i] = new udpengine(hport);
+		if (engines[i]->Open()) {
+			delete engines[i];
+			engines[i] = NULL;
+			return NULL;
+		}
+	}
+	engines[i]->refcnt++;
+	return engines[i];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Create and bind the socket listening on all interfaces
+//	Return 0 on success, negative on error
+int udpengine::Open(void)
+{
+	struct sockaddr_in address;
+	struct epoll_event ev;
+	int val;
+	socklen_t vlen;
+
+	if (!buf) {
+		Log(ERROR, "Memory allocation (%d bytes) failed: %m\n", UDPENGINE_BATCH * UDPENGINE_DGRAM);
+		return -10;
+	}
+	sock = socket(PF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (sock < 0) {
+		Log(ERROR, "Can not create UDP socket: %m\n");
+		return -10;
+	}
+	//	try to go above net.core.rmem_max if we are allowed to
+	val = UDPENGINE_RCVBUF;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &val, sizeof(val)))
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+	vlen = sizeof(val);
+	if (!getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &val, &vlen) && val < UDPENGINE_RCVBUF)
+		Log(WARN, "UDP port %d receive buffer is only %d bytes, increase net.core.rmem_max\n", port, val);
+	//	the time of arrival, not of our processing, tells the speed of the link
+	val = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &val, sizeof(val)))
+		Log(WARN, "UDP port %d: no receive timestamps, the speed measured includes the processing delay: %m\n", port);
+
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+	if (bind(sock, (struct sockaddr *) &address, sizeof(address)) < 0) {
+		Log(ERROR, "Can not allocate port %d: %m\n", port);
+		return -20;
+	}
+
+	epfd = epoll_create1(0);
+	if (epfd < 0) {
+		Log(ERROR, "Can not create epoll: %m\n");
+		return -30;
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = sock;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev)) {
+		Log(ERROR, "Can not add UDP socket to epoll: %m\n");
+		return -30;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Print statistics
+void udpengine::PrintStat(void)
+{
+	printf("UDP port %d: %Ld reads (%d failed, %Ld recovered), %Ld packets, %Ld bytes, %Ld duplicated, %Ld stray\n",
+		port, nreads, nfailed, nrecovered, npackets, nbytes, nduplicates, nstray);
+	printf("UDP port %d: %Ld chunks lost (%.4f%%), %Ld retransmit requests, reply delay %d us\n",
+		port, nlost, (npackets) ? 100.0 * nlost / npackets : 0.0, nretransmits, srtt);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Release the engine. The last user closes the socket.
+void udpengine::Put(udpengine *engine)
+{
+	int i;
+
+	if (!engine || --engine->refcnt > 0) return;
+	for (i=0; i<UDPENGINE_MAXPORTS; i++) if (engines[i] == engine) engines[i] = NULL;
+	delete engine;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Read block from module SDRAM. Data is left in network order.
+//	IP - module IP
+//	fifo_addr - absolute address in the memory
+//	data - buffer of len bytes
+//	cmdport - module command port
+//	Return 0 on success, negative on error
+int udpengine::Read(unsigned IP, unsigned int fifo_addr, void *data, int len, int cmdport)
+{
+	struct udpread_struct req;
+
+	req.IP = IP;
+	req.cmdport = cmdport;
+	req.fifo_addr = fifo_addr;
+	req.data = data;
+	req.len = len;
+	return ReadMulti(&req, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Read blocks from several modules (or several blocks from one module) at once.
+//	All commands are sent first, replies are sorted by the source IP and address.
+//	req - requests, status is filled for each of them
+//	n - number of requests, up to UDPENGINE_MAXREQS
+//	Return 0 if all blocks were read, otherwise the first error
+int udpengine::ReadMulti(struct udpread_struct *req, int n)
+{
+	int irc;
+
+	irc = ReadStart(req, n);
+	if (irc) return irc;
+	return ReadWait(req, n);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Send the read commands. The caller may do something else before ReadWait() collects the data.
+//	req - requests, up to UDPENGINE_MAXREQS
+//	Return 0 on success, negative if the requests can not be started at all
+int udpengine::ReadStart(struct udpread_struct *req, int n)
+{
+	struct udpread_struct *r;
+	int k;
+
+	if (n > UDPENGINE_MAXREQS) {
+		Log(ERROR, "Too many UDP read requests: %d, maximum %d\n", n, UDPENGINE_MAXREQS);
+		return -10;
+	}
+	Flush();
+	for (k=0; k<n; k++) {
+		r = &req[k];
+		nreads++;
+		r->rcvcnt = 0;
+		r->retry = 0;
+		r->status = 1;
+		r->tstart = GetRealTime();
+		r->tdone = 0;
+		if (masks[k].Reset(r->len)) {
+			r->status = -10;
+		} else if (Command(r->IP, r->cmdport, r->fifo_addr, r->len) < 0) {
+			Log(ERROR, "Can not send read command to %d.%d.%d.%d via UDP: %m\n",
+				(r->IP>>24) & 0xFF, (r->IP>>16) & 0xFF, (r->IP>>8) & 0xFF, r->IP & 0xFF);
+			r->status = -10;
+		}
+		if (r->status < 0) nfailed++;
+	}
+	tstart = GetTime();
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Receive the data for the requests started by ReadStart()
+//	Return 0 if all blocks were read, otherwise the first error
+int udpengine::ReadWait(struct udpread_struct *req, int n)
+{
+	struct udpread_struct *r;
+	unsigned *w;
+	int nactive;
+	int addr;
+	int ln;
+	int irc;
+	int retry, first, timeout;
+	int i, k, cnt;
+	long long tdone;
+
+	nactive = 0;
+	for (k=0; k<n; k++) if (req[k].status > 0) nactive++;
+	retry = 0;
+	first = (!srtt || GetTime() - tstart < srtt);	// the reply delay can be measured only if we did not come late
+	timeout = RetryTimeout(0);
+
+	while (nactive) {
+		cnt = Receive(timeout);
+		if (cnt < 0) {
+			Log(ERROR, "UDP receive error %m\n");
+			for (k=0; k<n; k++) if (req[k].status > 0) {
+				req[k].status = -10;
+				nfailed++;
+			}
+			break;
+		}
+		if (cnt == 0) {		// nothing comes - ask for the missing data
+			retry = 0;
+			for (k=0; k<n; k++) {
+				r = &req[k];
+				if (r->status <= 0) continue;
+				if (r->retry >= UDPENGINE_RETRIES) {
+					Log(ERROR, "UDP receive timeout from %d.%d.%d.%d @ %d bytes after %d retries\n",
+						(r->IP>>24) & 0xFF, (r->IP>>16) & 0xFF, (r->IP>>8) & 0xFF, r->IP & 0xFF, r->rcvcnt, r->retry);
+					masks[k].Dump(r->fifo_addr);
+					r->status = -20;
+				} else {
+					r->retry++;
+					if (Recover(r, &masks[k])) r->status = -10;
+				}
+				if (r->status < 0) {
+					nfailed++;
+					nactive--;
+				} else if (r->retry > retry) {
+					retry = r->retry;
+				}
+			}
+			timeout = RetryTimeout(retry);
+			continue;
+		}
+		if (first) {	// the reply delay tells how long to wait before asking again
+			first = 0;
+			irc = GetTime() - tstart;
+			srtt = (srtt) ? (7 * srtt + irc) / 8 : irc;
+			timeout = RetryTimeout(retry);
+		}
+		for (i=0; i<cnt; i++) {
+			irc = msgs[i].msg_len;
+			w = (unsigned *) iov[i].iov_base;
+			if (irc < UDPENGINE_HDRLEN) {
+				Log(ERROR, "Strange block of length %d received\n", irc);
+				nstray++;
+				continue;
+			}
+			if (ntohl(w[0]) & 0x80000000) {
+				Log(ERROR, "Error state signalled from the module\n");
+				continue;
+			}
+			ln = ntohl(w[2]);
+			if (ln != irc - UDPENGINE_HDRLEN) {
+				Log(ERROR, "Length mismatch received = %d: %8.8X %8.8X %8.8X\n",
+					irc - UDPENGINE_HDRLEN, ntohl(w[0]), ntohl(w[1]), ntohl(w[2]));
+				continue;
+			}
+			//	find the request
+			r = NULL;
+			addr = 0;
+			for (k=0; k<n; k++) {
+				if (req[k].status <= 0 || from[i].sin_addr.s_addr != htonl(req[k].IP)) continue;
+				addr = ntohl(w[1]) - req[k].fifo_addr;
+				if (addr >= 0 && addr + ln <= req[k].len) {
+					r = &req[k];
+					break;
+				}
+			}
+			if (!r) {	// other modules, finished requests or wrong addresses
+				nstray++;
+				continue;
+			}
+			if (masks[k].Get(addr / UDPENGINE_CHUNK)) {
+				nduplicates++;
+				if (!r->retry) Log(INFO, "Duplicated udp packet for SDRAM address 0x%8.8X\n", ntohl(w[1]));
+				continue;
+			}
+			masks[k].Set(addr / UDPENGINE_CHUNK);
+			r->rcvcnt += ln;
+			npackets++;
+			nbytes += ln;
+			memcpy((char *)r->data + addr, &w[3], ln);
+			tdone = RxTime(&msgs[i].msg_hdr);
+			if (tdone > r->tdone) r->tdone = tdone;
+			if (r->rcvcnt >= r->len) {
+				r->status = 0;
+				if (r->retry) nrecovered++;
+				nactive--;
+			}
+		}
+	}
+	for (k=0; k<n; k++) if (req[k].status) return req[k].status;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Request again the ranges missing in the mask
+//	Return 0 on success, negative on error
+int udpengine::Recover(struct udpread_struct *r, udpmask *m)
+{
+	int i, j, nreq;
+	int rlen;
+
+	nreq = 0;
+	for (i=0; i<m->GetCount() && nreq < UDPENGINE_MAXREQ; i = j) {
+		if (m->Get(i)) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < m->GetCount() && !m->Get(j); j++);
+		rlen = j * UDPENGINE_CHUNK;
+		if (rlen > r->len) rlen = r->len;
+		rlen -= i * UDPENGINE_CHUNK;
+		if (Command(r->IP, r->cmdport, r->fifo_addr + i * UDPENGINE_CHUNK, rlen) < 0) {
+			Log(ERROR, "Can not send read command to %d.%d.%d.%d via UDP: %m\n",
+				(r->IP>>24) & 0xFF, (r->IP>>16) & 0xFF, (r->IP>>8) & 0xFF, r->IP & 0xFF);
+			return -10;
+		}
+		Log(DEBUG, "UDP retransmit SDRAM[0x%8.8X] %d bytes\n", r->fifo_addr + i * UDPENGINE_CHUNK, rlen);
+		nretransmits++;
+		nlost += j - i;
+		nreq++;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Get a batch of datagrams, wait up to timeout ms if there is none
+//	Return number of datagrams, 0 on timeout, negative on error
+int udpengine::Receive(int timeout)
+{
+	struct epoll_event ev;
+	int i, irc;
+
+	for (;;) {
+		for (i = 0; i < UDPENGINE_BATCH; i++) {
+			msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+			msgs[i].msg_hdr.msg_controllen = UDPENGINE_CTRLLEN;
+		}
+		irc = recvmmsg(sock, msgs, UDPENGINE_BATCH, MSG_DONTWAIT, NULL);
+		if (irc > 0) return irc;
+		if (irc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+		irc = epoll_wait(epfd, &ev, 1, timeout);
+		if (irc == 0) return 0;
+		if (irc < 0 && errno != EINTR) return -1;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Time to wait for the next datagram before missing data is requested again, ms
+int udpengine::RetryTimeout(int retry)
+{
+	int tmo;
+
+	if (!srtt || retry >= UDPENGINE_RETRIES) return UDPENGINE_TIMEOUT;	// nothing measured yet or the last chance
+	tmo = (8 * srtt) / 1000 + 1;
+	if (tmo < UDPENGINE_MINTIMEOUT) tmo = UDPENGINE_MINTIMEOUT;
+	tmo <<= retry;
+	if (tmo > UDPENGINE_TIMEOUT) tmo = UDPENGINE_TIMEOUT;
+	return tmo;
+}
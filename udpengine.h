@@ -0,0 +1,103 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Persistent UDP receiver for SDRAM readout via ethernet.
+*/
+#ifndef UDPENGINE_H
+#define UDPENGINE_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define UDPENGINE_CMDPORT	9000		// modules listen for commands here by default
+#define UDPENGINE_CHUNK		1024		// maximum payload of one datagram
+#define UDPENGINE_HDRLEN	12		// status, address, length - network order
+#define UDPENGINE_DGRAM		2048		// receive buffer for one datagram, more than enough
+#define UDPENGINE_BATCH		64		// datagrams per recvmmsg
+#define UDPENGINE_RCVBUF	0x1000000	// socket receive buffer wanted
+#define UDPENGINE_TIMEOUT	500		// ms without any datagram to declare the read failed
+#define UDPENGINE_MINTIMEOUT	2		// ms, the shortest wait before missing data is requested again
+#define UDPENGINE_RETRIES	5		// requests for missing data before the read fails
+#define UDPENGINE_MAXREQ	64		// missing ranges requested at once
+#define UDPENGINE_MAXPORTS	16
+#define UDPENGINE_MAXREQS	64		// block reads done at once
+#define UDPENGINE_CTRLLEN	64		// control data of a datagram: the receive time
+
+//	One block read
+struct udpread_struct {
+	unsigned IP;		// module IP
+	int cmdport;		// module command port
+	unsigned int fifo_addr;	// absolute address in the SDRAM
+	void *data;		// buffer of len bytes, data is left in network order
+	int len;
+	int status;		// 0 - done, 1 - in progress, negative - error
+	int rcvcnt;		// bytes received
+	int retry;		// requests for missing data sent
+	long long tstart;	// us, CLOCK_REALTIME: the command sent
+	long long tdone;	// and the last datagram of the block taken by the kernel
+};
+
+//	Bitmap of received 1k chunks of one block read
+class udpmask {
+private:
+	unsigned *bits;
+	int size;		// allocated words
+	int nchunks;		// chunks in the current read
+public:
+	udpmask(void);
+	~udpmask(void);
+	inline int Get(int num) { return (bits[num >> 5] >> (num & 31)) & 1; };
+	inline int GetCount(void) { return nchunks; };
+	int Reset(int len);
+	inline void Set(int num) { bits[num >> 5] |= 1 << (num & 31); };
+	void Dump(unsigned int fifo_addr);
+};
+
+//	One bound socket per host port shared by all modules sending to this port
+class udpengine {
+private:
+	int port;
+	int refcnt;
+	int sock;
+	int epfd;
+	char *buf;				// UDPENGINE_BATCH datagrams
+	struct mmsghdr msgs[UDPENGINE_BATCH];
+	struct iovec iov[UDPENGINE_BATCH];
+	struct sockaddr_in from[UDPENGINE_BATCH];
+	char ctrl[UDPENGINE_BATCH][UDPENGINE_CTRLLEN];
+	udpmask masks[UDPENGINE_MAXREQS];	// one per request, kept between reads
+	int srtt;			// smoothed delay between the command and the first reply, us
+	long long tstart;		// when the last commands were sent, us
+	//	statistics
+	long long npackets;
+	long long nbytes;
+	long long nduplicates;
+	long long nstray;		// from other modules or for other reads
+	long long nreads;
+	int nfailed;
+	long long nretransmits;		// commands sent for missing ranges
+	long long nlost;		// chunks requested again
+	long long nrecovered;		// reads completed after retransmission
+	static udpengine *engines[UDPENGINE_MAXPORTS];
+	udpengine(int hport);
+	~udpengine(void);
+	void Flush(void);
+	int Open(void);
+	int Receive(int timeout);
+	int Recover(struct udpread_struct *r, udpmask *m);
+	int RetryTimeout(int retry);
+public:
+	static udpengine *Get(int hport);
+	static void Put(udpengine *engine);
+	int Command(unsigned IP, int cmdport, unsigned int fifo_addr, int len);
+	inline long long GetLost(void) { return nlost; };
+	inline long long GetPackets(void) { return npackets; };
+	inline int GetPort(void) { return port; };
+	inline long long GetRetransmits(void) { return nretransmits; };
+	void PrintStat(void);
+	int Read(unsigned IP, unsigned int fifo_addr, void *data, int len, int cmdport = UDPENGINE_CMDPORT);
+	int ReadMulti(struct udpread_struct *req, int n);
+	int ReadStart(struct udpread_struct *req, int n);
+	int ReadWait(struct udpread_struct *req, int n);
+};
+
+#endif /* UDPENGINE_H */
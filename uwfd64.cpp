@@ -14,12 +14,52 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "blkdecode.h"
 #include "libvmemap.h"
+#include "linefit.h"
 #include "log.h"
+#include "udpengine.h"
 #include "uwfd64.h"
 
+//	Convert words received via UDP from network order. SSSE3 shuffle when the CPU has it.
+#if (defined(__x86_64__) || defined(__i386__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+__attribute__((target("ssse3")))
+static void SwapWordsSSSE3(unsigned int *data, int n)
+{
+	const __m128i shuf = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m128i *ptr;
+	int i;
+
+	ptr = (__m128i *) data;
+	for (i = 0; i + 4 <= n; i += 4, ptr++)
+		_mm_storeu_si128(ptr, _mm_shuffle_epi8(_mm_loadu_si128(ptr), shuf));
+	for (; i < n; i++) data[i] = ntohl(data[i]);
+}
+#endif
+
+static void SwapWords(unsigned int *data, int n)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	int i;
+#if defined(__x86_64__) || defined(__i386__)
+	static int ssse3 = -1;
+
+	if (ssse3 < 0) ssse3 = __builtin_cpu_supports("ssse3");
+	if (ssse3) {
+		SwapWordsSSSE3(data, n);
+		return;
+	}
+#endif
+	for (i = 0; i < n; i++) data[i] = ntohl(data[i]);
+#endif
+}
+
 //	Constructor - only set addresses here
 uwfd64::uwfd64(int sernum, int gnum, unsigned short *space_a16, unsigned int *space_a32, int fd, config_t *cnf)
 {
@@ -31,9 +71,12 @@ uwfd64::uwfd64(int sernum, int gnum, unsigned short *space_a16, unsigned int *sp
 	a16 = (struct uwfd64_a16_reg *)((char *)space_a16 + serial * A16STEP);
 	a32 = (struct uwfd64_a32_reg *)((char *)space_a32 + ga * A32STEP);
 	dma_fd = fd;
+	udp = NULL;
+	noudp = 0;
 	// initial configuration - empty
 	memset(&Conf, 0, sizeof(Conf));
 	Conf.FifoEnd = 1;	// minimum FIFO size of 8kBytes
+	Conf.cmdport = UDPENGINE_CMDPORT;
 	if (cnf) ReadConfig(cnf);
 	// Set base address for A32 - emulate geographic and its parity
 	if (IsHere()) {
@@ -42,11 +85,28 @@ uwfd64::uwfd64(int sernum, int gnum, unsigned short *space_a16, unsigned int *sp
 		s = 1 - (s & 1);
 		a16->c2x = (CPLD_C2X_RESET + ga * CPLD_C2X_GA + s * CPLD_C2X_PARITY) << 8;
 	}
+	if ((Conf.blk_transp == UWFD64_BLK_UDP || Conf.blk_transp == UWFD64_BLK_STRIPED) && (GetVersion() < 0x20005 || !Conf.IP)) {
+		Log(WARN, "Module %d: UDP block transport needs firmware 2.5 and IP configured, using VME\n", serial);
+		Conf.blk_transp = UWFD64_BLK_AUTO;
+	}
 	// Determine block transport for auto
-	if (Conf.blk_transp == UWFD64_BLK_AUTO) {
+	vme_transp = Conf.blk_transp;
+	if (vme_transp == UWFD64_BLK_AUTO || vme_transp == UWFD64_BLK_UDP || vme_transp == UWFD64_BLK_STRIPED) {
 		i = vmemap_a64_blkread(A64UNIT, 0, &buf, sizeof(buf));	// try to read A64
-		Conf.blk_transp = (i) ? UWFD64_BLK_A32_BLT : UWFD64_BLK_A64_BLT;
+		vme_transp = (i) ? UWFD64_BLK_A32_BLT : UWFD64_BLK_A64_BLT;
 	}
+	if (Conf.blk_transp == UWFD64_BLK_AUTO) Conf.blk_transp = vme_transp;
+	memset(&stripe, 0, sizeof(stripe));
+	stripe.vme_frac = 0.5;
+	zs = NULL;
+	bc = NULL;
+}
+
+uwfd64::~uwfd64(void)
+{
+	udpengine::Put(udp);
+	if (zs) delete zs;
+	if (bc) delete bc;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -303,33 +363,6 @@ int uwfd64::ADCAdjust(int adcmask = 0xFFFF)
 	return 0;
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////
-//	Allocate udp port to listen all interfaces
-int uwfd64::AllocateUDPport(int port)
-{
-	int sock;
-	struct sockaddr_in address;
-	int flags;
-
-	/* Create the socket. */
-	sock = socket(PF_INET, SOCK_DGRAM, 0);
-	if (sock < 0) return sock;
-
-	/* Give the socket a name. */
-	address.sin_family = AF_INET;
-	address.sin_addr.s_addr = htonl(INADDR_ANY);
-	address.sin_port = htons(port);
-
-	if (bind(sock, (struct sockaddr *) &address, sizeof(address)) < 0) return -20;
-
-	flags = fcntl(sock, F_GETFL);
-	if (flags < 0) return flags;
-	flags |= O_NONBLOCK;
-	if (fcntl(sock, F_SETFL, flags) < 0) return -30;
-
-	return sock;
-}
-
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //	Do block transwer to/from fifo using configured transport
 //	fifo_addr - address in fifo
@@ -340,38 +373,26 @@ int uwfd64::AllocateUDPport(int port)
 int uwfd64::BlockTransfer(unsigned int fifo_addr, unsigned int *data, int len, int wr)
 {
 	int irc;
-	int adr, ln, done;
-	
-	irc = 0;
-	if (!len) return irc;	// nothing to do
+
+	if (!len) return 0;	// nothing to do
+	if (wr) return VMETransfer(fifo_addr, data, len, wr);	// writes are always via VME
 	switch (Conf.blk_transp) {
-	case UWFD64_BLK_A64_BLT:
-		irc = vmemap_a64_dma(dma_fd, GetBase64() + fifo_addr, data, len, wr);
-		break;
-	case UWFD64_BLK_A64_MAP:
-		irc = (wr) ? vmemap_a64_blkwrite(A64UNIT, GetBase64() + fifo_addr, data, len) : vmemap_a64_blkread(A64UNIT, GetBase64() + fifo_addr, data, len);
+	case UWFD64_BLK_UDP:
+		if (!GetUDP()) {
+			if (!noudp) Log(WARN, "Module %d: no UDP receiver on port %d, data is read via VME\n", serial, Conf.port);
+			noudp = 1;
+			irc = VMETransfer(fifo_addr, data, len, wr);
+			break;
+		}
+		irc = UDPBlockRead(fifo_addr, data, len);
+		if (!irc) SwapWords(data, len / sizeof(int));	// network order -> host
 		break;
-	case UWFD64_BLK_A32_BLT:
-		ln = 0;
-		a32->fifo.wptr = fifo_addr;
-		for (done = 0; done < len; done += ln) {
-			ln = len - done;
-			if (ln > UWFD64_A32_FIFO_WIN) ln = UWFD64_A32_FIFO_WIN;
-			irc = vmemap_a32_dma(dma_fd, GetBase32() + UWFD64_A32_FIFO, data + done / sizeof(int), ln, wr);
-//			printf("DMA irc = %d\n", irc);
-			if (irc != 0) break;
-		}
-		break;
-	case UWFD64_BLK_A32_MAP:
-		a32->fifo.wptr = fifo_addr;
-		if (wr) {
-			for (done = 0; done < len / sizeof(int); done++) ((unsigned int *)a32)[UWFD64_A32_FIFO / sizeof(int)] = data[done];
-		} else {
-			for (done = 0; done < len / sizeof(int); done++) data[done] = ((unsigned int *)a32)[UWFD64_A32_FIFO / sizeof(int)];
-		}
+	case UWFD64_BLK_STRIPED:
+		irc = StripedRead(fifo_addr, data, len);
 		break;
 	default:
-		irc = -1;
+		irc = VMETransfer(fifo_addr, data, len, wr);
+		break;
 	}
 	return irc;
 }
@@ -691,35 +712,94 @@ int uwfd64::GetADCID(int num)
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-//	Try to get data from FIFO
-//	buf - buffer for data
-//	size - buffer size
-//	Return number of bytes got, 0 - no data, negative on errors
-int uwfd64::GetFromFifo(void *buf, int size)
+//	Move the FIFO read pointer from rptr over len bytes read
+void uwfd64::FifoAdvance(int rptr, int len)
 {
 	int fifobot, fifotop, fifolen;
-	int rptr, wptr, len;
+
+	fifolen = a32->fifo.win;
+	fifobot = (fifolen & 0xFFFF) << 13;
+	fifotop = (fifolen >> 3) & 0x1FFFE000;
+	rptr += len;
+	if (rptr == fifotop) rptr = fifobot;
+	a32->fifo.rptr = rptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Find the data in the FIFO, up to size bytes not crossing the FIFO end
+//	rptr - gets the FIFO address of the data
+//	Return number of bytes, 0 - no data, negative on errors
+int uwfd64::FifoData(int size, int *rptr)
+{
+	int fifobot, fifotop, fifolen;
+	int wptr, len;
 	
-	rptr = a32->fifo.rptr;
+	*rptr = a32->fifo.rptr;
 	wptr = a32->fifo.wptr;
 
-	if (rptr == wptr) return 0;
+	if (*rptr == wptr) return 0;
 
 	fifolen = a32->fifo.win;
 	fifobot = (fifolen & 0xFFFF) << 13;
 	fifotop = (fifolen >> 3) & 0x1FFFE000;
 	fifolen = fifotop - fifobot;
 
-	len = wptr - rptr;
+	len = wptr - *rptr;
 	if (len < 0) len += fifolen;
 	if (len < 0) return -1;
 	if (len > size) len = size;
-	if (rptr + len > fifotop) len = fifotop - rptr;
+	if (*rptr + len > fifotop) len = fifotop - *rptr;
+	return len;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Finish the FIFO read of the request filled by FifoRequest() after udpengine::ReadWait()
+//	Return number of bytes got, negative on errors
+int uwfd64::FifoDone(struct udpread_struct *req)
+{
+	if (req->status) return -2;
+	SwapWords((unsigned int *) req->data, req->len / sizeof(int));	// network order -> host
+	FifoAdvance(req->fifo_addr, req->len);
+	return req->len;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Fill the UDP request for the data in FIFO. The requests of all modules sending to the same
+//	host port are started together by udpengine::ReadStart(), so the modules send at once,
+//	then udpengine::ReadWait() and FifoDone() for each of them finish the reads.
+//	buf - buffer for data
+//	size - buffer size
+//	Return number of bytes requested, 0 - no data, negative on errors
+int uwfd64::FifoRequest(void *buf, int size, struct udpread_struct *req)
+{
+	int rptr, len;
+
+	len = FifoData(size, &rptr);
+	if (len <= 0) return len;
+	req->IP = Conf.IP;
+	req->cmdport = Conf.cmdport;
+	req->fifo_addr = rptr;
+	req->data = buf;
+	req->len = len;
+	return len;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Try to get data from FIFO
+//	buf - buffer for data
+//	size - buffer size
+//	addr - if not NULL, gets the FIFO address the data was read from
+//	Return number of bytes got, 0 - no data, negative on errors
+int uwfd64::GetFromFifo(void *buf, int size, unsigned int *addr)
+{
+	int rptr, len;
+
+	len = FifoData(size, &rptr);
+	if (len <= 0) return len;
+	if (addr) *addr = rptr;
 
 	if (BlockTransfer(rptr, (unsigned int *)buf, len, 0)) return -2;
-	rptr += len;
-	if (rptr == fifotop) rptr = fifobot;
-	a32->fifo.rptr = rptr;
+	FifoAdvance(rptr, len);
 	
 	return len;
 }
@@ -1112,6 +1192,31 @@ err:
 	return -10;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Print integrity check counters if it is on
+void uwfd64::PrintCheckStat(void)
+{
+	if (bc) bc->PrintStat(serial);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Print striped readout statistics
+void uwfd64::PrintStripeStat(void)
+{
+	if (Conf.blk_transp != UWFD64_BLK_STRIPED) return;
+	printf("Module %d striped readout: VME %Ld bytes %.1f MBytes/s %d errors, UDP %Ld bytes %.1f MBytes/s %d errors, VME part %.2f%s\n",
+		serial, stripe.vme_bytes, stripe.vme_bw * 1000000 / MBYTE, stripe.vme_errors,
+		stripe.udp_bytes, stripe.udp_bw * 1000000 / MBYTE, stripe.udp_errors, stripe.vme_frac,
+		(stripe.disabled) ? ", UDP disabled" : "");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Print host zero suppression statistics if it is on
+void uwfd64::PrintZeroSupStat(void)
+{
+	if (zs) zs->PrintStat(serial);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //	Prog Xilinxes with binary file fname
 //	Pulse prog only if fname = NULL
@@ -1374,12 +1479,59 @@ void uwfd64::ReadConfig(config_t *cnf)
 		sprintf(str, "%s.InvertMask", sect);
 		ptr = config_lookup(cnf, str);
 		if (ptr) for (j=0; j<4; j++) Conf.InvertMask[j] = config_setting_get_int_elem(ptr, j);
+//	int SoftZSMode;		// Host zero suppression: 0 - off, 1 - drop, 2 - truncate blocks below threshold
+		sprintf(str, "%s.SoftZSMode", sect);
+		if (config_lookup_int(cnf, str, &tmp)) {
+			Conf.SoftZSMode = tmp;
+		}
+//	int SoftZSPedLen;	// Host zero suppression: samples at the block beginning for the pedestal
+		sprintf(str, "%s.SoftZSPedLen", sect);
+		if (config_lookup_int(cnf, str, &tmp)) {
+			tmp &= 0x1FF;
+			Conf.SoftZSPedLen = tmp;
+		}
+//	int SoftZSWinBegin;	// Host zero suppression window begin (from the first sample)
+		sprintf(str, "%s.SoftZSWinBegin", sect);
+		if (config_lookup_int(cnf, str, &tmp)) {
+			tmp &= 0x1FF;
+			Conf.SoftZSWinBegin = tmp;
+		}
+//	int SoftZSWinEnd;	// Host zero suppression window end, 0 - to the end of the block
+		sprintf(str, "%s.SoftZSWinEnd", sect);
+		if (config_lookup_int(cnf, str, &tmp)) {
+			tmp &= 0x1FF;
+			Conf.SoftZSWinEnd = tmp;
+		}
+//	short int SoftZSThreshold[64];	// Host zero suppression thresholds over the pedestal, one number for all channels or a list
+		sprintf(str, "%s.SoftZSThreshold", sect);
+		if (config_lookup_int(cnf, str, &tmp)) {
+			for (j=0; j<64; j++) Conf.SoftZSThreshold[j] = tmp;
+		} else {
+			ptr = config_lookup(cnf, str);
+			if (ptr) for (j=0; j<64; j++) Conf.SoftZSThreshold[j] = config_setting_get_int_elem(ptr, j);
+		}
+//	int DataCheck;		// Streaming integrity check of the data read: 0 - off, 1 - on
+		sprintf(str, "%s.DataCheck", sect);
+		if (config_lookup_int(cnf, str, &tmp)) {
+			Conf.DataCheck = tmp;
+		}
+//	int DataCheckBad;	// Offending blocks remembered by the integrity check
+		sprintf(str, "%s.DataCheckBad", sect);
+		if (config_lookup_int(cnf, str, &tmp)) {
+			Conf.DataCheckBad = tmp;
+		}
 //	unsigned short port;		// Destination UDP port
 		sprintf(str, "%s.port", sect);
 		if (config_lookup_int(cnf, str, &tmp)) {
 			tmp &= 0xFFFF;
 			Conf.port = tmp;
 		}
+//	unsigned short cmdport;		// Module command UDP port
+		sprintf(str, "%s.CmdPort", sect);
+		if (config_lookup_int(cnf, str, &tmp)) {
+			tmp &= 0xFFFF;
+			Conf.cmdport = tmp;
+		}
 //	unsigned long long MAC;		// Our MAC address
 		sprintf(str, "%s.MAC", sect);
 		if (config_lookup_string(cnf, str, (const char **) &stmp)) {
@@ -1411,40 +1563,121 @@ void uwfd64::ResetFifo(int mask)
 {
 	a32->fifo.csr |= mask & (FIFO_CSR_HRESET | FIFO_CSR_SRESET); 
 	vmemap_usleep(2000);
+	if (zs) zs->Reset();
+	if (bc) bc->Reset();
 };
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-//	Send FIFO read command via UDP
-//	IP - module IP
-//	fifo_addr - absolute address in the memory
-//	len - data length in bytes
+//	Read a block splitting it between VME DMA and UDP. The UDP part is requested first
+//	and comes while the DMA runs. The split follows the measured speed of both paths,
+//	a failed part is read again via the other path. After too many UDP errors in a row
+//	reads go via VME only, UDP is tried again every UWFD64_STRIPE_PROBE reads.
 //	Return 0 on success
-int uwfd64::SendUDPCommand(unsigned IP, int fifo_addr, int len)
+int uwfd64::StripedRead(unsigned int fifo_addr, unsigned int *data, int len)
 {
-	int sock;
-	struct sockaddr_in address;
-	int msg[3];
-	int irc;
-
-	/* Create the socket. */
-	sock = socket(PF_INET, SOCK_DGRAM, 0);
-	if (sock < 0) return sock;
-
-	/* Give the socket a name. */
-	address.sin_family = AF_INET;
-	address.sin_addr.s_addr = htonl(IP);
-	address.sin_port = htons(9000);
-
-	msg[0] = htonl(1);	// the command
-	msg[1] = htonl(fifo_addr);
-	msg[2] = htonl(len);
+	struct udpread_struct req;
+	struct timeval t[3];
+	int vlen;
+	int irc, virc;
+	double dt;
+
+	if (len < UWFD64_STRIPE_MIN || !GetUDP()) return VMETransfer(fifo_addr, data, len, 0);
+	if (stripe.disabled && ++stripe.probe < UWFD64_STRIPE_PROBE) return VMETransfer(fifo_addr, data, len, 0);
+	stripe.probe = 0;		// UDP is tried again from time to time
+	vlen = (int)(len * stripe.vme_frac) & ~(UDPENGINE_CHUNK - 1);
+	if (vlen <= 0 || vlen >= len) vlen = (len / 2) & ~(UDPENGINE_CHUNK - 1);
+	req.IP = Conf.IP;
+	req.cmdport = Conf.cmdport;
+	req.fifo_addr = fifo_addr + vlen;
+	req.data = (char *) data + vlen;
+	req.len = len - vlen;
+
+	gettimeofday(&t[0], NULL);
+	irc = udp->ReadStart(&req, 1);
+	virc = VMETransfer(fifo_addr, data, vlen, 0);
+	gettimeofday(&t[1], NULL);
+	if (!irc) irc = udp->ReadWait(&req, 1);
+	gettimeofday(&t[2], NULL);
+
+	if (virc) {
+		stripe.vme_errors++;
+		Log(WARN, "Module %d: VME part of striped read failed (%d), reading it via UDP\n", serial, virc);
+		virc = UDPBlockRead(fifo_addr, data, vlen);
+		if (virc) return -2;
+		SwapWords(data, vlen / sizeof(int));
+	} else {
+		stripe.vme_bytes += vlen;
+		dt = (t[1].tv_sec - t[0].tv_sec) * 1000000.0 + (t[1].tv_usec - t[0].tv_usec);
+		if (dt > 0) stripe.vme_bw = (stripe.vme_bw > 0) ? 0.875 * stripe.vme_bw + 0.125 * vlen / dt : vlen / dt;
+	}
+	if (irc) {
+		stripe.udp_errors++;
+		stripe.udp_errcnt++;
+		if (stripe.udp_errcnt >= UWFD64_STRIPE_MAXERR && !stripe.disabled) {
+			stripe.disabled = 1;
+			Log(ERROR, "Module %d: %d UDP errors in a row, striped readout is switched to VME only, UDP is tried every %d reads\n",
+				serial, stripe.udp_errcnt, UWFD64_STRIPE_PROBE);
+		}
+		irc = VMETransfer(fifo_addr + vlen, (unsigned int *) req.data, req.len, 0);
+		if (irc) return irc;
+	} else {
+		if (stripe.disabled) Log(INFO, "Module %d: UDP works again, striped readout is back\n", serial);
+		stripe.disabled = 0;
+		stripe.udp_errcnt = 0;
+		stripe.udp_bytes += req.len;
+		SwapWords((unsigned int *) req.data, req.len / sizeof(int));	// network order -> host
+		// the datagrams waiting while the DMA ran came at the speed of the link: time them by their arrival
+		dt = (req.tdone > 0) ? req.tdone - req.tstart : (t[2].tv_sec - t[0].tv_sec) * 1000000.0 + (t[2].tv_usec - t[0].tv_usec);
+		if (dt > 0) stripe.udp_bw = (stripe.udp_bw > 0) ? 0.875 * stripe.udp_bw + 0.125 * req.len / dt : req.len / dt;
+	}
+	if (stripe.vme_bw > 0 && stripe.udp_bw > 0) {	// keep both paths in use so that both speeds stay measured
+		stripe.vme_frac = stripe.vme_bw / (stripe.vme_bw + stripe.udp_bw);
+		if (stripe.vme_frac < 0.1) stripe.vme_frac = 0.1;
+		if (stripe.vme_frac > 0.9) stripe.vme_frac = 0.9;
+	}
+	return 0;
+}
 
-	irc = sendto(sock, msg, sizeof(msg), 0, (struct sockaddr *) &address, sizeof(address));
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Begin the integrity check of the data read with the current configuration, counters are cleared.
+//	Called at the start of a run, CheckData() does nothing if DataCheck is 0.
+void uwfd64::StartCheck(void)
+{
+	struct blkcheck_config bcc;
+
+	if (bc) delete bc;
+	bc = NULL;
+	if (!Conf.DataCheck) return;
+	bcc.WinLen = Conf.WinLen;
+	bcc.MaxBad = Conf.DataCheckBad;
+	bc = new blkcheck(&bcc);
+}
 
-	close(sock);
-	return irc;
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Begin host zero suppression of the data read with the current configuration, counters are cleared.
+//	Called at the start of a run, ZeroSup() keeps data as they are if SoftZSMode is 0.
+void uwfd64::StartZeroSup(void)
+{
+	struct zerosup_config zc;
+
+	if (zs) delete zs;
+	zs = NULL;
+	if (!Conf.SoftZSMode) return;
+	if (Conf.SoftZSWinEnd > 0 && Conf.SoftZSWinBegin >= Conf.SoftZSWinEnd) {
+		Log(ERROR, "Module %d: empty zero suppression window %d - %d, data is not suppressed\n",
+			serial, Conf.SoftZSWinBegin, Conf.SoftZSWinEnd);
+		return;
+	}
+	zc.Mode = Conf.SoftZSMode;
+	zc.PedLen = Conf.SoftZSPedLen;
+	zc.WinBegin = Conf.SoftZSWinBegin;
+	zc.WinEnd = Conf.SoftZSWinEnd;
+	memcpy(zc.Threshold, Conf.SoftZSThreshold, sizeof(zc.Threshold));
+	memcpy(zc.InvertMask, Conf.InvertMask, sizeof(zc.InvertMask));
+	zs = new zerosup(&zc);
 }
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //	Set or pulse soft trigger
 //	freq > 0 - soft trigger period in ms
@@ -1598,86 +1831,92 @@ void lslope(short * y, int len, double * slope, double * chi2) {
 int analyse(short *buf, int len, int ttype, int token, int blklen, double *slope, double *chi2) {
 
 	int pres[69];
-	int i, j, rlen, blktype, chn, errflag, errcnt=0;
+	int i, irc, rlen, blktype, chn, errflag, errcnt=0;
+	short data[BLK_MAXLEN];		// samples with the sign extended, buf is not changed
+	blkdecoder dec;
+	struct blk_view v;
+	linefit fit(blklen - 2);	// all waveforms of WinLen samples are fitted together at the end
+	struct lfit_result res[LFIT_MAXCHAN];
 
 	memset(slope, 0, 68*sizeof(double));
 	memset(chi2, 0, 68*sizeof(double));
 	memset(pres, 0, sizeof(pres));
 
 	// analyse
-	for (j=0; j<len/sizeof(short); ) {
-		// control word
-		if (buf[j] & 0x8000) {
-			rlen = buf[j] & 0x1FF;
-			if (rlen == 0) {	// this is alignment
-				j++;
-				continue;
+	dec.Feed(buf, len);
+	while ((irc = dec.Next(&v)) != BLK_END) {
+		if (irc == BLK_STRAY) {		// not a control word
+			errcnt += v.len;
+			continue;
+		}
+		if (irc == BLK_PART) {
+			printf("Block of channel %2.2X is cut at the end of data\n", v.chan);
+			errcnt++;
+			break;
+		}
+		rlen = v.len;
+		chn = v.chan;
+		blktype = v.type;
+//		printf("chn = %d, blktype = %d\n", chn, blktype);
+		if (ttype < 0) {		// only selftriggers
+			if (blktype != BLK_SELF) {
+				printf("Wrong blktype=%d encountered for selftrigger test, channel %2.2X\n", blktype, chn);
+				errcnt++;
+			} else {	// selftrigger block
+				if (fit.Add(chn, v.data, v.ndata)) {
+					blk_samples(v.data, v.ndata, data);
+					lslope(data, v.ndata, &slope[chn], &chi2[chn]);
+				}
+				pres[chn] ++;
 			}
-			chn = (buf[j] >> 9) & 0x3F;
-			blktype = (buf[j+1] >> 12) & 7;
-//			printf("chn = %d, blktype = %d\n", chn, blktype);
-			if (ttype < 0) {		// only selftriggers
-				if (blktype != 0) {
-					printf("Wrong blktype=%d encountered for selftrigger test, channel %2.2X\n", blktype, chn);
-					errcnt++;
-				} else {	// selftrigger block
-					// extend sign in data
-					for (i=0; i<rlen-2; i++) if (buf[j+i+3] & 0x4000) buf[j+i+3] |= 0x8000;
-					lslope(&buf[j+3], rlen-2, &slope[chn], &chi2[chn]);
-					pres[chn] ++;
+		} else {		// master trigger, trigger block or history block
+			if (((token & 0x3FF) != v.token) || v.err) {
+				printf("Token error in channel %2.2X: %3.3X(%3.3X)\n", chn, v.cw[1] & 0x7FF, token & 0x3FF);
+				errcnt ++;
+			}
+			switch (blktype) {
+			case BLK_TRIGINFO:	// trigger block
+				if (rlen != 7) {
+					printf("Wrong length of trigger block %d != 7\n", rlen);
+					errcnt ++;
+					break;
 				}
-			} else {		// master trigger, trigger block or history block
-				if (((token & 0x3FF) != (buf[j+1] & 0x3FF)) || (buf[j+1] & 0x400)) {
-					printf("Token error in channel %2.2X: %3.3X(%3.3X)\n", chn, buf[j+1] & 0x7FF, token & 0x3FF);
+				if (!(((chn & 0xF) == 0xF) || ((chn & 0x10) == 0x10)) || ((chn & 0x20) != 0) ) {
+					printf("Wrong trigger source %2.2X (0xF or 0x10)\n", chn);
 					errcnt ++;
 				}
-				switch (blktype) {
-				case 2:		// trigger block
-					if (rlen != 7) {
-						printf("Wrong length of trigger block %d != 7\n", rlen);
-						errcnt ++;
-						break;
-					}
-					if (!(((chn & 0xF) == 0xF) || ((chn & 0x10) == 0x10)) || ((chn & 0x20) != 0) ) {
-						printf("Wrong trigger source %2.2X (0xF or 0x10)\n", chn);
-						errcnt ++;
-					}
-					pres[68]++;
-					break;
-				case 4:		// history block
-					if (rlen != blklen) {
-						printf("Wrong length of history block %d != %d\n", rlen, blklen);
-						errcnt ++;
-						break;
-					}
-					// extend sign in data
-					for (i=0; i<rlen-2; i++) if (buf[j+i+3] & 0x4000) buf[j+i+3] |= 0x8000;
-					lslope(&buf[j+3], rlen-2, &slope[64 + (chn >> 4)], &chi2[64 + (chn >> 4)]);
-					pres[64 + (chn >> 4)]++;
-					break;
-				case 1:		// channel master trigger
-					if (rlen != blklen) {
-						printf("Wrong length of master data block %d != %d\n", rlen, blklen);
-						errcnt ++;
-						break;
-					}
-					// extend sign in data
-					for (i=0; i<rlen-2; i++) if (buf[j+i+3] & 0x4000) buf[j+i+3] |= 0x8000;
-					lslope(&buf[j+3], rlen-2, &slope[chn], &chi2[chn]);
-					pres[chn]++;
+				pres[68]++;
+				break;
+			case BLK_HISTORY:	// history block
+				if (rlen != blklen) {
+					printf("Wrong length of history block %d != %d\n", rlen, blklen);
+					errcnt ++;
 					break;
-				default:		// wrong type
-					printf("Wrong blktype=%d encountered for master trigger test, channel %2.2X\n", blktype, chn);
-					errcnt++;
+				}
+				fit.Add(64 + (chn >> 4), v.data, v.ndata);
+				pres[64 + (chn >> 4)]++;
+				break;
+			case BLK_MASTER:	// channel master trigger
+				if (rlen != blklen) {
+					printf("Wrong length of master data block %d != %d\n", rlen, blklen);
+					errcnt ++;
 					break;
 				}
+				fit.Add(chn, v.data, v.ndata);
+				pres[chn]++;
+				break;
+			default:		// wrong type
+				printf("Wrong blktype=%d encountered for master trigger test, channel %2.2X\n", blktype, chn);
+				errcnt++;
+				break;
 			}
-			j += rlen + 1;
-		} else {
-			j++;
-			errcnt++;
 		}
 	}
+	fit.Fit(res);
+	for (i = 0; i < LFIT_MAXCHAN; i++) if (fit.IsPresent(i)) {
+		slope[i] = res[i].slope;
+		chi2[i] = res[i].chi2;
+	}
 	errflag = 0;
 	for  (i=0; i<64; i++) {
 		if (pres[i] != 1) {
@@ -1908,14 +2147,15 @@ int uwfd64::TestFifo(int cnt)
 {
 	int errcnt, eflag;
 	unsigned short *buf;
-	int i, j, k, len, rlen, raddr, waddr;
+	int i, j, k, irc, len, raddr, waddr;
 	int blkcnt;
 	int fifobot, fifotop, fifosize;
+	blkdecoder dec(BLK_ALIGN | BLK_CHECK);	// keeps the block split between reads
+	struct blk_view v;
 	
 	buf = (unsigned short *) malloc(MBYTE);
 	if (!buf) return -1;
 	errcnt = 0;
-	rlen  = 0;
 //		reset FIFO and get fifo parameters
 	a32->fifo.csr &= ~FIFO_CSR_ENABLE;
 	ResetFifo(FIFO_CSR_HRESET);
@@ -1960,26 +2200,27 @@ int uwfd64::TestFifo(int cnt)
 			return -4;
 		}
 //		printf("\nraddr = 0x%X  len = %d\n", raddr, len);
-		for (k = 0; k < len / sizeof(short); k++) {
-			if (buf[k] & 0x8000) {
-//	control word
-				if (rlen) {
-					errcnt++;
-					eflag++;
-					printf("Error %6d: rlen = %4d  d = %4.4X @raddr = %X, addr = %X, len = %X\n", errcnt, rlen, buf[k], raddr, raddr + 2*k, len);
-				}
-				rlen = buf[k] & 0x1FF;
+		dec.Feed(buf, len);
+		while ((irc = dec.Next(&v)) != BLK_END) {
+			switch (irc) {
+			case BLK_OK:
+				blkcnt++;
+				break;
+			case BLK_SHORT:		// the next control word came before the block end
 				blkcnt++;
-//				printf("\nerrcnt = %d\n", errcnt);
-			} else if (rlen) {
-//	ordinary word
-				rlen--;
-			} else {
 				errcnt++;
 				eflag++;
-				printf("Error %6d: rlen = %4d  d = %4.4X @raddr = %X, addr = %X, len = %X\n", errcnt, rlen, buf[k], raddr, raddr + 2*k, len);
+				k = v.pos + v.len + 1;
+				printf("Error %6d: rlen = %4d  d = %4.4X @raddr = %X, addr = %X, len = %X\n", errcnt, v.missing, buf[k], raddr, raddr + 2*k, len);
+				break;
+			case BLK_STRAY:		// data words outside blocks
+				eflag++;
+				for (k = v.pos; k < v.pos + v.len; k++) {
+					errcnt++;
+					printf("Error %6d: rlen = %4d  d = %4.4X @raddr = %X, addr = %X, len = %X\n", errcnt, 0, buf[k], raddr, raddr + 2*k, len);
+				}
+				break;
 			}
-//			printf("%4.4X ", buf[k]);
 		}
 		if (eflag) {
 			for (k = 0; k < len / sizeof(short) && k < 0x80; k++) {	// don't want to print too much
@@ -2197,6 +2438,7 @@ int uwfd64::TestSDRAMUDP(int cnt)
 		}
 	}
 	free(buf);
+	if (udp) udp->PrintStat();
 	return errcnt;
 }
 
@@ -2219,133 +2461,102 @@ int uwfd64::TestSlaveReg16(int cnt)
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-//	Read block from SDRAM memory via UDP
-int uwfd64::UDPBlockRead(unsigned int fifo_addr, unsigned int *data, int len)
+//	Get the UDP receiver for the configured port
+//	Return NULL on error
+udpengine *uwfd64::GetUDP(void)
 {
-	int sock;
-	int buff[512];		// 2k is more than enough
-	int rcvcnt;
-	int timecnt;
-	int addr;
-	int ln;
-	int irc;
-	char *mask;
-	int lmask;
-	int i;
+	if (udp && udp->GetPort() != Conf.port) {	// configuration changed
+		udpengine::Put(udp);
+		udp = NULL;
+	}
+	if (!udp) udp = udpengine::Get(Conf.port);
+	return udp;
+}
 
-	lmask  = len /1024;
-	if (len % 1024) lmask++;
-	mask = (char *) malloc(lmask);
-	if (!mask) {
-		Log(ERROR, "Memory allocation (%d bytes) failed: %m\n", lmask);
-		return -10;
-	}
-	memset(mask, 0, lmask);
-
-	sock = AllocateUDPport(Conf.port);
-	if (sock < 0) {
-		Log(ERROR, "Can not allocate port %d: %m\n", Conf.port);
-		free(mask);
-		return -10;
-	}
-	irc = SendUDPCommand(Conf.IP, fifo_addr, len);
-	if (irc < 0) {
-		Log(ERROR, "Can not send read command to %d.%d.%d.%d via UDP: %m\n", 
-			(Conf.IP>>24) & 0xFF, (Conf.IP>>16) & 0xFF, (Conf.IP>>8) & 0xFF, Conf.IP & 0xFF);
-		free(mask);
-		return -10;
-	}
-	rcvcnt = 0;
-	timecnt = 0;
-
-	while (rcvcnt < len) {
-		irc = read(sock, buff, sizeof(buff));
-		if (irc >= 12) {
-			if (ntohl(buff[0]) & 0x80000000) {
-				Log(ERROR, "Error state signalled from the module\n");
-				continue;
-			}
-			ln = ntohl(buff[2]);
-			if (ln != irc - 12) {
-				Log(ERROR, "Length mismatch received = %d@%d: %8.8X %8.8X %8.8X\n", 
-					irc - 12, rcvcnt, ntohl(buff[0]), ntohl(buff[1]), ntohl(buff[2]));
-				continue;
-			}
-			addr = ntohl(buff[1]) - fifo_addr;
-			if (addr < 0 || addr + ln > len) {
-				Log(ERROR, "Address out of range: expected: %X-%X received: %X-%X\n",
-					fifo_addr, fifo_addr+len, ntohl(buff[1]), ntohl(buff[1]) + ln);
-				continue;
-			}
-			if (mask[addr/1024]) {
-				Log(INFO, "Duplicated udp packet for SDRAM address 0x%8.8X\n", ntohl(buff[1]));
-			} else {
-				mask[addr/1024]++;
-				rcvcnt += ln;
-				memcpy((char *)data + addr, &buff[3], ln);
-			}
-//			printf("%d bytes @%d\n", ln, addr);
-		} else if (irc > 0) {
-			Log(ERROR, "Strange block of length %d received\n", irc);
-			free(mask);
-			close(sock);
-			return -40;
-		} else if (errno == EAGAIN) {
-			timecnt++;
-			if (timecnt > 500) {	// should be enough
-				Log(ERROR, "UDP receive timeout @ %d bytes\n", rcvcnt);
-				for (i=0; i<lmask; i++) {
-					if(!(i & 63)) Log(DEBUG, "SDRAM[0x%8.8X]: ", fifo_addr + 1024*i);
-					Log(DEBUG, "%d", mask[i]);
-					if ((i & 7) == 7) Log(DEBUG, " ");
-					if ((i & 63) == 63) Log(DEBUG, "\n");
-				}
-				if (lmask & 63) Log(DEBUG, "\n");
-				free(mask);
-				close(sock);
-				return -20;
-			}
-			vmemap_usleep(1000);
-		} else {
-			Log(ERROR, "UDP receive error %m\n");
-			free(mask);
-			close(sock);
-			return -10;
-		}
-	}
-//	for (i=0; i<lmask; i++) {
-//		if(!(i & 63)) Log(DEBUG, "SDRAM[0x%8.8X]: ", fifo_addr + 1024*i);
-//		Log(DEBUG, "%d", mask[i]);
-//		if ((i & 7) == 7) Log(DEBUG, " ");
-//		if ((i & 63) == 63) Log(DEBUG, "\n");
-//	}
-//	if (lmask & 63) Log(DEBUG, "\n");
-	close(sock);
-	free(mask);
-	return 0;
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Read block from SDRAM memory via UDP. Data is left in network order.
+//	Return 0 on success, negative on error
+int uwfd64::UDPBlockRead(unsigned int fifo_addr, unsigned int *data, int len)
+{
+	if (!GetUDP()) return -10;
+	return udp->Read(Conf.IP, fifo_addr, data, len, Conf.cmdport);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //	Recevie and print block of SDRAM memory using UDP
-void uwfd64::UDPDump(int addr, int len)
+//	Return 0 on success, negative on error
+int uwfd64::UDPDump(int addr, int len)
 {
 	unsigned *data;
-	int i;
+	int i, irc;
 	
 	data = (unsigned *) malloc(len);
 	if (!data) {
 		printf("Memory allocation of %d bytes failed: %m\n", len);
-		return;
+		return -1;
 	}
-	i = UDPBlockRead(addr, data, len);
-	if (!i) {
+	irc = UDPBlockRead(addr, data, len);
+	if (!irc) {
 		for (i = 0; i < len/4; i++) {
 			if (!(i & 7)) printf("SDRAM[0x%8.8X]: ", addr + 4*i);
 			printf("%8.8X ", ntohl(data[i]));
 			if ((i & 7) == 7) printf("\n");
 		}
 		if (i & 7) printf("\n");
+	} else {
+		printf("Serial %d: UDP read failed (%d)\n", serial, irc);
+	}
+	free(data);
+	return irc;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Do block transwer to/from fifo via VME
+//	fifo_addr - address in fifo
+//	data - data to be sent/received
+//	len - size of data in bytes
+//	wr - 0 (read), (1) write
+//	Return 0 on success
+int uwfd64::VMETransfer(unsigned int fifo_addr, unsigned int *data, int len, int wr)
+{
+	int irc;
+	int adr, ln, done;
+	enum UWFD64_BLK_TRANSPORT transp;
+	
+	irc = 0;
+	if (!len) return irc;	// nothing to do
+	transp = Conf.blk_transp;
+	if (transp == UWFD64_BLK_AUTO || transp == UWFD64_BLK_UDP || transp == UWFD64_BLK_STRIPED) transp = vme_transp;
+	switch (transp) {
+	case UWFD64_BLK_A64_BLT:
+		irc = vmemap_a64_dma(dma_fd, GetBase64() + fifo_addr, data, len, wr);
+		break;
+	case UWFD64_BLK_A64_MAP:
+		irc = (wr) ? vmemap_a64_blkwrite(A64UNIT, GetBase64() + fifo_addr, data, len) : vmemap_a64_blkread(A64UNIT, GetBase64() + fifo_addr, data, len);
+		break;
+	case UWFD64_BLK_A32_BLT:
+		ln = 0;
+		a32->fifo.wptr = fifo_addr;
+		for (done = 0; done < len; done += ln) {
+			ln = len - done;
+			if (ln > UWFD64_A32_FIFO_WIN) ln = UWFD64_A32_FIFO_WIN;
+			irc = vmemap_a32_dma(dma_fd, GetBase32() + UWFD64_A32_FIFO, data + done / sizeof(int), ln, wr);
+//			printf("DMA irc = %d\n", irc);
+			if (irc != 0) break;
+		}
+		break;
+	case UWFD64_BLK_A32_MAP:
+		a32->fifo.wptr = fifo_addr;
+		if (wr) {
+			for (done = 0; done < len / sizeof(int); done++) ((unsigned int *)a32)[UWFD64_A32_FIFO / sizeof(int)] = data[done];
+		} else {
+			for (done = 0; done < len / sizeof(int); done++) data[done] = ((unsigned int *)a32)[UWFD64_A32_FIFO / sizeof(int)];
+		}
+		break;
+	default:
+		irc = -1;
 	}
+	return irc;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -6,6 +6,8 @@
 #define UWFD64_H
 
 #include <libconfig.h>
+#include "blkcheck.h"
+#include "zerosup.h"
 
 #define MAX_PATH_LEN	1024
 
@@ -635,7 +637,27 @@ enum UWFD64_BLK_TRANSPORT {
 	UWFD64_BLK_A64_BLT = 0,		// block transfere in A64 address space, DMA, 32 bit data
 	UWFD64_BLK_A64_MAP = 1,		// A64 mapped, no DMA, 32-bit data
 	UWFD64_BLK_A32_BLT = 100,	// block transfere in A32 address space, DMA, 32 bit data
-	UWFD64_BLK_A32_MAP = 101	// A32 mapped, no DMA, 32-bit data
+	UWFD64_BLK_A32_MAP = 101,	// A32 mapped, no DMA, 32-bit data
+	UWFD64_BLK_UDP = 200,		// reads via ethernet (firmware 2.5), pointers and writes via VME
+	UWFD64_BLK_STRIPED = 201	// big reads are split between VME and ethernet by their measured speed
+};
+
+#define UWFD64_STRIPE_MIN	0x10000	// smaller reads are done via VME only
+#define UWFD64_STRIPE_MAXERR	10	// consecutive UDP errors to stop striping
+#define UWFD64_STRIPE_PROBE	1000	// reads via VME only before UDP is tried again
+
+//	Striped readout state
+struct uwfd64_stripe_struct {
+	double vme_bw;		// measured speeds, bytes/us
+	double udp_bw;
+	double vme_frac;	// part of the read given to VME
+	int udp_errcnt;		// consecutive UDP errors
+	int disabled;		// UDP gave too many errors, VME only
+	int probe;		// reads since UDP was disabled or last tried
+	long long vme_bytes;
+	long long udp_bytes;
+	int vme_errors;
+	int udp_errors;
 };
 
 struct uwfd64_module_config {
@@ -674,14 +696,24 @@ struct uwfd64_module_config {
 	short int SelfTrigMask[4];	// Mask channels from self trigger
 	short int TrigSumMask[4];	// Mask channels from trigger production sum
 	short int InvertMask[4];	// Mask channels for invertion
+	int SoftZSMode;		// Host zero suppression: 0 - off, 1 - drop, 2 - truncate blocks below threshold
+	int SoftZSPedLen;	// Host zero suppression: samples at the block beginning for the pedestal
+	int SoftZSWinBegin;	// Host zero suppression window begin (from the first sample)
+	int SoftZSWinEnd;	// Host zero suppression window end, 0 - to the end of the block
+	short int SoftZSThreshold[64];	// Host zero suppression thresholds over the pedestal
+	int DataCheck;		// Streaming integrity check of the data read: 0 - off, 1 - on
+	int DataCheckBad;	// Offending blocks remembered by the integrity check
 	char SlaveClockFile[MAX_PATH_LEN];	// Si5338 .h configuration file
 	unsigned long long MAC;	// ethernet MAC address
 	unsigned int IP;	// ethernet IP address
 	unsigned short port;	// UDP port on the destination computer
+	unsigned short cmdport;	// UDP port the module listens for commands
 };
 
 //************************************************************************************************************************************************************************//
 class uwfd64_tool;
+class udpengine;
+struct udpread_struct;
 
 class uwfd64 {
 private:
@@ -691,33 +723,46 @@ private:
 	struct uwfd64_a32_reg *a32;
 	int dma_fd;
 	struct uwfd64_module_config Conf;
-
-	int AllocateUDPport(int port);
+	enum UWFD64_BLK_TRANSPORT vme_transp;	// VME transport for writes and when ethernet is not used
+	udpengine *udp;		// receiver on Conf.port, got on the first UDP read
+	int noudp;		// UDP transport without the receiver is reported, data goes via VME
+	struct uwfd64_stripe_struct stripe;
+	zerosup *zs;		// host zero suppression of the data read, NULL if off
+	blkcheck *bc;		// integrity check of the data read, NULL if off
+
+	void FifoAdvance(int rptr, int len);
+	int FifoData(int size, int *rptr);
 	unsigned long long str2MAC(const char *str);
 	unsigned str2IP(const char *str);
-	int SendUDPCommand(unsigned IP, int fifo_addr, int len);
+	int StripedRead(unsigned int fifo_addr, unsigned int *data, int len);
+	int VMETransfer(unsigned int fifo_addr, unsigned int *data, int len, int wr);
 public:
 	uwfd64(int sernum, int gnum, unsigned short *space_a16, unsigned int *space_a32, int fd, config_t *cnf = NULL);
+	~uwfd64(void);
 	int ADCRead(int num, int addr);
 	int ADCWrite(int num, int addr, int val);
 	int ADCCheckSeq(int time, int xilmask);
 	int ADCAdjust(int adcmask);
 	int BlockTransfer(unsigned int fifo_addr, unsigned int *data, int len, int wr);
+	inline int CheckData(const void *buf, int len, unsigned int fifo_addr) { return (bc) ? bc->Check(buf, len, fifo_addr) : 0; };
 	int ConfigureMasterClock(int sel, int div, int erc = 0);
 	int ConfigureSlaveClock(int num, const char *fname);
 	int ConfigureSlaveXilinx(int num);
 	int ConfigureUDP(int enable = 1);
 	void EnableFifo(int what);
 	int DACSet(int val);
+	int FifoDone(struct udpread_struct *req);
+	int FifoRequest(void *buf, int size, struct udpread_struct *req);
 	void FillSDRAM(int addr, int len);
 	int GetADCID(int num);
 	inline int GetBase16(void) { return A16BASE + serial * A16STEP; };
 	inline unsigned int GetBase32(void) { return A32BASE + ga * A32STEP; };
 	inline unsigned long long GetBase64(void) { return A64BASE + ga * A64STEP; };
 	inline int GetBatch(void) { return (a16->bnum >> 8) & 0xFF; };
-	int GetFromFifo(void *buf, int size);
+	int GetFromFifo(void *buf, int size, unsigned int *addr = NULL);
 	inline int GetGA(void) { return ga; };
 	inline int GetSerial(void) { return serial; };
+	udpengine *GetUDP(void);
 	inline int GetVersion(void) { return a32->ver.in; };
 	inline int GetSlaveVersion(int num) { return ICXRead(ICX_SLAVE_STEP * (num & 3) + ICX_SLAVE_VER_IN) & 0xFFFF; };
 	inline unsigned long long GetMAC(void) { return ((unsigned long long) a32->eth.machigh << 16) | (a32->eth.maclow >> 16); };
@@ -750,7 +795,13 @@ public:
 	int TestSDRAMUDP(int cnt);
 	int TestSlaveReg16(int cnt);
 	int UDPBlockRead(unsigned int fifo_addr, unsigned int *data, int len);
-	void UDPDump(int addr, int len);
+	int UDPDump(int addr, int len);
+	void PrintCheckStat(void);
+	void PrintStripeStat(void);
+	void PrintZeroSupStat(void);
+	void StartCheck(void);
+	void StartZeroSup(void);
+	inline int ZeroSup(void *buf, int len) { return (zs) ? zs->Process(buf, len) : len; };
 	void WriteUserWord(int num);
 	void ZeroTrigger(void);
 
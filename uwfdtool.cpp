@@ -18,9 +18,12 @@
 #include <unistd.h>
 #include <readline/history.h>
 #include <readline/readline.h>
+#include "blkdecode.h"
 #include "libvmemap.h"
 #include "log.h"
+#include "fanout.h"
 #include "recformat.h"
+#include "udpengine.h"
 #include "uwfd64.h"
           
 #define WAIT4DONE	1000	// 10 s
@@ -30,11 +33,22 @@
 
 class uwfd64_tool;
 int Process(char *cmd, uwfd64_tool *tool);
-int CheckCmd(void);
-int TcpOpen(FILE **f, char *name);
+int CheckCmd(int usec = 0);
+void *ControlThread(void *arg);
 
 volatile sig_atomic_t StopFlag;
 
+//	Command mailbox between the control thread and the readout loop during data taking
+struct cmdbox_struct {
+	uwfd64_tool *tool;
+	char cmd[1024];		// command to be applied by the readout loop
+	volatile int pending;	// cmd is waiting for the readout loop
+	volatile int quit;	// Q received
+	volatile int stop;	// data taking is over, the control thread must exit
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
 void catch_stop(int sig)
 {
 	StopFlag = 1;
@@ -51,6 +65,9 @@ private:
 	int DoTest(uwfd64 *ptr, int type, int cnt);
 	uwfd64 *FindSerial(int num);
 	int Status;
+	struct fanout_config SinkConf;
+	fanout *Out;		// sinks while taking data, NULL otherwise
+	void ReadSinkConfig(config_t *cnf);
 public:
 	uwfd64_tool(const char *ini_file_name = NULL);
 	~uwfd64_tool(void);
@@ -67,9 +84,11 @@ public:
 	void ADCWrite(int serial, int num, int addr, int ival);
 	inline void ClearStatus(void) { Status = 0;};
 	void Adjust(int serial, int adc);
+	void CheckStat(int serial);
 	void DACSet(int serial = -1, int val = 0x2000);
 	void FillSDRAM(int serial, int addr, int len);
 	inline int GetStatus(void) { return Status; };
+	void Histograms(char *fname);
 	void I2CRead(int serial, int addr);	
 	void I2CWrite(int serial, int addr, int ival);
 	inline int IsOK(void) { return a16 && a32 && (dma_fd >= 0); };
@@ -88,6 +107,7 @@ public:
 	void SoftTrigger(int serial, int freq);
 	void Test(int serial = -1, int type = 0, int cnt = 1000000);
 	void UDPDump(int serial, int addr, int len);
+	void UDPReadAll(int addr, int len);
 	void WriteFile(int serial, char *fname, int size);
 	void WriteNFile(int serial, char *fname, int size, int flag);
 	void ZeroTrigger(int serial);
@@ -103,6 +123,42 @@ uwfd64_tool::uwfd64_tool(const char *ini_file_name)
 
 	N = 0;
 	Status = 0;
+	Out = NULL;
+	memset(&SinkConf, 0, sizeof(SinkConf));
+	SinkConf.File.Queue = 512;
+	SinkConf.File.Policy = DATASINK_SPILL;
+	strcpy(SinkConf.File.SpillDir, "/tmp");
+	SinkConf.File.SpillSize = 4096;
+	SinkConf.Tcp.Queue = 256;
+	SinkConf.Tcp.Policy = DATASINK_SPILL;
+	strcpy(SinkConf.Tcp.SpillDir, "/tmp");
+	SinkConf.Tcp.SpillSize = 4096;
+	SinkConf.Tcp.CloseTimeout = 30;
+	SinkConf.TcpSock.SendBuffer = 4096;
+	SinkConf.TcpSock.ReconnectTime = 2;
+	SinkConf.Shm.Queue = 64;
+	SinkConf.Shm.Policy = DATASINK_DROP;
+	SinkConf.ShmSize = 256;
+	SinkConf.Evt.Queue = 256;
+	SinkConf.Evt.Policy = DATASINK_DROP;
+	SinkConf.EvtBuild.MaxEvent = EVT_MAXEVENT;
+	SinkConf.EvtBuild.Timeout = 1000;
+	SinkConf.EvtBuild.Clock.MaxJump = 2;
+	SinkConf.EvtBuild.Clock.MaxDrift = 10;
+	SinkConf.EvtBuild.Clock.Latency = 1000;
+	SinkConf.File.Features.BaseLen = SinkConf.Tcp.Features.BaseLen = WFF_BASELEN;
+	SinkConf.File.Features.Threshold = SinkConf.Tcp.Features.Threshold = 20;
+	SinkConf.Hist.Queue = 256;
+	SinkConf.Hist.Policy = DATASINK_DROP;
+	SinkConf.Histograms.Threads = 2;
+	SinkConf.Histograms.AmpBin = 4;
+	SinkConf.Histograms.IntBin = 64;
+	SinkConf.Histograms.IntMin = -4096;
+	SinkConf.Histograms.TimeBin = WFF_TSCALE / 2;
+	SinkConf.Histograms.Period = 10;
+	SinkConf.Histograms.Features.BaseLen = WFF_BASELEN;
+	SinkConf.Histograms.Features.Threshold = 20;
+	SinkConf.RecVersion = 1;
 
 	a16 = (unsigned short *) vmemap_open(A16UNIT, A16BASE, 0x100 * A16STEP, VME_A16, VME_USER | VME_DATA, VME_D16);
 	a32 = vmemap_open(A32UNIT, A32BASE, 32 * A32STEP, VME_A32, VME_USER | VME_DATA, VME_D32);
@@ -124,6 +180,7 @@ uwfd64_tool::uwfd64_tool(const char *ini_file_name)
 	}
 
 	LogInit(pcnf);
+	if (pcnf) ReadSinkConfig(pcnf);
 	cptr = (pcnf) ? config_lookup(pcnf, "ModuleList") : NULL;
 
 	for (i = 0; i < 255 && N < 20; i++) {
@@ -217,10 +274,12 @@ void uwfd64_tool::A32Write(int addr, int val)
 
 void uwfd64_tool::A64Dump(long long addr, int leng)
 {
-	int i, j;
+	int i, j, irc;
 	unsigned int *buf;
 	unsigned short *sbuf;
-	int len, blen;
+	int len;
+	blkdecoder dec(BLK_ALIGN);
+	struct blk_view v;
 
 	if (leng < 0) len = -leng; else len = leng;
 
@@ -235,6 +294,7 @@ void uwfd64_tool::A64Dump(long long addr, int leng)
 	}
 	if (vmemap_a64_blkread(A64UNIT, A64BASE + addr, buf, len)) {
 		printf("Read error.\n");
+		free(buf);
 		return;
 	}
 
@@ -246,23 +306,27 @@ void uwfd64_tool::A64Dump(long long addr, int leng)
 		}
 		if (i & 0x1C) printf("\n");
 	} else {
-		// dump as block structure	
+		// dump as block structure
 		sbuf = (unsigned short *)buf;
-		for (i = 0; i < len; i += 2) {
-			if (sbuf[i/2] & 0x8000) {
-				blen = sbuf[i/2] & 0x1FF;
-				printf("Block @ 0x%LX: Len = %3.3X ", addr + i, blen);		
-				if (blen) {
-					printf("Chan = %2.2X BlkType = %1X, Token = %3.3X Err = %d Par = %d Data:", (sbuf[i/2] >> 9) & 0x3F, (sbuf[i/2 + 1] >> 12) & 0x7, 
-							sbuf[i/2 + 1] & 0x3FF, (sbuf[i/2 + 1] >> 10) & 0x1, (sbuf[i/2 + 1] >> 11) & 0x1);
-					for (j=2; j<6 && j<blen + 1; j++) printf(" %4.4X", sbuf[i/2 + j]);
-					printf(" ... ");
-					for (j= (blen > 8) ? blen - 3 : 6; j<blen+1; j++) printf(" %4.4X", sbuf[i/2 + j]);
-				} 
-				printf(" Next CW: %s\n", (sbuf[i/2 + blen + 1]) ? "Yes" : "No");
-			}		
+		dec.Feed(buf, len);
+		while ((irc = dec.Next(&v)) != BLK_END) {
+			if (irc == BLK_STRAY) continue;
+			printf("Block @ 0x%LX: Len = %3.3X ", addr + 2 * v.pos, v.cw[0] & 0x1FF);
+			if (v.len) {
+				printf("Chan = %2.2X BlkType = %1X, Token = %3.3X Err = %d Par = %d Data:", v.chan, v.type, v.token, v.err, v.parity);
+				for (j=2; j<6 && j<v.len + 1; j++) printf(" %4.4X", v.cw[j]);
+				printf(" ... ");
+				for (j= (v.len > 8) ? v.len - 3 : 6; j<v.len+1; j++) printf(" %4.4X", v.cw[j]);
+			}
+			if (irc == BLK_PART) {
+				printf(" Cut: %d words beyond\n", v.missing);
+			} else {
+				j = v.pos + v.len + 1;
+				printf(" Next CW: %s\n", (j >= len / 2) ? "End" : (sbuf[j] & BLK_CW) ? "Yes" : "No");
+			}
 		}
 	}
+	free(buf);
 }
 
 void uwfd64_tool::A64Read(long long addr)
@@ -344,6 +408,25 @@ void uwfd64_tool::Adjust(int serial, int adc)
 	if (!irc) ClearStatus();
 }
 
+//	Print the counters of the data integrity check, during data taking too
+void uwfd64_tool::CheckStat(int serial)
+{
+	int i;
+	uwfd64 *ptr;
+	if (serial < 0) {
+		for (i=0; i<N; i++) array[i]->PrintCheckStat();
+	} else {
+		ptr = FindSerial(serial);
+		if (ptr == NULL) {
+			printf("Module %d not found.\n", serial);
+			SetStatus();
+			return;
+		}
+		ptr->PrintCheckStat();
+	}
+	ClearStatus();
+}
+
 void uwfd64_tool::DACSet(int serial, int val)
 {
 	int i;
@@ -425,6 +508,28 @@ void uwfd64_tool::FillSDRAM(int serial, int addr, int len)
 	ClearStatus();
 }
 
+//	Write the snapshot of the online histograms (sink hist:fname) now, to fname if given
+void uwfd64_tool::Histograms(char *fname)
+{
+	int irc;
+
+	if (!Out) {
+		printf("Histograms are filled only while taking data with a hist: sink.\n");
+		SetStatus();
+		return;
+	}
+	irc = Out->Snapshot(fname);
+	if (irc < 0) {
+		printf("Histogram snapshot write error.\n");
+		SetStatus();
+	} else if (!irc) {
+		printf("No hist: sink is open.\n");
+		SetStatus();
+	} else {
+		ClearStatus();
+	}
+}
+
 uwfd64 *uwfd64_tool::FindSerial(int num)
 {
 	int i;
@@ -688,9 +793,74 @@ void uwfd64_tool::ReadConfig(char *fname)
             	return;
     	}
 	for (i=0; i<N; i++) array[i]->ReadConfig(&cnf);
+	ReadSinkConfig(&cnf);
 	ClearStatus();
 }
 
+//	Queue overflow policy by name, def if the name is not known
+static int SinkPolicy(const char *key, const char *name, int def)
+{
+	if (!strcasecmp(name, "drop")) return DATASINK_DROP;
+	if (!strcasecmp(name, "spill")) return DATASINK_SPILL;
+	Log(WARN, "%s = \"%s\" is not known, \"%s\" is used\n", key, name, (def == DATASINK_SPILL) ? "spill" : "drop");
+	return def;
+}
+
+//	Get data sink parameters from Sink section
+void uwfd64_tool::ReadSinkConfig(config_t *cnf)
+{
+	int tmp;
+	char *stmp;
+
+	if (config_lookup_string(cnf, "Sink.AutoName", (const char **) &stmp))
+		strncpy(SinkConf.FileRot.AutoName, stmp, MAX_PATH_LEN - 1);
+	if (config_lookup_string(cnf, "Sink.CheckDiskScript", (const char **) &stmp))
+		strncpy(SinkConf.FileRot.CheckDiskScript, stmp, MAX_PATH_LEN - 1);
+	if (config_lookup_int(cnf, "Sink.AutoTime", &tmp)) SinkConf.FileRot.AutoTime = tmp;
+	if (config_lookup_int(cnf, "Sink.AutoSize", &tmp)) SinkConf.FileRot.AutoSize = tmp;
+	if (config_lookup_int(cnf, "Sink.IndexFiles", &tmp)) SinkConf.FileRot.Index = tmp;
+	if (config_lookup_int(cnf, "Sink.FileQueue", &tmp)) SinkConf.File.Queue = tmp;
+	if (config_lookup_string(cnf, "Sink.FilePolicy", (const char **) &stmp))
+		SinkConf.File.Policy = SinkPolicy("Sink.FilePolicy", stmp, SinkConf.File.Policy);
+	if (config_lookup_int(cnf, "Sink.SendQueue", &tmp)) SinkConf.Tcp.Queue = tmp;
+	if (config_lookup_string(cnf, "Sink.SendPolicy", (const char **) &stmp))
+		SinkConf.Tcp.Policy = SinkPolicy("Sink.SendPolicy", stmp, SinkConf.Tcp.Policy);
+	if (config_lookup_int(cnf, "Sink.CloseTimeout", &tmp)) SinkConf.Tcp.CloseTimeout = tmp;
+	if (config_lookup_string(cnf, "Sink.SpillDir", (const char **) &stmp)) {
+		strncpy(SinkConf.File.SpillDir, stmp, MAX_PATH_LEN - 1);
+		strncpy(SinkConf.Tcp.SpillDir, stmp, MAX_PATH_LEN - 1);
+	}
+	if (config_lookup_int(cnf, "Sink.SpillSize", &tmp)) SinkConf.File.SpillSize = SinkConf.Tcp.SpillSize = tmp;
+	if (config_lookup_int(cnf, "Sink.SendBuffer", &tmp)) SinkConf.TcpSock.SendBuffer = tmp;
+	if (config_lookup_int(cnf, "Sink.ZeroCopy", &tmp)) SinkConf.TcpSock.ZeroCopy = tmp;
+	if (config_lookup_int(cnf, "Sink.ReconnectTime", &tmp)) SinkConf.TcpSock.ReconnectTime = tmp;
+	if (config_lookup_int(cnf, "Sink.ShmSize", &tmp)) SinkConf.ShmSize = tmp;
+	if (config_lookup_int(cnf, "Sink.MaxEvent", &tmp)) SinkConf.EvtBuild.MaxEvent = tmp;
+	if (config_lookup_int(cnf, "Sink.EventTimeout", &tmp)) SinkConf.EvtBuild.Timeout = tmp;
+	if (config_lookup_int(cnf, "Sink.EventQueue", &tmp)) SinkConf.Evt.Queue = tmp;
+	if (config_lookup_int(cnf, "Sink.ClockMaxJump", &tmp)) SinkConf.EvtBuild.Clock.MaxJump = tmp;
+	if (config_lookup_int(cnf, "Sink.ClockMaxDrift", &tmp)) SinkConf.EvtBuild.Clock.MaxDrift = tmp;
+	if (config_lookup_int(cnf, "Sink.ClockLatency", &tmp)) SinkConf.EvtBuild.Clock.Latency = tmp;
+	if (config_lookup_int(cnf, "Sink.RecordVersion", &tmp)) SinkConf.RecVersion = (tmp >= 2) ? REC_VERSION : 1;
+	if (config_lookup_int(cnf, "Sink.FileCompress", &tmp)) SinkConf.File.Compress = tmp;
+	if (config_lookup_int(cnf, "Sink.SendCompress", &tmp)) SinkConf.Tcp.Compress = tmp;
+	if ((SinkConf.File.Compress || SinkConf.Tcp.Compress) && SinkConf.RecVersion < 2)
+		Log(WARN, "Compression needs Sink.RecordVersion = 2, data will not be compressed\n");
+	if (config_lookup_int(cnf, "Sink.FileFeatures", &tmp)) SinkConf.File.Features.Mode = tmp;
+	if (config_lookup_int(cnf, "Sink.SendFeatures", &tmp)) SinkConf.Tcp.Features.Mode = tmp;
+	if (config_lookup_int(cnf, "Sink.FeatureBaseline", &tmp))
+		SinkConf.File.Features.BaseLen = SinkConf.Tcp.Features.BaseLen = SinkConf.Histograms.Features.BaseLen = tmp;
+	if (config_lookup_int(cnf, "Sink.FeatureThreshold", &tmp))
+		SinkConf.File.Features.Threshold = SinkConf.Tcp.Features.Threshold = SinkConf.Histograms.Features.Threshold = tmp;
+	if (config_lookup_int(cnf, "Sink.HistQueue", &tmp)) SinkConf.Hist.Queue = tmp;
+	if (config_lookup_int(cnf, "Sink.HistThreads", &tmp)) SinkConf.Histograms.Threads = tmp;
+	if (config_lookup_int(cnf, "Sink.HistAmpBin", &tmp)) SinkConf.Histograms.AmpBin = tmp;
+	if (config_lookup_int(cnf, "Sink.HistIntegralBin", &tmp)) SinkConf.Histograms.IntBin = tmp;
+	if (config_lookup_int(cnf, "Sink.HistIntegralMin", &tmp)) SinkConf.Histograms.IntMin = tmp;
+	if (config_lookup_int(cnf, "Sink.HistTimeBin", &tmp)) SinkConf.Histograms.TimeBin = tmp;
+	if (config_lookup_int(cnf, "Sink.HistPeriod", &tmp)) SinkConf.Histograms.Period = tmp;
+}
+
 void uwfd64_tool::ResetFIFO(int serial, int what)
 {
 	int i;
@@ -775,7 +945,64 @@ void uwfd64_tool::UDPDump(int serial, int addr, int len)
 		printf("Module %d not found.\n", serial);
 		return;
 	}
-	ptr->UDPDump(addr, len);
+	if (!ptr->UDPDump(addr, len)) ClearStatus();
+}
+
+//	Read the same SDRAM block from all modules at once via UDP and print the rate
+void uwfd64_tool::UDPReadAll(int addr, int len)
+{
+	struct udpread_struct req[UDPENGINE_MAXREQS];
+	int idx[UDPENGINE_MAXREQS];
+	int status[20];
+	udpengine *eng;
+	char *buf;
+	int i, j, n, cnt, errcnt;
+	double dt;
+	struct timeval t[2];
+
+	buf = (char *) malloc((long long) N * len);
+	if (!buf) {
+		printf("Memory allocation of %Ld bytes failed: %m\n", (long long) N * len);
+		return;
+	}
+	for (i=0; i<N; i++) status[i] = (array[i]->GetVersion() < 0x20005) ? -1 : 1;	// UDP needs firmware 2.5
+	gettimeofday(&t[0], NULL);
+	for (i=0; i<N; i++) {	// all modules sending to the same port are read at once
+		if (status[i] <= 0) continue;
+		eng = array[i]->GetUDP();
+		if (!eng) {
+			status[i] = -10;
+			continue;
+		}
+		n = 0;
+		for (j=i; j<N; j++) if (status[j] > 0 && array[j]->GetUDP() == eng) {
+			req[n].IP = array[j]->Conf.IP;
+			req[n].cmdport = array[j]->Conf.cmdport;
+			req[n].fifo_addr = addr;
+			req[n].data = buf + (long long) j * len;
+			req[n].len = len;
+			idx[n] = j;
+			n++;
+		}
+		eng->ReadMulti(req, n);
+		for (j=0; j<n; j++) status[idx[j]] = req[j].status;
+	}
+	gettimeofday(&t[1], NULL);
+	dt = t[1].tv_sec - t[0].tv_sec + (t[1].tv_usec - t[0].tv_usec) * 0.000001;
+	cnt = errcnt = 0;
+	for (i=0; i<N; i++) {
+		if (status[i] == 0) {
+			cnt++;
+		} else {
+			printf("Serial %d: %s (%d)\n", array[i]->GetSerial(), (status[i] == -1) ? 
+				"UDP is not supported, firmware 2.5 required" : "UDP read failed", status[i]);
+			errcnt++;
+		}
+	}
+	printf("%d modules read %d bytes each in %8.3f ms: %8.3f MBytes/s\n", cnt, len, dt * 1000,
+		(dt > 0) ? cnt * (double) len / (dt * MBYTE) : 0.0);
+	free(buf);
+	if (!errcnt) ClearStatus();
 }
 
 void uwfd64_tool::WriteFile(int serial, char *fname, int size)
@@ -836,24 +1063,53 @@ void uwfd64_tool::WriteFile(int serial, char *fname, int size)
 	ClearStatus();
 }
 
+//	Check, suppress and send len bytes of the module data read from faddr to rec after the header of version
+//	Return 1 if rec went to the sinks, 0 if it can be used again
+static int PutData(fanout *out, uwfd64 *ptr, struct recbuf *rec, int len, int version, unsigned int faddr, long long *cnt)
+{
+	int hlen;
+
+	if (len <= 0) return 0;
+	hlen = rec_header_size(version);
+	ptr->CheckData(rec->data + hlen, len, faddr);	// as read, before any suppression
+	len = ptr->ZeroSup(rec->data + hlen, len);	// in place, the record can only get shorter
+	if (len <= 0) return 0;
+	rec->len = len + hlen;
+	rec_fill(rec->data, version, rec->len, ++(*cnt), REC_WFDDATA + ptr->GetSerial(), ptr->GetSerial(), faddr);
+	out->Put(recbuf_shrink(rec));	// never waits for the sinks
+	return 1;
+}
+
 void uwfd64_tool::WriteNFile(int serial, char *fname, int size, int flag)
 {
 	uwfd64 *ptr;
-	FILE *f;
+	fanout *out;
+	struct recbuf *rec;
 	long long i;
 	long long S;
 	int j;
 	int irc, jrc;
-	void *buf;
-	struct rec_header_struct header;
-	char cmd[1024];
+	long long header[REC_MAXHEADER / sizeof(long long)];	// aligned for v2
+	int hlen;
+	long long cnt;
+	unsigned int faddr;
+	struct cmdbox_struct box;
+	pthread_t control;
 	int active[20];		// if array element is active
 	int oldtime;
 	int iflag;
 	int iCycleCnt;
 	uwfd64 *fptr;
+	struct recbuf *mrec[20];		// the buffers of the modules read via UDP
+	udpengine *udp[20];
+	udpengine *eng[20];
+	struct udpread_struct req[20];
+	int idx[20];			// module of each request
+	int grp[21];			// requests of each engine, by the first one
+	int nreq, ngrp, k, m;
 
 	memset(&active, 0, sizeof(active));
+	memset(mrec, 0, sizeof(mrec));
 	if (serial >= 0) {
 		for (j = 0; j < N; j++) if (serial == array[j]->GetSerial()) break;
 		if (j == N) {
@@ -870,34 +1126,26 @@ void uwfd64_tool::WriteNFile(int serial, char *fname, int size, int flag)
 		}
 	}
 	
-	buf = malloc(BSIZE);
-	if (!buf) {
-		printf("No memory: %m.\n");
-		return;
+	rec = NULL;
+	for (j = 0; j < N; j++) {	// features and histograms invert the channels as the module does
+		k = array[j]->GetSerial() & (WFF_MAXSERIAL - 1);
+		memcpy(SinkConf.File.Features.InvertMask[k], array[j]->Conf.InvertMask, sizeof(array[j]->Conf.InvertMask));
+		memcpy(SinkConf.Tcp.Features.InvertMask[k], array[j]->Conf.InvertMask, sizeof(array[j]->Conf.InvertMask));
+		memcpy(SinkConf.Histograms.Features.InvertMask[k], array[j]->Conf.InvertMask, sizeof(array[j]->Conf.InvertMask));
 	}
-	
-	jrc = TcpOpen(&f, fname);	// if file name is host.address:port this will return proper stream
-	if (jrc < 0) {
-		free(buf);
+	out = new fanout();
+	if (out->Open(fname, &SinkConf)) {	// comma separated list of files and host:port
+		delete out;
 		return;
 	}
-	if (!jrc) {
-		f = fopen(fname, "wb");
-		if (!f) {
-			printf("Can not open file %s: %m.\n", fname);
-			free(buf);
-			return;
-		}
-	}
+	Out = out;
 	
-	header.len = sizeof(header);
-	header.cnt = 0;
-	header.ip = INADDR_LOOPBACK;		// 127.0.0.1 - loopback
-	header.type = REC_BEGIN;
-	header.time = time(NULL);
-	if (fwrite(&header, sizeof(header), 1, f) != 1) {
+	hlen = rec_header_size(SinkConf.RecVersion);
+	cnt = 0;
+	rec_fill(header, SinkConf.RecVersion, hlen, cnt, REC_BEGIN);
+	if (out->PutHeader(header, hlen)) {
 		printf("File write error: %m.\n");
-		fclose(f);
+		delete out;
 		return;
 	}
 
@@ -911,6 +1159,8 @@ void uwfd64_tool::WriteNFile(int serial, char *fname, int size, int flag)
 		ptr->EnableFifo(0);	// clear FIFO
 		ptr->ResetFifo(FIFO_CSR_SRESET);
 		ptr->EnableFifo(1);	// enable FIFO
+		ptr->StartCheck();
+		ptr->StartZeroSup();
 	}
 	S = (long long) size * MBYTE;
 	oldtime = time(NULL);
@@ -921,16 +1171,24 @@ void uwfd64_tool::WriteNFile(int serial, char *fname, int size, int flag)
 		fptr->Inhibit(0);
 	}
 	iCycleCnt = 0;
+
+	memset(&box, 0, sizeof(box));
+	box.tool = this;
+	pthread_mutex_init(&box.mutex, NULL);
+	pthread_cond_init(&box.cond, NULL);
+	if (pthread_create(&control, NULL, ControlThread, &box)) {
+		printf("Can not start control thread: %m.\n");
+		i = 0;
+		goto fin;
+	}
 	
-	for (i=0; (i < S || size <= 0) && (!StopFlag); i += irc) {
-		if (CheckCmd() && fgets(cmd, sizeof(cmd), stdin)) {
-			if (!isatty(STDIN_FILENO)) {
-				printf("%s", cmd);
-				fflush(stdout);
-			}
-			if (Process(cmd, this)) break;
-			printf("Taking data (Q to stop)> ");
-			fflush(stdout);
+	for (i=0; (i < S || size <= 0) && (!StopFlag) && (!box.quit); i += irc) {
+		if (box.pending) {	// a command which must not overlap with the readout
+			if (Process(box.cmd, this)) box.quit = 1;
+			pthread_mutex_lock(&box.mutex);
+			box.pending = 0;
+			pthread_cond_signal(&box.cond);
+			pthread_mutex_unlock(&box.mutex);
 		}
 		if (flag == 'P' && time(NULL) - oldtime > PS_ACTTIME) {
 			fptr->Inhibit(1);
@@ -940,36 +1198,59 @@ void uwfd64_tool::WriteNFile(int serial, char *fname, int size, int flag)
 		}
 
 		irc = 0;
-		for (j = 0; j < N; j++) if (active[j]) {
+		// modules read via UDP: the commands go to all modules of a host port at once,
+		// their data comes while the other modules are read
+		for (j = 0; j < N; j++) udp[j] = (active[j] && array[j]->Conf.blk_transp == UWFD64_BLK_UDP) ? array[j]->GetUDP() : NULL;
+		nreq = ngrp = 0;
+		for (j = 0; j < N; j++) if (udp[j]) {
+			grp[ngrp] = nreq;
+			for (k = j; k < N; k++) if (udp[k] == udp[j]) {
+				if (!mrec[k]) mrec[k] = recbuf_alloc(BSIZE + hlen);
+				if (!mrec[k]) goto err;
+				jrc = array[k]->FifoRequest(mrec[k]->data + hlen, BSIZE, &req[nreq]);
+				if (jrc < 0) {
+					printf("Module %d FIFO error %d\n", array[k]->GetSerial(), -jrc);
+					goto err;
+				}
+				if (jrc > 0) idx[nreq++] = k;
+				if (k > j) udp[k] = NULL;
+			}
+			if (nreq == grp[ngrp]) continue;
+			if (udp[j]->ReadStart(&req[grp[ngrp]], nreq - grp[ngrp])) {
+				printf("Module %d UDP read can not be started\n", array[j]->GetSerial());
+				goto err;
+			}
+			eng[ngrp++] = udp[j];
+		}
+		grp[ngrp] = nreq;
+		for (j = 0; j < N; j++) if (active[j] && !(array[j]->Conf.blk_transp == UWFD64_BLK_UDP && array[j]->GetUDP())) {
 			ptr = array[j];
-			jrc = ptr->GetFromFifo(buf, BSIZE);
+			if (!rec) rec = recbuf_alloc(BSIZE + hlen);	// read directly to the record buffer
+			if (!rec) goto err;
+			jrc = ptr->GetFromFifo(rec->data + hlen, BSIZE, &faddr);
 			if (jrc < 0) {
 				printf("Module %d FIFO error %d\n", ptr->GetSerial(), -jrc);
 				goto err;
 			}
 			irc += jrc;
-			if (jrc > 0) {
-				header.len = jrc + sizeof(header);
-				header.cnt++;
-				header.type = REC_WFDDATA + ptr->GetSerial();
-				header.time = time(NULL);
-				if (fwrite(&header, sizeof(header), 1, f) != 1) {
-					printf("File write error: %m.\n");
-					goto err;
-				}
-				if (fwrite(buf, jrc, 1, f) != 1) {
-					printf("File write error: %m.\n");
+			if (PutData(out, ptr, rec, jrc, SinkConf.RecVersion, faddr, &cnt)) rec = NULL;
+		}
+		for (k = 0; k < ngrp; k++) {
+			eng[k]->ReadWait(&req[grp[k]], grp[k + 1] - grp[k]);	// the status of each request is checked below
+			for (m = grp[k]; m < grp[k + 1]; m++) {
+				ptr = array[idx[m]];
+				jrc = ptr->FifoDone(&req[m]);
+				if (jrc < 0) {
+					printf("Module %d FIFO error %d\n", ptr->GetSerial(), -jrc);
 					goto err;
 				}
-				fflush(f);
+				irc += jrc;
+				if (PutData(out, ptr, mrec[idx[m]], jrc, SinkConf.RecVersion, req[m].fifo_addr, &cnt)) mrec[idx[m]] = NULL;
 			}
 		}
 		if (iflag) {
-			header.len = sizeof(header);
-			header.cnt++;
-			header.type = REC_PSEOC;
-			header.time = time(NULL);
-			if (fwrite(&header, sizeof(header), 1, f) != 1) {
+			rec_fill(header, SinkConf.RecVersion, hlen, ++cnt, REC_PSEOC);
+			if (out->PutHeader(header, hlen)) {
 				printf("File write error: %m.\n");
 				goto err;
 			}
@@ -982,29 +1263,40 @@ void uwfd64_tool::WriteNFile(int serial, char *fname, int size, int flag)
 		if (irc == 0) vmemap_usleep(10000);	// nothing was there - sleep some time
 	}
 	if (flag == 'P') {
-		header.len = sizeof(header);
-		header.cnt++;
-		header.type = REC_PSEOC;
-		header.time = time(NULL);
-		if (fwrite(&header, sizeof(header), 1, f) != 1) {
+		rec_fill(header, SinkConf.RecVersion, hlen, ++cnt, REC_PSEOC);
+		if (out->PutHeader(header, hlen)) {
 			printf("File write error: %m.\n");
 			goto err;
 		}
 		fptr->Inhibit(1);
-		fflush(f);
 	}
 
-	header.len = sizeof(header);
-	header.cnt++;
-	header.type = REC_END;
-	header.time = time(NULL);
-	if (fwrite(&header, sizeof(header), 1, f) != 1) printf("File write error: %m.\n");
+	rec_fill(header, SinkConf.RecVersion, hlen, ++cnt, REC_END);
+	if (out->PutHeader(header, hlen)) printf("File write error: %m.\n");
 
 err:
+	pthread_mutex_lock(&box.mutex);
+	box.stop = 1;
+	pthread_cond_signal(&box.cond);
+	pthread_mutex_unlock(&box.mutex);
+	pthread_join(control, NULL);
+fin:
+	Out = NULL;		// the control thread is gone, nobody asks for snapshots
 	for (j = 0; j < N; j++) if (active[j]) array[j]->EnableFifo(0);
-	free(buf);
-	fclose(f);
-	printf("%Ld bytes written to file %s\n", i, fname);
+	if (rec) recbuf_release(rec);
+	for (j = 0; j < N; j++) if (mrec[j]) recbuf_release(mrec[j]);
+	printf("%Ld bytes read. Waiting for the queued data to be written ...\n", i);
+	out->Close();		// sinks print statistics only after they are drained
+	out->PrintStat();
+	for (j = 0; j < N; j++) if (active[j]) {
+		array[j]->PrintStripeStat();
+		array[j]->PrintZeroSupStat();
+		array[j]->PrintCheckStat();
+	}
+	delete out;
+	pthread_cond_destroy(&box.cond);
+	pthread_mutex_destroy(&box.mutex);
+	if (box.pending) Process(box.cmd, this);	// the last command came too late for the readout loop
 	SetStatus();	// this is possibly not error, but DSINK needs to know that we are not in aquisition state
 }
 
@@ -1026,8 +1318,8 @@ void uwfd64_tool::ZeroTrigger(int serial)
 }
 
 //*************************************************************************************************************************************//
-//	Check if we have a line from stdin. Use select.
-int CheckCmd(void)
+//	Check if we have a line from stdin. Use select, wait up to usec.
+int CheckCmd(int usec)
 {
 	fd_set set;
 	int irc;
@@ -1035,57 +1327,98 @@ int CheckCmd(void)
 	struct timeval tmzero;
 	FD_ZERO(&set);
 	FD_SET(STDIN_FILENO, &set);
-	tmzero.tv_sec = 0;
-	tmzero.tv_usec = 0;
+	tmzero.tv_sec = usec / 1000000;
+	tmzero.tv_usec = usec % 1000000;
 	irc = select(FD_SETSIZE, &set, NULL, NULL, &tmzero);
 	if (irc < 0) return 0;
 	return FD_ISSET(STDIN_FILENO, &set);
 }
 
-int TcpOpen(FILE **f, char *name)
+//	Command classes during data taking. Only short register accesses are serialised with the readout,
+//	commands which take long or disturb the module data path are refused, so no command stalls the readout
+//	for more than a few register accesses.
+#define CMD_SERIAL	0	// a few register accesses - applied by the readout loop between passes
+#define CMD_BACKGROUND	1	// safe to run in parallel with the readout
+#define CMD_FORBIDDEN	2	// long or disturbs the readout - can not be done during data taking
+
+int CmdClass(const char *cmd)
 {
-	char *ptr;
-	struct hostent *host;
-	struct sockaddr_in hostname;
-	int port;
-	int fd;
-	
-	*f = NULL;
-	
-	ptr = strchr(name, ':');
-	if (!ptr) return 0;
-	*ptr = '\0';
-	ptr++;
-	
-	host = gethostbyname(name);
-	if (!host) {
-		printf("host %s not found.\n", name);
-		return -1;
+	while (*cmd == ' ' || *cmd == '\t') cmd++;
+	switch (toupper(*cmd)) {
+	case '\0':
+	case '\n':
+	case '\r':
+	case 'E':	// A16 dump - plain reads of the mapped window
+	case 'F':	// A32 dump
+	case 'H':
+	case 'J':	// ICX dump - the readout does not use ICX
+	case 'L':
+	case 'Q':
+	case 'W':
+	case '%':	// histogram snapshot - the sink is locked for it
+	case '?':
+		return CMD_BACKGROUND;
+	case 'G':	// A64 dump - SDRAM reads compete with the readout
+	case 'I':	// Init
+	case 'N':
+	case 'O':	// FIFO reset
+	case 'P':	// Program
+	case 'R':	// ADC, Si5338, I2C and slave Xilinx registers - SPI and I2C transfers with waits
+	case 'S':
+	case 'U':
+	case 'X':
+	case 'T':	// Tests
+	case 'V':	// delay scan
+	case 'Y':
+	case ':':	// SDRAM via UDP - the same engine as the readout
+	case ';':	// SDRAM fill
+		return CMD_FORBIDDEN;
+	default:	// A B C D K M Z ! - single registers and counters
+		return CMD_SERIAL;
 	}
-	port = strtol(ptr, NULL, 0);
-	
-	hostname.sin_family = AF_INET;
-	hostname.sin_port = htons(port);
-	hostname.sin_addr = *(struct in_addr *) host->h_addr;
+}
 
-	fd = socket(PF_INET, SOCK_STREAM, 0);
-	if (fd < 0) {
-		printf("Can not create socket %m\n");
-		return -1;
-	}
+//	Control thread: reads commands from stdin while the readout loop runs.
+//	Background commands are executed here. Others are passed to the readout loop and
+//	the thread waits for their completion, so the order of commands is kept and
+//	two commands never run at the same time.
+void *ControlThread(void *arg)
+{
+	struct cmdbox_struct *box;
+	char cmd[1024];
 
-	if (connect(fd, (struct sockaddr *)&hostname, sizeof(hostname))) {
-		printf("Connection to %s:%d failed %m\n", name, port);
-		return -1;
-	}
-	
-	*f = fdopen(fd, "wb");
-	if (!*f) {
-		printf("fdopen error %m\n");
-		return -1;
+	box = (struct cmdbox_struct *) arg;
+	while (!box->stop && !box->quit) {
+		if (!CheckCmd(100000)) continue;
+		if (!fgets(cmd, sizeof(cmd), stdin)) {
+			if (feof(stdin)) vmemap_usleep(100000);
+			continue;
+		}
+		if (!isatty(STDIN_FILENO)) {
+			printf("%s", cmd);
+			fflush(stdout);
+		}
+		switch (CmdClass(cmd)) {
+		case CMD_BACKGROUND:
+			if (Process(cmd, box->tool)) box->quit = 1;
+			break;
+		case CMD_FORBIDDEN:
+			printf("This command is not allowed during data taking, stop it with Q first.\n");
+			break;
+		default:
+			pthread_mutex_lock(&box->mutex);
+			strcpy(box->cmd, cmd);
+			box->pending = 1;
+			while (box->pending && !box->stop) pthread_cond_wait(&box->cond, &box->mutex);
+			pthread_mutex_unlock(&box->mutex);
+			break;
+		}
+		if (!box->quit && !box->stop) {
+			printf("Taking data (Q to stop)> ");
+			fflush(stdout);
+		}
 	}
-	
-	return 1;
+	return NULL;
 }
 
 void Help(void)
@@ -1137,10 +1470,21 @@ void Help(void)
 	printf("W ms - wait ms milliseconds.\n");
 	printf("X num|* addr [data] - send/receive data from slave Xilinxes via SPI. addr - SPI address.\n");
 	printf("Y[P] num|* size|* fname - get size Mbytes of data to new format file fname;\n");
+	printf("\tfname = * or a pattern with %%d - automatic file names (Sink.AutoName), new file after Sink.AutoSize MBytes or Sink.AutoTime s;\n");
+	printf("\tfname = host:port - send data over TCP, up to Sink.SendQueue MBytes are queued if the receiver is slow or reconnecting;\n");
+	printf("\tfname = shm:/name - publish records to shared memory ring of Sink.ShmSize MBytes for online monitors (see shmmon);\n");
+	printf("\tfname = evt:/name - build events by trigger token and publish them to shared memory ring of Sink.ShmSize MBytes;\n");
+	printf("\tfname = hist:file - fill online histograms of amplitude, integral and time by channel, write them to file every Sink.HistPeriod s\n");
+	printf("\t\tand at the end, text if the name ends with .txt, binary otherwise;\n");
+	printf("\tfname = name1,name2,... - write to several sinks at once, each has its own queue (Sink.FilePolicy, Sink.SendPolicy);\n");
 	printf("Z num|*. - reset trigger/token counters in triggen;\n");
-	printf(": num addr [len] - dump SDRAM at addr using UDP;\n");
+	printf(": num|* addr [len] - dump SDRAM at addr using UDP, * - read from all modules at once and print the rate;\n");
 	printf("; num|* addr [len] - fill SDRAM memory with sequential 32-bit numbers;\n");
+	printf("! num|* - print the counters and the first offending blocks of the data check (DataCheck), also while taking data;\n");
+	printf("%% [fname] - write the online histograms now, to fname or to the file of the hist: sink, only while taking data;\n");
 	printf("? - get return status of the last command\n");
+	printf("During data taking (Y) E, F, H, J, L, W, %%, ? run at once, A, B, C, D, K, M, Z, ! are applied between\n");
+	printf("\treadout passes, G, I, N, O, P, R, S, T, U, V, X, Y, :, ; are refused as they would stall the readout.\n");
 }
 
 int Process(char *cmd, uwfd64_tool *tool)
@@ -1593,11 +1937,11 @@ int Process(char *cmd, uwfd64_tool *tool)
 		tool->SetStatus();
 		tok = strtok(NULL, DELIM);
 		if (tok == NULL) {
-			printf("Need module serial number.\n");
+			printf("Need module serial number or *.\n");
 	    		Help();
 	    		break;
 		}
-		serial = strtol(tok, NULL, 0);
+		serial = (tok[0] == '*') ? -1 : strtol(tok, NULL, 0);
 		tok = strtok(NULL, DELIM);
 		if (tok == NULL) {
 			printf("Need address.\n");
@@ -1606,8 +1950,11 @@ int Process(char *cmd, uwfd64_tool *tool)
 		}
 		addr = strtol(tok, NULL, 0);
 		tok = strtok(NULL, DELIM);
-		tool->UDPDump(serial, addr, (tok) ? strtol(tok, NULL, 0) : 0x400);
-		tool->ClearStatus();
+		if (serial < 0) {
+			tool->UDPReadAll(addr, (tok) ? strtol(tok, NULL, 0) : MBYTE);
+		} else {
+			tool->UDPDump(serial, addr, (tok) ? strtol(tok, NULL, 0) : 0x400);
+		}
 		break;
 	case ';':
 		tool->SetStatus();
@@ -1645,6 +1992,14 @@ int Process(char *cmd, uwfd64_tool *tool)
 		tool->WriteNFile(serial, tok, ival, flag);
 		break;
 
+	case '!':	// data check counters
+		tok = strtok(NULL, DELIM);
+		tool->CheckStat((tok == NULL || tok[0] == '*') ? -1 : strtol(tok, NULL, 0));
+		break;
+	case '%':	// histogram snapshot
+		tok = strtok(NULL, DELIM);
+		tool->Histograms(tok);
+		break;
 	case '?':
 		printf("__%4.4d\n", tool->GetStatus());
 		break;
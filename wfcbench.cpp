@@ -0,0 +1,250 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Benchmark of the waveform codec on recorded data files:
+	compression ratio and encode/decode speed of each kernel level. Every record is checked
+	to be restored exactly.
+*/
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "recformat.h"
+#include "wfcodec.h"
+
+#define MAXREC	0x100000	// maximum payload of a record
+
+//	Module data payloads of all files
+struct wfcbench_data {
+	char *buf;
+	long long len;
+	long long size;
+	int *off;		// payload offsets in buf
+	int *plen;		// payload lengths
+	int n;
+	int nsize;
+};
+
+void Help(void)
+{
+	printf("\t\tWaveform codec benchmark\n");
+	printf("Usage wfcbench [options] file.data [...]\n");
+	printf("Options:\n");
+	printf("-g MBytes - use generated waveforms instead of files;\n");
+	printf("-h - print this message and exit;\n");
+	printf("-l level - test only this kernel level: 0 - scalar, 1 - SSE2, 2 - AVX2;\n");
+	printf("-n num - repeat num times, default 3.\n");
+}
+
+double Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+//	Add a payload. Return 0 on success, negative if no memory
+int AddPayload(struct wfcbench_data *d, const void *data, int len)
+{
+	if (d->len + len > d->size) {
+		d->size = 2 * (d->size + len);
+		d->buf = (char *) realloc(d->buf, d->size);
+		if (!d->buf) return -1;
+	}
+	if (d->n >= d->nsize) {
+		d->nsize = 2 * d->nsize + 1024;
+		d->off = (int *) realloc(d->off, d->nsize * sizeof(int));
+		d->plen = (int *) realloc(d->plen, d->nsize * sizeof(int));
+		if (!d->off || !d->plen) return -1;
+	}
+	memcpy(d->buf + d->len, data, len);
+	d->off[d->n] = d->len;
+	d->plen[d->n] = len;
+	d->n++;
+	d->len += (len + 7) & ~7;	// keep payloads aligned
+	return 0;
+}
+
+//	Take module data records of the file, compressed ones are expanded
+int ReadFile(struct wfcbench_data *d, const char *fname)
+{
+	struct stat st;
+	struct rec_info_struct info;
+	char *map, *rec;
+	long long pos;
+	int fd, irc, cnt;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		printf("Can not open %s: %m\n", fname);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("Can not map %s: %m\n", fname);
+		return -1;
+	}
+	rec = (char *) malloc(MAXREC + REC_MAXHEADER);
+	cnt = 0;
+	for (pos = 0; pos < st.st_size; pos += info.len) {
+		irc = rec_parse(map + pos, (st.st_size - pos > 0x7FFFFFFF) ? 0x7FFFFFFF : st.st_size - pos, &info);
+		if (irc < 0) break;
+		if (info.type < REC_WFDDATA) continue;
+		if (info.flags & REC_FLAG_WFC) {
+			irc = wfc_rec_decode(map + pos, info.len, rec, MAXREC + REC_MAXHEADER);
+			if (irc < 0) continue;
+			irc = AddPayload(d, rec + info.hlen, irc - info.hlen);
+		} else {
+			irc = AddPayload(d, map + pos + info.hlen, info.len - info.hlen);
+		}
+		if (irc) break;
+		cnt++;
+	}
+	if (pos < st.st_size) printf("%s: stopped at offset %Ld of %Ld\n", fname, pos, (long long) st.st_size);
+	printf("%s: %d data records\n", fname, cnt);
+	free(rec);
+	munmap(map, st.st_size);
+	return 0;
+}
+
+//	Generate records of self trigger blocks: noisy baseline with a pulse here and there
+int Generate(struct wfcbench_data *d, int mbytes)
+{
+	unsigned short *w;
+	int i, j, k, n, L;
+	double base, amp;
+
+	w = (unsigned short *) malloc(MAXREC);
+	if (!w) return -1;
+	srand48(1);
+	for (i = 0; i < mbytes; i++) {
+		for (n = 0; n + 66 <= MAXREC / 2; ) {
+			L = 65;
+			w[n] = 0x8000 | ((lrand48() & 0x3F) << 9) | L;
+			w[n+1] = lrand48() & 0x3FF;
+			w[n+2] = lrand48() & 0x7FFF;
+			base = 100 + 50 * drand48();
+			amp = (drand48() < 0.3) ? 2000 * drand48() : 0;
+			for (j = 0; j < L - 2; j++) {
+				k = (int) (base + 3 * (drand48() + drand48() + drand48() - 1.5) + amp * (j > 10) * exp(-(j - 10) / 8.0));
+				w[n+3+j] = k & 0x7FFF;
+			}
+			n += L + 1;
+		}
+		if (AddPayload(d, w, 2 * n)) break;
+	}
+	free(w);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct wfcbench_data d;
+	char *cbuf, *dbuf;
+	int *clen;
+	const char *lname[] = {"scalar", "SSE2", "AVX2"};
+	double t0, tenc, tdec;
+	long long total, ctotal;
+	int level, lfrom, lto, nrep, gen;
+	int c, i, k, irc, err;
+
+	memset(&d, 0, sizeof(d));
+	lfrom = WFC_SCALAR;
+	lto = WFC_AVX2;
+	nrep = 3;
+	gen = 0;
+	for (;;) {
+		c = getopt(argc, argv, "g:hl:n:");
+		if (c == -1) break;
+		switch (c) {
+		case 'g':
+			gen = strtol(optarg, NULL, 0);
+			break;
+		case 'l':
+			lfrom = lto = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			nrep = strtol(optarg, NULL, 0);
+			if (nrep < 1) nrep = 1;
+			break;
+		case 'h':
+		default:
+			Help();
+			return 0;
+		}
+	}
+	if (gen > 0) {
+		Generate(&d, gen);
+	} else if (optind < argc) {
+		for (; optind < argc; optind++) ReadFile(&d, argv[optind]);
+	} else {
+		Help();
+		return 0;
+	}
+	if (!d.n) {
+		printf("No data records.\n");
+		return 10;
+	}
+
+	total = 0;
+	ctotal = 0;
+	for (i = 0; i < d.n; i++) {
+		total += d.plen[i];
+		ctotal += WFC_MAXSIZE(d.plen[i]) + 8;
+	}
+	cbuf = (char *) malloc(ctotal);
+	dbuf = (char *) malloc(MAXREC);
+	clen = (int *) malloc(d.n * sizeof(int));
+	if (!cbuf || !dbuf || !clen) {
+		printf("No memory.\n");
+		return 20;
+	}
+	printf("%d records, %Ld bytes\n", d.n, total);
+	for (level = lfrom; level <= lto; level++) {
+		if (wfc_set_level(level) != level) continue;
+		// encode all records one after another into cbuf
+		tenc = 1E10;
+		ctotal = 0;
+		for (k = 0; k < nrep; k++) {
+			t0 = Now();
+			for (i = 0, ctotal = 0; i < d.n; i++) {
+				clen[i] = wfc_encode(d.buf + d.off[i], d.plen[i], cbuf + ctotal, WFC_MAXSIZE(d.plen[i]));
+				ctotal += (clen[i] + 7) & ~7;
+			}
+			t0 = Now() - t0;
+			if (t0 < tenc) tenc = t0;
+		}
+		tdec = 1E10;
+		err = 0;
+		for (k = 0; k < nrep; k++) {
+			t0 = Now();
+			for (i = 0, ctotal = 0; i < d.n; i++) {
+				irc = wfc_decode(cbuf + ctotal, clen[i], dbuf, MAXREC);
+				ctotal += (clen[i] + 7) & ~7;
+				if (!k && (irc != d.plen[i] || memcmp(dbuf, d.buf + d.off[i], irc))) err++;
+			}
+			t0 = Now() - t0;
+			if (t0 < tdec) tdec = t0;
+		}
+		for (i = 0, ctotal = 0; i < d.n; i++) ctotal += clen[i];
+		printf("%-6s: ratio %.3f (%Ld bytes), encode %.2f GB/s, decode %.2f GB/s", lname[level],
+			(double) total / ctotal, ctotal, total / tenc * 1E-9, total / tdec * 1E-9);
+		if (err) printf(", %d records NOT RESTORED", err);
+		printf("\n");
+	}
+	free(clen);
+	free(dbuf);
+	free(cbuf);
+	free(d.buf);
+	free(d.off);
+	free(d.plen);
+	return 0;
+}
@@ -0,0 +1,429 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Lossless waveform codec for module data records.
+	Control words and block headers are passed through, samples of each complete block
+	are replaced by their differences, zigzag coded and packed with the minimum bit width
+	for the block. Partial blocks at the record edges and anything not looking like a block
+	are stored as they are. Difference and prefix sum kernels use SSE2/AVX2 when available.
+*/
+
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "recformat.h"
+#include "wfcodec.h"
+
+#define WFC_MAXBLOCK	0x200		// words in the longest block including the control word
+
+//	Prefix of a compressed payload
+struct wfc_prefix_struct {
+	int len;		// original payload length
+	unsigned int crc;	// original payload CRC32C
+};
+
+//	Zigzag coded differences d[i] = x[i+1] - x[i], i < n - 1. Return OR of all d.
+typedef unsigned int (*wfc_delta_fn)(const unsigned short *x, int n, unsigned short *d);
+//	Reverse: x[i+1] = x[i] + d[i], x[0] is already set
+typedef void (*wfc_prefix_fn)(const unsigned short *d, int n, unsigned short *x);
+
+static unsigned int wfc_delta_scalar(const unsigned short *x, int n, unsigned short *d)
+{
+	unsigned int acc;
+	short v;
+	int i;
+
+	acc = 0;
+	for (i = 0; i < n - 1; i++) {
+		v = x[i+1] - x[i];
+		d[i] = (v << 1) ^ (v >> 15);
+		acc |= d[i];
+	}
+	return acc;
+}
+
+static void wfc_prefix_scalar(const unsigned short *d, int n, unsigned short *x)
+{
+	int i;
+
+	for (i = 0; i < n - 1; i++) x[i+1] = x[i] + ((d[i] >> 1) ^ -(d[i] & 1));
+}
+
+#if defined(__x86_64__)
+static unsigned int wfc_delta_sse2(const unsigned short *x, int n, unsigned short *d)
+{
+	__m128i v, acc;
+	unsigned short a[8];
+	int i;
+
+	acc = _mm_setzero_si128();
+	for (i = 0; i + 9 <= n; i += 8) {
+		v = _mm_sub_epi16(_mm_loadu_si128((const __m128i *) (x + i + 1)), _mm_loadu_si128((const __m128i *) (x + i)));
+		v = _mm_xor_si128(_mm_slli_epi16(v, 1), _mm_srai_epi16(v, 15));
+		_mm_storeu_si128((__m128i *) (d + i), v);
+		acc = _mm_or_si128(acc, v);
+	}
+	_mm_storeu_si128((__m128i *) a, acc);
+	return a[0] | a[1] | a[2] | a[3] | a[4] | a[5] | a[6] | a[7] | wfc_delta_scalar(x + i, n - i, d + i);
+}
+
+//	The tail is done here too: calling SSE2 code with the upper halves in use is very slow
+__attribute__((target("avx2")))
+static unsigned int wfc_delta_avx2(const unsigned short *x, int n, unsigned short *d)
+{
+	__m256i v, acc;
+	__m128i u, acc4;
+	unsigned short a[8];
+	int i;
+
+	acc = _mm256_setzero_si256();
+	for (i = 0; i + 17 <= n; i += 16) {
+		v = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *) (x + i + 1)), _mm256_loadu_si256((const __m256i *) (x + i)));
+		v = _mm256_xor_si256(_mm256_slli_epi16(v, 1), _mm256_srai_epi16(v, 15));
+		_mm256_storeu_si256((__m256i *) (d + i), v);
+		acc = _mm256_or_si256(acc, v);
+	}
+	acc4 = _mm_or_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	if (i + 9 <= n) {
+		u = _mm_sub_epi16(_mm_loadu_si128((const __m128i *) (x + i + 1)), _mm_loadu_si128((const __m128i *) (x + i)));
+		u = _mm_xor_si128(_mm_slli_epi16(u, 1), _mm_srai_epi16(u, 15));
+		_mm_storeu_si128((__m128i *) (d + i), u);
+		acc4 = _mm_or_si128(acc4, u);
+		i += 8;
+	}
+	_mm_storeu_si128((__m128i *) a, acc4);
+	_mm256_zeroupper();
+	return a[0] | a[1] | a[2] | a[3] | a[4] | a[5] | a[6] | a[7] | wfc_delta_scalar(x + i, n - i, d + i);
+}
+
+//	8 differences at once: in-register prefix sum in 3 shifted adds plus the carry from the previous 8
+static void wfc_prefix_sse2(const unsigned short *d, int n, unsigned short *x)
+{
+	__m128i u, v, prev;
+	const __m128i one = _mm_set1_epi16(1);
+	int i;
+
+	prev = _mm_set1_epi16(x[0]);
+	for (i = 0; i + 9 <= n; i += 8) {
+		u = _mm_loadu_si128((const __m128i *) (d + i));
+		v = _mm_xor_si128(_mm_srli_epi16(u, 1), _mm_sub_epi16(_mm_setzero_si128(), _mm_and_si128(u, one)));
+		v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+		v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+		v = _mm_add_epi16(v, _mm_slli_si128(v, 8));
+		v = _mm_add_epi16(v, prev);
+		_mm_storeu_si128((__m128i *) (x + i + 1), v);
+		prev = _mm_shufflehi_epi16(v, 0xFF);
+		prev = _mm_unpackhi_epi64(prev, prev);
+	}
+	wfc_prefix_scalar(d + i, n - i, x + i);
+}
+#endif
+
+static int wfc_level = -1;
+static int wfc_maxlevel = WFC_SCALAR;
+static wfc_delta_fn wfc_delta = wfc_delta_scalar;
+static wfc_prefix_fn wfc_prefix = wfc_prefix_scalar;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Select the kernels. The level is limited to what the CPU supports.
+//	Return the level set
+int wfc_set_level(int level)
+{
+#if defined(__x86_64__)
+	wfc_maxlevel = (__builtin_cpu_supports("avx2")) ? WFC_AVX2 : WFC_SSE2;
+#endif
+	if (level > wfc_maxlevel) level = wfc_maxlevel;
+	if (level < WFC_SCALAR) level = WFC_SCALAR;
+	wfc_delta = wfc_delta_scalar;
+	wfc_prefix = wfc_prefix_scalar;
+#if defined(__x86_64__)
+	if (level >= WFC_SSE2) {
+		wfc_delta = wfc_delta_sse2;
+		wfc_prefix = wfc_prefix_sse2;
+	}
+	if (level >= WFC_AVX2) wfc_delta = wfc_delta_avx2;
+#endif
+	wfc_level = level;
+	return level;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	The level in use, the best available by default
+int wfc_get_level(void)
+{
+	if (wfc_level < 0) wfc_set_level(WFC_AVX2);
+	return wfc_level;
+}
+
+//	Pack n values of b bits, 32 bits are stored at once
+static unsigned char *wfc_pack(const unsigned short *d, int n, int b, unsigned char *p)
+{
+	unsigned long long acc;
+	unsigned int w;
+	int bits, i;
+
+	acc = 0;
+	bits = 0;
+	for (i = 0; i < n; i++) {
+		acc |= (unsigned long long) d[i] << bits;
+		bits += b;
+		if (bits >= 32) {
+			w = acc;
+			memcpy(p, &w, 4);
+			p += 4;
+			acc >>= 32;
+			bits -= 32;
+		}
+	}
+	for (; bits > 0; bits -= 8, acc >>= 8) *p++ = acc;
+	return p;
+}
+
+//	The same without branches, but up to 8 bytes after the packed data are overwritten
+static unsigned char *wfc_pack_fast(const unsigned short *d, int n, int b, unsigned char *p)
+{
+	unsigned long long acc;
+	int bits, i, k;
+
+	acc = 0;
+	bits = 0;
+	for (i = 0; i < n; i++) {
+		acc |= (unsigned long long) d[i] << bits;
+		bits += b;
+		memcpy(p, &acc, 8);
+		k = bits >> 3;
+		p += k;
+		acc >>= 8 * k;
+		bits &= 7;
+	}
+	if (bits) *p++ = acc;
+	return p;
+}
+
+//	Unpack n values of b bits from nbytes at p. Each value is taken from an unaligned 32-bit load,
+//	so the loads are independent. avail - bytes which can be read at p.
+static void wfc_unpack(const unsigned char *p, int n, int b, int avail, unsigned short *d)
+{
+	unsigned int mask, w;
+	int pos, i;
+
+	if (!b) {
+		memset(d, 0, n * sizeof(short));
+		return;
+	}
+	mask = (1 << b) - 1;
+	pos = 0;
+	// the value ends at most 23 bits after the byte it starts in
+	for (i = 0; i < n && (pos >> 3) + 4 <= avail; i++, pos += b) {
+		memcpy(&w, p + (pos >> 3), 4);
+		d[i] = (w >> (pos & 7)) & mask;
+	}
+	for (; i < n; i++, pos += b) {
+		w = p[pos >> 3];
+		if ((pos & 7) + b > 8) w |= p[(pos >> 3) + 1] << 8;
+		if ((pos & 7) + b > 16) w |= p[(pos >> 3) + 2] << 16;
+		d[i] = (w >> (pos & 7)) & mask;
+	}
+}
+
+//	Store n words as WFC_RAW items. Return the new output pointer, NULL if no space
+static unsigned char *wfc_raw(const unsigned short *w, int n, unsigned char *p, unsigned char *end)
+{
+	int k;
+
+	for (; n > 0; n -= k, w += k) {
+		k = (n > WFC_RAWMAX) ? WFC_RAWMAX : n;
+		if (end - p < 3 + 2 * k) return NULL;
+		p[0] = WFC_RAW;
+		p[1] = k & 0xFF;
+		p[2] = k >> 8;
+		memcpy(p + 3, w, 2 * k);
+		p += 3 + 2 * k;
+	}
+	return p;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Compress len bytes of module data from src to dst of size bytes.
+//	WFC_MAXSIZE(len) is always enough.
+//	Return the compressed length, negative if dst is too small
+int wfc_encode(const void *src, int len, void *dst, int size)
+{
+	const unsigned short *w;
+	unsigned short d[WFC_MAXBLOCK];
+	unsigned char *p, *end;
+	unsigned int acc;
+	int n, j, raw, L, m, b, plen;
+
+	wfc_get_level();
+	w = (const unsigned short *) src;
+	n = len / 2;
+	p = (unsigned char *) dst;
+	end = p + size;
+	raw = 0;
+	for (j = 0; j < n; ) {
+		L = w[j] & 0x1FF;
+		if (!(w[j] & 0x8000) || !L || j + L >= n) {	// not a complete block
+			j++;
+			continue;
+		}
+		if (L < WFC_MINBLOCK) {
+			j += L + 1;
+			continue;
+		}
+		// samples are after the control word and 2 header words
+		m = L - 2;
+		acc = wfc_delta(w + j + 3, m, d);
+		b = (acc) ? 32 - __builtin_clz(acc) : 0;
+		plen = 9 + ((m - 1) * b + 7) / 8;
+		if (plen + 3 >= 2 * (L + 1)) {		// no gain, even if it does not break a raw item
+			j += L + 1;
+			continue;
+		}
+		p = wfc_raw(w + raw, j - raw, p, end);
+		if (!p || end - p < plen) return -1;
+		*p++ = WFC_PACKED | b;
+		memcpy(p, w + j, 8);
+		p = (end - p >= plen + 8) ? wfc_pack_fast(d, m - 1, b, p + 8) : wfc_pack(d, m - 1, b, p + 8);
+		j += L + 1;
+		raw = j;
+	}
+	p = wfc_raw(w + raw, n - raw, p, end);
+	if (!p) return -1;
+	if (len & 1) {
+		if (end - p < 2) return -1;
+		*p++ = WFC_BYTE;
+		*p++ = ((const unsigned char *) src)[len - 1];
+	}
+	return p - (unsigned char *) dst;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Expand len bytes of the compressed stream from src to dst of size bytes. dst must be 2-byte aligned.
+//	Return the expanded length, negative if the stream is damaged or dst is too small
+int wfc_decode(const void *src, int len, void *dst, int size)
+{
+	const unsigned char *p, *end;
+	unsigned char *q, *qend;
+	unsigned short d[WFC_MAXBLOCK];
+	unsigned short cw;
+	int tag, k, L, m, b, nbytes;
+
+	wfc_get_level();
+	p = (const unsigned char *) src;
+	end = p + len;
+	q = (unsigned char *) dst;
+	qend = q + size;
+	while (p < end) {
+		tag = *p++;
+		if (tag == WFC_RAW) {
+			if (end - p < 2) return -1;
+			k = 2 * (p[0] | (p[1] << 8));
+			p += 2;
+			if (end - p < k || qend - q < k) return -2;
+			memcpy(q, p, k);
+			p += k;
+			q += k;
+		} else if (tag == WFC_BYTE) {
+			if (end - p < 1 || qend - q < 1) return -2;
+			*q++ = *p++;
+		} else if (tag & WFC_PACKED) {
+			b = tag & ~WFC_PACKED;
+			if (b > 16 || end - p < 8) return -1;
+			memcpy(&cw, p, 2);
+			L = cw & 0x1FF;
+			if (L < WFC_MINBLOCK) return -1;
+			m = L - 2;
+			nbytes = ((m - 1) * b + 7) / 8;
+			if (end - p < 8 + nbytes || qend - q < 2 * (L + 1)) return -2;
+			memcpy(q, p, 8);
+			wfc_unpack(p + 8, m - 1, b, end - p - 8, d);
+			wfc_prefix(d, m, (unsigned short *) (q + 6));
+			p += 8 + nbytes;
+			q += 2 * (L + 1);
+		} else {
+			return -1;
+		}
+	}
+	return q - (unsigned char *) dst;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Compress a module data record to dst of size bytes, WFC_MAXSIZE(len) is enough.
+//	Only v2 records can be compressed, the header is kept with REC_FLAG_WFC set.
+//	Return the compressed record length, 0 if the record is not compressed
+//	(not a v2 data record, already compressed or no gain), negative on error
+int wfc_rec_encode(const void *rec, int len, void *dst, int size)
+{
+	struct rec_info_struct info;
+	struct rec_header_v2_struct *h;
+	struct wfc_prefix_struct pref;
+	char *c;
+	int irc;
+
+	if (rec_parse(rec, len, &info) < 2 || info.type < REC_WFDDATA || (info.flags & REC_FLAG_WFC)) return 0;
+	if (size < info.hlen + (int) sizeof(pref)) return -1;
+	c = (char *) dst;
+	h = (struct rec_header_v2_struct *) dst;
+	memcpy(c, rec, info.hlen);
+	pref.len = info.len - info.hlen;
+	pref.crc = h->crc;
+	memcpy(c + info.hlen, &pref, sizeof(pref));
+	irc = wfc_encode((const char *) rec + info.hlen, pref.len, c + info.hlen + sizeof(pref), size - info.hlen - sizeof(pref));
+	if (irc < 0) return -1;
+	irc += info.hlen + sizeof(pref);
+	if (irc >= info.len) return 0;
+	h->len = irc;
+	h->flags |= REC_FLAG_WFC;
+	h->crc = rec_crc32c(0, c + info.hlen, irc - info.hlen);
+	return irc;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Length of the record after expansion, negative if this is not a record
+int wfc_rec_size(const void *rec, int len)
+{
+	struct rec_info_struct info;
+	struct wfc_prefix_struct pref;
+	int irc;
+
+	irc = rec_parse(rec, len, &info);
+	if (irc < 0) return irc;
+	if (!(info.flags & REC_FLAG_WFC)) return info.len;
+	if (info.len < info.hlen + (int) sizeof(pref)) return REC_ERR_HEADER;
+	memcpy(&pref, (const char *) rec + info.hlen, sizeof(pref));
+	return info.hlen + pref.len;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Expand a record to dst of size bytes, wfc_rec_size() is enough. Records which are not
+//	compressed are copied. The original record is restored exactly and its CRC is checked.
+//	Return the record length, REC_ERR_* or -10 if dst is too small
+int wfc_rec_decode(const void *rec, int len, void *dst, int size)
+{
+	struct rec_info_struct info;
+	struct rec_header_v2_struct *h;
+	struct wfc_prefix_struct pref;
+	char *c;
+	int irc;
+
+	irc = rec_parse(rec, len, &info);
+	if (irc < 0) return irc;
+	if (!(info.flags & REC_FLAG_WFC)) {
+		if (size < info.len) return -10;
+		memcpy(dst, rec, info.len);
+		return info.len;
+	}
+	if (info.len < info.hlen + (int) sizeof(pref)) return REC_ERR_HEADER;
+	memcpy(&pref, (const char *) rec + info.hlen, sizeof(pref));
+	if (size < info.hlen + pref.len) return -10;
+	c = (char *) dst;
+	memcpy(c, rec, info.hlen);
+	irc = wfc_decode((const char *) rec + info.hlen + sizeof(pref), info.len - info.hlen - sizeof(pref), c + info.hlen, pref.len);
+	if (irc != pref.len || rec_crc32c(0, c + info.hlen, pref.len) != pref.crc) return REC_ERR_CRC;
+	h = (struct rec_header_v2_struct *) dst;
+	h->len = info.hlen + pref.len;
+	h->flags &= ~REC_FLAG_WFC;
+	h->crc = pref.crc;
+	return h->len;
+}
@@ -0,0 +1,39 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Lossless waveform codec for module data records.
+*/
+#ifndef WFCODEC_H
+#define WFCODEC_H
+
+//	Compressed stream: a sequence of items, each starts with a tag byte, words in host order.
+//	WFC_RAW, 16-bit count, count words as they are
+//	WFC_BYTE, one byte - odd length tail
+//	WFC_PACKED | b, control word, 2 block header words, the first sample,
+//		then the differences of the following samples, zigzag coded, b bits each, LSB first
+//	A compressed record has the v2 header with REC_FLAG_WFC and CRC of what is stored,
+//	the payload is the original payload length and CRC (2 ints) followed by the stream.
+#define WFC_RAW		0x00
+#define WFC_BYTE	0x01
+#define WFC_PACKED	0x80
+#define WFC_RAWMAX	0xFFFF		// words in one WFC_RAW item
+#define WFC_MINBLOCK	4		// shorter blocks are stored raw
+
+//	Maximum compressed size of len bytes
+#define WFC_MAXSIZE(len)	((len) + 3 * ((len) / (2 * WFC_RAWMAX) + 2) + 8)
+
+//	SIMD level of the kernels
+enum WFC_LEVEL {
+	WFC_SCALAR = 0,
+	WFC_SSE2 = 1,
+	WFC_AVX2 = 2
+};
+
+int wfc_decode(const void *src, int len, void *dst, int size);
+int wfc_encode(const void *src, int len, void *dst, int size);
+int wfc_get_level(void);
+int wfc_rec_decode(const void *rec, int len, void *dst, int size);
+int wfc_rec_encode(const void *rec, int len, void *dst, int size);
+int wfc_rec_size(const void *rec, int len);
+int wfc_set_level(int level);
+
+#endif /* WFCODEC_H */
@@ -0,0 +1,300 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Waveform feature extraction: compact per block records instead of samples.
+	Samples are converted with blk_samples(), the maximum, the sum and the count above
+	the threshold are found in one pass with SSE2/AVX2/AVX-512 at the level of blk_get_level().
+	A feature is 20 bytes instead of 2 * (WinLen + 3), an order of magnitude less data
+	for the usual windows.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "recformat.h"
+#include "wffeat.h"
+
+//	One pass over the samples: maximum, sum and count of samples above thr
+struct wff_sums {
+	int max;
+	int sum;
+	int cnt;
+};
+
+typedef void (*wff_sums_fn)(const short *y, int n, int thr, struct wff_sums *s);
+
+static void wff_sums_scalar(const short *y, int n, int thr, struct wff_sums *s)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (y[i] > s->max) s->max = y[i];
+		s->sum += y[i];
+		s->cnt += (y[i] > thr);
+	}
+}
+
+#if defined(__x86_64__)
+//	The count is kept in 16-bit lanes: blocks are shorter than 32768 samples
+static void wff_sums_sse2(const short *y, int n, int thr, struct wff_sums *s)
+{
+	__m128i v, vmax, vsum, vcnt;
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i t = _mm_set1_epi16(thr);
+	short m[8];
+	int i, k;
+
+	vmax = _mm_set1_epi16(-32768);
+	vsum = _mm_setzero_si128();
+	vcnt = _mm_setzero_si128();
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm_loadu_si128((const __m128i *) (y + i));
+		vmax = _mm_max_epi16(vmax, v);
+		vsum = _mm_add_epi32(vsum, _mm_madd_epi16(v, one));
+		vcnt = _mm_sub_epi16(vcnt, _mm_cmpgt_epi16(v, t));
+	}
+	vsum = _mm_add_epi32(vsum, _mm_shuffle_epi32(vsum, 0x4E));
+	vsum = _mm_add_epi32(vsum, _mm_shuffle_epi32(vsum, 0xB1));
+	s->sum += _mm_cvtsi128_si32(vsum);
+	vcnt = _mm_madd_epi16(vcnt, one);
+	vcnt = _mm_add_epi32(vcnt, _mm_shuffle_epi32(vcnt, 0x4E));
+	vcnt = _mm_add_epi32(vcnt, _mm_shuffle_epi32(vcnt, 0xB1));
+	s->cnt += _mm_cvtsi128_si32(vcnt);
+	_mm_storeu_si128((__m128i *) m, vmax);
+	for (k = 0; k < 8; k++) if (m[k] > s->max) s->max = m[k];
+	wff_sums_scalar(y + i, n - i, thr, s);
+}
+
+__attribute__((target("avx2")))
+static void wff_sums_avx2(const short *y, int n, int thr, struct wff_sums *s)
+{
+	__m256i v, vmax, vsum, vcnt;
+	__m128i h;
+	const __m256i one = _mm256_set1_epi16(1);
+	const __m256i t = _mm256_set1_epi16(thr);
+	int i;
+
+	vmax = _mm256_set1_epi16(-32768);
+	vsum = _mm256_setzero_si256();
+	vcnt = _mm256_setzero_si256();
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm256_loadu_si256((const __m256i *) (y + i));
+		vmax = _mm256_max_epi16(vmax, v);
+		vsum = _mm256_add_epi32(vsum, _mm256_madd_epi16(v, one));
+		vcnt = _mm256_sub_epi16(vcnt, _mm256_cmpgt_epi16(v, t));
+	}
+	h = _mm_add_epi32(_mm256_castsi256_si128(vsum), _mm256_extracti128_si256(vsum, 1));
+	h = _mm_add_epi32(h, _mm_shuffle_epi32(h, 0x4E));
+	h = _mm_add_epi32(h, _mm_shuffle_epi32(h, 0xB1));
+	s->sum += _mm_cvtsi128_si32(h);
+	vcnt = _mm256_madd_epi16(vcnt, one);
+	h = _mm_add_epi32(_mm256_castsi256_si128(vcnt), _mm256_extracti128_si256(vcnt, 1));
+	h = _mm_add_epi32(h, _mm_shuffle_epi32(h, 0x4E));
+	h = _mm_add_epi32(h, _mm_shuffle_epi32(h, 0xB1));
+	s->cnt += _mm_cvtsi128_si32(h);
+	h = _mm_max_epi16(_mm256_castsi256_si128(vmax), _mm256_extracti128_si256(vmax, 1));
+	h = _mm_max_epi16(h, _mm_shuffle_epi32(h, 0x4E));
+	h = _mm_max_epi16(h, _mm_shuffle_epi32(h, 0xB1));
+	h = _mm_max_epi16(h, _mm_srli_epi32(h, 16));
+	if ((short) _mm_cvtsi128_si32(h) > s->max) s->max = (short) _mm_cvtsi128_si32(h);
+	wff_sums_scalar(y + i, n - i, thr, s);
+}
+
+//	Tails are done with masked loads and compares
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+static void wff_sums_avx512(const short *y, int n, int thr, struct wff_sums *s)
+{
+	__m512i v, vmax, vsum;
+	const __m512i one = _mm512_set1_epi16(1);
+	const __m512i t = _mm512_set1_epi16(thr);
+	__mmask32 m;
+	int i, cnt;
+
+	vmax = _mm512_set1_epi16(-32768);
+	vsum = _mm512_setzero_si512();
+	cnt = 0;
+	for (i = 0; i < n; i += 32) {
+		m = (n - i >= 32) ? 0xFFFFFFFF : (1U << (n - i)) - 1;
+		v = _mm512_maskz_loadu_epi16(m, y + i);
+		vmax = _mm512_mask_max_epi16(vmax, m, vmax, v);
+		vsum = _mm512_add_epi32(vsum, _mm512_madd_epi16(v, one));
+		cnt += __builtin_popcount(_mm512_mask_cmpgt_epi16_mask(m, v, t));
+	}
+	s->sum += _mm512_reduce_add_epi32(vsum);
+	s->cnt += cnt;
+	v = _mm512_max_epi32(_mm512_cvtepi16_epi32(_mm512_castsi512_si256(vmax)), _mm512_cvtepi16_epi32(_mm512_extracti64x4_epi64(vmax, 1)));
+	i = _mm512_reduce_max_epi32(v);
+	if (i > s->max) s->max = i;
+}
+#endif
+
+static int wff_level = -1;
+static wff_sums_fn wff_sums = wff_sums_scalar;
+
+//	Follow the kernel level of the block decoder
+static void wff_set_kernels(void)
+{
+	wff_level = blk_get_level();
+	wff_sums = wff_sums_scalar;
+#if defined(__x86_64__)
+	if (wff_level >= BLK_SSE2) wff_sums = wff_sums_sse2;
+	if (wff_level >= BLK_AVX2) wff_sums = wff_sums_avx2;
+	if (wff_level >= BLK_AVX512) wff_sums = wff_sums_avx512;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Features of the waveform block v of the module serial. Fills f, the block words are not changed.
+void wff_extract(const struct blk_view *v, int serial, const struct wff_config *conf, struct wff_feature *f)
+{
+	short y[BLK_MAXLEN];
+	struct wff_sums s;
+	int i, n, b, thr, num, den;
+
+	memset(f, 0, sizeof(struct wff_feature));
+	f->cw = v->cw[0];
+	if (v->len >= 1) f->w1 = v->cw[1];
+	if (v->len >= 2) f->w2 = v->cw[2];
+	n = v->ndata;
+	if (n <= 0) return;
+	blk_samples(v->data, n, y, 0, BLK_INVERTED(conf->InvertMask[serial & (WFF_MAXSERIAL - 1)], v->chan));
+
+	num = (conf->BaseLen > 0 && conf->BaseLen < n) ? conf->BaseLen : n;
+	for (i = 0, b = 0; i < num; i++) b += y[i];
+	b = (b >= 0) ? (b + num / 2) / num : -((-b + num / 2) / num);
+	thr = b + conf->Threshold;
+	thr = (thr > 32767) ? 32767 : (thr < -32768) ? -32768 : thr;
+
+	s.max = -32768;
+	s.sum = 0;
+	s.cnt = 0;
+	if (wff_level != blk_get_level()) wff_set_kernels();
+	wff_sums(y, n, thr, &s);
+
+	for (i = 0; i < n; i++) if (y[i] == s.max) break;
+	f->baseline = b;
+	f->amplitude = (s.max - b > 32767) ? 32767 : s.max - b;
+	f->integral = s.sum - n * b;
+	f->tot = s.cnt;
+	f->peak = i * WFF_TSCALE;
+	if (s.max >= 16383) f->flags |= WFF_SAT;
+	if (i == 0 || i == n - 1) {
+		f->flags |= WFF_EDGE;
+		return;
+	}
+	// vertex of the parabola through i-1, i, i+1: y[i] is the first maximum, so den < 0 and |num| <= -den / 2
+	num = WFF_TSCALE * (y[i-1] - y[i+1]);
+	den = 2 * (y[i-1] - 2 * y[i] + y[i+1]);
+	if (den) f->peak += (num >= 0) ? (num - den / 2) / den : (num + den / 2) / den;
+}
+
+//*************************************************************************************************************************************//
+
+wffextractor::wffextractor(struct wff_config *conf)
+{
+	memcpy(&Conf, conf, sizeof(Conf));
+	if (Conf.BaseLen <= 0) Conf.BaseLen = WFF_BASELEN;
+	memset(dec, 0, sizeof(dec));
+	buf = NULL;
+	size = 0;
+	raw = NULL;
+	rawsize = 0;
+	memset(&stat, 0, sizeof(stat));
+}
+
+wffextractor::~wffextractor(void)
+{
+	int i;
+
+	for (i = 0; i < WFF_MAXSERIAL; i++) if (dec[i]) delete dec[i];
+	free(buf);
+	free(raw);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Make the feature record of the module data record into the buffer of GetRecord().
+//	Records of other types, compressed ones and buffers holding more than one record are not converted.
+//	Return the feature record length, 0 if the record is not converted, negative if no memory
+int wffextractor::Convert(const void *rec, int len)
+{
+	struct rec_info_struct info;
+	struct rec_header_struct *h1;
+	struct rec_header_v2_struct *h2;
+	struct wff_feature *f;
+	struct blk_view v;
+	blkdecoder *d;
+	int nfeat, nraw, need, irc;
+
+	if (rec_parse(rec, len, &info) < 0 || info.type < REC_WFDDATA || info.len != len || (info.flags & REC_FLAG_WFC)) return 0;
+	// a block carried from the previous record adds at most BLK_MAXLEN words, a feature is less than 4 bytes per word
+	need = info.hlen + sizeof(int) + 4 * (len - info.hlen + 2 * BLK_MAXLEN);
+	if (size < need) {
+		free(buf);
+		free(raw);
+		size = need;
+		rawsize = len - info.hlen + 2 * BLK_MAXLEN;
+		buf = (char *) malloc(size);
+		raw = (unsigned short *) malloc(rawsize);
+		if (!buf || !raw) {
+			free(buf);
+			free(raw);
+			buf = NULL;
+			raw = NULL;
+			size = rawsize = 0;
+			return -1;
+		}
+	}
+	d = dec[(info.type - REC_WFDDATA) & (WFF_MAXSERIAL - 1)];
+	if (!d) d = dec[(info.type - REC_WFDDATA) & (WFF_MAXSERIAL - 1)] = new blkdecoder();
+
+	f = (struct wff_feature *) (buf + info.hlen + sizeof(int));
+	nfeat = nraw = 0;
+	d->Feed((const char *) rec + info.hlen, len - info.hlen);
+	while ((irc = d->Next(&v)) != BLK_END) {
+		if (irc == BLK_STRAY || irc == BLK_SHORT) {
+			stat.errors++;
+			continue;
+		}
+		if (irc != BLK_OK) continue;
+		if ((v.type == BLK_SELF || v.type == BLK_MASTER) && v.len >= 2) {
+			wff_extract(&v, info.type - REC_WFDDATA, &Conf, &f[nfeat]);
+			nfeat++;
+		} else {
+			memcpy(raw + nraw, v.cw, 2 * (v.len + 1));
+			nraw += v.len + 1;
+			stat.other++;
+		}
+	}
+	memcpy(buf + info.hlen, &nfeat, sizeof(int));
+	memcpy(&f[nfeat], raw, 2 * nraw);
+	need = info.hlen + sizeof(int) + nfeat * sizeof(struct wff_feature) + 2 * nraw;
+
+	// the header of the data record with the new length, type and CRC
+	memcpy(buf, rec, info.hlen);
+	if (info.version < 2) {
+		h1 = (struct rec_header_struct *) buf;
+		h1->len = need;
+		h1->type = REC_FEATURE + (info.type - REC_WFDDATA);
+	} else {
+		h2 = (struct rec_header_v2_struct *) buf;
+		h2->len = need;
+		h2->type = REC_FEATURE + (info.type - REC_WFDDATA);
+		h2->flags = 0;
+		h2->crc = rec_crc32c(0, buf + info.hlen, need - info.hlen);
+	}
+	stat.records++;
+	stat.features += nfeat;
+	stat.in += len;
+	stat.out += need;
+	return need;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Forget blocks carried between records, at the beginning of a new run
+void wffextractor::Reset(void)
+{
+	int i;
+
+	for (i = 0; i < WFF_MAXSERIAL; i++) if (dec[i]) dec[i]->Reset();
+}
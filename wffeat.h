@@ -0,0 +1,82 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Waveform feature extraction: compact per block records instead of samples.
+*/
+#ifndef WFFEAT_H
+#define WFFEAT_H
+
+#include "blkdecode.h"
+
+#define WFF_MAXSERIAL	256		// module serial numbers
+#define WFF_TSCALE	64		// peak time units per sample
+#define WFF_BASELEN	8		// default samples for the baseline
+
+//	Features of one waveform block (self or master trigger), 20 bytes.
+//	Samples of inverted channels are negated first, so pulses always go up.
+struct wff_feature {
+	unsigned short cw;	// control word of the block: channel and length
+	unsigned short w1;	// block word 1: type, parity, error, token
+	unsigned short w2;	// block word 2: time
+	short baseline;		// mean of the first BaseLen samples, rounded
+	short amplitude;	// maximum sample minus baseline
+	unsigned short peak;	// position of the maximum from the first sample, 1/WFF_TSCALE sample, parabolic interpolation
+	unsigned short tot;	// samples above baseline + Threshold
+	unsigned short flags;	// WFF_*
+	int integral;		// sum of all samples minus baseline
+};
+
+//	Feature flags
+#define WFF_SAT		1	// the maximum is at the 15-bit limit
+#define WFF_EDGE	2	// the maximum is the first or the last sample, the peak is not interpolated
+
+//	Feature record: type REC_FEATURE + serial, the header as of the data record it was made of.
+//	Payload: int nfeat, struct wff_feature[nfeat], then the other blocks (trigger information,
+//	history, token synchronization) as they came, with control words.
+
+//	Where the features go instead of the data records
+enum WFF_MODE {
+	WFF_OFF = 0,		// data records only
+	WFF_ONLY = 1,		// feature records instead of data records
+	WFF_BOTH = 2		// each data record is followed by its feature record
+};
+
+//	Parameters, normally from Sink section of the configuration, InvertMask from the modules
+struct wff_config {
+	int Mode;		// WFF_MODE
+	int BaseLen;		// samples at the beginning of the window for the baseline
+	int Threshold;		// ADC counts above the baseline for the time over threshold
+	short int InvertMask[WFF_MAXSERIAL][4];	// inverted channels of each module by serial, its InvertMask
+};
+
+//	Counters
+struct wff_stat {
+	long long records;	// data records converted
+	long long features;	// waveform blocks
+	long long other;	// blocks copied as they are
+	long long errors;	// stray words and cut blocks, dropped
+	long long in;		// bytes of data records
+	long long out;		// bytes of feature records
+};
+
+void wff_extract(const struct blk_view *v, int serial, const struct wff_config *conf, struct wff_feature *f);
+
+//	Converts data records of all modules, blocks split between records are followed per module
+class wffextractor {
+private:
+	struct wff_config Conf;
+	blkdecoder *dec[WFF_MAXSERIAL];
+	char *buf;		// the last feature record
+	int size;
+	unsigned short *raw;	// other blocks of the record being converted
+	int rawsize;
+	struct wff_stat stat;
+public:
+	wffextractor(struct wff_config *conf);
+	~wffextractor(void);
+	int Convert(const void *rec, int len);
+	inline const char *GetRecord(void) { return buf; };
+	inline const struct wff_stat *GetStat(void) { return &stat; };
+	void Reset(void);
+};
+
+#endif /* WFFEAT_H */
@@ -0,0 +1,246 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Online histograms of the waveform blocks: amplitude, integral, time by channel.
+
+	Every filling thread has its own histograms, so nothing is locked or shared while
+	the data flows. A record is decoded on its own: records of a module may go to different
+	threads, the blocks split between records are counted but not histogrammed, which is
+	a block in a few thousand with the usual readout buffers. The features are made with
+	wff_extract(), as in the feature records. Snapshot() sums the threads without stopping
+	them, the counts of a snapshot may be a few blocks apart between histograms.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "recformat.h"
+#include "wfhist.h"
+
+//	Bin of x in a histogram beginning at min with bins of width
+static inline int wfh_bin(int x, int min, int width)
+{
+	if (x < min) return 0;
+	x = (x - min) / width;
+	return (x >= WFH_NBINS) ? WFH_NBINS + 1 : x + 1;
+}
+
+wfhfiller::wfhfiller(struct wfh_config *conf)
+{
+	memcpy(&Conf, conf, sizeof(Conf));
+	memset(mod, 0, sizeof(mod));
+}
+
+wfhfiller::~wfhfiller(void)
+{
+	int i;
+
+	for (i = 0; i < WFH_MAXSERIAL; i++) free(mod[i]);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Add the histograms of this thread to sum. Modules not yet in sum are allocated.
+//	May be called from any thread while the owner keeps filling.
+void wfhfiller::Add(struct wfh_module **sum)
+{
+	const unsigned int *a;
+	unsigned int *b;
+	struct wfh_module *m;
+	int i, j;
+
+	for (i = 0; i < WFH_MAXSERIAL; i++) {
+		m = __atomic_load_n(&mod[i], __ATOMIC_ACQUIRE);
+		if (!m) continue;
+		if (!sum[i]) sum[i] = (struct wfh_module *) calloc(1, sizeof(struct wfh_module));
+		if (!sum[i]) continue;
+		a = (const unsigned int *) m;
+		b = (unsigned int *) sum[i];
+		for (j = 0; j < (int) (sizeof(struct wfh_module) / sizeof(unsigned int)); j++) b[j] += a[j];
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Histogram the blocks of the module data record. Other records are skipped.
+//	Return 1 if the record is histogrammed, 0 if skipped, negative if no memory
+int wfhfiller::Fill(const void *rec, int len)
+{
+	struct rec_info_struct info;
+	struct wfh_module *m;
+	struct wfh_channel *c;
+	struct wff_feature f;
+	struct blk_view v;
+	int serial, irc;
+
+	if (rec_parse(rec, len, &info) < 0 || info.type < REC_WFDDATA || info.len != len || (info.flags & REC_FLAG_WFC)) return 0;
+	serial = (info.type - REC_WFDDATA) & (WFH_MAXSERIAL - 1);
+	m = mod[serial];
+	if (!m) {
+		m = (struct wfh_module *) calloc(1, sizeof(struct wfh_module));
+		if (!m) return -1;
+		__atomic_store_n(&mod[serial], m, __ATOMIC_RELEASE);	// readers see it zeroed
+	}
+	m->records++;
+	dec.Reset();
+	dec.Feed((const char *) rec + info.hlen, len - info.hlen);
+	while ((irc = dec.Next(&v)) != BLK_END) {
+		switch (irc) {
+		case BLK_OK:
+			break;
+		case BLK_PART:
+			m->split++;
+			continue;
+		case BLK_STRAY:
+			if (v.pos) m->errors++;		// at 0 it is the end of the block split from the previous record
+			continue;
+		default:
+			m->errors++;
+			continue;
+		}
+		c = &m->chan[v.chan];
+		c->types[v.type & 7]++;
+		if ((v.type != BLK_SELF && v.type != BLK_MASTER) || v.ndata <= 0) continue;
+		wff_extract(&v, serial, &Conf.Features, &f);
+		c->amp[wfh_bin(f.amplitude, 0, Conf.AmpBin)]++;
+		c->integral[wfh_bin(f.integral, Conf.IntMin, Conf.IntBin)]++;
+		c->time[wfh_bin(f.peak, 0, Conf.TimeBin)]++;
+	}
+	return 1;
+}
+
+//*************************************************************************************************************************************//
+
+wfhist::wfhist(struct wfh_config *conf)
+{
+	int i;
+
+	memcpy(&Conf, conf, sizeof(Conf));
+	if (Conf.Threads <= 0) Conf.Threads = 1;
+	if (Conf.Threads > WFH_MAXTHREADS) Conf.Threads = WFH_MAXTHREADS;
+	if (Conf.AmpBin <= 0) Conf.AmpBin = 1;
+	if (Conf.IntBin <= 0) Conf.IntBin = 1;
+	if (Conf.TimeBin <= 0) Conf.TimeBin = 1;
+	if (Conf.Features.BaseLen <= 0) Conf.Features.BaseLen = WFF_BASELEN;
+	memset(fill, 0, sizeof(fill));
+	for (i = 0; i < Conf.Threads; i++) fill[i] = new wfhfiller(&Conf);
+	memset(snap, 0, sizeof(snap));
+}
+
+wfhist::~wfhist(void)
+{
+	int i;
+
+	for (i = 0; i < Conf.Threads; i++) delete fill[i];
+	for (i = 0; i < WFH_MAXSERIAL; i++) free(snap[i]);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Sum the histograms of all threads into the snapshot. Only one thread may call this at a time.
+void wfhist::Snapshot(void)
+{
+	int i;
+
+	for (i = 0; i < WFH_MAXSERIAL; i++) if (snap[i]) memset(snap[i], 0, sizeof(struct wfh_module));
+	for (i = 0; i < Conf.Threads; i++) fill[i]->Add(snap);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Make a snapshot and write it to fname, text if the name ends with .txt, binary otherwise.
+//	The file is written under a temporary name and renamed, readers never see it half written.
+//	Return 0 on success, negative on error
+int wfhist::Write(const char *fname)
+{
+	char tmp[MAX_PATH_LEN + 8];
+	FILE *f;
+	time_t t;
+	int irc, len;
+
+	Snapshot();
+	t = time(NULL);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+	f = fopen(tmp, "wb");
+	if (!f) {
+		Log(ERROR, "Can not create histogram file %s: %m\n", tmp);
+		return -1;
+	}
+	len = strlen(fname);
+	irc = (len > 4 && !strcasecmp(fname + len - 4, ".txt")) ? WriteText(f, t) : WriteBinary(f, t);
+	if (fclose(f)) irc = -1;
+	if (irc || rename(tmp, fname)) {
+		Log(ERROR, "Can not write histogram file %s: %m\n", fname);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+//	Binary snapshot
+int wfhist::WriteBinary(FILE *f, time_t t)
+{
+	struct wfh_file_header h;
+	int i;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = WFH_MAGIC;
+	h.version = WFH_VERSION;
+	h.nbins = WFH_NBINS;
+	h.nchan = WFH_NCHAN;
+	h.ampbin = Conf.AmpBin;
+	h.intbin = Conf.IntBin;
+	h.intmin = Conf.IntMin;
+	h.timebin = Conf.TimeBin;
+	h.tscale = WFF_TSCALE;
+	h.time = t;
+	for (i = 0; i < WFH_MAXSERIAL; i++) if (snap[i]) h.nmodules++;
+	if (fwrite(&h, sizeof(h), 1, f) != 1) return -1;
+	for (i = 0; i < WFH_MAXSERIAL; i++) if (snap[i]) {
+		if (fwrite(&i, sizeof(int), 1, f) != 1) return -1;
+		if (fwrite(snap[i], sizeof(struct wfh_module), 1, f) != 1) return -1;
+	}
+	return 0;
+}
+
+//	One histogram line of the text snapshot, nothing if it is empty
+static void wfh_print(FILE *f, const char *name, int serial, int chan, const unsigned int *h, int min, int width)
+{
+	int i;
+
+	for (i = 0; i < WFH_NBINS + 2; i++) if (h[i]) break;
+	if (i == WFH_NBINS + 2) return;
+	fprintf(f, "%s %d %d %u %u", name, serial, chan, h[0], h[WFH_NBINS + 1]);
+	for (i = 1; i <= WFH_NBINS; i++) if (h[i]) fprintf(f, " %d:%u", min + (i - 1) * width, h[i]);
+	fprintf(f, "\n");
+}
+
+//	Text snapshot
+int wfhist::WriteText(FILE *f, time_t t)
+{
+	const struct wfh_channel *c;
+	char str[64];
+	int i, j, k;
+
+	ctime_r(&t, str);
+	fprintf(f, "# UWFD64 histograms %s", str);
+	fprintf(f, "# amp: %d bins of %d ADC counts from 0; integral: %d bins of %d from %d; time: %d bins of %d/%d sample from 0\n",
+		WFH_NBINS, Conf.AmpBin, WFH_NBINS, Conf.IntBin, Conf.IntMin, WFH_NBINS, Conf.TimeBin, WFF_TSCALE);
+	fprintf(f, "# types serial chan self master triginfo 3 history tokensync 6 7\n");
+	fprintf(f, "# amp|integral|time serial chan underflow overflow lower_edge:count ...\n");
+	for (i = 0; i < WFH_MAXSERIAL; i++) if (snap[i]) {
+		fprintf(f, "# module %d: %u records, %u blocks split between records, %u errors\n",
+			i, snap[i]->records, snap[i]->split, snap[i]->errors);
+		for (j = 0; j < WFH_NCHAN; j++) {
+			c = &snap[i]->chan[j];
+			for (k = 0; k < 8; k++) if (c->types[k]) break;
+			if (k == 8) continue;
+			fprintf(f, "types %d %d", i, j);
+			for (k = 0; k < 8; k++) fprintf(f, " %u", c->types[k]);
+			fprintf(f, "\n");
+			wfh_print(f, "amp", i, j, c->amp, 0, Conf.AmpBin);
+			wfh_print(f, "integral", i, j, c->integral, Conf.IntMin, Conf.IntBin);
+			wfh_print(f, "time", i, j, c->time, 0, Conf.TimeBin);
+		}
+	}
+	return ferror(f) ? -1 : 0;
+}
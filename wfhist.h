@@ -0,0 +1,100 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Online histograms of the waveform blocks: amplitude, integral, time by channel.
+*/
+#ifndef WFHIST_H
+#define WFHIST_H
+
+#include <stdio.h>
+#include <time.h>
+#include "blkdecode.h"
+#include "wffeat.h"
+
+#ifndef MAX_PATH_LEN
+#define MAX_PATH_LEN	1024
+#endif
+
+#define WFH_MAXSERIAL	256		// module serial numbers
+#define WFH_NCHAN	64		// channels of a module
+#define WFH_NBINS	1024		// bins of a histogram, not counting underflow and overflow
+#define WFH_MAXTHREADS	16		// filling threads
+#define WFH_MAGIC	0x48465755	// "UWFH", binary snapshot
+#define WFH_VERSION	1
+
+//	Histograms of one channel. Bin 0 is the underflow, bin WFH_NBINS + 1 is the overflow.
+struct wfh_channel {
+	unsigned int types[8];			// complete blocks by type
+	unsigned int amp[WFH_NBINS + 2];	// amplitude over the baseline, self and master trigger blocks
+	unsigned int integral[WFH_NBINS + 2];	// sum of the samples minus the baseline
+	unsigned int time[WFH_NBINS + 2];	// peak position in the window, 1/WFF_TSCALE sample
+};
+
+//	Histograms of one module
+struct wfh_module {
+	struct wfh_channel chan[WFH_NCHAN];
+	unsigned int records;	// data records
+	unsigned int errors;	// stray words and cut blocks
+	unsigned int split;	// blocks split between records, not counted
+};
+
+//	Parameters, normally from Sink section of the configuration
+struct wfh_config {
+	int Threads;		// filling threads
+	int AmpBin;		// ADC counts per amplitude bin, the range begins at 0
+	int IntBin;		// ADC counts * samples per integral bin
+	int IntMin;		// the lower edge of the integral range
+	int TimeBin;		// 1/WFF_TSCALE sample per time bin, the range begins at 0
+	int Period;		// s, the snapshot is written this often, 0 - only at the end and by command
+	struct wff_config Features;	// baseline, threshold and inverted channels (Mode is not used)
+};
+
+//	Binary snapshot: struct wfh_file_header, then nmodules of int serial followed by struct wfh_module.
+//	Text snapshot: # comments, then lines of the channels with data:
+//	types serial chan n0 ... n7
+//	amp|integral|time serial chan underflow overflow lower_edge:count ... - only bins with counts
+struct wfh_file_header {
+	int magic;		// WFH_MAGIC
+	int version;		// WFH_VERSION
+	int nbins;		// WFH_NBINS
+	int nchan;		// WFH_NCHAN
+	int ampbin;
+	int intbin;
+	int intmin;
+	int timebin;
+	int tscale;		// WFF_TSCALE
+	int nmodules;
+	long long time;		// s since the Epoch, when the snapshot was made
+};
+
+//	Histograms filled by one thread. Only the owner thread writes them,
+//	readers sum the counters without locking, see wfhist::Snapshot().
+class wfhfiller {
+private:
+	struct wfh_config Conf;
+	blkdecoder dec;
+	struct wfh_module *mod[WFH_MAXSERIAL];	// NULL until the module is seen
+public:
+	wfhfiller(struct wfh_config *conf);
+	~wfhfiller(void);
+	void Add(struct wfh_module **sum);
+	int Fill(const void *rec, int len);
+};
+
+//	Histograms of all threads and their snapshots
+class wfhist {
+private:
+	struct wfh_config Conf;
+	wfhfiller *fill[WFH_MAXTHREADS];
+	struct wfh_module *snap[WFH_MAXSERIAL];	// the last snapshot
+	int WriteBinary(FILE *f, time_t t);
+	int WriteText(FILE *f, time_t t);
+public:
+	wfhist(struct wfh_config *conf);
+	~wfhist(void);
+	inline wfhfiller *GetFiller(int i) { return fill[i]; };
+	inline int GetThreads(void) { return Conf.Threads; };
+	void Snapshot(void);
+	int Write(const char *fname);
+};
+
+#endif /* WFHIST_H */
@@ -0,0 +1,221 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Host zero suppression of waveform blocks in the readout.
+	Unlike the hardware suppression (ZeroSupThreshold, ZSWinBegin, ZSWinEnd) the parameters
+	are per channel and can be changed without module initialization. The buffer is compacted
+	in place, the window is checked with SSE2/AVX2/AVX-512 at the level of blk_get_level().
+*/
+
+#include <stdio.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "blkdecode.h"
+#include "zerosup.h"
+
+//	1 if any of n 15-bit samples is below lo or above hi
+typedef int (*zs_any_fn)(const unsigned short *src, int n, int lo, int hi);
+
+static int zs_any_scalar(const unsigned short *src, int n, int lo, int hi)
+{
+	int i, y;
+
+	for (i = 0; i < n; i++) {
+		y = ((short) (src[i] << 1)) >> 1;
+		if (y < lo || y > hi) return 1;
+	}
+	return 0;
+}
+
+#if defined(__x86_64__)
+static int zs_any_sse2(const unsigned short *src, int n, int lo, int hi)
+{
+	__m128i v;
+	const __m128i l = _mm_set1_epi16(lo);
+	const __m128i h = _mm_set1_epi16(hi);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm_srai_epi16(_mm_slli_epi16(_mm_loadu_si128((const __m128i *) (src + i)), 1), 1);
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi16(v, l), _mm_cmpgt_epi16(v, h)))) return 1;
+	}
+	return zs_any_scalar(src + i, n - i, lo, hi);
+}
+
+__attribute__((target("avx2")))
+static int zs_any_avx2(const unsigned short *src, int n, int lo, int hi)
+{
+	__m256i v;
+	const __m256i l = _mm256_set1_epi16(lo);
+	const __m256i h = _mm256_set1_epi16(hi);
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm256_srai_epi16(_mm256_slli_epi16(_mm256_loadu_si256((const __m256i *) (src + i)), 1), 1);
+		if (_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpgt_epi16(l, v), _mm256_cmpgt_epi16(v, h)))) return 1;
+	}
+	return zs_any_scalar(src + i, n - i, lo, hi);
+}
+
+//	Tails are done with masked loads and compares
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+static int zs_any_avx512(const unsigned short *src, int n, int lo, int hi)
+{
+	__m512i v;
+	const __m512i l = _mm512_set1_epi16(lo);
+	const __m512i h = _mm512_set1_epi16(hi);
+	__mmask32 m;
+	int i;
+
+	for (i = 0; i < n; i += 32) {
+		m = (n - i >= 32) ? 0xFFFFFFFF : (1U << (n - i)) - 1;
+		v = _mm512_srai_epi16(_mm512_slli_epi16(_mm512_maskz_loadu_epi16(m, src + i), 1), 1);
+		if (_mm512_mask_cmplt_epi16_mask(m, v, l) | _mm512_mask_cmpgt_epi16_mask(m, v, h)) return 1;
+	}
+	return 0;
+}
+#endif
+
+static int zs_level = -1;
+static zs_any_fn zs_any = zs_any_scalar;
+
+//	Follow the kernel level of the block decoder
+static void zs_set_kernels(void)
+{
+	zs_level = blk_get_level();
+	zs_any = zs_any_scalar;
+#if defined(__x86_64__)
+	if (zs_level >= BLK_SSE2) zs_any = zs_any_sse2;
+	if (zs_level >= BLK_AVX2) zs_any = zs_any_avx2;
+	if (zs_level >= BLK_AVX512) zs_any = zs_any_avx512;
+#endif
+}
+
+//*************************************************************************************************************************************//
+
+zerosup::zerosup(struct zerosup_config *conf)
+{
+	memcpy(&Conf, conf, sizeof(Conf));
+	if (Conf.PedLen <= 0) Conf.PedLen = ZS_PEDLEN;
+	carry = 0;
+	memset(&stat, 0, sizeof(stat));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Check the waveform block at cw: the pedestal is the mean of the first PedLen samples,
+//	the signal must go over it by more than the channel threshold inside the window,
+//	down for inverted channels. A block with no samples in the window is not checked.
+//	Return 1 if the block is to be kept
+int zerosup::Pass(const unsigned short *cw)
+{
+	const unsigned short *s;
+	int i, n, chan, ped, num, from, to, lo, hi;
+
+	s = cw + 3;
+	n = (cw[0] & 0x1FF) - 2;
+	chan = (cw[0] >> 9) & 0x3F;
+	num = (Conf.PedLen < n) ? Conf.PedLen : n;
+	for (i = 0, ped = 0; i < num; i++) ped += ((short) (s[i] << 1)) >> 1;
+	ped = (ped >= 0) ? (ped + num / 2) / num : -((-ped + num / 2) / num);
+	from = (Conf.WinBegin > 0) ? Conf.WinBegin : 0;
+	to = (Conf.WinEnd > 0 && Conf.WinEnd < n) ? Conf.WinEnd : n;
+	if (from >= to) return 1;
+	lo = -32768;
+	hi = 32767;
+	if (BLK_INVERTED(Conf.InvertMask, chan)) {
+		lo = ped - Conf.Threshold[chan];
+		if (lo < -32768) lo = -32768;
+	} else {
+		hi = ped + Conf.Threshold[chan];
+		if (hi > 32767) hi = 32767;
+	}
+	if (zs_level != blk_get_level()) zs_set_kernels();
+	return zs_any(s + from, to - from, lo, hi);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Print suppression ratio for the module and by channel
+void zerosup::PrintStat(int serial)
+{
+	long long blocks, suppressed;
+	int i;
+
+	for (i = 0, blocks = suppressed = 0; i < ZS_NCHAN; i++) {
+		blocks += stat.blocks[i];
+		suppressed += stat.suppressed[i];
+	}
+	printf("Module %d zero suppression: %Ld of %Ld blocks %s (%.1f%%), %Ld of %Ld words kept (%.1f%%)",
+		serial, suppressed, blocks, (Conf.Mode == ZS_TRUNCATE) ? "truncated" : "dropped",
+		(blocks) ? 100.0 * suppressed / blocks : 0.0, stat.words_out, stat.words_in,
+		(stat.words_in) ? 100.0 * stat.words_out / stat.words_in : 0.0);
+	if (stat.stray) printf(", %Ld stray words", stat.stray);
+	printf("\n");
+	if (!blocks) return;
+	printf("Suppressed by channel, %%:");
+	for (i = 0; i < ZS_NCHAN; i++) if (stat.blocks[i]) printf(" %d:%.1f", i, 100.0 * stat.suppressed[i] / stat.blocks[i]);
+	printf("\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Suppress blocks in the module data of len bytes in place, len is even. The words go in order
+//	as they came from the module FIFO, buffer by buffer.
+//	Return the new length in bytes
+int zerosup::Process(void *data, int len)
+{
+	unsigned short *w;
+	int i, o, n, k, L, chan, type;
+
+	w = (unsigned short *) data;
+	n = len / 2;
+	i = o = 0;
+	if (carry) {		// the end of a block begun in the previous buffer
+		i = o = (carry < n) ? carry : n;
+		carry -= i;
+	}
+	while (i < n) {
+		if (!(w[i] & BLK_CW)) {
+			k = blk_scan(w + i, n - i);
+			if (o != i) memmove(w + o, w + i, 2 * k);
+			stat.stray += k;
+			i += k;
+			o += k;
+			continue;
+		}
+		L = w[i] & 0x1FF;
+		if (i + L + 1 > n) {
+			carry = i + L + 1 - n;
+			L = n - i - 1;
+		} else if (L > 2) {
+			type = (w[i+1] >> 12) & 7;
+			chan = (w[i] >> 9) & 0x3F;
+			if (type == BLK_SELF || type == BLK_MASTER) {
+				stat.blocks[chan]++;
+				if (!Pass(w + i)) {
+					stat.suppressed[chan]++;
+					if (Conf.Mode == ZS_TRUNCATE) {
+						w[o] = (w[i] & ~0x1FF) | 2;
+						w[o+1] = w[i+1];
+						w[o+2] = w[i+2];
+						o += 3;
+					}
+					i += L + 1;
+					continue;
+				}
+			}
+		}
+		if (o != i) memmove(w + o, w + i, 2 * (L + 1));
+		i += L + 1;
+		o += L + 1;
+	}
+	stat.words_in += n;
+	stat.words_out += o;
+	return 2 * o;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//	Forget a block split between buffers, when the module FIFO is reset
+void zerosup::Reset(void)
+{
+	carry = 0;
+}
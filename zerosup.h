@@ -0,0 +1,53 @@
+/*
+	Moscow, ITEP, I. Alekseev, D. Kalinkin, D. Svirida
+	Support UWFD64 modules. Host zero suppression of waveform blocks in the readout.
+*/
+#ifndef ZEROSUP_H
+#define ZEROSUP_H
+
+#define ZS_NCHAN	64		// channels of a module
+#define ZS_PEDLEN	8		// default samples for the pedestal
+
+//	What is done with a block which does not cross the threshold
+enum ZS_MODE {
+	ZS_OFF = 0,		// nothing, all blocks are kept
+	ZS_DROP = 1,		// the block is removed
+	ZS_TRUNCATE = 2		// only control word, word 1 and the time are kept, the length becomes 2
+};
+
+//	Parameters of one module, normally SoftZS* of the module configuration
+struct zerosup_config {
+	int Mode;		// ZS_MODE
+	int PedLen;		// samples at the beginning of the block for the pedestal
+	int WinBegin;		// the first sample of the window where the signal must cross the threshold
+	int WinEnd;		// the sample after the window, 0 - to the end of the block
+	short int Threshold[ZS_NCHAN];	// ADC counts over the pedestal
+	short int InvertMask[4];	// inverted channels, pulses go down
+};
+
+//	Counters
+struct zerosup_stat {
+	long long blocks[ZS_NCHAN];	// self and master trigger blocks seen
+	long long suppressed[ZS_NCHAN];	// of them dropped or truncated
+	long long words_in;
+	long long words_out;
+	long long stray;	// words outside blocks, kept
+};
+
+//	Suppression of self and master trigger blocks of one module stream in place.
+//	Other blocks and stray words are kept as they are, a block split between buffers is kept.
+class zerosup {
+private:
+	struct zerosup_config Conf;
+	int carry;		// words of a block begun in the previous buffer still to come
+	struct zerosup_stat stat;
+	int Pass(const unsigned short *cw);
+public:
+	zerosup(struct zerosup_config *conf);
+	inline const struct zerosup_stat *GetStat(void) { return &stat; };
+	void PrintStat(int serial);
+	int Process(void *data, int len);
+	void Reset(void);
+};
+
+#endif /* ZEROSUP_H */